@@ -70,6 +70,8 @@ set(SUNSHINE_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/uuid.h"
         "${CMAKE_SOURCE_DIR}/src/config.h"
         "${CMAKE_SOURCE_DIR}/src/config.cpp"
+        "${CMAKE_SOURCE_DIR}/src/congestion.cpp"
+        "${CMAKE_SOURCE_DIR}/src/congestion.h"
         "${CMAKE_SOURCE_DIR}/src/display_device.h"
         "${CMAKE_SOURCE_DIR}/src/display_device.cpp"
         "${CMAKE_SOURCE_DIR}/src/entry_handler.cpp"
@@ -107,6 +109,8 @@ set(SUNSHINE_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/process.h"
         "${CMAKE_SOURCE_DIR}/src/network.cpp"
         "${CMAKE_SOURCE_DIR}/src/network.h"
+        "${CMAKE_SOURCE_DIR}/src/pacing.cpp"
+        "${CMAKE_SOURCE_DIR}/src/pacing.h"
         "${CMAKE_SOURCE_DIR}/src/move_by_copy.h"
         "${CMAKE_SOURCE_DIR}/src/system_tray.cpp"
         "${CMAKE_SOURCE_DIR}/src/system_tray.h"
@@ -117,10 +121,16 @@ set(SUNSHINE_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/round_robin.h"
         "${CMAKE_SOURCE_DIR}/src/stat_trackers.h"
         "${CMAKE_SOURCE_DIR}/src/stat_trackers.cpp"
+        "${CMAKE_SOURCE_DIR}/src/trace.cpp"
+        "${CMAKE_SOURCE_DIR}/src/trace.h"
         "${CMAKE_SOURCE_DIR}/src/rswrapper.h"
         "${CMAKE_SOURCE_DIR}/src/rswrapper.c"
         "${CMAKE_SOURCE_DIR}/src/starbeam/client.cpp"
         "${CMAKE_SOURCE_DIR}/src/starbeam/client.h"
+        "${CMAKE_SOURCE_DIR}/src/starbeam/connection_pool.cpp"
+        "${CMAKE_SOURCE_DIR}/src/starbeam/connection_pool.h"
+        "${CMAKE_SOURCE_DIR}/src/starbeam/framing.cpp"
+        "${CMAKE_SOURCE_DIR}/src/starbeam/framing.h"
         "${CMAKE_SOURCE_DIR}/src/starbeam/handler.cpp"
         "${CMAKE_SOURCE_DIR}/src/starbeam/handler.h"
         "${CMAKE_SOURCE_DIR}/src/starbeam/protocol.cpp"
@@ -78,6 +78,11 @@ if(BUILD_TESTS)
     add_subdirectory(tests)
 endif()
 
+# extra tools/binaries for audio/display devices, and benchmarking tools if requested
+if(WIN32 OR SUNSHINE_BUILD_TOOLS)
+    add_subdirectory(tools)
+endif()
+
 # custom compile flags, must be after adding tests
 
 if (NOT BUILD_TESTS)
@@ -86,6 +91,12 @@ else()
     set(TEST_DIR "${CMAKE_SOURCE_DIR}/tests")
 endif()
 
+if (NOT SUNSHINE_BUILD_TOOLS)
+    set(TOOLS_DIR "")
+else()
+    set(TOOLS_DIR "${CMAKE_SOURCE_DIR}/tools")
+endif()
+
 # src/upnp
 set_source_files_properties("${CMAKE_SOURCE_DIR}/src/upnp.cpp"
         DIRECTORY "${CMAKE_SOURCE_DIR}" "${TEST_DIR}"
@@ -93,7 +104,7 @@ set_source_files_properties("${CMAKE_SOURCE_DIR}/src/upnp.cpp"
 
 # third-party/nanors
 set_source_files_properties("${CMAKE_SOURCE_DIR}/src/rswrapper.c"
-        DIRECTORY "${CMAKE_SOURCE_DIR}" "${TEST_DIR}"
+        DIRECTORY "${CMAKE_SOURCE_DIR}" "${TOOLS_DIR}" "${TEST_DIR}"
         PROPERTIES COMPILE_FLAGS "-ftree-vectorize -funroll-loops")
 
 # third-party/ViGEmClient
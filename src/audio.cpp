@@ -3,7 +3,11 @@
  * @brief Definitions for audio capture and encoding.
  */
 // standard includes
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 // lib includes
 #include <opus/opus_multistream.h>
@@ -14,13 +18,15 @@
 #include "globals.h"
 #include "logging.h"
 #include "platform/common.h"
+#include "sync.h"
 #include "thread_safe.h"
 #include "utility.h"
 
 namespace audio {
   using namespace std::literals;
   using opus_t = util::safe_ptr<OpusMSEncoder, opus_multistream_encoder_destroy>;
-  using sample_queue_t = std::shared_ptr<safe::queue_t<std::vector<float>>>;
+  using sample_pool_t = safe::pool_t<std::vector<float>>;
+  using sample_queue_t = std::shared_ptr<safe::ring_queue_t<sample_pool_t::ptr_t>>;
 
   static int start_audio_control(audio_ctx_t &ctx);
   static void stop_audio_control(audio_ctx_t &);
@@ -83,15 +89,103 @@ namespace audio {
     },
   };
 
-  void encodeThread(sample_queue_t samples, config_t config, void *channel_data) {
-    auto packets = mail::man->queue<packet_t>(mail::audio_packets);
+  /**
+   * @brief A capture and encode pipeline, and the sessions it sends packets to.
+   * @details Sessions streaming with the same audio parameters share a group, which captures
+   *          and encodes on its own threads until the last of them leaves.
+   */
+  struct audio_group_t {
+    explicit audio_group_t(const config_t &config):
+        config {config} {
+    }
+
+    ~audio_group_t() {
+      stop_event.raise(true);
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+
+    const config_t config;
+
+    std::thread thread;
+
+    // Raised once the last session left
+    safe::signal_t stop_event;
+
+    std::mutex mutex;
+    std::vector<void *> subscribers;
+    bool stopped = false;
+  };
+
+  // Pipelines shared by the sessions streaming the same audio parameters
+  sync_util::sync_t<std::vector<std::shared_ptr<audio_group_t>>> audio_groups;
+
+  /**
+   * @brief Check whether two sessions can share a capture and encode pipeline.
+   */
+  bool same_stream(const config_t &a, const config_t &b) {
+    if (a.channels != b.channels || a.packetDuration != b.packetDuration) {
+      return false;
+    }
+
+    for (auto flag : {config_t::HIGH_QUALITY, config_t::CONTINUOUS_AUDIO, config_t::CUSTOM_SURROUND_PARAMS}) {
+      if (a.flags[flag] != b.flags[flag]) {
+        return false;
+      }
+    }
+
+    if (!a.flags[config_t::CUSTOM_SURROUND_PARAMS]) {
+      return true;
+    }
+
+    auto &x = a.customStreamParams;
+    auto &y = b.customStreamParams;
+    return x.channelCount == y.channelCount && x.streams == y.streams && x.coupledStreams == y.coupledStreams &&
+           std::equal(std::begin(x.mapping), std::end(x.mapping), std::begin(y.mapping));
+  }
+
+  std::shared_ptr<buffer_pool_t> make_packet_pool(const safe::ring_queue_t<packet_t> &packets) {
+    // Buffers go round between the encode thread and the broadcast thread. Besides those filling
+    // the queue, one is being encoded, one copied for another session and two are being sent.
+    return std::make_shared<buffer_pool_t>(packets.capacity() + 4, buffer_t {MAX_PACKET_SIZE});
+  }
+
+  std::size_t send_to_sessions(safe::ring_queue_t<packet_t> &packets, buffer_pool_t &packet_pool, buffer_pool_t::ptr_t &&packet, const std::vector<void *> &sessions) {
+    std::size_t sent = 0;
+
+    // Every session gets a copy, but the last one
+    for (std::size_t x = 0; x < sessions.size(); ++x) {
+      if (x + 1 == sessions.size()) {
+        packets.raise(sessions[x], std::move(packet));
+        ++sent;
+        break;
+      }
+
+      auto copy = packet_pool.pop();
+      if (!copy) {
+        BOOST_LOG(warning) << "Out of audio packet buffers, dropping audio"sv;
+        continue;
+      }
+
+      copy->fake_resize(packet->size());
+      std::copy(std::begin(*packet), std::end(*packet), std::begin(*copy));
+      packets.raise(sessions[x], std::move(copy));
+      ++sent;
+    }
+
+    return sent;
+  }
+
+  void encodeThread(sample_queue_t samples, config_t config, audio_group_t &group) {
+    auto packets = mail::man->ring_queue<packet_t>(mail::audio_packets);
     auto stream = stream_configs[map_stream(config.channels, config.flags[config_t::HIGH_QUALITY])];
     if (config.flags[config_t::CUSTOM_SURROUND_PARAMS]) {
       apply_surround_params(stream, config.customStreamParams);
     }
 
     // Encoding takes place on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::high);
+    platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::encode);
 
     opus_t opus {opus_multistream_encoder_create(
       stream.sampleRate,
@@ -110,11 +204,20 @@ namespace audio {
                     << stream.channelCount << " channels, "sv
                     << stream.bitrate / 1000 << " kbps (total), LOWDELAY"sv;
 
+    auto packet_pool = make_packet_pool(*packets);
+
     auto frame_size = config.packetDuration * stream.sampleRate / 1000;
     while (auto sample = samples->pop()) {
-      buffer_t packet {1400};
+      auto packet = packet_pool->pop();
+      if (!packet) {
+        BOOST_LOG(warning) << "Out of audio packet buffers, dropping audio"sv;
+        continue;
+      }
 
-      int bytes = opus_multistream_encode_float(opus.get(), sample->data(), frame_size, std::begin(packet), packet.size());
+      // The buffer may have held a shorter packet before
+      packet->fake_resize(MAX_PACKET_SIZE);
+
+      int bytes = opus_multistream_encode_float(opus.get(), sample->data(), frame_size, std::begin(*packet), packet->size());
       if (bytes < 0) {
         BOOST_LOG(error) << "Couldn't encode audio: "sv << opus_strerror(bytes);
         packets->stop();
@@ -122,17 +225,26 @@ namespace audio {
         return;
       }
 
-      packet.fake_resize(bytes);
-      packets->raise(channel_data, std::move(packet));
+      packet->fake_resize(bytes);
+
+      std::lock_guard lg {group.mutex};
+      send_to_sessions(*packets, *packet_pool, std::move(packet), group.subscribers);
     }
   }
 
-  void capture(safe::mail_t mail, config_t config, void *channel_data) {
-    auto shutdown_event = mail->event<bool>(mail::shutdown);
-    if (!config::audio.stream) {
-      shutdown_event->view();
-      return;
-    }
+  /**
+   * @brief Capture and encode audio for the sessions of a group until they have all left.
+   * @param group The group to capture for.
+   */
+  void capture_group(audio_group_t &group) {
+    auto &config = group.config;
+
+    // Sessions joining later start a new group
+    auto stopped_fg = util::fail_guard([&group]() {
+      std::lock_guard lg {group.mutex};
+      group.stopped = true;
+    });
+
     auto stream = stream_configs[map_stream(config.channels, config.flags[config_t::HIGH_QUALITY])];
     if (config.flags[config_t::CUSTOM_SURROUND_PARAMS]) {
       apply_surround_params(stream, config.customStreamParams);
@@ -143,12 +255,9 @@ namespace audio {
       return;
     }
 
-    auto init_failure_fg = util::fail_guard([&shutdown_event]() {
+    // The sessions keep streaming without audio
+    auto init_failure_fg = util::fail_guard([]() {
       BOOST_LOG(error) << "Unable to initialize audio capture. The stream will not have audio."sv;
-
-      // Wait for shutdown to be signalled if we fail init.
-      // This allows streaming to continue without audio.
-      shutdown_event->view();
     });
 
     auto &control = ref->control;
@@ -203,25 +312,31 @@ namespace audio {
     init_failure_fg.disable();
 
     // Capture takes place on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::critical);
+    platf::adjust_thread_priority(platf::thread_priority_e::critical, platf::thread_role_e::capture);
 
     auto samples = std::make_shared<sample_queue_t::element_type>(30);
-    std::thread thread {encodeThread, samples, config, channel_data};
+    std::thread thread {encodeThread, samples, config, std::ref(group)};
 
     auto fg = util::fail_guard([&]() {
       samples->stop();
       thread.join();
-
-      shutdown_event->view();
     });
 
     int samples_per_frame = frame_size * stream.channelCount;
 
-    while (!shutdown_event->peek()) {
-      std::vector<float> sample_buffer;
-      sample_buffer.resize(samples_per_frame);
+    // Buffers go round between this thread and the encoder. Besides those filling the queue,
+    // one is being captured and one encoded.
+    auto sample_pool = std::make_shared<sample_pool_t>(samples->capacity() + 2, std::vector<float>(samples_per_frame));
 
-      auto status = mic->sample(sample_buffer);
+    while (!group.stop_event.peek()) {
+      auto sample_buffer = sample_pool->pop();
+      if (!sample_buffer) {
+        // The queue drops the oldest buffers when full, so the encoder is about to give one back
+        std::this_thread::yield();
+        continue;
+      }
+
+      auto status = mic->sample(*sample_buffer);
       switch (status) {
         case platf::capture_e::ok:
           break;
@@ -235,7 +350,7 @@ namespace audio {
             if (!mic) {
               BOOST_LOG(warning) << "Couldn't re-initialize audio input"sv;
             }
-          } while (!mic && !shutdown_event->view(5s));
+          } while (!mic && !group.stop_event.view(5s));
           continue;
         default:
           return;
@@ -245,6 +360,73 @@ namespace audio {
     }
   }
 
+  /**
+   * @brief Join the group capturing the session's audio parameters, or start a new one.
+   * @param config The audio configuration of the session.
+   * @param channel_data The session to send packets to.
+   * @return The group the session joined.
+   */
+  std::shared_ptr<audio_group_t> join_group(const config_t &config, void *channel_data) {
+    auto lg = audio_groups.lock();
+
+    for (auto &group : *audio_groups) {
+      if (!same_stream(group->config, config)) {
+        continue;
+      }
+
+      std::lock_guard group_lg {group->mutex};
+      if (group->stopped) {
+        continue;
+      }
+
+      BOOST_LOG(info) << "Sharing the audio encoder of "sv << group->subscribers.size() << " other session(s)"sv;
+
+      group->subscribers.emplace_back(channel_data);
+      return group;
+    }
+
+    auto group = std::make_shared<audio_group_t>(config);
+    group->subscribers.emplace_back(channel_data);
+
+    // The thread only borrows the group, the last session to leave joins it
+    group->thread = std::thread {capture_group, std::ref(*group)};
+
+    audio_groups->emplace_back(group);
+    return group;
+  }
+
+  /**
+   * @brief Stop sending packets to a session, and stop the group once no sessions are left.
+   * @param group The group the session joined.
+   * @param channel_data The session leaving.
+   */
+  void leave_group(const std::shared_ptr<audio_group_t> &group, void *channel_data) {
+    auto lg = audio_groups.lock();
+    std::lock_guard group_lg {group->mutex};
+
+    std::erase(group->subscribers, channel_data);
+    if (group->subscribers.empty()) {
+      group->stopped = true;
+      group->stop_event.raise(true);
+      std::erase(*audio_groups, group);
+    }
+  }
+
+  void capture(safe::mail_t mail, config_t config, void *channel_data) {
+    auto shutdown_event = mail->event<bool>(mail::shutdown);
+    if (!config::audio.stream) {
+      shutdown_event->view();
+      return;
+    }
+
+    auto group = join_group(config, channel_data);
+
+    // Audio is captured and encoded on the group's threads until the stream ends
+    shutdown_event->view();
+
+    leave_group(group, channel_data);
+  }
+
   audio_ctx_ref_t get_audio_ctx_ref() {
     static auto control_shared {safe::make_shared<audio_ctx_t>(start_audio_control, stop_audio_control)};
     return control_shared.ref();
@@ -10,6 +10,8 @@
 #include "utility.h"
 
 #include <bitset>
+#include <memory>
+#include <vector>
 
 namespace audio {
   enum stream_config_e : int {
@@ -69,11 +71,32 @@ namespace audio {
   };
 
   using buffer_t = util::buffer_t<std::uint8_t>;
-  using packet_t = std::pair<void *, buffer_t>;
+  using buffer_pool_t = safe::pool_t<buffer_t>;
+  using packet_t = std::pair<void *, buffer_pool_t::ptr_t>;
   using audio_ctx_ref_t = safe::shared_t<audio_ctx_t>::ptr_t;
 
+  // Encoded packets must fit in a single datagram
+  constexpr std::size_t MAX_PACKET_SIZE = 1400;
+
   void capture(safe::mail_t mail, config_t config, void *channel_data);
 
+  /**
+   * @brief Make the pool that encoded packets are written to.
+   * @param packets The queue the packets are sent through.
+   * @return A pool of `MAX_PACKET_SIZE` buffers, enough to keep the queue full while others are in use.
+   */
+  std::shared_ptr<buffer_pool_t> make_packet_pool(const safe::ring_queue_t<packet_t> &packets);
+
+  /**
+   * @brief Send an encoded packet to every session that shares it.
+   * @param packets The queue the packets are sent through.
+   * @param packet_pool The pool the packet came from, which the copies for the other sessions are taken from.
+   * @param packet The encoded packet, which the last session gets.
+   * @param sessions The channel data of each session.
+   * @return The number of sessions the packet was queued for, fewer if the pool ran out of buffers for the copies.
+   */
+  std::size_t send_to_sessions(safe::ring_queue_t<packet_t> &packets, buffer_pool_t &packet_pool, buffer_pool_t::ptr_t &&packet, const std::vector<void *> &sessions);
+
   /**
    * @brief Get the reference to the audio context.
    * @returns A shared pointer reference to audio context.
@@ -491,6 +491,8 @@ namespace config {
     {},  // adapter_name
     {},  // output_name
 
+    "mixed"s,  // synthetic_pattern
+
     {
       video_t::dd_t::config_option_e::disabled,  // configuration_option
       video_t::dd_t::resolution_option_e::automatic,  // resolution_option
@@ -505,7 +507,8 @@ namespace config {
     },  // display_device
 
     0,  // max_bitrate
-    0  // minimum_fps_target (0 = framerate)
+    0,  // minimum_fps_target (0 = framerate)
+    false  // shared_encode
   };
 
   audio_t audio {
@@ -522,6 +525,24 @@ namespace config {
 
     20,  // fecPercentage
 
+    false,  // adaptive_bitrate
+
+    true,  // video_send_per_session
+
+    "link"s,  // pacing_mode
+    800,  // pacing_link_rate
+    false,  // pacing_kernel_offload
+
+    false,  // realtime_threads
+
+    {},  // capture_cpus
+    {},  // encode_cpus
+    {},  // video_send_cpus
+    {},  // audio_send_cpus
+    {},  // input_cpus
+
+    false,  // frame_trace
+
     ENCRYPTION_MODE_NEVER,  // lan_encryption_mode
     ENCRYPTION_MODE_OPPORTUNISTIC,  // wan_encryption_mode
   };
@@ -590,6 +611,8 @@ namespace config {
     {},     // auth_key
     {},     // host_id
     5,      // reconnect_interval_seconds
+    true,   // direct_udp
+    false,  // p2p
   };
 
   bool endline(char ch) {
@@ -1141,6 +1164,7 @@ namespace config {
     string_f(vars, "encoder", video.encoder);
     string_f(vars, "adapter_name", video.adapter_name);
     string_f(vars, "output_name", video.output_name);
+    string_restricted_f(vars, "synthetic_pattern", video.synthetic_pattern, {"static"sv, "scroll"sv, "noise"sv, "mixed"sv});
 
     generic_f(vars, "dd_configuration_option", video.dd.configuration_option, dd::config_option_from_view);
     generic_f(vars, "dd_resolution_option", video.dd.resolution_option, dd::resolution_option_from_view);
@@ -1165,6 +1189,7 @@ namespace config {
 
     int_f(vars, "max_bitrate", video.max_bitrate);
     double_between_f(vars, "minimum_fps_target", video.minimum_fps_target, {0.0, 1000.0});
+    bool_f(vars, "shared_encode", video.shared_encode);
 
     path_f(vars, "pkey", nvhttp.pkey);
     path_f(vars, "cert", nvhttp.cert);
@@ -1197,6 +1222,18 @@ namespace config {
 
     path_f(vars, "file_apps", stream.file_apps);
     int_between_f(vars, "fec_percentage", stream.fec_percentage, {1, 255});
+    bool_f(vars, "adaptive_bitrate", stream.adaptive_bitrate);
+    bool_f(vars, "video_send_per_session", stream.video_send_per_session);
+    string_restricted_f(vars, "pacing_mode", stream.pacing_mode, {"link"sv, "bitrate"sv});
+    int_between_f(vars, "pacing_link_rate", stream.pacing_link_rate, {1, 400000});
+    bool_f(vars, "pacing_kernel_offload", stream.pacing_kernel_offload);
+    bool_f(vars, "realtime_threads", stream.realtime_threads);
+    list_int_f(vars, "capture_cpus", stream.capture_cpus);
+    list_int_f(vars, "encode_cpus", stream.encode_cpus);
+    list_int_f(vars, "video_send_cpus", stream.video_send_cpus);
+    list_int_f(vars, "audio_send_cpus", stream.audio_send_cpus);
+    list_int_f(vars, "input_cpus", stream.input_cpus);
+    bool_f(vars, "frame_trace", stream.frame_trace);
 
     map_int_int_f(vars, "keybindings"s, input.keybindings);
     list_int_f(vars, "allowed_keys"s, input.allowed_keys);
@@ -1320,6 +1357,8 @@ namespace config {
     string_f(vars, "starbeam_auth_key", starbeam.auth_key);
     string_f(vars, "starbeam_host_id", starbeam.host_id);
     int_between_f(vars, "starbeam_reconnect_interval", starbeam.reconnect_interval_seconds, {1, 300});
+    bool_f(vars, "starbeam_direct_udp", starbeam.direct_udp);
+    bool_f(vars, "starbeam_p2p", starbeam.p2p);
 
     auto it = vars.find("flags"s);
     if (it != std::end(vars)) {
@@ -85,6 +85,8 @@ namespace config {
     std::string adapter_name;
     std::string output_name;
 
+    std::string synthetic_pattern;  ///< Test pattern drawn by the synthetic capture method: static, scroll, noise or mixed.
+
     struct dd_t {
       struct workarounds_t {
         std::chrono::milliseconds hdr_toggle_delay;  ///< Specify whether to apply HDR high-contrast color workaround and what delay to use.
@@ -142,6 +144,7 @@ namespace config {
 
     int max_bitrate;  // Maximum bitrate, sets ceiling in kbps for bitrate requested from client
     double minimum_fps_target;  ///< Lowest framerate that will be used when streaming. Range 0-1000, 0 = half of client's requested framerate.
+    bool shared_encode;  ///< Encode once for all clients streaming with the same video settings.
   };
 
   struct audio_t {
@@ -162,6 +165,30 @@ namespace config {
 
     int fec_percentage;
 
+    // Adapt each session's bitrate and FEC percentage to the frames its client loses
+    bool adaptive_bitrate;
+
+    // Send each session's video on its own thread instead of the shared broadcast thread
+    bool video_send_per_session;
+
+    // Video pacing: "link" paces at pacing_link_rate, "bitrate" derives the rate from each session's bitrate
+    std::string pacing_mode;
+    int pacing_link_rate;  // Mbps
+    bool pacing_kernel_offload;
+
+    // Use real-time scheduling for capture, encoding and sending where the OS allows it
+    bool realtime_threads;
+
+    // CPUs to pin each kind of thread to, empty leaves them to the scheduler
+    std::vector<int> capture_cpus;
+    std::vector<int> encode_cpus;
+    std::vector<int> video_send_cpus;
+    std::vector<int> audio_send_cpus;
+    std::vector<int> input_cpus;
+
+    // Record the time each frame spends in capture, encoding and sending, for /api/trace
+    bool frame_trace;
+
     // Video encryption settings for LAN and WAN streams
     int lan_encryption_mode;
     int wan_encryption_mode;
@@ -268,6 +295,8 @@ namespace config {
     std::string auth_key;            // Pre-shared auth key
     std::string host_id;             // Optional: fixed host identifier
     int reconnect_interval_seconds;  // Reconnect interval (default: 5)
+    bool direct_udp;                 // Send video/audio straight to the relay, skipping the loopback hop
+    bool p2p;                        // Try a direct path to clients through hole punching
   };
 
   extern video_t video;
@@ -33,6 +33,9 @@
 #include "nvhttp.h"
 #include "platform/common.h"
 #include "process.h"
+#include "starbeam/client.h"
+#include "starbeam/udp.h"
+#include "trace.h"
 #include "utility.h"
 #include "uuid.h"
 
@@ -1006,6 +1009,89 @@ namespace confighttp {
     response->write(SimpleWeb::StatusCode::success_ok, content, headers);
   }
 
+  /**
+   * @brief Get the recent spans of the video pipeline, in the Trace Event format.
+   * @param response The HTTP response object.
+   * @param request The HTTP request object.
+   * The trace can be opened in Perfetto or chrome://tracing. It has no events unless `frame_trace` is enabled.
+   *
+   * @api_examples{/api/trace| GET| null}
+   */
+  void getTrace(resp_https_t response, req_https_t request) {
+    if (!authenticate(response, request)) {
+      return;
+    }
+
+    print_req(request);
+
+    SimpleWeb::CaseInsensitiveMultimap headers;
+    headers.emplace("Content-Type", "application/json");
+    headers.emplace("Content-Disposition", "attachment; filename=\"sunshine-trace.json\"");
+    headers.emplace("X-Frame-Options", "DENY");
+    headers.emplace("Content-Security-Policy", "frame-ancestors 'none';");
+    response->write(SimpleWeb::StatusCode::success_ok, trace::dump(), headers);
+  }
+
+  /**
+   * @brief Get the state of the Starbeam relay connection and the telemetry of its links.
+   * @param response The HTTP response object.
+   * @param request The HTTP request object.
+   * The round trip time and jitter of the connection to the relay come from pings the host sends it, `rtt_ms` is null
+   * until the relay answered one. Every open UDP channel reports its traffic counters, whether it reaches its client
+   * through the relay or directly, and its rates over the last second. Sizes don't include the UDP/IP headers.
+   *
+   * @api_examples{/api/starbeam| GET| null}
+   */
+  void getStarbeam(resp_https_t response, req_https_t request) {
+    if (!authenticate(response, request)) {
+      return;
+    }
+
+    print_req(request);
+
+    nlohmann::json output_tree;
+    auto client = starbeam::get_client();
+    output_tree["enabled"] = client != nullptr;
+    if (client) {
+      auto link = client->get_link_stats();
+      output_tree["state"] = starbeam::connection_state_string(client->get_state());
+      output_tree["link"] = {
+        {"rtt_ms", link.rtt_ms ? nlohmann::json(*link.rtt_ms) : nlohmann::json()},
+        {"jitter_ms", link.jitter_ms},
+        {"pings", link.pings},
+        {"lost", link.lost},
+      };
+    }
+
+    nlohmann::json channels = nlohmann::json::array();
+    for (auto &stats : starbeam::udp::get_stats()) {
+      channels.push_back({
+        {"session_id", stats.session_id},
+        {"channel", starbeam::protocol::channel_type_string(stats.channel)},
+        {"local_port", stats.local_port},
+        {"path", stats.direct ? "direct" : "relay"},
+        {"rtt_us", stats.rtt_us},
+        {"packets_to_relay", stats.packets_to_relay},
+        {"bytes_to_relay", stats.bytes_to_relay},
+        {"packets_to_peer", stats.packets_to_peer},
+        {"bytes_to_peer", stats.bytes_to_peer},
+        {"packets_to_local", stats.packets_to_local},
+        {"bytes_to_local", stats.bytes_to_local},
+        {"drops", stats.drops},
+        {"rates", {
+          {"packets_to_client", stats.rates.packets_to_client},
+          {"bytes_to_client", stats.rates.bytes_to_client},
+          {"packets_to_local", stats.rates.packets_to_local},
+          {"bytes_to_local", stats.rates.bytes_to_local},
+          {"loss", stats.rates.loss},
+        }},
+      });
+    }
+    output_tree["channels"] = channels;
+    output_tree["status"] = true;
+    send_response(response, output_tree);
+  }
+
   /**
    * @brief Update existing credentials.
    * @param response The HTTP response object.
@@ -1202,6 +1288,8 @@ namespace confighttp {
     server.resource["^/api/pin$"]["POST"] = savePin;
     server.resource["^/api/apps$"]["GET"] = getApps;
     server.resource["^/api/logs$"]["GET"] = getLogs;
+    server.resource["^/api/trace$"]["GET"] = getTrace;
+    server.resource["^/api/starbeam$"]["GET"] = getStarbeam;
     server.resource["^/api/apps$"]["POST"] = saveApp;
     server.resource["^/api/config$"]["GET"] = getConfig;
     server.resource["^/api/config$"]["POST"] = saveConfig;
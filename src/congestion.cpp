@@ -0,0 +1,176 @@
+/**
+ * @file src/congestion.cpp
+ * @brief Definitions for adapting the bitrate and FEC of a stream to the network.
+ */
+// standard includes
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// local includes
+#include "congestion.h"
+
+using namespace std::literals;
+
+namespace congestion {
+  // How often the bitrate and FEC are adapted
+  constexpr auto UPDATE_INTERVAL = 250ms;
+
+  // How long the bitrate is held after being cut, so the effect shows up in the statistics
+  constexpr auto HOLD_TIME = 1s;
+
+  // The share of lost or late frames beyond which the link is considered congested
+  constexpr double CONGESTION_THRESHOLD = 0.1;
+
+  // The rate is cut by at least this much when congested, and at most by half
+  constexpr double MIN_DECREASE = 0.15;
+
+  // Growth per second while below the rate congestion was last seen at, and beyond it
+  constexpr double FAST_INCREASE = 0.08;
+  constexpr double SLOW_INCREASE = 0.02;
+
+  // The lowest bitrate, as a fraction of the requested one
+  constexpr int MIN_BITRATE_DIVISOR = 10;
+  constexpr int MIN_BITRATE = 500;
+
+  // Bounds of the FEC percentage, unless the configured one lies outside
+  constexpr int MIN_FEC_PERCENTAGE = 5;
+  constexpr int MAX_FEC_PERCENTAGE = 60;
+
+  // How much FEC is raised when frames are lost, and how long it takes to decay by 1 point
+  constexpr int FEC_INCREASE = 5;
+  constexpr auto FEC_DECAY_TIME = 1s;
+
+  // Frames lost this soon after raising FEC show it didn't help
+  constexpr auto FEC_SETTLE_TIME = 2s;
+
+  // Changes smaller than this aren't worth reconfiguring the encoder for
+  constexpr double MIN_BITRATE_CHANGE = 0.05;
+
+  controller_t::controller_t(int max_bitrate, int fec_percentage, std::chrono::nanoseconds frame_interval, clock::time_point now):
+      max_bitrate {max_bitrate},
+      min_bitrate {std::min(max_bitrate, std::max(max_bitrate / MIN_BITRATE_DIVISOR, MIN_BITRATE))},
+      max_fec {std::max(fec_percentage, MAX_FEC_PERCENTAGE)},
+      min_fec {std::min(fec_percentage, MIN_FEC_PERCENTAGE)},
+      frame_interval {frame_interval},
+      frames_sent {0},
+      late_frames {0},
+      applied_bitrate {max_bitrate},
+      fec {fec_percentage},
+      lost_frames {0},
+      loss_events {0},
+      target_rate {max_bitrate * (100.0 + fec_percentage) / 100},
+      congested_rate {std::numeric_limits<double>::infinity()},
+      last_update {now},
+      hold_until {now},
+      fec_settled {now},
+      loss_free_time {0} {
+  }
+
+  void controller_t::frame_sent(clock::duration send_time) {
+    frames_sent.fetch_add(1, std::memory_order_relaxed);
+    if (send_time > frame_interval) {
+      late_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void controller_t::loss_report(int count) {
+    lost_frames += std::max(count, 0);
+  }
+
+  void controller_t::frame_lost() {
+    ++loss_events;
+  }
+
+  std::optional<int> controller_t::update(clock::time_point now) {
+    auto elapsed = now - last_update;
+    if (elapsed < UPDATE_INTERVAL) {
+      return std::nullopt;
+    }
+    last_update = now;
+
+    auto frames = frames_sent.exchange(0, std::memory_order_relaxed);
+    auto late = late_frames.exchange(0, std::memory_order_relaxed);
+
+    // Clients that send loss statistics also ask to recover from the same losses,
+    // so take whichever accounts for more frames rather than counting them twice.
+    auto lost = std::max(lost_frames, loss_events);
+    lost_frames = 0;
+    loss_events = 0;
+
+    // Without frames there's nothing to learn about the link
+    if (frames == 0) {
+      return std::nullopt;
+    }
+
+    auto loss = std::min(1.0, (double) lost / frames);
+    auto lateness = (double) late / frames;
+
+    // Frames lost right after a cut aren't down to congestion, the bottleneck's queue drains
+    // as soon as less is sent. Otherwise, many lost frames show the link is congested, and so
+    // do losses that more FEC didn't recover from or that show up while probing past the rate
+    // congestion was last seen at. Adding FEC would only make congestion worse.
+    auto holding = now < hold_until;
+    auto probing = target_rate >= congested_rate * (1.0 - MIN_DECREASE / 2);
+    auto congested = lateness > CONGESTION_THRESHOLD ||
+                     (lost > 0 && !holding && (loss > CONGESTION_THRESHOLD || probing || now < fec_settled || fec == max_fec));
+
+    if (lost > 0) {
+      loss_free_time = 0s;
+
+      if (!congested && now >= fec_settled) {
+        fec = std::min(max_fec, fec + FEC_INCREASE + (int) std::ceil(loss * 100));
+        fec_settled = now + FEC_SETTLE_TIME;
+      }
+    } else {
+      loss_free_time += elapsed;
+      while (loss_free_time >= FEC_DECAY_TIME) {
+        loss_free_time -= FEC_DECAY_TIME;
+        fec = std::max(min_fec, fec - 1);
+      }
+    }
+
+    // Congestion depends on everything that goes on the wire, so adapt the rate including FEC
+    if (!holding) {
+      if (congested) {
+        congested_rate = target_rate;
+        target_rate *= std::clamp(1.0 - std::max(loss, lateness), 0.5, 1.0 - MIN_DECREASE);
+        hold_until = now + HOLD_TIME;
+      } else if (lost == 0) {
+        // Return quickly to the rate that used to work, then probe carefully for more
+        auto seconds = std::chrono::duration<double>(elapsed).count();
+        if (target_rate < congested_rate * (1.0 - MIN_DECREASE / 2)) {
+          target_rate *= std::pow(1.0 + FAST_INCREASE, seconds);
+        } else {
+          target_rate += max_bitrate * SLOW_INCREASE * seconds;
+        }
+      }
+    }
+
+    // FEC comes out of the same rate, but never leaves the encoder with more than was requested
+    auto overhead = (100.0 + fec) / 100;
+    target_rate = std::clamp(target_rate, min_bitrate * overhead, max_bitrate * overhead);
+
+    auto bitrate = (int) std::lround(target_rate / overhead);
+    auto applied = applied_bitrate.load(std::memory_order_relaxed);
+    if (bitrate == applied) {
+      return std::nullopt;
+    }
+
+    // Always apply the limits, they may be a step smaller than what's worth reconfiguring for
+    if (std::abs(bitrate - applied) < applied * MIN_BITRATE_CHANGE && bitrate != max_bitrate && bitrate != min_bitrate) {
+      return std::nullopt;
+    }
+
+    applied_bitrate.store(bitrate, std::memory_order_relaxed);
+    return bitrate;
+  }
+
+  int controller_t::bitrate() const {
+    return applied_bitrate.load(std::memory_order_relaxed);
+  }
+
+  int controller_t::fec_percentage() const {
+    return fec.load(std::memory_order_relaxed);
+  }
+}  // namespace congestion
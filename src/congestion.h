@@ -0,0 +1,113 @@
+/**
+ * @file src/congestion.h
+ * @brief Declarations for adapting the bitrate and FEC of a stream to the network.
+ */
+#pragma once
+
+// standard includes
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace congestion {
+  using clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Adapts the bitrate and FEC percentage of a session to the frames the client loses.
+   * @details Lost frames are learned from the client's loss statistics and from its requests
+   *          for reference frame invalidation. IDR frame requests aren't counted, since clients
+   *          also send them at startup and when their decoder resets. Frames that take longer than the
+   *          frame interval to send show that the host can't get them out fast enough.
+   *
+   *          The rate on the wire, FEC included, is what congests the link. When many frames
+   *          are lost or sent late, or frames are lost while probing past the rate congestion was
+   *          last seen at, that rate is cut in proportion and held for a moment. Other losses are
+   *          taken for random ones and recovered by raising FEC, which comes out of the bitrate.
+   *          Without losses, the rate grows back quickly up to where congestion was last seen,
+   *          then slowly beyond it, and FEC decays back down.
+   *
+   *          The send side methods are called on the video thread, everything else on the
+   *          control thread.
+   * @examples
+   * congestion::controller_t controller {20000, 20, 16ms, congestion::clock::now()};
+   * controller.frame_sent(3ms);
+   * controller.frame_lost();
+   * if (auto bitrate = controller.update(congestion::clock::now())) {
+   *   encoder.set_bitrate(*bitrate);
+   * }
+   * @examples_end
+   */
+  class controller_t {
+  public:
+    /**
+     * @param max_bitrate The bitrate requested by the client in kilobits per second.
+     * @param fec_percentage The FEC percentage to start with.
+     * @param frame_interval The time between two frames.
+     * @param now The current time.
+     */
+    controller_t(int max_bitrate, int fec_percentage, std::chrono::nanoseconds frame_interval, clock::time_point now);
+
+    /**
+     * @brief Record a frame that was sent to the client.
+     * @param send_time The time it took to send the frame, including waiting for earlier frames.
+     */
+    void frame_sent(clock::duration send_time);
+
+    /**
+     * @brief Record the frames the client reported lost since its last report.
+     * @param count The number of frames lost.
+     */
+    void loss_report(int count);
+
+    /**
+     * @brief Record a request from the client to recover from a lost frame.
+     */
+    void frame_lost();
+
+    /**
+     * @brief Adapt the bitrate and FEC percentage to what was recorded since the last update.
+     * @param now The current time.
+     * @return The new bitrate to encode at, or `std::nullopt` if the encoder should be left alone.
+     */
+    std::optional<int> update(clock::time_point now);
+
+    /**
+     * @brief Get the bitrate the encoder was last asked to use.
+     * @return The bitrate in kilobits per second.
+     */
+    int bitrate() const;
+
+    /**
+     * @brief Get the FEC percentage to protect frames with.
+     * @return The FEC percentage.
+     */
+    int fec_percentage() const;
+
+  private:
+    const int max_bitrate;
+    const int min_bitrate;
+    const int max_fec;
+    const int min_fec;
+    const std::chrono::nanoseconds frame_interval;
+
+    // Updated on the video thread
+    std::atomic<std::uint32_t> frames_sent;
+    std::atomic<std::uint32_t> late_frames;
+
+    std::atomic<int> applied_bitrate;
+    std::atomic<int> fec;
+
+    int lost_frames;
+    int loss_events;
+
+    // Rates on the wire, including FEC
+    double target_rate;
+    double congested_rate;
+
+    clock::time_point last_update;
+    clock::time_point hold_until;
+    clock::time_point fec_settled;
+    clock::duration loss_free_time;
+  };
+}  // namespace congestion
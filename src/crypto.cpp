@@ -214,6 +214,38 @@ namespace crypto {
       return update_outlen + final_outlen;
     }
 
+    int gcm_t::encrypt(const std::string_view &plaintext1, const std::string_view &plaintext2, std::uint8_t *tag, std::uint8_t *ciphertext, aes_t *iv) {
+      if (!encrypt_ctx && init_encrypt_gcm(encrypt_ctx, &key, iv, padding)) {
+        return -1;
+      }
+
+      if (EVP_EncryptInit_ex(encrypt_ctx.get(), nullptr, nullptr, nullptr, iv->data()) != 1) {
+        return -1;
+      }
+
+      int update_outlen1, update_outlen2, final_outlen;
+
+      // GCM is a stream cipher mode, so encrypting both parts back to back
+      // produces the same ciphertext as encrypting a single contiguous buffer
+      if (EVP_EncryptUpdate(encrypt_ctx.get(), ciphertext, &update_outlen1, (const std::uint8_t *) plaintext1.data(), plaintext1.size()) != 1) {
+        return -1;
+      }
+
+      if (EVP_EncryptUpdate(encrypt_ctx.get(), ciphertext + update_outlen1, &update_outlen2, (const std::uint8_t *) plaintext2.data(), plaintext2.size()) != 1) {
+        return -1;
+      }
+
+      if (EVP_EncryptFinal_ex(encrypt_ctx.get(), ciphertext + update_outlen1 + update_outlen2, &final_outlen) != 1) {
+        return -1;
+      }
+
+      if (EVP_CIPHER_CTX_ctrl(encrypt_ctx.get(), EVP_CTRL_GCM_GET_TAG, tag_size, tag) != 1) {
+        return -1;
+      }
+
+      return update_outlen1 + update_outlen2 + final_outlen;
+    }
+
     int gcm_t::encrypt(const std::string_view &plaintext, std::uint8_t *tagged_cipher, aes_t *iv) {
       // This overload handles the common case of [GCM tag][cipher text] buffer layout
       return encrypt(plaintext, tagged_cipher, tagged_cipher + tag_size, iv);
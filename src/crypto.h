@@ -122,6 +122,17 @@ namespace crypto {
        */
       int encrypt(const std::string_view &plaintext, std::uint8_t *tag, std::uint8_t *ciphertext, aes_t *iv);
 
+      /**
+       * @brief Encrypts the concatenation of two plaintext buffers using AES GCM mode.
+       * @param plaintext1 The first part of the plaintext data to be encrypted.
+       * @param plaintext2 The second part of the plaintext data to be encrypted.
+       * @param tag The buffer where the GCM tag will be written.
+       * @param ciphertext The buffer where the resulting ciphertext of both parts will be written.
+       * @param iv The initialization vector to be used for the encryption.
+       * @return The total length of the ciphertext. Returns -1 in case of an error.
+       */
+      int encrypt(const std::string_view &plaintext1, const std::string_view &plaintext2, std::uint8_t *tag, std::uint8_t *ciphertext, aes_t *iv);
+
       /**
        * @brief Encrypts the plaintext using AES GCM mode.
        * length of cipher must be at least: round_to_pkcs7_padded(plaintext.size()) + crypto::cipher::tag_size
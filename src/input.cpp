@@ -9,10 +9,11 @@ extern "C" {
 }
 
 // standard includes
+#include <array>
 #include <bitset>
 #include <chrono>
 #include <cmath>
-#include <list>
+#include <cstring>
 #include <thread>
 #include <unordered_map>
 
@@ -184,9 +185,16 @@ namespace input {
     safe::mail_raw_t::event_t<input::touch_port_t> touch_port_event;
     platf::feedback_queue_t feedback_queue;
 
-    std::list<std::vector<uint8_t>> input_queue;
+    input_ring_t input_queue;
     std::mutex input_queue_lock;
 
+    // Set while a task is draining input_queue, so each session has at most one
+    bool input_drain_scheduled {};
+
+    // Input messages dropped since the last warning about it, so a flood logs once a second
+    std::uint64_t input_dropped {};
+    std::chrono::steady_clock::time_point input_drop_warned {};
+
     thread_pool_util::ThreadPool::task_id_t mouse_left_button_timeout;
 
     input::touch_port_t touch_port;
@@ -1234,10 +1242,10 @@ namespace input {
     short deltaX, deltaY;
 
     // Batching is safe as long as the result doesn't overflow a 16-bit integer
-    if (!__builtin_add_overflow(util::endian::big(dest->deltaX), util::endian::big(src->deltaX), &deltaX)) {
+    if (__builtin_add_overflow(util::endian::big(dest->deltaX), util::endian::big(src->deltaX), &deltaX)) {
       return batch_result_e::terminate_batch;
     }
-    if (!__builtin_add_overflow(util::endian::big(dest->deltaY), util::endian::big(src->deltaY), &deltaY)) {
+    if (__builtin_add_overflow(util::endian::big(dest->deltaY), util::endian::big(src->deltaY), &deltaY)) {
       return batch_result_e::terminate_batch;
     }
 
@@ -1274,7 +1282,7 @@ namespace input {
     short scrollAmt;
 
     // Batching is safe as long as the result doesn't overflow a 16-bit integer
-    if (!__builtin_add_overflow(util::endian::big(dest->scrollAmt1), util::endian::big(src->scrollAmt1), &scrollAmt)) {
+    if (__builtin_add_overflow(util::endian::big(dest->scrollAmt1), util::endian::big(src->scrollAmt1), &scrollAmt)) {
       return batch_result_e::terminate_batch;
     }
 
@@ -1294,7 +1302,7 @@ namespace input {
     short scrollAmt;
 
     // Batching is safe as long as the result doesn't overflow a 16-bit integer
-    if (!__builtin_add_overflow(util::endian::big(dest->scrollAmount), util::endian::big(src->scrollAmount), &scrollAmt)) {
+    if (__builtin_add_overflow(util::endian::big(dest->scrollAmount), util::endian::big(src->scrollAmount), &scrollAmt)) {
       return batch_result_e::terminate_batch;
     }
 
@@ -1500,100 +1508,234 @@ namespace input {
   }
 
   /**
-   * @brief Called on a thread pool thread to process an input message.
-   * @param input The input context pointer.
+   * @brief Check whether a message only carries movement, which later messages make up for.
+   * @param header The message.
+   * @return `true` if dropping the message leaves no key, button or device in the wrong state.
    */
-  void passthrough_next_message(std::shared_ptr<input_t> input) {
-    // 'entry' backs the 'payload' pointer, so they must remain in scope together
-    std::vector<uint8_t> entry;
-    PNV_INPUT_HEADER payload;
+  static bool is_movement(PNV_INPUT_HEADER header) {
+    switch (util::endian::little(header->magic)) {
+      case MOUSE_MOVE_REL_MAGIC_GEN5:
+      case MOUSE_MOVE_ABS_MAGIC:
+      case SCROLL_MAGIC_GEN5:
+      case SS_HSCROLL_MAGIC:
+      case SS_CONTROLLER_MOTION_MAGIC:
+        return true;
+      default:
+        return false;
+    }
+  }
 
-    // Lock the input queue while batching, but release it before sending
-    // the input to the OS. This avoids potentially lengthy lock contention
-    // in the control stream thread while input is being processed by the OS.
-    {
-      std::lock_guard<std::mutex> lg(input->input_queue_lock);
+  bool input_ring_t::make_room() {
+    // The message being sent stays in its slot
+    auto first = head + (front_in_flight ? 1 : 0);
 
-      // If all entries have already been processed, nothing to do
-      if (input->input_queue.empty()) {
-        return;
+    auto evict = tail;
+    for (auto x = first; x != tail; ++x) {
+      if (!slots[x % SLOTS].size) {
+        evict = x;
+        break;
       }
+    }
 
-      // Pop off the first entry, which we will send
-      entry = input->input_queue.front();
-      payload = (PNV_INPUT_HEADER) entry.data();
-      input->input_queue.pop_front();
-
-      // Try to batch with remaining items on the queue
-      auto i = input->input_queue.begin();
-      while (i != input->input_queue.end()) {
-        auto batchable_entry = *i;
-        auto batchable_payload = (PNV_INPUT_HEADER) batchable_entry.data();
-
-        auto batch_result = batch(payload, batchable_payload);
-        if (batch_result == batch_result_e::terminate_batch) {
-          // Stop batching
+    if (evict == tail) {
+      for (auto x = first; x != tail; ++x) {
+        if (is_movement(slots[x % SLOTS].header())) {
+          evict = x;
+          ++dropped_messages;
           break;
-        } else if (batch_result == batch_result_e::batched) {
-          // Erase this entry since it was batched
-          i = input->input_queue.erase(i);
-        } else {
-          // We couldn't batch this entry, but try to batch later entries.
-          i++;
         }
       }
     }
 
-    // Print the final input packet
-    input::print((void *) payload);
+    if (evict == tail) {
+      return false;
+    }
 
-    // Send the batched input to the OS
-    switch (util::endian::little(payload->magic)) {
-      case MOUSE_MOVE_REL_MAGIC_GEN5:
-        passthrough(input, (PNV_REL_MOUSE_MOVE_PACKET) payload);
-        break;
-      case MOUSE_MOVE_ABS_MAGIC:
-        passthrough(input, (PNV_ABS_MOUSE_MOVE_PACKET) payload);
-        break;
-      case MOUSE_BUTTON_DOWN_EVENT_MAGIC_GEN5:
-      case MOUSE_BUTTON_UP_EVENT_MAGIC_GEN5:
-        passthrough(input, (PNV_MOUSE_BUTTON_PACKET) payload);
-        break;
-      case SCROLL_MAGIC_GEN5:
-        passthrough(input, (PNV_SCROLL_PACKET) payload);
-        break;
-      case SS_HSCROLL_MAGIC:
-        passthrough(input, (PSS_HSCROLL_PACKET) payload);
-        break;
-      case KEY_DOWN_EVENT_MAGIC:
-      case KEY_UP_EVENT_MAGIC:
-        passthrough(input, (PNV_KEYBOARD_PACKET) payload);
-        break;
-      case UTF8_TEXT_EVENT_MAGIC:
-        passthrough((PNV_UNICODE_PACKET) payload);
-        break;
-      case MULTI_CONTROLLER_MAGIC_GEN5:
-        passthrough(input, (PNV_MULTI_CONTROLLER_PACKET) payload);
-        break;
-      case SS_TOUCH_MAGIC:
-        passthrough(input, (PSS_TOUCH_PACKET) payload);
-        break;
-      case SS_PEN_MAGIC:
-        passthrough(input, (PSS_PEN_PACKET) payload);
-        break;
-      case SS_CONTROLLER_ARRIVAL_MAGIC:
-        passthrough(input, (PSS_CONTROLLER_ARRIVAL_PACKET) payload);
-        break;
-      case SS_CONTROLLER_TOUCH_MAGIC:
-        passthrough(input, (PSS_CONTROLLER_TOUCH_PACKET) payload);
-        break;
-      case SS_CONTROLLER_MOTION_MAGIC:
-        passthrough(input, (PSS_CONTROLLER_MOTION_PACKET) payload);
-        break;
-      case SS_CONTROLLER_BATTERY_MAGIC:
-        passthrough(input, (PSS_CONTROLLER_BATTERY_PACKET) payload);
+    // Close the gap, keeping the messages in order
+    for (auto x = evict; x + 1 != tail; ++x) {
+      slots[x % SLOTS] = slots[(x + 1) % SLOTS];
+    }
+    --tail;
+
+    return true;
+  }
+
+  bool input_ring_t::push(const std::string_view &data) {
+    if (data.size() < sizeof(NV_INPUT_HEADER) || data.size() > SLOT_SIZE) {
+      return false;
+    }
+
+    // Pad the message, so batching never reads past the end of a short message
+    std::memcpy(incoming.data.data(), data.data(), data.size());
+    std::memset(incoming.data.data() + data.size(), 0, SLOT_SIZE - data.size());
+    incoming.size = data.size();
+
+    // Messages may not overtake those waiting for room
+    if (!overflow.empty()) {
+      if (batch(overflow.back().header(), incoming.header()) == batch_result_e::batched) {
+        return true;
+      }
+
+      if (is_movement(incoming.header())) {
+        ++dropped_messages;
+        return false;
+      }
+
+      overflow.emplace_back(incoming);
+      return true;
+    }
+
+    // Try to merge with the newest message, unless it's already being sent
+    if (tail - head > (front_in_flight ? 1 : 0)) {
+      auto &last = slots[(tail - 1) % SLOTS];
+      if (last.size && batch(last.header(), incoming.header()) == batch_result_e::batched) {
+        return true;
+      }
+    }
+
+    if (tail - head == SLOTS && !make_room()) {
+      if (is_movement(incoming.header())) {
+        ++dropped_messages;
+        return false;
+      }
+
+      overflow.emplace_back(incoming);
+      return true;
+    }
+
+    slots[tail++ % SLOTS] = incoming;
+    return true;
+  }
+
+  PNV_INPUT_HEADER input_ring_t::front() {
+    if (head == tail) {
+      return nullptr;
+    }
+
+    auto payload = slots[head % SLOTS].header();
+
+    // Try to batch with the remaining messages
+    for (auto x = head + 1; x != tail; ++x) {
+      auto &slot = slots[x % SLOTS];
+      if (!slot.size) {
+        continue;
+      }
+
+      auto batch_result = batch(payload, slot.header());
+      if (batch_result == batch_result_e::terminate_batch) {
+        // Stop batching
         break;
+      } else if (batch_result == batch_result_e::batched) {
+        // Skip this message from now on, since it was batched
+        slot.size = 0;
+      }
+
+      // We couldn't batch this message, but try to batch later messages.
+    }
+
+    front_in_flight = true;
+    return payload;
+  }
+
+  void input_ring_t::pop_front() {
+    front_in_flight = false;
+
+    // Drop the sent message along with any messages that were batched into it
+    do {
+      slots[head++ % SLOTS].size = 0;
+    } while (head != tail && !slots[head % SLOTS].size);
+
+    while (!overflow.empty() && tail - head < SLOTS) {
+      slots[tail++ % SLOTS] = overflow.front();
+      overflow.pop_front();
+    }
+  }
+
+  /**
+   * @brief Called on a thread pool thread to send the queued input messages of a session.
+   * @param input The input context pointer.
+   */
+  void passthrough_next_message(std::shared_ptr<input_t> input) {
+    // Give other input tasks, such as key repeats, a chance to run in between
+    constexpr auto MAX_MESSAGES_PER_TASK = 32;
+
+    for (int x = 0; x < MAX_MESSAGES_PER_TASK; ++x) {
+      PNV_INPUT_HEADER payload;
+
+      // Lock the input queue while batching, but release it before sending
+      // the input to the OS. This avoids potentially lengthy lock contention
+      // in the control stream thread while input is being processed by the OS.
+      // The payload stays in its slot until it is popped below.
+      {
+        std::lock_guard<std::mutex> lg(input->input_queue_lock);
+
+        payload = input->input_queue.front();
+        if (!payload) {
+          // All messages have been processed
+          input->input_drain_scheduled = false;
+          return;
+        }
+      }
+
+      // Print the final input packet
+      input::print((void *) payload);
+
+      // Send the batched input to the OS
+      switch (util::endian::little(payload->magic)) {
+        case MOUSE_MOVE_REL_MAGIC_GEN5:
+          passthrough(input, (PNV_REL_MOUSE_MOVE_PACKET) payload);
+          break;
+        case MOUSE_MOVE_ABS_MAGIC:
+          passthrough(input, (PNV_ABS_MOUSE_MOVE_PACKET) payload);
+          break;
+        case MOUSE_BUTTON_DOWN_EVENT_MAGIC_GEN5:
+        case MOUSE_BUTTON_UP_EVENT_MAGIC_GEN5:
+          passthrough(input, (PNV_MOUSE_BUTTON_PACKET) payload);
+          break;
+        case SCROLL_MAGIC_GEN5:
+          passthrough(input, (PNV_SCROLL_PACKET) payload);
+          break;
+        case SS_HSCROLL_MAGIC:
+          passthrough(input, (PSS_HSCROLL_PACKET) payload);
+          break;
+        case KEY_DOWN_EVENT_MAGIC:
+        case KEY_UP_EVENT_MAGIC:
+          passthrough(input, (PNV_KEYBOARD_PACKET) payload);
+          break;
+        case UTF8_TEXT_EVENT_MAGIC:
+          passthrough((PNV_UNICODE_PACKET) payload);
+          break;
+        case MULTI_CONTROLLER_MAGIC_GEN5:
+          passthrough(input, (PNV_MULTI_CONTROLLER_PACKET) payload);
+          break;
+        case SS_TOUCH_MAGIC:
+          passthrough(input, (PSS_TOUCH_PACKET) payload);
+          break;
+        case SS_PEN_MAGIC:
+          passthrough(input, (PSS_PEN_PACKET) payload);
+          break;
+        case SS_CONTROLLER_ARRIVAL_MAGIC:
+          passthrough(input, (PSS_CONTROLLER_ARRIVAL_PACKET) payload);
+          break;
+        case SS_CONTROLLER_TOUCH_MAGIC:
+          passthrough(input, (PSS_CONTROLLER_TOUCH_PACKET) payload);
+          break;
+        case SS_CONTROLLER_MOTION_MAGIC:
+          passthrough(input, (PSS_CONTROLLER_MOTION_PACKET) payload);
+          break;
+        case SS_CONTROLLER_BATTERY_MAGIC:
+          passthrough(input, (PSS_CONTROLLER_BATTERY_PACKET) payload);
+          break;
+      }
+
+      {
+        std::lock_guard<std::mutex> lg(input->input_queue_lock);
+        input->input_queue.pop_front();
+      }
     }
+
+    // More input is waiting, continue in a new task
+    task_pool.push(passthrough_next_message, input);
   }
 
   /**
@@ -1601,11 +1743,29 @@ namespace input {
    * @param input The input context pointer.
    * @param input_data The input message.
    */
-  void passthrough(std::shared_ptr<input_t> &input, std::vector<std::uint8_t> &&input_data) {
+  void passthrough(std::shared_ptr<input_t> &input, const std::string_view &input_data) {
     {
       std::lock_guard<std::mutex> lg(input->input_queue_lock);
-      input->input_queue.push_back(std::move(input_data));
+
+      if (!input->input_queue.push(input_data)) {
+        ++input->input_dropped;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - input->input_drop_warned >= 1s) {
+          BOOST_LOG(warning) << "Dropped "sv << input->input_dropped << " input message(s), input queue is full or message is too large"sv;
+          input->input_dropped = 0;
+          input->input_drop_warned = now;
+        }
+        return;
+      }
+
+      // A task is already draining the queue and will pick up this message
+      if (input->input_drain_scheduled) {
+        return;
+      }
+      input->input_drain_scheduled = true;
     }
+
     task_pool.push(passthrough_next_message, input);
   }
 
@@ -5,18 +5,25 @@
 #pragma once
 
 // standard includes
+#include <array>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <string_view>
 
 // local includes
 #include "platform/common.h"
 #include "thread_safe.h"
 
+// Defined by moonlight-common-c
+struct _NV_INPUT_HEADER;
+
 namespace input {
   struct input_t;
 
   void print(void *input);
   void reset(std::shared_ptr<input_t> &input);
-  void passthrough(std::shared_ptr<input_t> &input, std::vector<std::uint8_t> &&input_data);
+  void passthrough(std::shared_ptr<input_t> &input, const std::string_view &input_data);
 
   [[nodiscard]] std::unique_ptr<platf::deinit_t> init();
 
@@ -37,6 +44,82 @@ namespace input {
     }
   };
 
+  /**
+   * @brief A fixed-size ring of input messages waiting to be sent to the OS.
+   * @details Messages are copied into preallocated slots, so queueing input never allocates.
+   *          A message that can be batched with the newest queued message is merged into it
+   *          right away, which keeps the ring short when a high polling rate mouse floods us
+   *          with movement. The ring isn't thread-safe, callers must hold `input_queue_lock`.
+   */
+  class input_ring_t {
+  public:
+    static constexpr std::size_t SLOTS = 256;
+    static constexpr std::size_t SLOT_SIZE = 128;
+
+    /**
+     * @brief Queue a message, or merge it into the newest queued message.
+     * @details When the ring is full, the oldest mouse movement, scroll or motion message makes room.
+     *          Messages that change the state of a key, button or device are never dropped, they wait
+     *          in an overflow list if nothing can make room for them.
+     * @param data The input message.
+     * @return `false` if the message is too large, or is a movement message with no room for it.
+     */
+    bool push(const std::string_view &data);
+
+    /**
+     * @brief Get the oldest message, with any later messages batched into it.
+     * @details The message stays valid until `pop_front()`, even without holding the lock.
+     * @return The message, or `nullptr` if the ring is empty.
+     */
+    _NV_INPUT_HEADER *front();
+
+    /**
+     * @brief Release the message returned by `front()`.
+     */
+    void pop_front();
+
+    /**
+     * @brief Get the number of movement messages dropped so far to make room for others.
+     * @return The number of messages.
+     */
+    std::uint64_t dropped() const {
+      return dropped_messages;
+    }
+
+  private:
+    struct slot_t {
+      // Zero once the message has been batched into an earlier one
+      std::uint16_t size;
+      alignas(8) std::array<std::uint8_t, SLOT_SIZE> data;
+
+      _NV_INPUT_HEADER *header() {
+        return (_NV_INPUT_HEADER *) data.data();
+      }
+    };
+
+    /**
+     * @brief Free the slot of a message that was batched into another, or else of the oldest movement message.
+     * @return `false` if every slot holds a message that must be kept.
+     */
+    bool make_room();
+
+    std::array<slot_t, SLOTS> slots {};
+
+    // Messages that must not be dropped, waiting for the ring to have room
+    std::deque<slot_t> overflow;
+
+    // Used to compare an incoming message with the newest queued message
+    slot_t incoming;
+
+    std::uint64_t dropped_messages {};
+
+    std::size_t head {};
+    std::size_t tail {};
+
+    // The message at head is being sent and must not be touched
+    bool front_in_flight {};
+  };
+
   /**
    * @brief Scale the ellipse axes according to the provided size.
    * @param val The major and minor axis pair.
@@ -23,6 +23,7 @@
 #include "starbeam/tunnel.h"
 #include "starbeam/udp.h"
 #include "system_tray.h"
+#include "trace.h"
 #include "upnp.h"
 #include "video.h"
 
@@ -334,6 +335,13 @@ int main(int argc, char *argv[]) {
   }
 
   reed_solomon_init();
+  BOOST_LOG(debug) << "Using "sv << reed_solomon_isa_name(reed_solomon_get_isa()) << " Reed-Solomon kernels"sv;
+
+  if (config::stream.frame_trace) {
+    trace::init(trace::DEFAULT_CAPACITY);
+    BOOST_LOG(info) << "Frame tracing enabled, download the trace from /api/trace"sv;
+  }
+
   auto input_deinit_guard = input::init();
 
   if (input::probe_gamepads()) {
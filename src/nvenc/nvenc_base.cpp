@@ -11,6 +11,7 @@
 // local includes
 #include "src/config.h"
 #include "src/logging.h"
+#include "src/trace.h"
 #include "src/utility.h"
 
 #define MAKE_NVENC_VER(major, minor) ((major) | ((minor) << 24))
@@ -213,6 +214,8 @@ namespace nvenc {
 
     encoder_params.rfi = get_encoder_cap(NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION);
 
+    encoder_params.dynamic_bitrate = get_encoder_cap(NV_ENC_CAPS_SUPPORT_DYN_BITRATE_CHANGE);
+
     init_params.presetGUID = quality_preset_guid_from_number(config.quality_preset);
     init_params.tuningInfo = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
     init_params.enablePTD = 1;
@@ -394,6 +397,10 @@ namespace nvenc {
       return false;
     }
 
+    reconfigure_params.init_params = init_params;
+    reconfigure_params.enc_config = enc_config;
+    reconfigure_params.init_params.encodeConfig = &reconfigure_params.enc_config;
+
     if (async_event_handle) {
       NV_ENC_EVENT_PARAMS event_params = {min_struct_version(NV_ENC_EVENT_PARAMS_VER)};
       event_params.completionEvent = async_event_handle;
@@ -503,6 +510,7 @@ namespace nvenc {
     assert(registered_input_buffer);
     assert(output_bitstream);
 
+    trace::span_t submit {trace::span_e::encode_submit, (std::int64_t) frame_index};
     if (!synchronize_input_buffer()) {
       BOOST_LOG(error) << "NvEnc: failed to synchronize input buffer";
       return {};
@@ -536,6 +544,9 @@ namespace nvenc {
       BOOST_LOG(error) << "NvEnc: NvEncEncodePicture() failed: " << last_nvenc_error_string;
       return {};
     }
+    submit.end();
+
+    trace::span_t receive {trace::span_e::encode_receive, (std::int64_t) frame_index};
 
     NV_ENC_LOCK_BITSTREAM lock_bitstream = {min_struct_version(NV_ENC_LOCK_BITSTREAM_VER, 1, 2)};
     lock_bitstream.outputBitstream = output_bitstream;
@@ -573,6 +584,7 @@ namespace nvenc {
     if (nvenc_failed(nvenc->nvEncUnlockBitstream(encoder, lock_bitstream.outputBitstream))) {
       BOOST_LOG(error) << "NvEnc: NvEncUnlockBitstream() failed: " << last_nvenc_error_string;
     }
+    receive.end();
 
     encoder_state.frame_size_logger.collect_and_log(encoded_frame.data.size() / 1000.);
 
@@ -617,6 +629,35 @@ namespace nvenc {
     return true;
   }
 
+  bool nvenc_base::set_bitrate(uint32_t bitrate_kbps) {
+    if (!encoder || !encoder_params.dynamic_bitrate) {
+      return false;
+    }
+
+    auto &rc_params = reconfigure_params.enc_config.rcParams;
+    auto bitrate = bitrate_kbps * 1000;
+    if (bitrate == rc_params.averageBitRate) {
+      return true;
+    }
+
+    // Keep the VBV buffer at the same number of frames
+    if (rc_params.vbvBufferSize) {
+      rc_params.vbvBufferSize = (uint32_t) ((uint64_t) rc_params.vbvBufferSize * bitrate / rc_params.averageBitRate);
+    }
+    rc_params.averageBitRate = bitrate;
+
+    NV_ENC_RECONFIGURE_PARAMS reconfigure = {min_struct_version(NV_ENC_RECONFIGURE_PARAMS_VER)};
+    reconfigure.reInitEncodeParams = reconfigure_params.init_params;
+
+    if (nvenc_failed(nvenc->nvEncReconfigureEncoder(encoder, &reconfigure))) {
+      BOOST_LOG(error) << "NvEnc: NvEncReconfigureEncoder() failed: " << last_nvenc_error_string;
+      return false;
+    }
+
+    BOOST_LOG(debug) << "NvEnc: bitrate changed to " << bitrate_kbps << " kbps";
+    return true;
+  }
+
   bool nvenc_base::nvenc_failed(NVENCSTATUS status) {
     auto status_string = [](NVENCSTATUS status) -> std::string {
       switch (status) {
@@ -69,6 +69,13 @@ namespace nvenc {
      */
     bool invalidate_ref_frames(uint64_t first_frame, uint64_t last_frame);
 
+    /**
+     * @brief Change the bitrate of the running encoder without an IDR frame.
+     * @param bitrate_kbps New bitrate in kilobits per second.
+     * @return `true` on success, `false` on error or if the encoder can't change its bitrate.
+     */
+    bool set_bitrate(uint32_t bitrate_kbps);
+
   protected:
     /**
      * @brief Required. Used for loading NvEnc library and setting `nvenc` variable with `NvEncodeAPICreateInstance()`.
@@ -126,6 +133,7 @@ namespace nvenc {
       NV_ENC_BUFFER_FORMAT buffer_format = NV_ENC_BUFFER_FORMAT_UNDEFINED;
       uint32_t ref_frames_in_dpb = 0;
       bool rfi = false;
+      bool dynamic_bitrate = false;
     } encoder_params;
 
     std::string last_nvenc_error_string;
@@ -150,6 +158,12 @@ namespace nvenc {
       std::pair<uint64_t, uint64_t> last_rfi_range;
       logging::min_max_avg_periodic_logger<double> frame_size_logger = {debug, "NvEnc: encoded frame sizes in kB", ""};
     } encoder_state;
+
+    // Parameters the encoder was initialized with, reused by `set_bitrate()`
+    struct {
+      NV_ENC_INITIALIZE_PARAMS init_params = {};
+      NV_ENC_CONFIG enc_config = {};
+    } reconfigure_params;
   };
 
 }  // namespace nvenc
@@ -0,0 +1,70 @@
+/**
+ * @file src/pacing.cpp
+ * @brief Definitions for pacing outgoing video packets.
+ */
+// standard includes
+#include <algorithm>
+#include <ratio>
+
+// local includes
+#include "pacing.h"
+
+using namespace std::literals;
+
+namespace pacing {
+  std::uint64_t rate_from_bitrate(std::uint64_t bitrate_kbps) {
+    // An average frame holds (bitrate / framerate) bits, which must be sent
+    // within (1 / framerate) / 2 seconds, so the frame rate cancels out.
+    return bitrate_kbps * 1000 * 2;
+  }
+
+  pacer_t::pacer_t():
+      bits_per_second {0},
+      packet_interval {0},
+      packets_per_group {1},
+      frame_packets_sent {0},
+      group_packets_sent {0} {
+  }
+
+  void pacer_t::set_rate(std::uint64_t bits_per_second, std::size_t packet_size) {
+    this->bits_per_second = std::max<std::uint64_t>(bits_per_second, 1);
+
+    packet_interval = std::max(1ns, std::chrono::nanoseconds {packet_size * 8 * std::nano::den / this->bits_per_second});
+    packets_per_group = std::max<std::size_t>(1ms / packet_interval, 1);
+  }
+
+  std::uint64_t pacer_t::rate() const {
+    return bits_per_second;
+  }
+
+  void pacer_t::begin_frame(clock::time_point now) {
+    // Don't ignore the last group of the previous frame
+    frame_start = std::max(_next_frame_start, now);
+
+    frame_packets_sent = 0;
+    group_packets_sent = 0;
+  }
+
+  std::optional<clock::time_point> pacer_t::next_send_time() {
+    // Pace once every group within the frame, and also before the first
+    // group of the frame to account for the last group of the previous frame.
+    if (group_packets_sent < packets_per_group && frame_packets_sent != 0) {
+      return std::nullopt;
+    }
+
+    group_packets_sent = 0;
+    return frame_start + packet_interval * frame_packets_sent;
+  }
+
+  void pacer_t::packets_sent(std::size_t count) {
+    group_packets_sent += count;
+    frame_packets_sent += count;
+
+    // Remember this in case the next frame comes immediately
+    _next_frame_start = frame_start + packet_interval * frame_packets_sent;
+  }
+
+  clock::time_point pacer_t::next_frame_start() const {
+    return _next_frame_start;
+  }
+}  // namespace pacing
@@ -0,0 +1,98 @@
+/**
+ * @file src/pacing.h
+ * @brief Declarations for pacing outgoing video packets.
+ */
+#pragma once
+
+// standard includes
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace pacing {
+  using clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Derive a pacing rate from the bitrate of a stream.
+   * @details The rate is chosen so an average sized frame is sent within half of the
+   *          frame interval, whatever the frame rate. Larger frames, such as IDR frames,
+   *          are spread over more time.
+   * @param bitrate_kbps The bitrate of the stream in kilobits per second.
+   * @return The pacing rate in bits per second.
+   */
+  std::uint64_t rate_from_bitrate(std::uint64_t bitrate_kbps);
+
+  /**
+   * @brief Spaces the packets of each frame out so they leave at no more than a target rate.
+   * @details Packets are released in groups of up to 1 ms worth of traffic. The pacing
+   *          of a frame carries over to the next one, so a frame arriving while the
+   *          previous frame is still being paced is delayed accordingly.
+   * @examples
+   * pacing::pacer_t pacer;
+   * pacer.set_rate(800'000'000, 1416);
+   * pacer.begin_frame(pacing::clock::now());
+   * for (auto &batch : batches) {
+   *   if (auto due = pacer.next_send_time()) {
+   *     sleep_until(*due);
+   *   }
+   *   send(batch);
+   *   pacer.packets_sent(batch.size());
+   * }
+   * @examples_end
+   */
+  class pacer_t {
+  public:
+    pacer_t();
+
+    /**
+     * @brief Set the rate to pace packets at.
+     * @param bits_per_second The pacing rate in bits per second.
+     * @param packet_size The size of each packet in bytes.
+     */
+    void set_rate(std::uint64_t bits_per_second, std::size_t packet_size);
+
+    /**
+     * @brief Get the rate packets are paced at.
+     * @return The pacing rate in bits per second.
+     */
+    std::uint64_t rate() const;
+
+    /**
+     * @brief Start pacing a new frame.
+     * @param now The current time.
+     */
+    void begin_frame(clock::time_point now);
+
+    /**
+     * @brief Get the time the next group of packets of the frame may be sent.
+     * @return The time to wait for, or `std::nullopt` if the packets may be sent right away.
+     */
+    std::optional<clock::time_point> next_send_time();
+
+    /**
+     * @brief Record packets of the frame that were just sent.
+     * @param count The number of packets sent.
+     */
+    void packets_sent(std::size_t count);
+
+    /**
+     * @brief Get the time the next frame can start being sent without exceeding the rate.
+     * @return The time the last packet sent so far is paid off.
+     */
+    clock::time_point next_frame_start() const;
+
+  private:
+    std::uint64_t bits_per_second;
+
+    // The time it takes to send a single packet at the pacing rate
+    std::chrono::nanoseconds packet_interval;
+
+    // The number of packets that may be sent in a single burst
+    std::size_t packets_per_group;
+
+    clock::time_point frame_start;
+    clock::time_point _next_frame_start;
+    std::size_t frame_packets_sent;
+    std::size_t group_packets_sent;
+  };
+}  // namespace pacing
@@ -5,7 +5,12 @@
 #pragma once
 
 // standard includes
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <bitset>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
 #include <functional>
 #include <mutex>
@@ -608,7 +613,22 @@ namespace platf {
     high,  ///< High priority
     critical  ///< Critical priority
   };
-  void adjust_thread_priority(thread_priority_e priority);
+
+  enum class thread_role_e : int {
+    none,  ///< No particular role
+    capture,  ///< Captures video or audio
+    encode,  ///< Encodes video or audio
+    video_send,  ///< Sends video
+    audio_send,  ///< Sends audio
+    input  ///< Receives input and control messages
+  };
+
+  /**
+   * @brief Adjust the scheduling of the calling thread.
+   * @param priority The priority of the thread.
+   * @param role What the thread does, to pin it to the CPUs configured for it.
+   */
+  void adjust_thread_priority(thread_priority_e priority, thread_role_e role = thread_role_e::none);
 
   // Allow OS-specific actions to be taken to prepare for streaming
   void streaming_will_start();
@@ -706,6 +726,31 @@ namespace platf {
 
   bool send(send_info_t &send_info);
 
+  /**
+   * @brief Send several datagrams, which may have different sizes and targets.
+   * @param send_infos The datagrams to send, all through the same socket.
+   * @return `true` if all of them were sent.
+   * @note Where the OS allows it, they are sent with a single system call.
+   */
+  bool send_multi(std::vector<send_info_t> &send_infos);
+
+  /**
+   * @brief Datagrams sent by a thread and the system calls it took to send them.
+   */
+  struct send_stats_t {
+    std::uint64_t syscalls;
+    std::uint64_t datagrams;
+  };
+
+  /**
+   * @brief Get the send statistics of the calling thread.
+   * @return The statistics, counted since the thread started.
+   */
+  inline send_stats_t &thread_send_stats() {
+    thread_local send_stats_t stats {};
+    return stats;
+  }
+
   enum class qos_data_type_e : int {
     audio,  ///< Audio
     video  ///< Video
@@ -721,6 +766,15 @@ namespace platf {
    */
   std::unique_ptr<deinit_t> enable_socket_qos(uintptr_t native_socket, boost::asio::ip::address &address, uint16_t port, qos_data_type_e data_type, bool dscp_tagging);
 
+  /**
+   * @brief Ask the kernel to pace traffic sent on the given socket.
+   * @details Logs why when kernel pacing can't be enabled.
+   * @param native_socket The native socket handle.
+   * @param bytes_per_second The maximum rate to send traffic at.
+   * @return `true` if kernel pacing is supported and was enabled.
+   */
+  bool set_socket_pacing_rate(uintptr_t native_socket, std::uint64_t bytes_per_second);
+
   /**
    * @brief Open a url in the default web browser.
    * @param url The url to open.
@@ -846,6 +900,49 @@ namespace platf {
    */
   std::vector<supported_gamepad_t> &supported_gamepads(input_t *input);
 
+  /**
+   * @brief Histogram of how late a timer woke up.
+   * @details Bucket `x` counts wake-ups that were less than `2^x` microseconds late,
+   *          the last bucket counts the ones later than that too.
+   */
+  struct wakeup_histogram_t {
+    static constexpr std::size_t BUCKETS = 16;
+
+    std::array<std::uint64_t, BUCKETS> buckets {};
+    std::uint64_t count {};
+    std::chrono::nanoseconds max {};
+
+    /**
+     * @brief Record a wake-up.
+     * @param error How late the timer woke up.
+     */
+    void record(std::chrono::nanoseconds error) {
+      auto us = (std::uint64_t) std::max<std::int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(error).count(), 0);
+      ++buckets[std::min<std::size_t>(std::bit_width(us), BUCKETS - 1)];
+      ++count;
+      max = std::max(max, error);
+    }
+
+    /**
+     * @brief Get an upper bound of how late the given share of wake-ups were.
+     * @param p The share of wake-ups, between 0 and 1.
+     * @return The upper bound of the bucket the percentile falls in, at most the latest wake-up.
+     */
+    std::chrono::nanoseconds percentile(double p) const {
+      auto target = (std::uint64_t) std::ceil(p * count);
+
+      std::uint64_t seen = 0;
+      for (std::size_t x = 0; x + 1 < BUCKETS; ++x) {
+        seen += buckets[x];
+        if (seen >= target) {
+          return std::min<std::chrono::nanoseconds>(std::chrono::microseconds {1ll << x}, max);
+        }
+      }
+
+      return max;
+    }
+  };
+
   struct high_precision_timer: private boost::noncopyable {
     virtual ~high_precision_timer() = default;
 
@@ -855,11 +952,35 @@ namespace platf {
      */
     virtual void sleep_for(const std::chrono::nanoseconds &duration) = 0;
 
+    /**
+     * @brief Sleep until the deadline, recording how late the timer woke up.
+     * @param deadline The time to wake up at.
+     */
+    virtual void sleep_until(const std::chrono::steady_clock::time_point &deadline) {
+      auto now = std::chrono::steady_clock::now();
+      if (now < deadline) {
+        sleep_for(deadline - now);
+      }
+
+      histogram.record(std::chrono::steady_clock::now() - deadline);
+    }
+
     /**
      * @brief Check if platform-specific timer backend has been initialized successfully
      * @return `true` on success, `false` on error
      */
     virtual operator bool() = 0;
+
+    /**
+     * @brief Get how late `sleep_until()` woke up so far.
+     * @return The histogram, which may be reset by the caller.
+     */
+    wakeup_histogram_t &wakeup_histogram() {
+      return histogram;
+    }
+
+  protected:
+    wakeup_histogram_t histogram;
   };
 
   /**
@@ -9,9 +9,13 @@
 #endif
 
 // standard includes
+#include <array>
+#include <atomic>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <optional>
 #include <sstream>
 
 // platform includes
@@ -20,8 +24,17 @@
 #include <ifaddrs.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#ifdef __linux__
+  #include <sys/prctl.h>
+#endif
 
 #ifdef __FreeBSD__
   #include <net/if_dl.h>  // For sockaddr_dl, LLADDR, and AF_LINK
@@ -41,6 +54,7 @@
 #include "src/entry_handler.h"
 #include "src/logging.h"
 #include "src/platform/common.h"
+#include "synthetic.h"
 #include "vaapi.h"
 
 #ifdef __GNUC__
@@ -323,8 +337,281 @@ namespace platf {
     }
   }
 
-  void adjust_thread_priority(thread_priority_e priority) {
-    // Unimplemented
+  namespace {
+    // Real-time priorities are kept low, so kernel threads and audio servers like PipeWire still come first
+    constexpr int REALTIME_PRIORITY_CRITICAL = 10;
+    constexpr int REALTIME_PRIORITY_HIGH = 5;
+
+    // From linux/ioprio.h
+    constexpr int IOPRIO_WHO_PROCESS = 1;
+    constexpr int IOPRIO_CLASS_SHIFT = 13;
+    constexpr int IOPRIO_CLASS_BE = 2;
+    constexpr int IOPRIO_CLASS_IDLE = 3;
+
+    constexpr std::array priority_names {"low"sv, "normal"sv, "high"sv, "critical"sv};
+
+    /**
+     * @brief Check whether something happens for the first time to a thread of the given priority.
+     * @details Many threads share a priority, so fallbacks are only logged for the first of them.
+     */
+    bool first_time(std::array<std::atomic_bool, priority_names.size()> &seen, thread_priority_e priority) {
+      return !seen[(int) priority].exchange(true, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Set the scheduling policy of the calling thread.
+     * @param policy The policy.
+     * @param priority The real-time priority, lowered to RLIMIT_RTPRIO if that's all that is permitted.
+     * @return 0 on success, the error otherwise.
+     */
+    int set_scheduler(int policy, int priority) {
+      sched_param param {};
+      param.sched_priority = priority;
+
+#ifdef SCHED_RESET_ON_FORK
+      // Apps launched from this thread shouldn't inherit its priority
+      policy |= SCHED_RESET_ON_FORK;
+#endif
+
+      auto err = pthread_setschedparam(pthread_self(), policy, &param);
+      if (err == EPERM) {
+        rlimit limit;
+        if (!getrlimit(RLIMIT_RTPRIO, &limit) && limit.rlim_cur > 0 && limit.rlim_cur < (rlim_t) priority) {
+          param.sched_priority = (int) limit.rlim_cur;
+          err = pthread_setschedparam(pthread_self(), policy, &param);
+        }
+      }
+
+      return err;
+    }
+
+    /**
+     * @brief Set the nice value of the calling thread.
+     * @param nice The nice value, raised to what RLIMIT_NICE permits if need be.
+     * @return The nice value that was set, or `std::nullopt` if none could be.
+     */
+    std::optional<int> set_nice(int nice) {
+#ifdef __linux__
+      // On Linux, nice values belong to threads rather than processes
+      auto tid = (id_t) syscall(SYS_gettid);
+      if (!setpriority(PRIO_PROCESS, tid, nice)) {
+        return nice;
+      }
+
+      rlimit limit;
+      if (errno == EACCES && !getrlimit(RLIMIT_NICE, &limit) && limit.rlim_cur != RLIM_INFINITY) {
+        auto lowest = 20 - (int) limit.rlim_cur;
+        if (lowest > nice && lowest < 0 && !setpriority(PRIO_PROCESS, tid, lowest)) {
+          return lowest;
+        }
+      }
+#endif
+
+      return std::nullopt;
+    }
+
+    /**
+     * @brief Set the I/O priority of the calling thread.
+     * @return 0 on success, the error otherwise.
+     */
+    int set_io_priority(int io_class, int level) {
+#ifdef __linux__
+      if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int) syscall(SYS_gettid), io_class << IOPRIO_CLASS_SHIFT | level)) {
+        return errno;
+      }
+      return 0;
+#else
+      return ENOTSUP;
+#endif
+    }
+
+    // The autogroup is shared by the whole process, so its nice value is put back once streaming stops
+    std::mutex autogroup_lock;
+    std::optional<int> autogroup_original_nice;
+    int autogroup_nice;
+    bool autogroup_lowered;
+
+    /**
+     * @brief Get the nice value of Sunshine's autogroup.
+     * @return The nice value, or `std::nullopt` if the kernel doesn't group processes.
+     */
+    std::optional<int> read_autogroup_nice() {
+      // e.g. "/autogroup-42 nice 0"
+      std::ifstream autogroup {"/proc/self/autogroup"};
+
+      std::string name;
+      std::string label;
+      int nice;
+      if (autogroup >> name >> label >> nice && label == "nice") {
+        return nice;
+      }
+      return std::nullopt;
+    }
+
+    /**
+     * @brief Set the nice value of Sunshine's autogroup.
+     * @return `true` on success.
+     */
+    bool write_autogroup_nice(int nice) {
+      std::ofstream autogroup {"/proc/self/autogroup"};
+      return (bool) (autogroup << nice << std::flush);
+    }
+
+    /**
+     * @brief Lower the nice value of Sunshine's autogroup.
+     * @details With autogroups, the CPU is first shared between sessions, and only then between the
+     *          threads of a session by their nice values. The game may well run in another session.
+     */
+    void lower_autogroup_nice(int nice) {
+      std::lock_guard lg {autogroup_lock};
+
+      if (!autogroup_original_nice) {
+        autogroup_original_nice = read_autogroup_nice();
+        if (!autogroup_original_nice) {
+          return;
+        }
+        autogroup_nice = *autogroup_original_nice;
+        autogroup_lowered = false;
+      }
+
+      if (nice >= autogroup_nice) {
+        return;
+      }
+
+      // Not retried by later threads if it fails
+      autogroup_nice = nice;
+      if (!write_autogroup_nice(nice)) {
+        BOOST_LOG(debug) << "Couldn't set the nice value of the autogroup to "sv << nice;
+        return;
+      }
+      autogroup_lowered = true;
+    }
+
+    /**
+     * @brief Put back the nice value Sunshine's autogroup had before it was lowered.
+     */
+    void restore_autogroup_nice() {
+      std::lock_guard lg {autogroup_lock};
+
+      if (autogroup_original_nice && autogroup_lowered && !write_autogroup_nice(*autogroup_original_nice)) {
+        BOOST_LOG(debug) << "Couldn't restore the nice value of the autogroup to "sv << *autogroup_original_nice;
+      }
+      autogroup_original_nice.reset();
+    }
+
+    /**
+     * @brief Pin the calling thread to the CPUs configured for its role.
+     */
+    void pin_thread(thread_role_e role) {
+      const std::vector<int> *cpus;
+      switch (role) {
+        case thread_role_e::capture:
+          cpus = &config::stream.capture_cpus;
+          break;
+        case thread_role_e::encode:
+          cpus = &config::stream.encode_cpus;
+          break;
+        case thread_role_e::video_send:
+          cpus = &config::stream.video_send_cpus;
+          break;
+        case thread_role_e::audio_send:
+          cpus = &config::stream.audio_send_cpus;
+          break;
+        case thread_role_e::input:
+          cpus = &config::stream.input_cpus;
+          break;
+        default:
+          return;
+      }
+
+      if (cpus->empty()) {
+        return;
+      }
+
+#ifdef __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (auto cpu : *cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+          BOOST_LOG(warning) << "Ignoring invalid CPU "sv << cpu << " to pin threads to"sv;
+          continue;
+        }
+        CPU_SET(cpu, &set);
+      }
+
+      if (auto err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        BOOST_LOG(warning) << "Unable to pin thread to its configured CPUs: "sv << err;
+      }
+#else
+      BOOST_LOG(warning) << "Pinning threads to CPUs isn't supported on this platform"sv;
+#endif
+    }
+  }  // namespace
+
+  void adjust_thread_priority(thread_priority_e priority, thread_role_e role) {
+    static std::array<std::atomic_bool, priority_names.size()> realtime_fallback {};
+    static std::array<std::atomic_bool, priority_names.size()> nice_fallback {};
+
+    int policy = SCHED_OTHER;
+    int realtime_priority = 0;
+    int nice = 0;
+    int io_class = IOPRIO_CLASS_BE;
+    int io_level = 4;
+
+    switch (priority) {
+      case thread_priority_e::low:
+        nice = 10;
+        io_class = IOPRIO_CLASS_IDLE;
+        io_level = 0;
+        break;
+      case thread_priority_e::normal:
+        break;
+      case thread_priority_e::high:
+        policy = SCHED_RR;
+        realtime_priority = REALTIME_PRIORITY_HIGH;
+        nice = -5;
+        io_level = 2;
+        break;
+      case thread_priority_e::critical:
+        policy = SCHED_FIFO;
+        realtime_priority = REALTIME_PRIORITY_CRITICAL;
+        nice = -10;
+        io_level = 0;
+        break;
+      default:
+        BOOST_LOG(error) << "Unknown thread priority: "sv << (int) priority;
+        return;
+    }
+
+    pin_thread(role);
+
+    auto name = priority_names[(int) priority];
+    if (policy != SCHED_OTHER && config::stream.realtime_threads) {
+      auto err = set_scheduler(policy, realtime_priority);
+      if (!err) {
+        return;
+      }
+
+      if (first_time(realtime_fallback, priority)) {
+        BOOST_LOG(info) << "Real-time scheduling isn't permitted for "sv << name << " priority threads, falling back to nice values: "sv << err;
+      }
+    }
+
+    // Threads inherit real-time scheduling from the thread that started them
+    set_scheduler(SCHED_OTHER, 0);
+
+    auto applied = set_nice(nice);
+    if (!applied) {
+      if (nice != 0 && first_time(nice_fallback, priority)) {
+        BOOST_LOG(warning) << "Unable to set the nice value of "sv << name << " priority threads to "sv << nice << ", they may be preempted by the game"sv;
+      }
+    } else if (*applied < 0) {
+      lower_autogroup_nice(*applied);
+    }
+
+    if (auto err = set_io_priority(io_class, io_level); err && err != ENOTSUP) {
+      BOOST_LOG(debug) << "Unable to set the I/O priority of "sv << name << " priority thread: "sv << err;
+    }
   }
 
   void streaming_will_start() {
@@ -332,7 +619,7 @@ namespace platf {
   }
 
   void streaming_will_stop() {
-    // Nothing to do
+    restore_autogroup_nice();
   }
 
   void restart_on_exit() {
@@ -544,6 +831,7 @@ namespace platf {
         // This will fail if GSO is not available, so we will fall back to non-GSO if
         // it's the first sendmsg() call. On subsequent calls, we will treat errors as
         // actual failures and return to the caller.
+        ++thread_send_stats().syscalls;
         auto bytes_sent = sendmsg(sockfd, &msg, 0);
         if (bytes_sent < 0) {
           // If there's no send buffer space, wait for some to be available
@@ -567,6 +855,7 @@ namespace platf {
         }
 
         seg_index += bytes_sent / msg_size;
+        thread_send_stats().datagrams += bytes_sent / msg_size;
       }
 
       // If we sent something, return the status and don't fall back to the non-GSO path.
@@ -606,6 +895,7 @@ namespace platf {
       // Call sendmmsg() until all messages are sent
       size_t blocks_sent = 0;
       while (blocks_sent < send_info.block_count) {
+        ++thread_send_stats().syscalls;
         int msgs_sent = sendmmsg(sockfd, &msgs[blocks_sent], send_info.block_count - blocks_sent, 0);
         if (msgs_sent < 0) {
           // If there's no send buffer space, wait for some to be available
@@ -629,51 +919,27 @@ namespace platf {
         }
 
         blocks_sent += msgs_sent;
+        thread_send_stats().datagrams += msgs_sent;
       }
 
       return true;
     }
   }
 
-  bool send(send_info_t &send_info) {
-    auto sockfd = (int) send_info.native_socket;
-    struct msghdr msg = {};
-
-    // Convert the target address into a sockaddr
-    struct sockaddr_in taddr_v4 = {};
-    struct sockaddr_in6 taddr_v6 = {};
-    if (send_info.target_address.is_v6()) {
-      taddr_v6 = to_sockaddr(send_info.target_address.to_v6(), send_info.target_port);
-
-      msg.msg_name = (struct sockaddr *) &taddr_v6;
-      msg.msg_namelen = sizeof(taddr_v6);
-    } else {
-      taddr_v4 = to_sockaddr(send_info.target_address.to_v4(), send_info.target_port);
-
-      msg.msg_name = (struct sockaddr *) &taddr_v4;
-      msg.msg_namelen = sizeof(taddr_v4);
-    }
-
-    union {
-#ifdef IP_PKTINFO
-      char buf[std::max(CMSG_SPACE(sizeof(struct in_pktinfo)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
-#elif defined(IP_SENDSRCADDR)
-      // FreeBSD uses IP_SENDSRCADDR with struct in_addr instead of IP_PKTINFO with struct in_pktinfo
-      char buf[std::max(CMSG_SPACE(sizeof(struct in_addr)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
-#endif
-      struct cmsghdr alignment;
-    } cmbuf;
-
+  /**
+   * @brief Add the source address option to the control buffer of a message.
+   * @param msg The message, with a control buffer large enough for the option.
+   * @param source_address The address to send from.
+   * @return The length of the control buffer taken up by the option.
+   */
+  static socklen_t set_source_address(struct msghdr &msg, const boost::asio::ip::address &source_address) {
     socklen_t cmbuflen = 0;
 
-    msg.msg_control = cmbuf.buf;
-    msg.msg_controllen = sizeof(cmbuf.buf);
-
     auto pktinfo_cm = CMSG_FIRSTHDR(&msg);
-    if (send_info.source_address.is_v6()) {
+    if (source_address.is_v6()) {
       struct in6_pktinfo pktInfo;
 
-      struct sockaddr_in6 saddr_v6 = to_sockaddr(send_info.source_address.to_v6(), 0);
+      struct sockaddr_in6 saddr_v6 = to_sockaddr(source_address.to_v6(), 0);
       pktInfo.ipi6_addr = saddr_v6.sin6_addr;
       pktInfo.ipi6_ifindex = 0;
 
@@ -687,7 +953,7 @@ namespace platf {
 #ifdef IP_PKTINFO
       struct in_pktinfo pktInfo;
 
-      struct sockaddr_in saddr_v4 = to_sockaddr(send_info.source_address.to_v4(), 0);
+      struct sockaddr_in saddr_v4 = to_sockaddr(source_address.to_v4(), 0);
       pktInfo.ipi_spec_dst = saddr_v4.sin_addr;
       pktInfo.ipi_ifindex = 0;
 
@@ -699,7 +965,7 @@ namespace platf {
       memcpy(CMSG_DATA(pktinfo_cm), &pktInfo, sizeof(pktInfo));
 #elif defined(IP_SENDSRCADDR)
       // FreeBSD uses IP_SENDSRCADDR with struct in_addr instead of IP_PKTINFO
-      struct sockaddr_in saddr_v4 = to_sockaddr(send_info.source_address.to_v4(), 0);
+      struct sockaddr_in saddr_v4 = to_sockaddr(source_address.to_v4(), 0);
       struct in_addr src_addr = saddr_v4.sin_addr;
 
       cmbuflen += CMSG_SPACE(sizeof(src_addr));
@@ -711,6 +977,43 @@ namespace platf {
 #endif
     }
 
+    return cmbuflen;
+  }
+
+  bool send(send_info_t &send_info) {
+    auto sockfd = (int) send_info.native_socket;
+    struct msghdr msg = {};
+
+    // Convert the target address into a sockaddr
+    struct sockaddr_in taddr_v4 = {};
+    struct sockaddr_in6 taddr_v6 = {};
+    if (send_info.target_address.is_v6()) {
+      taddr_v6 = to_sockaddr(send_info.target_address.to_v6(), send_info.target_port);
+
+      msg.msg_name = (struct sockaddr *) &taddr_v6;
+      msg.msg_namelen = sizeof(taddr_v6);
+    } else {
+      taddr_v4 = to_sockaddr(send_info.target_address.to_v4(), send_info.target_port);
+
+      msg.msg_name = (struct sockaddr *) &taddr_v4;
+      msg.msg_namelen = sizeof(taddr_v4);
+    }
+
+    union {
+#ifdef IP_PKTINFO
+      char buf[std::max(CMSG_SPACE(sizeof(struct in_pktinfo)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
+#elif defined(IP_SENDSRCADDR)
+      // FreeBSD uses IP_SENDSRCADDR with struct in_addr instead of IP_PKTINFO with struct in_pktinfo
+      char buf[std::max(CMSG_SPACE(sizeof(struct in_addr)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
+#endif
+      struct cmsghdr alignment;
+    } cmbuf;
+
+    msg.msg_control = cmbuf.buf;
+    msg.msg_controllen = sizeof(cmbuf.buf);
+
+    socklen_t cmbuflen = set_source_address(msg, send_info.source_address);
+
     struct iovec iovs[2];
     int iovlen = 0;
     if (send_info.header) {
@@ -727,6 +1030,9 @@ namespace platf {
 
     msg.msg_controllen = cmbuflen;
 
+    auto &stats = thread_send_stats();
+
+    ++stats.syscalls;
     auto bytes_sent = sendmsg(sockfd, &msg, 0);
 
     // If there's no send buffer space, wait for some to be available
@@ -742,6 +1048,7 @@ namespace platf {
       }
 
       // Try to send again
+      ++stats.syscalls;
       bytes_sent = sendmsg(sockfd, &msg, 0);
     }
 
@@ -750,9 +1057,119 @@ namespace platf {
       return false;
     }
 
+    ++stats.datagrams;
     return true;
   }
 
+  bool send_multi(std::vector<send_info_t> &send_infos) {
+    if (send_infos.size() <= 1) {
+      return send_infos.empty() || send(send_infos.front());
+    }
+
+    auto sockfd = (int) send_infos.front().native_socket;
+
+    // Each datagram has its own target and source address
+    struct message_t {
+      union {
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+      } name;
+
+      union {
+#ifdef IP_PKTINFO
+        char buf[std::max(CMSG_SPACE(sizeof(struct in_pktinfo)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
+#elif defined(IP_SENDSRCADDR)
+        char buf[std::max(CMSG_SPACE(sizeof(struct in_addr)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
+#endif
+        struct cmsghdr alignment;
+      } cmbuf;
+
+      struct iovec iovs[2];
+    };
+
+    // Reused across calls, so sending doesn't allocate once they have grown large enough
+    thread_local std::vector<message_t> messages;
+    thread_local std::vector<struct mmsghdr> msgs;
+    messages.resize(send_infos.size());
+    msgs.resize(send_infos.size());
+
+    for (size_t i = 0; i < send_infos.size(); i++) {
+      auto &send_info = send_infos[i];
+      auto &message = messages[i];
+      auto &msg = msgs[i].msg_hdr;
+
+      msg = {};
+      msgs[i].msg_len = 0;
+
+      if (send_info.target_address.is_v6()) {
+        message.name.v6 = to_sockaddr(send_info.target_address.to_v6(), send_info.target_port);
+        msg.msg_namelen = sizeof(message.name.v6);
+      } else {
+        message.name.v4 = to_sockaddr(send_info.target_address.to_v4(), send_info.target_port);
+        msg.msg_namelen = sizeof(message.name.v4);
+      }
+      msg.msg_name = &message.name;
+
+      // Must be zeroed for CMSG_FIRSTHDR()
+      message.cmbuf = {};
+      msg.msg_control = message.cmbuf.buf;
+      msg.msg_controllen = sizeof(message.cmbuf.buf);
+      msg.msg_controllen = set_source_address(msg, send_info.source_address);
+
+      int iovlen = 0;
+      if (send_info.header) {
+        message.iovs[iovlen].iov_base = (void *) send_info.header;
+        message.iovs[iovlen].iov_len = send_info.header_size;
+        iovlen++;
+      }
+      message.iovs[iovlen].iov_base = (void *) send_info.payload;
+      message.iovs[iovlen].iov_len = send_info.payload_size;
+      iovlen++;
+
+      msg.msg_iov = message.iovs;
+      msg.msg_iovlen = iovlen;
+    }
+
+    auto &stats = thread_send_stats();
+
+    // Call sendmmsg() until all messages are sent
+    bool all_sent = true;
+    size_t msgs_sent = 0;
+    while (msgs_sent < msgs.size()) {
+      ++stats.syscalls;
+      int sent = sendmmsg(sockfd, &msgs[msgs_sent], msgs.size() - msgs_sent, 0);
+      if (sent < 0) {
+        // If there's no send buffer space, wait for some to be available
+        if (errno == EAGAIN) {
+          struct pollfd pfd;
+
+          pfd.fd = sockfd;
+          pfd.events = POLLOUT;
+
+          if (poll(&pfd, 1, -1) != 1) {
+            BOOST_LOG(warning) << "poll() failed: "sv << errno;
+            return false;
+          }
+
+          // Try to send again
+          continue;
+        }
+
+        // sendmmsg() only fails if the first message couldn't be sent, so skip it
+        // rather than dropping the rest of the batch, which may go to other clients
+        BOOST_LOG(warning) << "sendmmsg() failed: "sv << errno;
+        all_sent = false;
+        msgs_sent += 1;
+        continue;
+      }
+
+      msgs_sent += sent;
+      stats.datagrams += sent;
+    }
+
+    return all_sent;
+  }
+
   // We can't track QoS state separately for each destination on this OS,
   // so we keep a ref count to only disable QoS options when all clients
   // are disconnected.
@@ -858,6 +1275,21 @@ namespace platf {
     return std::make_unique<qos_t>(sockfd, reset_options);
   }
 
+  bool set_socket_pacing_rate(uintptr_t native_socket, std::uint64_t bytes_per_second) {
+#ifdef SO_MAX_PACING_RATE
+    // The fq qdisc spaces out the packets of each socket according to this rate
+    if (setsockopt((int) native_socket, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes_per_second, sizeof(bytes_per_second)) == 0) {
+      return true;
+    }
+
+    BOOST_LOG(warning) << "Failed to set SO_MAX_PACING_RATE, kernel video pacing is disabled: "sv << errno;
+    return false;
+#else
+    BOOST_LOG(warning) << "Kernel video pacing is not supported on this platform"sv;
+    return false;
+#endif
+  }
+
   std::string get_host_name() {
     try {
       return boost::asio::ip::host_name();
@@ -869,6 +1301,7 @@ namespace platf {
 
   namespace source {
     enum source_e : std::size_t {
+      SYNTHETIC,  ///< Synthetic test patterns
 #ifdef SUNSHINE_BUILD_CUDA
       NVFBC,  ///< NvFBC
 #endif
@@ -924,6 +1357,9 @@ namespace platf {
 #endif
 
   std::vector<std::string> display_names(mem_type_e hwdevice_type) {
+    if (sources[source::SYNTHETIC]) {
+      return synthetic::display_names();
+    }
 #ifdef SUNSHINE_BUILD_CUDA
     // display using NvFBC only supports mem_type_e::cuda
     if (sources[source::NVFBC] && hwdevice_type == mem_type_e::cuda) {
@@ -958,6 +1394,10 @@ namespace platf {
   }
 
   std::shared_ptr<display_t> display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config) {
+    if (sources[source::SYNTHETIC]) {
+      BOOST_LOG(info) << "Screencasting with synthetic test patterns"sv;
+      return synthetic::display(hwdevice_type, display_name, config);
+    }
 #ifdef SUNSHINE_BUILD_CUDA
     if (sources[source::NVFBC] && hwdevice_type == mem_type_e::cuda) {
       BOOST_LOG(info) << "Screencasting with NvFBC"sv;
@@ -1010,6 +1450,11 @@ namespace platf {
     }
 #endif
 
+    // Test patterns are only drawn when asked for, they don't depend on a window system or GPU
+    if (config::video.capture == "synthetic") {
+      sources[source::SYNTHETIC] = true;
+    }
+
 #ifdef SUNSHINE_BUILD_CUDA
     if ((config::video.capture.empty() && sources.none()) || config::video.capture == "nvfbc") {
       if (verify_nvfbc()) {
@@ -1053,15 +1498,92 @@ namespace platf {
     return std::make_unique<deinit_t>();
   }
 
+  /**
+   * @brief Sleeps on an absolute deadline, then spins for the last stretch.
+   * @details The kernel may wake a sleeping thread late by its timer slack plus the time
+   *          it takes to schedule it. The timer sleeps until that long before the deadline
+   *          and spins for the rest. How long to spin is learned from how late its own
+   *          sleeps wake up: every so many sleeps, it becomes the 99th percentile of their
+   *          lateness, so a single late wake-up doesn't make every later sleep spin longer.
+   */
   class linux_high_precision_timer: public high_precision_timer {
   public:
     void sleep_for(const std::chrono::nanoseconds &duration) override {
-      std::this_thread::sleep_for(duration);
+      sleep_until(std::chrono::steady_clock::now() + duration);
+    }
+
+    void sleep_until(const std::chrono::steady_clock::time_point &deadline) override {
+#ifdef PR_SET_TIMERSLACK
+      // Timer slack belongs to the thread, and a timer may be used by a thread other than its creator
+      thread_local bool timer_slack_set = false;
+      if (!timer_slack_set) {
+        if (prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0)) {
+          BOOST_LOG(debug) << "Unable to reduce timer slack: "sv << errno;
+        }
+        timer_slack_set = true;
+      }
+#endif
+
+      auto wake_up = deadline - spin_time;
+      if (std::chrono::steady_clock::now() < wake_up) {
+        auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(wake_up.time_since_epoch());
+
+        // std::chrono::steady_clock is CLOCK_MONOTONIC
+        timespec ts;
+        ts.tv_sec = since_epoch.count() / 1'000'000'000;
+        ts.tv_nsec = since_epoch.count() % 1'000'000'000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+
+        calibrate(std::chrono::steady_clock::now() - wake_up);
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      while (now < deadline) {
+        cpu_relax();
+        now = std::chrono::steady_clock::now();
+      }
+
+      histogram.record(now - deadline);
     }
 
     operator bool() override {
       return true;
     }
+
+  private:
+    static constexpr std::chrono::nanoseconds MIN_SPIN_TIME = 5us;
+    static constexpr std::chrono::nanoseconds MAX_SPIN_TIME = 200us;
+
+    // Sleeps measured before the spin time is adapted
+    static constexpr std::uint64_t CALIBRATION_SLEEPS = 128;
+
+    /**
+     * @brief Adapt the spin time to how late sleeps woke up.
+     * @param lateness How late the last sleep woke up.
+     */
+    void calibrate(std::chrono::nanoseconds lateness) {
+      sleep_lateness.record(lateness);
+      if (sleep_lateness.count < CALIBRATION_SLEEPS) {
+        return;
+      }
+
+      spin_time = std::clamp(sleep_lateness.percentile(0.99), MIN_SPIN_TIME, MAX_SPIN_TIME);
+      sleep_lateness = {};
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      asm volatile("yield");
+#endif
+    }
+
+    // Timer slack defaults to 50 us, so start out spinning for a bit more
+    std::chrono::nanoseconds spin_time = 100us;
+
+    // How late the sleeps since the spin time was last adapted woke up
+    wakeup_histogram_t sleep_lateness;
   };
 
   std::unique_ptr<high_precision_timer> create_high_precision_timer() {
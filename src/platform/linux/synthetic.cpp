@@ -0,0 +1,363 @@
+/**
+ * @file src/platform/linux/synthetic.cpp
+ * @brief Definitions for the synthetic test pattern capture method.
+ */
+// standard includes
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+// local includes
+#include "cuda.h"
+#include "src/config.h"
+#include "src/logging.h"
+#include "src/video.h"
+#include "synthetic.h"
+#include "vaapi.h"
+
+using namespace std::literals;
+
+namespace platf::synthetic {
+  // 75% color bars, in BGRA
+  constexpr std::array<std::uint32_t, 8> COLOR_BARS {
+    0xFFC0C0C0,  // White
+    0xFFC0C000,  // Yellow
+    0xFF00C0C0,  // Cyan
+    0xFF00C000,  // Green
+    0xFFC000C0,  // Magenta
+    0xFFC00000,  // Red
+    0xFF0000C0,  // Blue
+    0xFF000000,  // Black
+  };
+
+  constexpr std::uint32_t PAPER = 0xFFF0F0F0;
+  constexpr std::uint32_t INK = 0xFF202020;
+
+  // Glyphs take up 6x10 pixels of an 8x16 cell
+  constexpr int GLYPH_WIDTH = 6;
+  constexpr int GLYPH_HEIGHT = 10;
+  constexpr int CELL_WIDTH = 8;
+  constexpr int LINE_HEIGHT = 16;
+
+  // How fast text scrolls, whatever the frame rate
+  constexpr int SCROLL_SPEED = 240;  // pixels per second
+
+  enum class pattern_e {
+    still,  ///< Color bars and a gradient
+    scroll,  ///< A page of text scrolling up
+    noise,  ///< New noise every frame
+    mixed  ///< Color bars, with a scrolling text panel and a moving rectangle of noise
+  };
+
+  /**
+   * @brief A step of the xorshift64* generator.
+   */
+  static std::uint64_t next_random(std::uint64_t &state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+  }
+
+  std::uint32_t read_frame_marker(const std::uint8_t *data, int row_pitch) {
+    std::uint32_t frame = 0;
+    for (int bit = 0; bit < MARKER_BITS; ++bit) {
+      // Sample the middle of the cell, so scaling or compression doesn't blur it into its neighbors
+      auto pixel = data + (MARKER_CELL_SIZE / 2) * row_pitch + (bit * MARKER_CELL_SIZE + MARKER_CELL_SIZE / 2) * 4;
+      if (pixel[1] >= 0x80) {
+        frame |= 1u << bit;
+      }
+    }
+
+    return frame;
+  }
+
+  struct synthetic_img_t: public img_t {
+    ~synthetic_img_t() override {
+      delete[] data;
+      data = nullptr;
+    }
+  };
+
+  class synthetic_display_t: public display_t {
+  public:
+    int init(mem_type_e hwdevice_type, const ::video::config_t &config) {
+      mem_type = hwdevice_type;
+
+      width = config.width;
+      height = config.height;
+      env_width = width;
+      env_height = height;
+
+      if (width < MARKER_BITS * MARKER_CELL_SIZE || height < MARKER_CELL_SIZE) {
+        BOOST_LOG(error) << "Synthetic display needs to be at least "sv << MARKER_BITS * MARKER_CELL_SIZE << 'x' << MARKER_CELL_SIZE;
+        return -1;
+      }
+
+      framerate_x100 = config.framerateX100 > 0 ? config.framerateX100 : config.framerate * 100;
+      if (framerate_x100 <= 0) {
+        BOOST_LOG(error) << "Synthetic display needs a frame rate"sv;
+        return -1;
+      }
+
+      auto &name = config::video.synthetic_pattern;
+      pattern = name == "static"sv ? pattern_e::still :
+                name == "scroll"sv ? pattern_e::scroll :
+                name == "noise"sv  ? pattern_e::noise :
+                                     pattern_e::mixed;
+
+      timer = create_high_precision_timer();
+      if (!timer || !*timer) {
+        BOOST_LOG(error) << "Synthetic display couldn't create a timer"sv;
+        return -1;
+      }
+
+      draw_background();
+
+      // The text panel takes up the whole frame, or its left third when mixed
+      page_width = pattern == pattern_e::mixed ? width / 3 : width;
+      draw_page();
+
+      BOOST_LOG(info) << "Drawing "sv << name << " test pattern at "sv << width << 'x' << height << ", "sv << framerate_x100 / 100.0 << " fps"sv;
+
+      return 0;
+    }
+
+    capture_e capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override {
+      auto start = std::chrono::steady_clock::now();
+
+      sleep_overshoot_logger.reset();
+
+      for (std::uint64_t frame = 0;; ++frame) {
+        auto frame_time = start + frame_offset(frame);
+
+        auto now = std::chrono::steady_clock::now();
+        if (frame_time > now) {
+          timer->sleep_until(frame_time);
+          sleep_overshoot_logger.first_point(frame_time);
+          sleep_overshoot_logger.second_point_now_and_log();
+        } else if (now - frame_time >= frame_offset(1)) {
+          // We couldn't keep up, skip the frames that are already overdue rather than bursting
+          frame = (std::uint64_t) (std::chrono::duration<double>(now - start).count() * framerate_x100 / 100);
+          frame_time = start + frame_offset(frame);
+        }
+
+        std::shared_ptr<img_t> img_out;
+        if (!pull_free_image_cb(img_out)) {
+          return capture_e::interrupted;
+        }
+
+        draw(*img_out, frame);
+
+        // The pattern shows exactly the moment it was due, however late the thread woke up
+        img_out->frame_timestamp = frame_time;
+
+        if (!push_captured_image_cb(std::move(img_out), true)) {
+          return capture_e::ok;
+        }
+      }
+    }
+
+    std::shared_ptr<img_t> alloc_img() override {
+      auto img = std::make_shared<synthetic_img_t>();
+      img->width = width;
+      img->height = height;
+      img->pixel_pitch = 4;
+      img->row_pitch = img->pixel_pitch * width;
+      img->data = new std::uint8_t[height * img->row_pitch];
+
+      return img;
+    }
+
+    int dummy_img(img_t *img) override {
+      std::memset(img->data, 0, img->height * img->row_pitch);
+      return 0;
+    }
+
+    std::unique_ptr<avcodec_encode_device_t> make_avcodec_encode_device(pix_fmt_e pix_fmt) override {
+#ifdef SUNSHINE_BUILD_VAAPI
+      if (mem_type == mem_type_e::vaapi) {
+        return va::make_avcodec_encode_device(width, height, false);
+      }
+#endif
+
+#ifdef SUNSHINE_BUILD_CUDA
+      if (mem_type == mem_type_e::cuda) {
+        return cuda::make_avcodec_encode_device(width, height, false);
+      }
+#endif
+
+      return std::make_unique<avcodec_encode_device_t>();
+    }
+
+  private:
+    /**
+     * @brief Get the time a frame is due, relative to the first one.
+     */
+    std::chrono::nanoseconds frame_offset(std::uint64_t frame) const {
+      return std::chrono::nanoseconds {(std::int64_t) (frame * 100'000'000'000 / framerate_x100)};
+    }
+
+    /**
+     * @brief Draw color bars over the top two thirds, and a gradient below them.
+     */
+    void draw_background() {
+      background.resize((std::size_t) width * height);
+
+      auto bars_height = height * 2 / 3;
+      for (int y = 0; y < height; ++y) {
+        auto row = &background[(std::size_t) y * width];
+        for (int x = 0; x < width; ++x) {
+          if (y < bars_height) {
+            row[x] = COLOR_BARS[x * COLOR_BARS.size() / width];
+          } else {
+            auto level = (std::uint32_t) (x * 255 / std::max(width - 1, 1));
+            row[x] = 0xFF000000 | level << 16 | level << 8 | level;
+          }
+        }
+      }
+    }
+
+    /**
+     * @brief Draw a page of text-like glyphs, tall enough to scroll through without repeating on screen.
+     * @details The glyphs are random bitmaps rather than letters. What matters to the encoder is
+     *          the fine, high contrast detail of text, not whether it can be read.
+     */
+    void draw_page() {
+      page_height = (height * 2 + LINE_HEIGHT - 1) / LINE_HEIGHT * LINE_HEIGHT;
+      page.assign((std::size_t) page_width * page_height, PAPER);
+
+      std::uint64_t state = 0x9E3779B97F4A7C15ull;
+
+      auto columns = page_width / CELL_WIDTH;
+      for (int line = 0; line < page_height / LINE_HEIGHT; ++line) {
+        // Ragged lines of words, with the odd empty line between paragraphs
+        auto length = next_random(state) % 8 == 0 ? 0 : (int) (columns / 2 + next_random(state) % (columns / 2 + 1));
+        auto next_space = 2 + (int) (next_random(state) % 8);
+
+        for (int column = 0; column < length; ++column) {
+          if (column == next_space) {
+            next_space += 2 + (int) (next_random(state) % 8);
+            continue;
+          }
+
+          auto glyph = next_random(state);
+          for (int y = 0; y < GLYPH_HEIGHT; ++y) {
+            auto row = &page[(std::size_t) (line * LINE_HEIGHT + 3 + y) * page_width + column * CELL_WIDTH + 1];
+            for (int x = 0; x < GLYPH_WIDTH; ++x) {
+              if (glyph >> ((y * GLYPH_WIDTH + x) % 64) & 1) {
+                row[x] = INK;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    /**
+     * @brief Copy the page of text into a panel of the frame, scrolled for the given frame.
+     */
+    void draw_text(img_t &img, std::uint64_t frame, int panel_width) const {
+      auto scroll = (int) (frame * SCROLL_SPEED * 100 / framerate_x100 % page_height);
+      for (int y = 0; y < img.height; ++y) {
+        auto src = &page[(std::size_t) ((y + scroll) % page_height) * page_width];
+        std::memcpy(img.data + y * img.row_pitch, src, panel_width * 4);
+      }
+    }
+
+    /**
+     * @brief Fill a rectangle of the frame with noise that is different for every frame.
+     */
+    void draw_noise(img_t &img, std::uint64_t frame, int left, int top, int noise_width, int noise_height) const {
+      std::uint64_t state = (frame + 1) * 0x9E3779B97F4A7C15ull;
+      for (int y = top; y < top + noise_height; ++y) {
+        auto row = (std::uint32_t *) (img.data + y * img.row_pitch) + left;
+
+        int x = 0;
+        for (; x + 1 < noise_width; x += 2) {
+          auto random = next_random(state);
+          row[x] = 0xFF000000 | (std::uint32_t) random;
+          row[x + 1] = 0xFF000000 | (std::uint32_t) (random >> 32);
+        }
+        if (x < noise_width) {
+          row[x] = 0xFF000000 | (std::uint32_t) next_random(state);
+        }
+      }
+    }
+
+    /**
+     * @brief Stamp the frame number into the top left corner.
+     */
+    static void draw_marker(img_t &img, std::uint64_t frame) {
+      for (int y = 0; y < MARKER_CELL_SIZE; ++y) {
+        auto row = (std::uint32_t *) (img.data + y * img.row_pitch);
+        for (int bit = 0; bit < MARKER_BITS; ++bit) {
+          auto color = frame >> bit & 1 ? 0xFFFFFFFF : 0xFF000000;
+          std::fill_n(row + bit * MARKER_CELL_SIZE, MARKER_CELL_SIZE, color);
+        }
+      }
+    }
+
+    void draw(img_t &img, std::uint64_t frame) const {
+      switch (pattern) {
+        case pattern_e::still:
+          std::memcpy(img.data, background.data(), background.size() * 4);
+          break;
+        case pattern_e::scroll:
+          draw_text(img, frame, page_width);
+          break;
+        case pattern_e::noise:
+          draw_noise(img, frame, 0, 0, width, height);
+          break;
+        case pattern_e::mixed:
+          {
+            std::memcpy(img.data, background.data(), background.size() * 4);
+            draw_text(img, frame, page_width);
+
+            // Like a video playing in a window that is being dragged around
+            auto noise_width = width / 4;
+            auto noise_height = height / 4;
+            auto t = (double) frame * 100 / framerate_x100;
+            auto left = page_width + (int) ((width - page_width - noise_width) * (0.5 + 0.5 * std::sin(t)));
+            auto top = (int) ((height - noise_height) * (0.5 + 0.5 * std::sin(t * std::numbers::phi)));
+            draw_noise(img, frame, left, top, noise_width, noise_height);
+            break;
+          }
+      }
+
+      draw_marker(img, frame);
+    }
+
+    mem_type_e mem_type;
+    pattern_e pattern;
+    int framerate_x100;
+
+    std::vector<std::uint32_t> background;
+
+    std::vector<std::uint32_t> page;
+    int page_width;
+    int page_height;
+
+    std::unique_ptr<high_precision_timer> timer;
+  };
+
+  std::vector<std::string> display_names() {
+    return {"synthetic"s};
+  }
+
+  std::shared_ptr<display_t> display(mem_type_e hwdevice_type, const std::string &display_name, const ::video::config_t &config) {
+    if (hwdevice_type != mem_type_e::system && hwdevice_type != mem_type_e::vaapi && hwdevice_type != mem_type_e::cuda) {
+      BOOST_LOG(error) << "Could not initialize synthetic display with the given hw device type."sv;
+      return nullptr;
+    }
+
+    auto disp = std::make_shared<synthetic_display_t>();
+    if (disp->init(hwdevice_type, config)) {
+      return nullptr;
+    }
+
+    return disp;
+  }
+}  // namespace platf::synthetic
@@ -0,0 +1,43 @@
+/**
+ * @file src/platform/linux/synthetic.h
+ * @brief Declarations for the synthetic test pattern capture method.
+ */
+#pragma once
+
+// standard includes
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// local includes
+#include "src/platform/common.h"
+
+namespace platf::synthetic {
+  // Every frame carries its number in a row of black and white cells in the top left corner
+  constexpr int MARKER_BITS = 32;
+  constexpr int MARKER_CELL_SIZE = 8;
+
+  /**
+   * @brief Read back the frame number stamped into a test pattern.
+   * @param data The BGRA pixels of the frame.
+   * @param row_pitch The size of a row of pixels in bytes.
+   * @return The frame number, counted from the start of the capture.
+   */
+  std::uint32_t read_frame_marker(const std::uint8_t *data, int row_pitch);
+
+  /**
+   * @brief Get the names of the synthetic displays.
+   * @return A single display, the test pattern has no outputs to choose from.
+   */
+  std::vector<std::string> display_names();
+
+  /**
+   * @brief Create a display drawing the configured test pattern at the resolution and frame rate of the stream.
+   * @param hwdevice_type The memory type the encoder wants frames in.
+   * @param display_name The name of the display.
+   * @param config The configuration of the stream.
+   * @return The display, or `nullptr` if the memory type isn't supported.
+   */
+  std::shared_ptr<display_t> display(mem_type_e hwdevice_type, const std::string &display_name, const ::video::config_t &config);
+}  // namespace platf::synthetic
@@ -210,7 +210,7 @@ namespace platf {
     }
   }
 
-  void adjust_thread_priority(thread_priority_e priority) {
+  void adjust_thread_priority(thread_priority_e priority, thread_role_e role) {
     // Unimplemented
   }
 
@@ -375,6 +375,9 @@ namespace platf {
 
     msg.msg_controllen = cmbuflen;
 
+    auto &stats = thread_send_stats();
+
+    ++stats.syscalls;
     auto bytes_sent = sendmsg(sockfd, &msg, 0);
 
     // If there's no send buffer space, wait for some to be available
@@ -390,6 +393,7 @@ namespace platf {
       }
 
       // Try to send again
+      ++stats.syscalls;
       bytes_sent = sendmsg(sockfd, &msg, 0);
     }
 
@@ -398,9 +402,20 @@ namespace platf {
       return false;
     }
 
+    ++stats.datagrams;
     return true;
   }
 
+  bool send_multi(std::vector<send_info_t> &send_infos) {
+    // Fall back to unbatched send calls
+    bool sent = true;
+    for (auto &send_info : send_infos) {
+      sent = send(send_info) && sent;
+    }
+
+    return sent;
+  }
+
   // We can't track QoS state separately for each destination on this OS,
   // so we keep a ref count to only disable QoS options when all clients
   // are disconnected.
@@ -507,6 +522,12 @@ namespace platf {
     return std::make_unique<qos_t>(sockfd, reset_options);
   }
 
+  bool set_socket_pacing_rate(uintptr_t native_socket, std::uint64_t bytes_per_second) {
+    // Kernel pacing of UDP sockets is not available on this platform
+    BOOST_LOG(warning) << "Kernel video pacing is not supported on this platform"sv;
+    return false;
+  }
+
   std::string get_host_name() {
     try {
       return boost::asio::ip::host_name();
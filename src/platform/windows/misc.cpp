@@ -1021,7 +1021,7 @@ namespace platf {
     }
   }
 
-  void adjust_thread_priority(thread_priority_e priority) {
+  void adjust_thread_priority(thread_priority_e priority, thread_role_e role) {
     int win32_priority;
 
     switch (priority) {
@@ -1448,7 +1448,13 @@ namespace platf {
 
     // If USO is not supported, this will fail and the caller will fall back to unbatched sends.
     DWORD bytes_sent;
-    return WSASendMsg((SOCKET) send_info.native_socket, &msg, 0, &bytes_sent, nullptr, nullptr) != SOCKET_ERROR;
+    ++thread_send_stats().syscalls;
+    if (WSASendMsg((SOCKET) send_info.native_socket, &msg, 0, &bytes_sent, nullptr, nullptr) == SOCKET_ERROR) {
+      return false;
+    }
+
+    thread_send_stats().datagrams += send_info.block_count;
+    return true;
   }
 
   bool send(send_info_t &send_info) {
@@ -1522,15 +1528,27 @@ namespace platf {
     msg.Control.len = cmbuflen;
 
     DWORD bytes_sent;
+    ++thread_send_stats().syscalls;
     if (WSASendMsg((SOCKET) send_info.native_socket, &msg, 0, &bytes_sent, nullptr, nullptr) == SOCKET_ERROR) {
       auto winerr = WSAGetLastError();
       BOOST_LOG(warning) << "WSASendMsg() failed: "sv << winerr;
       return false;
     }
 
+    ++thread_send_stats().datagrams;
     return true;
   }
 
+  bool send_multi(std::vector<send_info_t> &send_infos) {
+    // Windows has no equivalent of sendmmsg(), and USO needs datagrams of the same size
+    bool sent = true;
+    for (auto &send_info : send_infos) {
+      sent = send(send_info) && sent;
+    }
+
+    return sent;
+  }
+
   class qos_t: public deinit_t {
   public:
     qos_t(QOS_FLOWID flow_id):
@@ -1739,6 +1757,12 @@ namespace platf {
     return output;
   }
 
+  bool set_socket_pacing_rate(uintptr_t native_socket, std::uint64_t bytes_per_second) {
+    // Kernel pacing of UDP sockets is not available on this platform
+    BOOST_LOG(warning) << "Kernel video pacing is not supported on this platform"sv;
+    return false;
+  }
+
   std::string get_host_name() {
     WCHAR hostname[256];
     if (GetHostNameW(hostname, ARRAYSIZE(hostname)) == SOCKET_ERROR) {
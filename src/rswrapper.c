@@ -97,7 +97,15 @@
 
 #endif
 
-// Compile a default variant
+// Compile a portable scalar variant without any vector kernels. This is only
+// used as the reference to validate the vectorized variants against, since
+// reed_solomon_init() falls back to the default variant below.
+#define ISA_SUFFIX _scalar
+#include "../third-party/nanors/rs.c"
+#undef ISA_SUFFIX
+
+// Compile a default variant. This uses whatever vector kernels the compiler's
+// baseline target allows (NEON on AArch64, none on a plain x86-64 target).
 #define ISA_SUFFIX _def
 #include "../third-party/nanors/deps/obl/autoshim.h"
 #include "../third-party/nanors/rs.c"
@@ -117,37 +125,116 @@ reed_solomon_release_t reed_solomon_release_fn;
 reed_solomon_encode_t reed_solomon_encode_fn;
 reed_solomon_decode_t reed_solomon_decode_fn;
 
+static reed_solomon_isa_e reed_solomon_active_isa;
+
+// The public RS names are macros again after including rswrapper.h,
+// so paste the ISA suffix without expanding them first.
+#define REED_SOLOMON_USE_ISA(suffix) \
+  reed_solomon_new_fn = DECORATE_FUNC_I(reed_solomon_new, suffix); \
+  reed_solomon_release_fn = DECORATE_FUNC_I(reed_solomon_release, suffix); \
+  reed_solomon_encode_fn = DECORATE_FUNC_I(reed_solomon_encode, suffix); \
+  reed_solomon_decode_fn = DECORATE_FUNC_I(reed_solomon_decode, suffix); \
+  DECORATE_FUNC_I(reed_solomon_init, suffix)()
+
+/**
+ * @brief Check whether the running CPU can execute the given RS variant.
+ * @param isa The variant to check.
+ * @return Non-zero if the variant is usable.
+ */
+int reed_solomon_isa_supported(reed_solomon_isa_e isa) {
+  switch (isa) {
+    case REED_SOLOMON_ISA_SCALAR:
+    case REED_SOLOMON_ISA_BASELINE:
+      return 1;
+#if defined(__x86_64) || defined(__x86_64__) || defined(__amd64) || defined(__amd64__) || defined(_M_AMD64)
+    case REED_SOLOMON_ISA_SSSE3:
+      return __builtin_cpu_supports("ssse3");
+    case REED_SOLOMON_ISA_AVX2:
+      return __builtin_cpu_supports("avx2");
+    case REED_SOLOMON_ISA_AVX512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief Initialize the RS function pointers to a specific variant.
+ * @param isa The variant to use.
+ * @return 0 on success, or -1 if the variant is not usable on this CPU.
+ */
+int reed_solomon_init_isa(reed_solomon_isa_e isa) {
+  if (!reed_solomon_isa_supported(isa)) {
+    return -1;
+  }
+
+  switch (isa) {
+#if defined(__x86_64) || defined(__x86_64__) || defined(__amd64) || defined(__amd64__) || defined(_M_AMD64)
+    case REED_SOLOMON_ISA_AVX512:
+      REED_SOLOMON_USE_ISA(_avx512);
+      break;
+    case REED_SOLOMON_ISA_AVX2:
+      REED_SOLOMON_USE_ISA(_avx2);
+      break;
+    case REED_SOLOMON_ISA_SSSE3:
+      REED_SOLOMON_USE_ISA(_ssse3);
+      break;
+#endif
+    case REED_SOLOMON_ISA_SCALAR:
+      REED_SOLOMON_USE_ISA(_scalar);
+      break;
+    default:
+      REED_SOLOMON_USE_ISA(_def);
+      break;
+  }
+
+  reed_solomon_active_isa = isa;
+  return 0;
+}
+
 /**
  * @brief This initializes the RS function pointers to the best vectorized version available.
  * @details The streaming code will directly invoke these function pointers during encoding.
  */
 void reed_solomon_init(void) {
-#if defined(__x86_64) || defined(__x86_64__) || defined(__amd64) || defined(__amd64__) || defined(_M_AMD64)
-  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
-    reed_solomon_new_fn = reed_solomon_new_avx512;
-    reed_solomon_release_fn = reed_solomon_release_avx512;
-    reed_solomon_encode_fn = reed_solomon_encode_avx512;
-    reed_solomon_decode_fn = reed_solomon_decode_avx512;
-    reed_solomon_init_avx512();
-  } else if (__builtin_cpu_supports("avx2")) {
-    reed_solomon_new_fn = reed_solomon_new_avx2;
-    reed_solomon_release_fn = reed_solomon_release_avx2;
-    reed_solomon_encode_fn = reed_solomon_encode_avx2;
-    reed_solomon_decode_fn = reed_solomon_decode_avx2;
-    reed_solomon_init_avx2();
-  } else if (__builtin_cpu_supports("ssse3")) {
-    reed_solomon_new_fn = reed_solomon_new_ssse3;
-    reed_solomon_release_fn = reed_solomon_release_ssse3;
-    reed_solomon_encode_fn = reed_solomon_encode_ssse3;
-    reed_solomon_decode_fn = reed_solomon_decode_ssse3;
-    reed_solomon_init_ssse3();
-  } else
+  if (reed_solomon_init_isa(REED_SOLOMON_ISA_AVX512) &&
+      reed_solomon_init_isa(REED_SOLOMON_ISA_AVX2) &&
+      reed_solomon_init_isa(REED_SOLOMON_ISA_SSSE3)) {
+    reed_solomon_init_isa(REED_SOLOMON_ISA_BASELINE);
+  }
+}
+
+/**
+ * @brief Get the variant currently used by the RS function pointers.
+ * @return The active variant.
+ */
+reed_solomon_isa_e reed_solomon_get_isa(void) {
+  return reed_solomon_active_isa;
+}
+
+/**
+ * @brief Get a human-readable name for an RS variant.
+ * @param isa The variant.
+ * @return The name of the variant.
+ */
+const char *reed_solomon_isa_name(reed_solomon_isa_e isa) {
+  switch (isa) {
+    case REED_SOLOMON_ISA_SCALAR:
+      return "scalar";
+    case REED_SOLOMON_ISA_BASELINE:
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+      return "neon";
+#else
+      return "baseline";
 #endif
-  {
-    reed_solomon_new_fn = reed_solomon_new_def;
-    reed_solomon_release_fn = reed_solomon_release_def;
-    reed_solomon_encode_fn = reed_solomon_encode_def;
-    reed_solomon_decode_fn = reed_solomon_decode_def;
-    reed_solomon_init_def();
+    case REED_SOLOMON_ISA_SSSE3:
+      return "ssse3";
+    case REED_SOLOMON_ISA_AVX2:
+      return "avx2";
+    case REED_SOLOMON_ISA_AVX512:
+      return "avx512";
+    default:
+      return "unknown";
   }
 }
@@ -25,8 +25,47 @@ extern reed_solomon_decode_t reed_solomon_decode_fn;
 #define reed_solomon_encode reed_solomon_encode_fn
 #define reed_solomon_decode reed_solomon_decode_fn
 
+/**
+ * @brief The compiled RS variants.
+ */
+typedef enum {
+  REED_SOLOMON_ISA_SCALAR,  ///< Portable scalar GF(2^8) kernels
+  REED_SOLOMON_ISA_BASELINE,  ///< Kernels for the compiler's baseline target (NEON on AArch64)
+  REED_SOLOMON_ISA_SSSE3,  ///< 128-bit split-nibble PSHUFB kernels
+  REED_SOLOMON_ISA_AVX2,  ///< 256-bit split-nibble VPSHUFB kernels
+  REED_SOLOMON_ISA_AVX512,  ///< 512-bit split-nibble VPSHUFB kernels
+  REED_SOLOMON_ISA_COUNT  ///< Number of variants
+} reed_solomon_isa_e;
+
 /**
  * @brief This initializes the RS function pointers to the best vectorized version available.
  * @details The streaming code will directly invoke these function pointers during encoding.
  */
 void reed_solomon_init(void);
+
+/**
+ * @brief Initialize the RS function pointers to a specific variant.
+ * @param isa The variant to use.
+ * @return 0 on success, or -1 if the variant is not usable on this CPU.
+ */
+int reed_solomon_init_isa(reed_solomon_isa_e isa);
+
+/**
+ * @brief Check whether the running CPU can execute the given RS variant.
+ * @param isa The variant to check.
+ * @return Non-zero if the variant is usable.
+ */
+int reed_solomon_isa_supported(reed_solomon_isa_e isa);
+
+/**
+ * @brief Get the variant currently used by the RS function pointers.
+ * @return The active variant.
+ */
+reed_solomon_isa_e reed_solomon_get_isa(void);
+
+/**
+ * @brief Get a human-readable name for an RS variant.
+ * @param isa The variant.
+ * @return The name of the variant.
+ */
+const char *reed_solomon_isa_name(reed_solomon_isa_e isa);
@@ -6,6 +6,7 @@
 #include "udp.h"
 
 #include <chrono>
+#include <cmath>
 #include <regex>
 #include <boost/property_tree/json_parser.hpp>
 
@@ -17,6 +18,14 @@ namespace starbeam {
 
   using namespace std::chrono_literals;
 
+  // Number of relayed HTTP/RTSP requests handled at once
+  constexpr int REQUEST_WORKERS = 4;
+
+  // Timestamps of the host's pings, only ever compared to each other
+  static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
   // Global client instance
   static std::shared_ptr<Client> g_client;
   static std::mutex g_client_mutex;
@@ -39,6 +48,8 @@ namespace starbeam {
 
     running_ = true;
 
+    workers_ = std::make_unique<net::thread_pool>(REQUEST_WORKERS);
+
     // Start IO thread
     io_thread_ = std::make_unique<std::thread>([this]() {
       run_io_context();
@@ -50,8 +61,11 @@ namespace starbeam {
   void Client::stop() {
     running_ = false;
 
-    if (io_context_) {
-      io_context_->stop();
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      if (io_context_) {
+        io_context_->stop();
+      }
     }
 
     if (io_thread_ && io_thread_->joinable()) {
@@ -59,6 +73,13 @@ namespace starbeam {
     }
 
     io_thread_.reset();
+
+    // Let in-flight requests finish, their responses are dropped now that we're disconnected
+    if (workers_) {
+      workers_->join();
+      workers_.reset();
+    }
+
     set_state(ConnectionState::Disconnected);
   }
 
@@ -111,6 +132,11 @@ namespace starbeam {
     udp_channel_handler_ = std::move(handler);
   }
 
+  void Client::set_udp_candidates_handler(UdpCandidatesHandler handler) {
+    std::lock_guard<std::mutex> lock(handler_mutex_);
+    udp_candidates_handler_ = std::move(handler);
+  }
+
   void Client::set_state_handler(StateChangeHandler handler) {
     std::lock_guard<std::mutex> lock(handler_mutex_);
     state_handler_ = std::move(handler);
@@ -125,10 +151,23 @@ namespace starbeam {
     send_message(msg.to_json());
   }
 
+  void Client::send_udp_path(const protocol::UdpPathMessage &path) {
+    send_message(path.to_json());
+  }
+
   void Client::set_reconnect_interval(int seconds) {
     reconnect_interval_seconds_ = seconds;
   }
 
+  void Client::set_ping_interval(std::chrono::milliseconds interval) {
+    ping_interval_ = interval;
+  }
+
+  LinkStats Client::get_link_stats() const {
+    std::lock_guard<std::mutex> lock(link_stats_mutex_);
+    return link_stats_;
+  }
+
   bool Client::parse_url(const std::string &url, std::string &host, std::string &port, std::string &path, bool &use_ssl) {
     // Parse URL like wss://example.com:8443/path or ws://example.com:8080
     std::regex url_regex(R"((wss?):\/\/([^:/]+)(?::(\d+))?(\/.*)?)", std::regex::icase);
@@ -187,7 +226,11 @@ namespace starbeam {
     BOOST_LOG(info) << "starbeam: Connecting to " << server_url_;
 
     // Create new IO context
-    io_context_ = std::make_unique<net::io_context>();
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      io_context_ = std::make_unique<net::io_context>();
+      ++connection_generation_;
+    }
 
     // Resolve the host
     tcp::resolver resolver(*io_context_);
@@ -205,6 +248,9 @@ namespace starbeam {
       auto &socket = beast::get_lowest_layer(*wss_);
       socket.connect(*results.begin());
 
+      // Relayed messages are small, don't let Nagle delay them
+      socket.set_option(tcp::no_delay(true));
+
       // Set SNI hostname
       if (!SSL_set_tlsext_host_name(wss_->next_layer().native_handle(), host.c_str())) {
         throw beast::system_error(
@@ -228,6 +274,9 @@ namespace starbeam {
       auto &socket = beast::get_lowest_layer(*ws_);
       socket.connect(*results.begin());
 
+      // Relayed messages are small, don't let Nagle delay them
+      socket.set_option(tcp::no_delay(true));
+
       // WebSocket handshake
       ws_->handshake(host, path);
 
@@ -245,10 +294,12 @@ namespace starbeam {
 
   void Client::disconnect() {
     try {
-      if (use_ssl_ && wss_) {
+      if (!send_queue_.empty()) {
+        // A write is still pending, so the stream can't be closed gracefully
+      } else if (use_ssl_ && wss_ && wss_->is_open()) {
         wss_->close(websocket::close_code::normal);
         wss_.reset();
-      } else if (ws_) {
+      } else if (ws_ && ws_->is_open()) {
         ws_->close(websocket::close_code::normal);
         ws_.reset();
       }
@@ -259,7 +310,22 @@ namespace starbeam {
     wss_.reset();
     ws_.reset();
     ssl_context_.reset();
-    io_context_.reset();
+    send_queue_ = {};
+    decoder_ = {};
+    binary_framing_ = false;
+
+    ping_timer_.reset();
+    pending_ping_.reset();
+    last_rtt_ms_.reset();
+    {
+      std::lock_guard<std::mutex> lock(link_stats_mutex_);
+      link_stats_ = {};
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      io_context_.reset();
+    }
 
     assigned_host_id_.clear();
     assigned_ports_ = {};
@@ -281,6 +347,9 @@ namespace starbeam {
     reg.capabilities.video_codecs = {"H264", "HEVC", "AV1"};
     reg.capabilities.audio_codecs = {"opus"};
 
+    // Relays that don't know binary framing ignore it and keep using JSON
+    reg.framing = {"json", framing::NAME};
+
     send_message(reg.to_json());
     BOOST_LOG(info) << "starbeam: Sent registration as '" << hostname_ << "'";
   }
@@ -300,7 +369,12 @@ namespace starbeam {
       std::string message = beast::buffers_to_string(self->read_buffer_.data());
       self->read_buffer_.consume(bytes_transferred);
 
-      self->handle_message(message);
+      auto binary = self->use_ssl_ ? self->wss_->got_binary() : self->ws_->got_binary();
+      if (binary) {
+        self->handle_frame(message);
+      } else {
+        self->handle_message(message);
+      }
 
       // Continue reading
       if (self->running_) {
@@ -323,9 +397,11 @@ namespace starbeam {
         auto ack = protocol::RegisterAckMessage::from_json(message);
         assigned_host_id_ = ack.host_id;
         assigned_ports_ = ack.ports;
+        binary_framing_ = ack.framing == framing::NAME;
         set_state(ConnectionState::Registered);
         BOOST_LOG(info) << "starbeam: Registered as '" << assigned_host_id_
-                        << "' with HTTP port " << assigned_ports_.http;
+                        << "' with HTTP port " << assigned_ports_.http
+                        << (binary_framing_ ? " (binary framing)" : "");
 
         // Initialize UDP channel manager with relay port info
         // Extract host from server URL for UDP connections
@@ -339,6 +415,10 @@ namespace starbeam {
             assigned_ports_.control
           );
         }
+
+        // Measure the link for as long as we're registered
+        ping_timer_ = std::make_unique<net::steady_timer>(*io_context_);
+        do_ping();
         break;
       }
 
@@ -351,22 +431,12 @@ namespace starbeam {
       }
 
       case protocol::MessageType::HttpRequest: {
-        std::lock_guard<std::mutex> lock(handler_mutex_);
-        if (http_handler_) {
-          auto req = protocol::HttpRequestMessage::from_json(message);
-          auto resp = http_handler_(req);
-          send_message(resp.to_json());
-        }
+        handle_http_request(protocol::HttpRequestMessage::from_json(message));
         break;
       }
 
       case protocol::MessageType::RtspRequest: {
-        std::lock_guard<std::mutex> lock(handler_mutex_);
-        if (rtsp_handler_) {
-          auto req = protocol::RtspRequestMessage::from_json(message);
-          auto resp = rtsp_handler_(req);
-          send_message(resp.to_json());
-        }
+        handle_rtsp_request(protocol::RtspRequestMessage::from_json(message));
         break;
       }
 
@@ -402,6 +472,14 @@ namespace starbeam {
         break;
       }
 
+      case protocol::MessageType::UdpCandidates: {
+        std::lock_guard<std::mutex> lock(handler_mutex_);
+        if (udp_candidates_handler_) {
+          udp_candidates_handler_(protocol::UdpCandidatesMessage::from_json(message));
+        }
+        break;
+      }
+
       case protocol::MessageType::Ping: {
         auto ping = protocol::PingMessage::from_json(message);
         protocol::PongMessage pong;
@@ -410,6 +488,11 @@ namespace starbeam {
         break;
       }
 
+      case protocol::MessageType::Pong: {
+        handle_pong(protocol::PongMessage::from_json(message));
+        break;
+      }
+
       case protocol::MessageType::Error: {
         auto err = protocol::ErrorMessage::from_json(message);
         BOOST_LOG(error) << "starbeam: Error from server: " << err.code << " - " << err.message;
@@ -422,15 +505,201 @@ namespace starbeam {
     }
   }
 
-  void Client::send_message(const std::string &message) {
-    try {
-      if (use_ssl_ && wss_) {
-        wss_->write(net::buffer(message));
-      } else if (ws_) {
-        ws_->write(net::buffer(message));
+  void Client::do_ping() {
+    if (pending_ping_) {
+      BOOST_LOG(debug) << "starbeam: Relay didn't answer ping in time";
+      std::lock_guard<std::mutex> lock(link_stats_mutex_);
+      ++link_stats_.lost;
+    }
+
+    protocol::PingMessage ping;
+    ping.ts = now_us();
+    pending_ping_ = ping.ts;
+    send_message(ping.to_json());
+    {
+      std::lock_guard<std::mutex> lock(link_stats_mutex_);
+      ++link_stats_.pings;
+    }
+
+    ping_timer_->expires_after(ping_interval_);
+    ping_timer_->async_wait([this](const beast::error_code &ec) {
+      if (!ec) {
+        do_ping();
       }
+    });
+  }
+
+  void Client::handle_pong(const protocol::PongMessage &pong) {
+    if (pong.ts != pending_ping_) {
+      // Too late, the ping already counted as lost
+      return;
+    }
+    pending_ping_.reset();
+
+    auto rtt_ms = (now_us() - pong.ts) / 1000.0;
+    rtt_logger_.collect_and_log(rtt_ms);
+
+    // Smoothed the way TCP smooths its round trip time, and RFC 3550 its interarrival jitter
+    std::lock_guard<std::mutex> lock(link_stats_mutex_);
+    if (last_rtt_ms_) {
+      link_stats_.rtt_ms = *link_stats_.rtt_ms + (rtt_ms - *link_stats_.rtt_ms) / 8;
+      link_stats_.jitter_ms += (std::abs(rtt_ms - *last_rtt_ms_) - link_stats_.jitter_ms) / 16;
+    } else {
+      link_stats_.rtt_ms = rtt_ms;
+    }
+    last_rtt_ms_ = rtt_ms;
+  }
+
+  void Client::handle_frame(const std::string &frame) {
+    std::optional<framing::Message> message;
+    try {
+      message = decoder_.feed(frame);
     } catch (const std::exception &e) {
-      BOOST_LOG(error) << "starbeam: Send error: " << e.what();
+      BOOST_LOG(error) << "starbeam: Invalid binary frame: " << e.what();
+      return;
+    }
+
+    if (!message) {
+      // More of the body follows
+      return;
+    }
+
+    if (auto req = std::get_if<protocol::HttpRequestMessage>(&*message)) {
+      handle_http_request(std::move(*req));
+    } else if (auto req = std::get_if<protocol::RtspRequestMessage>(&*message)) {
+      handle_rtsp_request(std::move(*req));
+    } else {
+      BOOST_LOG(warning) << "starbeam: Unexpected binary message";
+    }
+  }
+
+  void Client::handle_http_request(protocol::HttpRequestMessage req) {
+    HttpRequestHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(handler_mutex_);
+      handler = http_handler_;
+    }
+
+    if (handler) {
+      // Requests are matched to responses by id, so they may complete in any order
+      net::post(*workers_, [this, handler = std::move(handler), req = std::move(req), generation = current_generation()]() {
+        try {
+          send_response(handler(req), generation);
+        } catch (const std::exception &e) {
+          BOOST_LOG(error) << "starbeam: HTTP request " << req.id << " failed: " << e.what();
+        }
+      });
+    }
+  }
+
+  void Client::handle_rtsp_request(protocol::RtspRequestMessage req) {
+    RtspRequestHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(handler_mutex_);
+      handler = rtsp_handler_;
+    }
+
+    if (handler) {
+      net::post(*workers_, [this, handler = std::move(handler), req = std::move(req), generation = current_generation()]() {
+        try {
+          send_response(handler(req), generation);
+        } catch (const std::exception &e) {
+          BOOST_LOG(error) << "starbeam: RTSP request " << req.id << " failed: " << e.what();
+        }
+      });
+    }
+  }
+
+  uint64_t Client::current_generation() {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return connection_generation_;
+  }
+
+  void Client::send_response(const protocol::HttpResponseMessage &resp, uint64_t generation) {
+    if (binary_framing_) {
+      send_frames(framing::encode(resp), generation);
+    } else {
+      send_message(resp.to_json(), generation);
+    }
+  }
+
+  void Client::send_response(const protocol::RtspResponseMessage &resp, uint64_t generation) {
+    if (binary_framing_) {
+      send_frames(framing::encode(resp), generation);
+    } else {
+      send_message(resp.to_json(), generation);
+    }
+  }
+
+  void Client::send_message(std::string message, std::optional<uint64_t> generation) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (!io_context_) {
+      return;
+    }
+
+    // The relay forgot the request when the connection it came on closed
+    if (generation && *generation != connection_generation_) {
+      BOOST_LOG(debug) << "starbeam: Dropping response to a request from a previous connection";
+      return;
+    }
+
+    // Writes are queued on the IO thread, so any thread may send without blocking on the socket
+    net::post(*io_context_, [this, message = std::move(message)]() mutable {
+      send_queue_.push({std::move(message), false});
+
+      // Otherwise, do_write() picks it up when the pending write completes
+      if (send_queue_.size() == 1) {
+        do_write();
+      }
+    });
+  }
+
+  void Client::send_frames(std::vector<std::string> frames, std::optional<uint64_t> generation) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (!io_context_) {
+      return;
+    }
+
+    if (generation && *generation != connection_generation_) {
+      BOOST_LOG(debug) << "starbeam: Dropping response to a request from a previous connection";
+      return;
+    }
+
+    // Queued together, so the frames of a message stay in order
+    net::post(*io_context_, [this, frames = std::move(frames)]() mutable {
+      auto idle = send_queue_.empty();
+      for (auto &frame : frames) {
+        send_queue_.push({std::move(frame), true});
+      }
+
+      if (idle && !send_queue_.empty()) {
+        do_write();
+      }
+    });
+  }
+
+  void Client::do_write() {
+    auto write_handler = [this](beast::error_code ec, std::size_t) {
+      if (ec) {
+        BOOST_LOG(error) << "starbeam: Send error: " << ec.message();
+        send_queue_ = {};
+        io_context_->stop();
+        return;
+      }
+
+      send_queue_.pop();
+      if (!send_queue_.empty()) {
+        do_write();
+      }
+    };
+
+    auto &message = send_queue_.front();
+    if (use_ssl_ && wss_) {
+      wss_->binary(message.binary);
+      wss_->async_write(net::buffer(message.data), write_handler);
+    } else if (ws_) {
+      ws_->binary(message.binary);
+      ws_->async_write(net::buffer(message.data), write_handler);
     }
   }
 
@@ -504,4 +773,15 @@ namespace starbeam {
     return config::starbeam.enabled;
   }
 
+  std::string connection_state_string(ConnectionState state) {
+    switch (state) {
+      case ConnectionState::Disconnected: return "disconnected";
+      case ConnectionState::Connecting: return "connecting";
+      case ConnectionState::Connected: return "connected";
+      case ConnectionState::Registered: return "registered";
+      case ConnectionState::Error: return "error";
+    }
+    return "unknown";
+  }
+
 }  // namespace starbeam
@@ -5,21 +5,26 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <queue>
-#include <condition_variable>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast.hpp>
 #include <boost/beast/ssl.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/websocket/ssl.hpp>
 
+#include "../logging.h"
+#include "framing.h"
 #include "protocol.h"
 
 namespace starbeam {
@@ -39,12 +44,23 @@ namespace starbeam {
     Error          ///< Connection error occurred
   };
 
+  /**
+   * @brief Round trip measurements of the connection to the relay, from pings the host sends.
+   */
+  struct LinkStats {
+    std::optional<double> rtt_ms;  ///< Smoothed round trip time, unset until the first pong
+    double jitter_ms;              ///< Smoothed difference between consecutive round trips
+    uint64_t pings;                ///< Pings sent since connecting
+    uint64_t lost;                 ///< Pings that weren't answered before the next one was due
+  };
+
   // Callback types
   using HttpRequestHandler = std::function<protocol::HttpResponseMessage(const protocol::HttpRequestMessage &)>;
   using RtspRequestHandler = std::function<protocol::RtspResponseMessage(const protocol::RtspRequestMessage &)>;
   using SessionStartHandler = std::function<void(const protocol::SessionStartMessage &)>;
   using SessionEndHandler = std::function<void(uint64_t session_id)>;
   using UdpChannelSetupHandler = std::function<protocol::UdpChannelAckMessage(const protocol::UdpChannelSetupMessage &)>;
+  using UdpCandidatesHandler = std::function<void(const protocol::UdpCandidatesMessage &)>;
   using StateChangeHandler = std::function<void(ConnectionState old_state, ConnectionState new_state)>;
 
   /**
@@ -142,6 +158,12 @@ namespace starbeam {
      */
     void set_udp_channel_handler(UdpChannelSetupHandler handler);
 
+    /**
+     * @brief Set UDP candidates handler.
+     * @param handler Handler function
+     */
+    void set_udp_candidates_handler(UdpCandidatesHandler handler);
+
     /**
      * @brief Set state change handler.
      * @param handler Handler function
@@ -155,12 +177,30 @@ namespace starbeam {
      */
     void send_session_end(uint64_t session_id, const std::string &reason = "");
 
+    /**
+     * @brief Send the path a UDP channel's traffic takes.
+     * @param path Path message
+     */
+    void send_udp_path(const protocol::UdpPathMessage &path);
+
     /**
      * @brief Set reconnect interval.
      * @param seconds Interval in seconds
      */
     void set_reconnect_interval(int seconds);
 
+    /**
+     * @brief Set how often the relay is pinged while registered.
+     * @param interval Ping interval, also how long a pong may take before the ping counts as lost
+     */
+    void set_ping_interval(std::chrono::milliseconds interval);
+
+    /**
+     * @brief Get the round trip measurements of the connection to the relay.
+     * @return Link stats, reset whenever the client reconnects
+     */
+    LinkStats get_link_stats() const;
+
   private:
     // Connection management
     void connect();
@@ -171,11 +211,23 @@ namespace starbeam {
     // Message handling
     void do_read();
     void handle_message(const std::string &message);
-    void send_message(const std::string &message);
+    void handle_frame(const std::string &frame);
+    void handle_http_request(protocol::HttpRequestMessage req);
+    void handle_rtsp_request(protocol::RtspRequestMessage req);
+    uint64_t current_generation();
+    void send_response(const protocol::HttpResponseMessage &resp, uint64_t generation);
+    void send_response(const protocol::RtspResponseMessage &resp, uint64_t generation);
+    void send_message(std::string message, std::optional<uint64_t> generation = std::nullopt);
+    void send_frames(std::vector<std::string> frames, std::optional<uint64_t> generation = std::nullopt);
+    void do_write();
 
     // Registration
     void send_registration();
 
+    // Link measurements, on the IO thread
+    void do_ping();
+    void handle_pong(const protocol::PongMessage &pong);
+
     // State management
     void set_state(ConnectionState new_state);
 
@@ -189,6 +241,7 @@ namespace starbeam {
     std::string hostname_;
     std::string unique_id_;
     int reconnect_interval_seconds_ = 5;
+    std::chrono::milliseconds ping_interval_ = std::chrono::seconds(2);
 
     // State
     std::atomic<ConnectionState> state_{ConnectionState::Disconnected};
@@ -196,6 +249,9 @@ namespace starbeam {
     std::string assigned_host_id_;
     protocol::PortAssignment assigned_ports_{};
 
+    // Set once the relay agreed to binary framing for HTTP and RTSP messages
+    std::atomic<bool> binary_framing_{false};
+
     // IO
     std::unique_ptr<net::io_context> io_context_;
     std::unique_ptr<ssl::context> ssl_context_;
@@ -206,9 +262,34 @@ namespace starbeam {
 
     // Threading
     std::unique_ptr<std::thread> io_thread_;
+
+    // Relayed requests are handled here, so a slow request doesn't hold up the others
+    std::unique_ptr<net::thread_pool> workers_;
+
+    // Guards io_context_ against being replaced while other threads send messages
     std::mutex send_mutex_;
-    std::queue<std::string> send_queue_;
-    std::condition_variable send_cv_;
+
+    // Counts connections to the relay, so a response to a request from an earlier connection isn't sent on a later one
+    uint64_t connection_generation_ = 0;
+
+    // Messages waiting to be written, only accessed on the IO thread
+    struct OutgoingMessage {
+      std::string data;
+      bool binary;
+    };
+    std::queue<OutgoingMessage> send_queue_;
+
+    // Reassembles binary messages, only accessed on the IO thread
+    framing::Decoder decoder_;
+
+    // Pings the relay while registered, only accessed on the IO thread
+    std::unique_ptr<net::steady_timer> ping_timer_;
+    std::optional<uint64_t> pending_ping_;
+    std::optional<double> last_rtt_ms_;
+    logging::min_max_avg_periodic_logger<double> rtt_logger_ {debug, "Starbeam: relay round trip time", "ms"};
+
+    LinkStats link_stats_ {};
+    mutable std::mutex link_stats_mutex_;
 
     // Handlers
     HttpRequestHandler http_handler_;
@@ -216,6 +297,7 @@ namespace starbeam {
     SessionStartHandler session_start_handler_;
     SessionEndHandler session_end_handler_;
     UdpChannelSetupHandler udp_channel_handler_;
+    UdpCandidatesHandler udp_candidates_handler_;
     StateChangeHandler state_handler_;
 
     mutable std::mutex handler_mutex_;
@@ -244,4 +326,11 @@ namespace starbeam {
    */
   bool is_enabled();
 
+  /**
+   * @brief Get the name of a connection state.
+   * @param state Connection state
+   * @return Lowercase name, e.g. "registered"
+   */
+  std::string connection_state_string(ConnectionState state);
+
 }  // namespace starbeam
@@ -0,0 +1,345 @@
+/**
+ * @file src/starbeam/connection_pool.cpp
+ * @brief Keep-alive connections to the local nvhttp/RTSP servers for relayed requests.
+ */
+#include "connection_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+namespace starbeam {
+namespace handler {
+
+  namespace asio = boost::asio;
+  using tcp = asio::ip::tcp;
+
+  // Longest status or header line we accept from a local server
+  constexpr std::size_t MAX_LINE_LENGTH = 8192;
+
+  static bool iequals(std::string_view a, std::string_view b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+      return std::tolower((unsigned char) x) == std::tolower((unsigned char) y);
+    });
+  }
+
+  static std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+      value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+      value.remove_suffix(1);
+    }
+    return value;
+  }
+
+  ResponseParser::Result ResponseParser::feed(std::string_view data) {
+    while (!data.empty()) {
+      switch (stage_) {
+        case Stage::StatusLine:
+        case Stage::Headers: {
+          auto end = data.find('\n');
+          if (end == std::string_view::npos) {
+            line_.append(data);
+            return line_.size() > MAX_LINE_LENGTH ? Result::Error : Result::NeedMore;
+          }
+
+          line_.append(data.substr(0, end));
+          data.remove_prefix(end + 1);
+
+          if (!line_.empty() && line_.back() == '\r') {
+            line_.pop_back();
+          }
+
+          auto result = parse_line(line_);
+          line_.clear();
+
+          if (result != Result::NeedMore) {
+            return result;
+          }
+          break;
+        }
+
+        case Stage::Body: {
+          if (content_length_) {
+            auto size = std::min(data.size(), *content_length_ - body_.size());
+            body_.append(data.substr(0, size));
+            data.remove_prefix(size);
+
+            if (body_.size() == *content_length_) {
+              stage_ = Stage::Done;
+            }
+          } else {
+            // The body runs until the server closes the connection
+            body_.append(data);
+            data = {};
+          }
+          break;
+        }
+
+        case Stage::Done:
+          // Anything after the response isn't ours to parse
+          return Result::Complete;
+      }
+    }
+
+    return stage_ == Stage::Done ? Result::Complete : Result::NeedMore;
+  }
+
+  ResponseParser::Result ResponseParser::parse_line(std::string_view line) {
+    if (stage_ == Stage::StatusLine) {
+      // Tolerate empty lines before the status line
+      if (line.empty()) {
+        return Result::NeedMore;
+      }
+
+      // e.g. "HTTP/1.1 200 OK" or "RTSP/1.0 200 OK"
+      auto version_end = line.find(' ');
+      if (version_end == std::string_view::npos) {
+        return Result::Error;
+      }
+
+      auto version = line.substr(0, version_end);
+      if (!version.starts_with("HTTP/") && !version.starts_with("RTSP/")) {
+        return Result::Error;
+      }
+
+      // HTTP/1.0 closes the connection unless asked otherwise
+      close_ = version == "HTTP/1.0";
+
+      auto rest = line.substr(version_end + 1);
+      auto [ptr, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), status_);
+      if (ec != std::errc {}) {
+        return Result::Error;
+      }
+
+      reason_ = trim(rest.substr(ptr - rest.data()));
+      stage_ = Stage::Headers;
+      return Result::NeedMore;
+    }
+
+    if (line.empty()) {
+      // End of headers
+      if (content_length_ && *content_length_ == 0) {
+        stage_ = Stage::Done;
+        return Result::Complete;
+      }
+
+      if (content_length_) {
+        body_.reserve(*content_length_);
+      }
+      stage_ = Stage::Body;
+      return Result::NeedMore;
+    }
+
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      return Result::Error;
+    }
+
+    auto key = trim(line.substr(0, colon));
+    auto value = trim(line.substr(colon + 1));
+
+    if (iequals(key, "content-length")) {
+      std::size_t length;
+      auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), length);
+      if (ec != std::errc {} || ptr != value.data() + value.size()) {
+        return Result::Error;
+      }
+      content_length_ = length;
+    } else if (iequals(key, "connection")) {
+      if (iequals(value, "close")) {
+        close_ = true;
+      } else if (iequals(value, "keep-alive")) {
+        close_ = false;
+      }
+    } else if (iequals(key, "transfer-encoding") && !iequals(value, "identity")) {
+      // The local servers always send a Content-Length
+      return Result::Error;
+    }
+
+    headers_[std::string {key}] = value;
+    return Result::NeedMore;
+  }
+
+  ResponseParser::Result ResponseParser::finish() {
+    if (stage_ == Stage::Body && !content_length_) {
+      stage_ = Stage::Done;
+    }
+
+    return stage_ == Stage::Done ? Result::Complete : Result::Error;
+  }
+
+  void ResponseParser::reset() {
+    stage_ = Stage::StatusLine;
+    line_.clear();
+    status_ = 0;
+    reason_.clear();
+    headers_.clear();
+    body_.clear();
+    content_length_.reset();
+    close_ = false;
+  }
+
+  std::string ResponseParser::header(std::string_view name) const {
+    for (const auto &[key, value] : headers_) {
+      if (iequals(key, name)) {
+        return value;
+      }
+    }
+    return {};
+  }
+
+  bool ResponseParser::keep_alive() const {
+    return stage_ == Stage::Done && content_length_ && !close_;
+  }
+
+  /**
+   * @brief Run the operation started on a socket until it completes or the timeout expires.
+   * @param io_context The socket's context.
+   * @param socket The socket, closed if the operation times out.
+   * @param timeout How long the operation may take.
+   * @param ec Set to timed_out if the operation didn't complete in time.
+   */
+  static void run_for(asio::io_context &io_context, tcp::socket &socket, std::chrono::milliseconds timeout, boost::system::error_code &ec) {
+    io_context.restart();
+    io_context.run_for(timeout);
+    if (io_context.stopped()) {
+      return;
+    }
+
+    // Closing the socket cancels the operation, whose handler still has to run before its buffers go away
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    io_context.run();
+
+    ec = asio::error::timed_out;
+  }
+
+  ConnectionPool::ConnectionPool(std::size_t max_idle_per_port, std::chrono::milliseconds connect_timeout, std::chrono::milliseconds io_timeout)
+      : max_idle_per_port_(max_idle_per_port), connect_timeout_(connect_timeout), io_timeout_(io_timeout) {
+  }
+
+  bool ConnectionPool::exchange(uint16_t port, std::string_view request, ResponseParser &parser, bool reuse, std::string &error) {
+    std::array<char, 16 * 1024> buffer;
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      boost::system::error_code ec;
+      bool reused = false;
+
+      auto connection = acquire(port, reused, ec);
+      if (!connection) {
+        error = "Cannot connect to local server: " + ec.message();
+        return false;
+      }
+
+      auto &socket = connection->socket;
+      asio::async_write(socket, asio::buffer(request), [&](const boost::system::error_code &code, std::size_t) {
+        ec = code;
+      });
+      run_for(connection->io_context, socket, io_timeout_, ec);
+      if (ec) {
+        if (reused && ec != asio::error::timed_out) {
+          // The server closed the idle connection, try again on a new one
+          continue;
+        }
+        error = "Failed to send request: " + ec.message();
+        return false;
+      }
+
+      parser.reset();
+
+      bool received = false;
+      auto result = ResponseParser::Result::NeedMore;
+      while (result == ResponseParser::Result::NeedMore) {
+        std::size_t size = 0;
+        socket.async_read_some(asio::buffer(buffer), [&](const boost::system::error_code &code, std::size_t bytes) {
+          ec = code;
+          size = bytes;
+        });
+        run_for(connection->io_context, socket, io_timeout_, ec);
+        if (ec == asio::error::eof) {
+          result = received ? parser.finish() : ResponseParser::Result::Error;
+          break;
+        }
+        if (ec) {
+          break;
+        }
+
+        received = true;
+        result = parser.feed({buffer.data(), size});
+      }
+
+      if (!received && reused && ec != asio::error::timed_out) {
+        // The server closed the idle connection, try again on a new one
+        continue;
+      }
+
+      if (result != ResponseParser::Result::Complete) {
+        error = ec && ec != asio::error::eof ? "Failed to read response: " + ec.message() : "Malformed response";
+        return false;
+      }
+
+      if (reuse && parser.keep_alive()) {
+        release(port, std::move(connection));
+      }
+      return true;
+    }
+
+    error = "Local server closed the connection";
+    return false;
+  }
+
+  void ConnectionPool::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.clear();
+  }
+
+  std::size_t ConnectionPool::connections_opened() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connections_opened_;
+  }
+
+  ConnectionPool::connection_ptr ConnectionPool::acquire(uint16_t port, bool &reused, boost::system::error_code &ec) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      auto &idle = idle_[port];
+      if (!idle.empty()) {
+        auto connection = std::move(idle.back());
+        idle.pop_back();
+
+        reused = true;
+        return connection;
+      }
+
+      ++connections_opened_;
+    }
+
+    auto connection = std::make_unique<Connection>();
+    connection->socket.async_connect(tcp::endpoint(asio::ip::address_v4::loopback(), port), [&](const boost::system::error_code &code) {
+      ec = code;
+    });
+    run_for(connection->io_context, connection->socket, connect_timeout_, ec);
+    if (ec) {
+      return nullptr;
+    }
+
+    // Requests and responses are small, don't let Nagle hold them back
+    connection->socket.set_option(tcp::no_delay(true), ec);
+    ec.clear();
+
+    return connection;
+  }
+
+  void ConnectionPool::release(uint16_t port, connection_ptr connection) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto &idle = idle_[port];
+    if (idle.size() < max_idle_per_port_) {
+      idle.push_back(std::move(connection));
+    }
+  }
+
+}  // namespace handler
+}  // namespace starbeam
@@ -0,0 +1,163 @@
+/**
+ * @file src/starbeam/connection_pool.h
+ * @brief Keep-alive connections to the local nvhttp/RTSP servers for relayed requests.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace starbeam {
+namespace handler {
+
+  /**
+   * @brief Incremental parser for HTTP/1.1 and RTSP/1.0 responses.
+   *
+   * Data is fed in as it arrives from the socket, so the response is parsed in a
+   * single pass without waiting for the connection to close. The body is delimited
+   * by Content-Length, or by the end of the stream if there is none.
+   */
+  class ResponseParser {
+  public:
+    enum class Result {
+      NeedMore,  ///< The response is incomplete
+      Complete,  ///< The whole response has been parsed
+      Error      ///< The response is malformed
+    };
+
+    /**
+     * @brief Parse the next part of the response.
+     * @param data Bytes received from the server
+     * @return Parsing state after consuming the data
+     */
+    Result feed(std::string_view data);
+
+    /**
+     * @brief Signal that the server closed the connection.
+     * @return Complete if the response is delimited by the end of the stream
+     */
+    Result finish();
+
+    /**
+     * @brief Prepare the parser for the next response.
+     */
+    void reset();
+
+    int status() const { return status_; }
+    const std::string &reason() const { return reason_; }
+    const std::map<std::string, std::string> &headers() const { return headers_; }
+    const std::string &body() const { return body_; }
+    std::string &body() { return body_; }
+
+    /**
+     * @brief Get a header value, ignoring the case of its name.
+     * @param name Header name
+     * @return Header value or empty string if not present
+     */
+    std::string header(std::string_view name) const;
+
+    /**
+     * @brief Check if the connection may be reused for another request.
+     * @return true if the response was delimited and the server didn't ask to close
+     */
+    bool keep_alive() const;
+
+  private:
+    enum class Stage {
+      StatusLine,
+      Headers,
+      Body,
+      Done
+    };
+
+    Result parse_line(std::string_view line);
+
+    Stage stage_ = Stage::StatusLine;
+
+    // Holds a partial line until its end arrives
+    std::string line_;
+
+    int status_ = 0;
+    std::string reason_;
+    std::map<std::string, std::string> headers_;
+    std::string body_;
+    std::optional<std::size_t> content_length_;
+    bool close_ = false;
+  };
+
+  /**
+   * @brief Pool of idle keep-alive connections to local servers, keyed by port.
+   *
+   * Requests are sent synchronously, so any number of threads may forward requests
+   * at once, each on its own connection. Every step of an exchange has a deadline,
+   * after which its connection is closed, so a stuck server can't tie up the caller.
+   */
+  class ConnectionPool {
+  public:
+    /**
+     * @param max_idle_per_port Maximum number of idle connections kept per port
+     * @param connect_timeout How long connecting to a local server may take
+     * @param io_timeout How long sending the request, or waiting for more of the response, may take
+     */
+    explicit ConnectionPool(std::size_t max_idle_per_port = 4, std::chrono::milliseconds connect_timeout = std::chrono::seconds(5), std::chrono::milliseconds io_timeout = std::chrono::seconds(60));
+
+    /**
+     * @brief Send a request to a local server and parse its response.
+     *
+     * An idle connection is reused if available. If it turns out the server already
+     * closed it, the request is retried once on a fresh connection.
+     *
+     * @param port Local port to connect to
+     * @param request Serialized request
+     * @param parser Parser receiving the response
+     * @param reuse Whether the connection may be kept for later requests
+     * @param error Set to a description of the failure
+     * @return true if a complete response was received
+     */
+    bool exchange(uint16_t port, std::string_view request, ResponseParser &parser, bool reuse, std::string &error);
+
+    /**
+     * @brief Close all idle connections.
+     */
+    void clear();
+
+    /**
+     * @brief Get the number of connections opened so far.
+     * @return Connection count
+     */
+    std::size_t connections_opened() const;
+
+  private:
+    /**
+     * @brief A socket with a context of its own, so the thread using it can run its operations with a deadline.
+     */
+    struct Connection {
+      boost::asio::io_context io_context;
+      boost::asio::ip::tcp::socket socket {io_context};
+    };
+
+    using connection_ptr = std::unique_ptr<Connection>;
+
+    connection_ptr acquire(uint16_t port, bool &reused, boost::system::error_code &ec);
+    void release(uint16_t port, connection_ptr connection);
+
+    std::size_t max_idle_per_port_;
+    std::chrono::milliseconds connect_timeout_;
+    std::chrono::milliseconds io_timeout_;
+
+    mutable std::mutex mutex_;
+    std::map<uint16_t, std::vector<connection_ptr>> idle_;
+    std::size_t connections_opened_ = 0;
+  };
+
+}  // namespace handler
+}  // namespace starbeam
@@ -0,0 +1,315 @@
+/**
+ * @file src/starbeam/framing.cpp
+ * @brief Binary framing of Starbeam messages.
+ */
+#include "framing.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace starbeam {
+namespace framing {
+
+  namespace {
+
+    void put_u8(std::string &out, uint8_t value) {
+      out.push_back((char) value);
+    }
+
+    void put_u16(std::string &out, uint16_t value) {
+      out.push_back((char) (value >> 8));
+      out.push_back((char) value);
+    }
+
+    void put_u64(std::string &out, uint64_t value) {
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back((char) (value >> shift));
+      }
+    }
+
+    void put_string(std::string &out, std::string_view value) {
+      if (value.size() > std::numeric_limits<uint16_t>::max()) {
+        throw std::length_error("starbeam::framing: String too long");
+      }
+      put_u16(out, (uint16_t) value.size());
+      out.append(value);
+    }
+
+    void put_headers(std::string &out, const std::map<std::string, std::string> &headers) {
+      if (headers.size() > std::numeric_limits<uint16_t>::max()) {
+        throw std::length_error("starbeam::framing: Too many headers");
+      }
+      put_u16(out, (uint16_t) headers.size());
+      for (auto &[key, value] : headers) {
+        put_string(out, key);
+        put_string(out, value);
+      }
+    }
+
+    void put_header(std::string &out, protocol::MessageType type, uint8_t flags, uint64_t id) {
+      put_u8(out, (uint8_t) type);
+      put_u8(out, flags);
+      put_u64(out, id);
+    }
+
+    // Reads the fields of a frame, throwing if it ends early
+    class Reader {
+    public:
+      explicit Reader(std::string_view data):
+          data_(data) {}
+
+      uint8_t u8() {
+        return (uint8_t) take(1)[0];
+      }
+
+      uint16_t u16() {
+        auto bytes = take(2);
+        return (uint16_t) ((uint8_t) bytes[0] << 8 | (uint8_t) bytes[1]);
+      }
+
+      uint64_t u64() {
+        uint64_t value = 0;
+        for (auto byte : take(8)) {
+          value = value << 8 | (uint8_t) byte;
+        }
+        return value;
+      }
+
+      std::string string() {
+        return std::string(take(u16()));
+      }
+
+      std::map<std::string, std::string> headers() {
+        std::map<std::string, std::string> headers;
+        for (auto count = u16(); count > 0; --count) {
+          auto key = string();
+          headers[std::move(key)] = string();
+        }
+        return headers;
+      }
+
+      std::string_view rest() {
+        return take(data_.size());
+      }
+
+    private:
+      std::string_view take(std::size_t size) {
+        if (size > data_.size()) {
+          throw std::runtime_error("starbeam::framing: Truncated frame");
+        }
+        auto bytes = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return bytes;
+      }
+
+      std::string_view data_;
+    };
+
+    protocol::MessageType type_of(const protocol::HttpRequestMessage &) {
+      return protocol::MessageType::HttpRequest;
+    }
+
+    protocol::MessageType type_of(const protocol::HttpResponseMessage &) {
+      return protocol::MessageType::HttpResponse;
+    }
+
+    protocol::MessageType type_of(const protocol::RtspRequestMessage &) {
+      return protocol::MessageType::RtspRequest;
+    }
+
+    protocol::MessageType type_of(const protocol::RtspResponseMessage &) {
+      return protocol::MessageType::RtspResponse;
+    }
+
+    void put_fields(std::string &out, const protocol::HttpRequestMessage &msg) {
+      put_string(out, msg.method);
+      put_string(out, msg.path);
+      if (msg.query) {
+        put_string(out, *msg.query);
+      }
+      put_string(out, msg.client_addr);
+      put_headers(out, msg.headers);
+    }
+
+    void put_fields(std::string &out, const protocol::HttpResponseMessage &msg) {
+      put_u16(out, msg.status);
+      put_headers(out, msg.headers);
+    }
+
+    void put_fields(std::string &out, const protocol::RtspRequestMessage &msg) {
+      put_string(out, msg.method);
+      put_string(out, msg.uri);
+      put_string(out, msg.client_addr);
+      put_headers(out, msg.headers);
+    }
+
+    void put_fields(std::string &out, const protocol::RtspResponseMessage &msg) {
+      put_u16(out, msg.status);
+      put_string(out, msg.reason);
+      put_headers(out, msg.headers);
+    }
+
+    uint8_t flags_of(const protocol::HttpRequestMessage &msg) {
+      return (msg.query ? HasQuery : 0) | (msg.is_https ? IsHttps : 0);
+    }
+
+    template<class T>
+    uint8_t flags_of(const T &) {
+      return 0;
+    }
+
+    Message read_fields(Reader &reader, protocol::MessageType type, uint8_t flags, uint64_t id) {
+      switch (type) {
+        case protocol::MessageType::HttpRequest: {
+          protocol::HttpRequestMessage msg;
+          msg.id = id;
+          msg.method = reader.string();
+          msg.path = reader.string();
+          if (flags & HasQuery) {
+            msg.query = reader.string();
+          }
+          msg.client_addr = reader.string();
+          msg.headers = reader.headers();
+          msg.is_https = flags & IsHttps;
+          return msg;
+        }
+        case protocol::MessageType::HttpResponse: {
+          protocol::HttpResponseMessage msg;
+          msg.id = id;
+          msg.status = reader.u16();
+          msg.headers = reader.headers();
+          return msg;
+        }
+        case protocol::MessageType::RtspRequest: {
+          protocol::RtspRequestMessage msg;
+          msg.id = id;
+          msg.method = reader.string();
+          msg.uri = reader.string();
+          msg.client_addr = reader.string();
+          msg.headers = reader.headers();
+          return msg;
+        }
+        case protocol::MessageType::RtspResponse: {
+          protocol::RtspResponseMessage msg;
+          msg.id = id;
+          msg.status = reader.u16();
+          msg.reason = reader.string();
+          msg.headers = reader.headers();
+          return msg;
+        }
+        default:
+          throw std::runtime_error("starbeam::framing: Unsupported message type");
+      }
+    }
+
+    std::optional<std::string> &body_of(Message &message) {
+      return std::visit([](auto &msg) -> std::optional<std::string> & {
+        return msg.body;
+      }, message);
+    }
+
+  }  // namespace
+
+  std::vector<std::string> encode(const Message &message, std::size_t chunk_size) {
+    chunk_size = std::max<std::size_t>(chunk_size, 1);
+
+    std::vector<std::string> frames;
+    std::visit([&](auto &msg) {
+      auto type = type_of(msg);
+      std::string_view rest = msg.body ? std::string_view(*msg.body) : std::string_view();
+
+      auto chunk = rest.substr(0, chunk_size);
+      rest.remove_prefix(chunk.size());
+
+      uint8_t flags = flags_of(msg) | (msg.body ? HasBody : 0) | (rest.empty() ? 0 : More);
+
+      auto &first = frames.emplace_back();
+      put_header(first, type, flags, msg.id);
+      put_fields(first, msg);
+      first.append(chunk);
+
+      while (!rest.empty()) {
+        chunk = rest.substr(0, chunk_size);
+        rest.remove_prefix(chunk.size());
+
+        auto &frame = frames.emplace_back();
+        frame.reserve(HEADER_SIZE + chunk.size());
+        put_header(frame, type, Continuation | (rest.empty() ? 0 : More), msg.id);
+        frame.append(chunk);
+      }
+    }, message);
+
+    return frames;
+  }
+
+  std::optional<Message> Decoder::feed(std::string_view frame) {
+    Reader reader(frame);
+    auto type = (protocol::MessageType) reader.u8();
+    auto flags = reader.u8();
+    auto id = reader.u64();
+
+    if (flags & Continuation) {
+      auto it = pending_.find({type, id});
+      if (it == pending_.end()) {
+        throw std::runtime_error("starbeam::framing: Continuation of an unknown message");
+      }
+
+      auto &body = *body_of(it->second);
+      auto rest = reader.rest();
+      if (rest.size() > MAX_PENDING_SIZE - pending_size_) {
+        pending_size_ -= body.size();
+        pending_.erase(it);
+        throw std::length_error("starbeam::framing: Pending messages too large");
+      }
+
+      body.append(rest);
+      pending_size_ += rest.size();
+      if (flags & More) {
+        return std::nullopt;
+      }
+
+      pending_size_ -= body.size();
+      auto message = std::move(it->second);
+      pending_.erase(it);
+      return message;
+    }
+
+    auto message = read_fields(reader, type, flags, id);
+    if (flags & HasBody) {
+      body_of(message) = std::string(reader.rest());
+    }
+
+    if (flags & More) {
+      if (!(flags & HasBody)) {
+        throw std::runtime_error("starbeam::framing: More body without a body");
+      }
+
+      // A message restarting under the same id replaces the pending one
+      if (auto it = pending_.find({type, id}); it != pending_.end()) {
+        pending_size_ -= body_of(it->second)->size();
+        pending_.erase(it);
+      }
+
+      auto size = body_of(message)->size();
+      if (pending_.size() >= MAX_PENDING_MESSAGES) {
+        throw std::length_error("starbeam::framing: Too many pending messages");
+      }
+      if (size > MAX_PENDING_SIZE - pending_size_) {
+        throw std::length_error("starbeam::framing: Pending messages too large");
+      }
+
+      pending_.emplace(std::make_pair(type, id), std::move(message));
+      pending_size_ += size;
+      return std::nullopt;
+    }
+
+    return message;
+  }
+
+  std::size_t Decoder::pending() const {
+    return pending_.size();
+  }
+
+}  // namespace framing
+}  // namespace starbeam
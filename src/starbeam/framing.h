@@ -0,0 +1,104 @@
+/**
+ * @file src/starbeam/framing.h
+ * @brief Binary framing of Starbeam messages.
+ */
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "protocol.h"
+
+namespace starbeam {
+namespace framing {
+
+  /*
+   * Once both ends agree on binary framing during registration, HTTP and RTSP
+   * messages are sent as binary WebSocket messages instead of JSON. Each one
+   * starts with a fixed header:
+   *
+   *   type (1 byte) | flags (1 byte) | id (8 bytes)
+   *
+   * In the first frame of a message, the header is followed by the message's
+   * fields. Numbers are big endian. Strings are a 2 byte length followed by the
+   * bytes, and headers are a 2 byte count followed by that many key/value
+   * strings. The rest of the frame is the body, as is. A body larger than a
+   * chunk continues in frames that only hold the header and the next part of
+   * the body, until a frame without the More flag.
+   */
+
+  // Name of the framing in registration messages
+  constexpr auto NAME = "binary";
+
+  constexpr std::size_t HEADER_SIZE = 10;
+
+  // Body bytes per frame, larger bodies are split
+  constexpr std::size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+  // Most body bytes of all messages being reassembled at once
+  constexpr std::size_t MAX_PENDING_SIZE = 64 * 1024 * 1024;
+
+  // Most messages being reassembled at once
+  constexpr std::size_t MAX_PENDING_MESSAGES = 256;
+
+  // Frame flags
+  enum Flags : uint8_t {
+    HasBody = 1 << 0,       ///< The message has a body, possibly empty
+    More = 1 << 1,          ///< More of the body follows in another frame
+    Continuation = 1 << 2,  ///< The frame only carries more of a body
+    HasQuery = 1 << 3,      ///< The HTTP request has a query string
+    IsHttps = 1 << 4,       ///< The HTTP request was made over HTTPS
+  };
+
+  // Messages that can be sent in binary frames
+  using Message = std::variant<
+    protocol::HttpRequestMessage,
+    protocol::HttpResponseMessage,
+    protocol::RtspRequestMessage,
+    protocol::RtspResponseMessage>;
+
+  /**
+   * @brief Encode a message as binary frames.
+   * @param message The message
+   * @param chunk_size Most body bytes per frame
+   * @return The frames, to send in order
+   * @throws std::length_error if a string or the headers don't fit their length prefix
+   */
+  std::vector<std::string> encode(const Message &message, std::size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+  /**
+   * @brief Reassembles messages from binary frames.
+   *
+   * The frames of different messages may be interleaved.
+   */
+  class Decoder {
+  public:
+    /**
+     * @brief Decode a frame.
+     * @param frame The frame
+     * @return The message if this was its last frame, otherwise nullopt
+     * @throws std::runtime_error if the frame is malformed
+     * @throws std::length_error if the message would exceed MAX_PENDING_SIZE or MAX_PENDING_MESSAGES,
+     *         in which case the rest of it is dropped
+     */
+    std::optional<Message> feed(std::string_view frame);
+
+    /**
+     * @brief Get the number of messages waiting for more of their body.
+     * @return Number of messages
+     */
+    std::size_t pending() const;
+
+  private:
+    std::map<std::pair<protocol::MessageType, uint64_t>, Message> pending_;
+    std::size_t pending_size_ = 0;  ///< Body bytes of the pending messages
+  };
+
+}  // namespace framing
+}  // namespace starbeam
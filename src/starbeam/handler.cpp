@@ -3,11 +3,10 @@
  * @brief Starbeam HTTP/RTSP request handler implementation.
  */
 #include "handler.h"
+#include "connection_pool.h"
 #include "tunnel.h"
 
-#include <sstream>
-#include <boost/asio.hpp>
-#include <boost/asio/ssl.hpp>
+#include <algorithm>
 
 #include "../config.h"
 #include "../logging.h"
@@ -21,51 +20,34 @@ namespace handler {
   namespace asio = boost::asio;
   using tcp = asio::ip::tcp;
 
-  // Forward HTTP request to local nvhttp server
-  std::tuple<int, std::string, std::string> handle_http_request(
+  // Idle connections to the local servers, shared by all relayed requests
+  static ConnectionPool pool;
+
+  std::tuple<int, std::string, std::string> forward_http_request(
+    uint16_t local_port,
     const std::string &method,
     const std::string &path,
     const std::string &query,
     const std::map<std::string, std::string> &headers,
     const std::string &body,
-    const std::string &client_addr,
-    bool is_https
+    const std::string &client_addr
   ) {
     try {
-      // Connect to local nvhttp server
-      asio::io_context io_context;
-      tcp::socket socket(io_context);
-
-      // Determine local port using net::map_port
-      uint16_t local_port = net::map_port(is_https ? nvhttp::PORT_HTTPS : nvhttp::PORT_HTTP);
-
-      BOOST_LOG(info) << "starbeam::handler: " << method << " " << path
-                      << (query.empty() ? "" : "?" + query)
-                      << " from " << client_addr
-                      << " -> connecting to 127.0.0.1:" << local_port;
-
-      tcp::resolver resolver(io_context);
-      auto endpoints = resolver.resolve("127.0.0.1", std::to_string(local_port));
-
-      boost::system::error_code ec;
-      asio::connect(socket, endpoints, ec);
-
-      if (ec) {
-        BOOST_LOG(error) << "starbeam::handler: Failed to connect to local server: " << ec.message();
-        return {503, "text/plain", "Service Unavailable: Cannot connect to local server"};
-      }
-
-      BOOST_LOG(info) << "starbeam::handler: Connected to local server";
+      BOOST_LOG(debug) << "starbeam::handler: " << method << " " << path
+                       << (query.empty() ? "" : "?" + query)
+                       << " from " << client_addr
+                       << " -> 127.0.0.1:" << local_port;
 
       // Build HTTP request
-      std::ostringstream request_stream;
-      std::string full_path = path;
+      std::string request;
+      request.reserve(512 + body.size());
+
+      request.append(method).append(" ").append(path);
       if (!query.empty()) {
-        full_path += "?" + query;
+        request.append("?").append(query);
       }
-
-      request_stream << method << " " << full_path << " HTTP/1.1\r\n";
-      request_stream << "Host: 127.0.0.1:" << local_port << "\r\n";
+      request.append(" HTTP/1.1\r\n");
+      request.append("Host: 127.0.0.1:").append(std::to_string(local_port)).append("\r\n");
 
       // Forward headers (but override some)
       for (const auto &[key, value] : headers) {
@@ -73,125 +55,35 @@ namespace handler {
         std::transform(lower_key.begin(), lower_key.end(), lower_key.begin(), ::tolower);
 
         // Skip connection-related headers
-        if (lower_key == "host" || lower_key == "connection" || lower_key == "transfer-encoding") {
+        if (lower_key == "host" || lower_key == "connection" || lower_key == "transfer-encoding" || lower_key == "content-length") {
           continue;
         }
-        request_stream << key << ": " << value << "\r\n";
+        request.append(key).append(": ").append(value).append("\r\n");
       }
 
       // Add client address as custom header for tracking
-      request_stream << "X-Forwarded-For: " << client_addr << "\r\n";
-      request_stream << "X-Starbeam-Client: " << client_addr << "\r\n";
+      request.append("X-Forwarded-For: ").append(client_addr).append("\r\n");
+      request.append("X-Starbeam-Client: ").append(client_addr).append("\r\n");
 
-      // Add body if present
       if (!body.empty()) {
-        request_stream << "Content-Length: " << body.size() << "\r\n";
-      }
-
-      request_stream << "Connection: close\r\n";
-      request_stream << "\r\n";
-
-      if (!body.empty()) {
-        request_stream << body;
-      }
-
-      std::string request = request_stream.str();
-
-      BOOST_LOG(info) << "starbeam::handler: Sending request to local server";
-
-      // Send request
-      asio::write(socket, asio::buffer(request), ec);
-
-      if (ec) {
-        BOOST_LOG(error) << "starbeam::handler: Failed to send request: " << ec.message();
-        return {503, "text/plain", "Service Unavailable: Failed to send request"};
-      }
-
-      // Read response
-      asio::streambuf response_buf;
-
-      // Read until we get headers
-      asio::read_until(socket, response_buf, "\r\n\r\n", ec);
-
-      if (ec && ec != asio::error::eof) {
-        BOOST_LOG(error) << "starbeam::handler: Failed to read response headers: " << ec.message();
-        return {503, "text/plain", "Service Unavailable: Failed to read response"};
-      }
-
-      std::istream response_stream(&response_buf);
-
-      // Parse status line
-      std::string http_version;
-      int status_code;
-      std::string status_message;
-      response_stream >> http_version >> status_code;
-      std::getline(response_stream, status_message);
-
-      // Parse headers
-      std::string content_type;
-      size_t content_length = 0;
-      std::string header_line;
-      while (std::getline(response_stream, header_line) && header_line != "\r") {
-        // Remove trailing \r
-        if (!header_line.empty() && header_line.back() == '\r') {
-          header_line.pop_back();
-        }
-        if (header_line.empty()) break;
-
-        auto colon_pos = header_line.find(':');
-        if (colon_pos != std::string::npos) {
-          std::string key = header_line.substr(0, colon_pos);
-          std::string value = header_line.substr(colon_pos + 1);
-          // Trim whitespace
-          while (!value.empty() && value[0] == ' ') value.erase(0, 1);
-
-          std::string lower_key = key;
-          std::transform(lower_key.begin(), lower_key.end(), lower_key.begin(), ::tolower);
-
-          if (lower_key == "content-type") {
-            content_type = value;
-          } else if (lower_key == "content-length") {
-            content_length = std::stoul(value);
-          }
-        }
+        request.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
       }
 
-      // Read body
-      std::string response_body;
-      if (content_length > 0) {
-        // Some data might already be in the buffer
-        if (response_buf.size() > 0) {
-          std::ostringstream body_stream;
-          body_stream << &response_buf;
-          response_body = body_stream.str();
-        }
+      // Keep the connection open for the next relayed request
+      request.append("Connection: keep-alive\r\n\r\n");
+      request.append(body);
 
-        // Read remaining body
-        while (response_body.size() < content_length) {
-          size_t to_read = content_length - response_body.size();
-          std::vector<char> buf(to_read);
-          size_t n = socket.read_some(asio::buffer(buf), ec);
-          if (ec) break;
-          response_body.append(buf.data(), n);
-        }
-      } else {
-        // Read until EOF
-        std::ostringstream body_stream;
-        if (response_buf.size() > 0) {
-          body_stream << &response_buf;
-        }
-        while (asio::read(socket, response_buf, asio::transfer_at_least(1), ec)) {
-          body_stream << &response_buf;
-        }
-        response_body = body_stream.str();
+      ResponseParser response;
+      std::string failure;
+      if (!pool.exchange(local_port, request, response, true, failure)) {
+        BOOST_LOG(error) << "starbeam::handler: HTTP " << method << " " << path << " failed: " << failure;
+        return {503, "text/plain", "Service Unavailable: " + failure};
       }
 
-      socket.close();
-
-      BOOST_LOG(info) << "starbeam::handler: HTTP " << method << " " << path
-                      << " -> " << status_code << " (" << response_body.size() << " bytes)";
+      BOOST_LOG(debug) << "starbeam::handler: HTTP " << method << " " << path
+                       << " -> " << response.status() << " (" << response.body().size() << " bytes)";
 
-      return {status_code, content_type, response_body};
+      return {response.status(), response.header("content-type"), std::move(response.body())};
 
     } catch (const std::exception &e) {
       BOOST_LOG(error) << "starbeam::handler: HTTP request failed: " << e.what();
@@ -199,6 +91,22 @@ namespace handler {
     }
   }
 
+  // Forward HTTP request to local nvhttp server
+  std::tuple<int, std::string, std::string> handle_http_request(
+    const std::string &method,
+    const std::string &path,
+    const std::string &query,
+    const std::map<std::string, std::string> &headers,
+    const std::string &body,
+    const std::string &client_addr,
+    bool is_https
+  ) {
+    // Determine local port using net::map_port
+    uint16_t local_port = net::map_port(is_https ? nvhttp::PORT_HTTPS : nvhttp::PORT_HTTP);
+
+    return forward_http_request(local_port, method, path, query, headers, body, client_addr);
+  }
+
   // Forward RTSP request to local RTSP server
   std::tuple<int, std::string, std::map<std::string, std::string>, std::string> handle_rtsp_request(
     const std::string &method,
@@ -208,131 +116,46 @@ namespace handler {
     const std::string &client_addr
   ) {
     try {
-      // Connect to local RTSP server
-      asio::io_context io_context;
-      tcp::socket socket(io_context);
-
       // RTSP port using net::map_port
       uint16_t rtsp_port = net::map_port(rtsp_stream::RTSP_SETUP_PORT);
 
-      BOOST_LOG(info) << "starbeam::handler: RTSP " << method << " " << uri
-                      << " from " << client_addr
-                      << " -> connecting to 127.0.0.1:" << rtsp_port;
-
-      tcp::resolver resolver(io_context);
-      auto endpoints = resolver.resolve("127.0.0.1", std::to_string(rtsp_port));
-
-      boost::system::error_code ec;
-      asio::connect(socket, endpoints, ec);
-
-      if (ec) {
-        BOOST_LOG(error) << "starbeam::handler: Failed to connect to RTSP server: " << ec.message();
-        return {503, "Service Unavailable", {}, ""};
-      }
+      BOOST_LOG(debug) << "starbeam::handler: RTSP " << method << " " << uri
+                       << " from " << client_addr
+                       << " -> 127.0.0.1:" << rtsp_port;
 
       // Build RTSP request
-      std::ostringstream request_stream;
-      request_stream << method << " " << uri << " RTSP/1.0\r\n";
+      std::string request;
+      request.reserve(512 + body.size());
+
+      request.append(method).append(" ").append(uri).append(" RTSP/1.0\r\n");
 
       // Forward headers
       for (const auto &[key, value] : headers) {
-        request_stream << key << ": " << value << "\r\n";
+        request.append(key).append(": ").append(value).append("\r\n");
       }
 
       // Add client tracking header
-      request_stream << "X-Starbeam-Client: " << client_addr << "\r\n";
-
-      if (!body.empty()) {
-        request_stream << "Content-Length: " << body.size() << "\r\n";
-      }
-
-      request_stream << "\r\n";
+      request.append("X-Starbeam-Client: ").append(client_addr).append("\r\n");
 
       if (!body.empty()) {
-        request_stream << body;
-      }
-
-      std::string request = request_stream.str();
-
-      // Send request
-      asio::write(socket, asio::buffer(request), ec);
-
-      if (ec) {
-        BOOST_LOG(error) << "starbeam::handler: Failed to send RTSP request: " << ec.message();
-        return {503, "Service Unavailable", {}, ""};
+        request.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
       }
 
-      // Read response
-      asio::streambuf response_buf;
-
-      asio::read_until(socket, response_buf, "\r\n\r\n", ec);
+      request.append("\r\n");
+      request.append(body);
 
-      if (ec && ec != asio::error::eof) {
-        BOOST_LOG(error) << "starbeam::handler: Failed to read RTSP response: " << ec.message();
+      // The RTSP server closes the connection after every response, so it's never reused
+      ResponseParser response;
+      std::string failure;
+      if (!pool.exchange(rtsp_port, request, response, false, failure)) {
+        BOOST_LOG(error) << "starbeam::handler: RTSP " << method << " " << uri << " failed: " << failure;
         return {503, "Service Unavailable", {}, ""};
       }
 
-      std::istream response_stream(&response_buf);
-
-      // Parse status line
-      std::string rtsp_version;
-      int status_code;
-      std::string reason;
-      response_stream >> rtsp_version >> status_code;
-      std::getline(response_stream, reason);
-      // Trim leading space and trailing \r
-      if (!reason.empty() && reason[0] == ' ') reason.erase(0, 1);
-      if (!reason.empty() && reason.back() == '\r') reason.pop_back();
-
-      // Parse headers
-      std::map<std::string, std::string> response_headers;
-      size_t content_length = 0;
-      std::string header_line;
-      while (std::getline(response_stream, header_line) && header_line != "\r") {
-        if (!header_line.empty() && header_line.back() == '\r') {
-          header_line.pop_back();
-        }
-        if (header_line.empty()) break;
-
-        auto colon_pos = header_line.find(':');
-        if (colon_pos != std::string::npos) {
-          std::string key = header_line.substr(0, colon_pos);
-          std::string value = header_line.substr(colon_pos + 1);
-          while (!value.empty() && value[0] == ' ') value.erase(0, 1);
-
-          response_headers[key] = value;
-
-          std::string lower_key = key;
-          std::transform(lower_key.begin(), lower_key.end(), lower_key.begin(), ::tolower);
-          if (lower_key == "content-length") {
-            content_length = std::stoul(value);
-          }
-        }
-      }
-
-      // Read body
-      std::string response_body;
-      if (content_length > 0) {
-        if (response_buf.size() > 0) {
-          std::ostringstream body_stream;
-          body_stream << &response_buf;
-          response_body = body_stream.str();
-        }
-        while (response_body.size() < content_length) {
-          size_t to_read = content_length - response_body.size();
-          std::vector<char> buf(to_read);
-          size_t n = socket.read_some(asio::buffer(buf), ec);
-          if (ec) break;
-          response_body.append(buf.data(), n);
-        }
-      }
-
-      socket.close();
+      BOOST_LOG(debug) << "starbeam::handler: RTSP " << method << " " << uri
+                       << " -> " << response.status() << " (" << response.body().size() << " bytes)";
 
-      BOOST_LOG(info) << "starbeam::handler: RTSP " << method << " " << uri
-                      << " -> " << status_code << " (" << response_body.size() << " bytes)";
-
-      return {status_code, reason, response_headers, response_body};
+      return {response.status(), response.reason(), response.headers(), std::move(response.body())};
 
     } catch (const std::exception &e) {
       BOOST_LOG(error) << "starbeam::handler: RTSP request failed: " << e.what();
@@ -351,6 +174,8 @@ namespace handler {
 
   void shutdown() {
     // Handlers will be cleared by tunnel::shutdown()
+    pool.clear();
+
     BOOST_LOG(info) << "starbeam::handler: Shutdown";
   }
 
@@ -4,6 +4,7 @@
  */
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <map>
 #include <tuple>
@@ -36,6 +37,31 @@ namespace handler {
     bool is_https
   );
 
+  /**
+   * @brief Forward an HTTP request to a local server.
+   *
+   * Connections are kept alive and reused by later requests, so concurrent
+   * requests each get their own connection without reconnecting every time.
+   *
+   * @param local_port Port of the local server
+   * @param method HTTP method (GET, POST, etc.)
+   * @param path Request path (e.g., "/serverinfo")
+   * @param query Query string (without leading ?)
+   * @param headers Request headers
+   * @param body Request body
+   * @param client_addr Client's address (from Starbeam)
+   * @return Tuple of (status_code, content_type, body)
+   */
+  std::tuple<int, std::string, std::string> forward_http_request(
+    uint16_t local_port,
+    const std::string &method,
+    const std::string &path,
+    const std::string &query,
+    const std::map<std::string, std::string> &headers,
+    const std::string &body,
+    const std::string &client_addr
+  );
+
   /**
    * @brief Handle an RTSP request from the Starbeam relay.
    *
@@ -69,7 +69,18 @@ namespace protocol {
       if (i > 0) ss << ",";
       ss << "\"" << escape_json(capabilities.audio_codecs[i]) << "\"";
     }
-    ss << "]}}";
+    ss << "]}";
+
+    if (!framing.empty()) {
+      ss << ",\"framing\":[";
+      for (size_t i = 0; i < framing.size(); ++i) {
+        if (i > 0) ss << ",";
+        ss << "\"" << escape_json(framing[i]) << "\"";
+      }
+      ss << "]";
+    }
+
+    ss << "}";
 
     return ss.str();
   }
@@ -94,6 +105,10 @@ namespace protocol {
       msg.external_address = *ext;
     }
 
+    if (auto framing = tree.get_optional<std::string>("framing")) {
+      msg.framing = *framing;
+    }
+
     return msg;
   }
 
@@ -218,8 +233,53 @@ namespace protocol {
        << ",\"session_id\":" << session_id
        << ",\"channel\":\"" << channel_type_string(channel) << "\""
        << ",\"relay_port\":" << relay_port
-       << ",\"local_port\":" << local_port
-       << "}";
+       << ",\"local_port\":" << local_port;
+
+    if (!candidates.empty()) {
+      ss << ",\"candidates\":[";
+      for (size_t i = 0; i < candidates.size(); ++i) {
+        if (i > 0) ss << ",";
+        ss << "\"" << escape_json(candidates[i]) << "\"";
+      }
+      ss << "]";
+    }
+
+    ss << "}";
+    return ss.str();
+  }
+
+  UdpCandidatesMessage UdpCandidatesMessage::from_json(const std::string &json) {
+    std::istringstream ss(json);
+    pt::ptree tree;
+    pt::read_json(ss, tree);
+
+    UdpCandidatesMessage msg;
+    msg.session_id = tree.get<uint64_t>("session_id");
+    msg.channel = channel_type_from_string(tree.get<std::string>("channel"));
+    msg.token = tree.get<std::string>("token");
+
+    if (auto candidates = tree.get_child_optional("candidates")) {
+      for (auto &[key, value] : *candidates) {
+        msg.candidates.push_back(value.get_value<std::string>());
+      }
+    }
+
+    return msg;
+  }
+
+  std::string UdpPathMessage::to_json() const {
+    std::ostringstream ss;
+    ss << "{\"type\":\"udp_path\""
+       << ",\"session_id\":" << session_id
+       << ",\"channel\":\"" << channel_type_string(channel) << "\""
+       << ",\"path\":\"" << (direct ? "direct" : "relay") << "\"";
+    if (peer) {
+      ss << ",\"peer\":\"" << escape_json(*peer) << "\"";
+    }
+    if (rtt_us) {
+      ss << ",\"rtt_us\":" << *rtt_us;
+    }
+    ss << "}";
     return ss.str();
   }
 
@@ -257,6 +317,22 @@ namespace protocol {
     return msg;
   }
 
+  std::string PingMessage::to_json() const {
+    std::ostringstream ss;
+    ss << "{\"type\":\"ping\",\"ts\":" << ts << "}";
+    return ss.str();
+  }
+
+  PongMessage PongMessage::from_json(const std::string &json) {
+    std::istringstream ss(json);
+    pt::ptree tree;
+    pt::read_json(ss, tree);
+
+    PongMessage msg;
+    msg.ts = tree.get<uint64_t>("ts");
+    return msg;
+  }
+
   std::string PongMessage::to_json() const {
     std::ostringstream ss;
     ss << "{\"type\":\"pong\",\"ts\":" << ts << "}";
@@ -309,6 +385,8 @@ namespace protocol {
       if (type_str == "udp_channel_setup") return MessageType::UdpChannelSetup;
       if (type_str == "udp_channel_ack") return MessageType::UdpChannelAck;
       if (type_str == "udp_channel_close") return MessageType::UdpChannelClose;
+      if (type_str == "udp_candidates") return MessageType::UdpCandidates;
+      if (type_str == "udp_path") return MessageType::UdpPath;
       if (type_str == "session_start") return MessageType::SessionStart;
       if (type_str == "session_end") return MessageType::SessionEnd;
       if (type_str == "ping") return MessageType::Ping;
@@ -333,6 +411,8 @@ namespace protocol {
       case MessageType::UdpChannelSetup: return "udp_channel_setup";
       case MessageType::UdpChannelAck: return "udp_channel_ack";
       case MessageType::UdpChannelClose: return "udp_channel_close";
+      case MessageType::UdpCandidates: return "udp_candidates";
+      case MessageType::UdpPath: return "udp_path";
       case MessageType::SessionStart: return "session_start";
       case MessageType::SessionEnd: return "session_end";
       case MessageType::Ping: return "ping";
@@ -27,6 +27,8 @@ namespace protocol {
     UdpChannelSetup,  ///< UDP channel setup request
     UdpChannelAck,    ///< UDP channel setup acknowledgment
     UdpChannelClose,  ///< UDP channel close notification
+    UdpCandidates,    ///< Candidate addresses of a client for a direct path
+    UdpPath,          ///< Path a UDP channel's traffic takes
     SessionStart,     ///< Streaming session start notification
     SessionEnd,       ///< Streaming session end notification
     Ping,             ///< Ping message
@@ -61,6 +63,7 @@ namespace protocol {
     std::optional<std::string> host_id;
     std::string auth_key;
     HostCapabilities capabilities;
+    std::vector<std::string> framing;  // Framings the host supports, JSON only if empty
 
     std::string to_json() const;
   };
@@ -70,6 +73,7 @@ namespace protocol {
     std::string host_id;
     PortAssignment ports;
     std::optional<std::string> external_address;
+    std::optional<std::string> framing;  // Framing chosen by the relay, JSON if not set
 
     static RegisterAckMessage from_json(const std::string &json);
   };
@@ -143,6 +147,28 @@ namespace protocol {
     UdpChannelType channel;
     uint16_t relay_port;
     uint16_t local_port;
+    std::vector<std::string> candidates;  // Addresses the host may be reached at directly, as "ip:port"
+
+    std::string to_json() const;
+  };
+
+  // Candidate addresses of a client for a direct path (from Starbeam to Sunlight)
+  struct UdpCandidatesMessage {
+    uint64_t session_id;
+    UdpChannelType channel;
+    std::string token;                    // Authenticates the hole punching probes of both ends
+    std::vector<std::string> candidates;  // Addresses the client may be reached at, as "ip:port"
+
+    static UdpCandidatesMessage from_json(const std::string &json);
+  };
+
+  // Path a UDP channel's traffic takes (from Sunlight to Starbeam)
+  struct UdpPathMessage {
+    uint64_t session_id;
+    UdpChannelType channel;
+    bool direct;                      // Sent straight to the client rather than through the relay
+    std::optional<std::string> peer;  // The client's address on the direct path
+    std::optional<uint32_t> rtt_us;   // Round trip time to the client on the direct path
 
     std::string to_json() const;
   };
@@ -164,17 +190,19 @@ namespace protocol {
     std::string to_json() const;
   };
 
-  // Ping message
+  // Ping message, sent by both ends
   struct PingMessage {
-    uint64_t ts;
+    uint64_t ts;  // Opaque to the receiver, echoed back in the pong
 
     static PingMessage from_json(const std::string &json);
+    std::string to_json() const;
   };
 
   // Pong message
   struct PongMessage {
     uint64_t ts;
 
+    static PongMessage from_json(const std::string &json);
     std::string to_json() const;
   };
 
@@ -20,8 +20,14 @@ namespace tunnel {
     protocol::HttpResponseMessage resp;
     resp.id = req.id;
 
-    std::lock_guard<std::mutex> lock(g_handler_mutex);
-    if (!g_nvhttp_handler) {
+    // Requests are handled concurrently, so only hold the lock while copying the handler
+    NvhttpHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(g_handler_mutex);
+      handler = g_nvhttp_handler;
+    }
+
+    if (!handler) {
       BOOST_LOG(error) << "starbeam::tunnel: No HTTP handler registered";
       resp.status = 500;
       resp.body = "Internal Server Error: No handler";
@@ -29,7 +35,7 @@ namespace tunnel {
     }
 
     try {
-      auto [status, content_type, body] = g_nvhttp_handler(
+      auto [status, content_type, body] = handler(
         req.method,
         req.path,
         req.query.value_or(""),
@@ -60,8 +66,13 @@ namespace tunnel {
     protocol::RtspResponseMessage resp;
     resp.id = req.id;
 
-    std::lock_guard<std::mutex> lock(g_handler_mutex);
-    if (!g_rtsp_handler) {
+    RtspHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(g_handler_mutex);
+      handler = g_rtsp_handler;
+    }
+
+    if (!handler) {
       BOOST_LOG(error) << "starbeam::tunnel: No RTSP handler registered";
       resp.status = 500;
       resp.reason = "Internal Server Error";
@@ -69,7 +80,7 @@ namespace tunnel {
     }
 
     try {
-      auto [status, reason, headers, body] = g_rtsp_handler(
+      auto [status, reason, headers, body] = handler(
         req.method,
         req.uri,
         req.headers,
@@ -103,6 +114,13 @@ namespace tunnel {
     client->set_http_handler(handle_http_request);
     client->set_rtsp_handler(handle_rtsp_request);
     client->set_udp_channel_handler(udp::handle_channel_setup);
+    client->set_session_end_handler(udp::close_session);
+    client->set_udp_candidates_handler(udp::handle_candidates);
+    udp::set_path_handler([](const protocol::UdpPathMessage &path) {
+      if (auto client = get_client()) {
+        client->send_udp_path(path);
+      }
+    });
 
     BOOST_LOG(info) << "starbeam::tunnel: Initialized";
     return true;
@@ -113,6 +131,7 @@ namespace tunnel {
     std::lock_guard<std::mutex> lock(g_handler_mutex);
     g_nvhttp_handler = nullptr;
     g_rtsp_handler = nullptr;
+    udp::set_path_handler(nullptr);
     BOOST_LOG(info) << "starbeam::tunnel: Shutdown";
   }
 
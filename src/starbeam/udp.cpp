@@ -4,6 +4,16 @@
  */
 #include "udp.h"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#ifdef __linux__
+  #include <cerrno>
+  #include <netinet/in.h>
+  #include <sys/socket.h>
+#endif
+
 #include "../config.h"
 #include "../logging.h"
 
@@ -12,8 +22,57 @@ namespace udp {
 
   // Global channel manager
   static std::unique_ptr<ChannelManager> g_channel_manager;
+  static PathHandler g_path_handler;
   static std::mutex g_manager_mutex;
 
+  // Room for bursts while the relay thread is busy with other channels
+  static constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+
+  // Batches relayed from a channel before the other channels get a turn
+  static constexpr int MAX_BATCHES_PER_WAKEUP = 8;
+
+  // Hole punching probes
+  static constexpr char PROBE_MAGIC[] = {'S', 'B', 'P', '1'};
+  static constexpr std::size_t PROBE_HEADER_SIZE = sizeof(PROBE_MAGIC) + 1 + 8;
+  static constexpr uint8_t PROBE_REQUEST = 0;
+  static constexpr uint8_t PROBE_RESPONSE = 1;
+
+  // Packs an IPv4 endpoint into a value that's never 0
+  static uint64_t pack_endpoint(uint32_t address, uint16_t port) {
+    return 1ull << 48 | (uint64_t) address << 16 | port;
+  }
+
+  static uint64_t pack_endpoint(const boost::asio::ip::udp::endpoint &endpoint) {
+    return pack_endpoint(endpoint.address().to_v4().to_uint(), endpoint.port());
+  }
+
+  static boost::asio::ip::udp::endpoint unpack_endpoint(uint64_t packed) {
+    return {boost::asio::ip::address_v4((uint32_t) (packed >> 16)), (uint16_t) packed};
+  }
+
+  static std::string to_string(const boost::asio::ip::udp::endpoint &endpoint) {
+    return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+  }
+
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  boost::asio::ip::udp::endpoint DirectRoute::destination() const {
+    auto packed = peer ? peer->load(std::memory_order_relaxed) : 0;
+    return packed ? unpack_endpoint(packed) : relay_endpoint;
+  }
+
+  void DirectRoute::count(uint64_t packets, uint64_t bytes) const {
+    if (!counters) {
+      return;
+    }
+
+    auto direct = peer && peer->load(std::memory_order_relaxed);
+    (direct ? counters->packets_to_peer : counters->packets_to_relay).fetch_add(packets, std::memory_order_relaxed);
+    (direct ? counters->bytes_to_peer : counters->bytes_to_relay).fetch_add(bytes, std::memory_order_relaxed);
+  }
+
   ChannelManager::ChannelManager() {}
 
   ChannelManager::~ChannelManager() {
@@ -37,7 +96,19 @@ namespace udp {
     relay_audio_port_ = relay_audio_port;
     relay_control_port_ = relay_control_port;
 
-    io_context_ = std::make_unique<boost::asio::io_context>();
+    io_context_ = std::make_shared<boost::asio::io_context>();
+    work_guard_.emplace(io_context_->get_executor());
+    buffer_.resize(BATCH_SIZE * MAX_DATAGRAM_SIZE);
+
+    // All channels are relayed by this thread
+    relay_thread_ = std::thread([io_context = io_context_]() {
+      try {
+        io_context->run();
+      } catch (const std::exception &e) {
+        BOOST_LOG(error) << "starbeam::udp: Relay error: " << e.what();
+      }
+    });
+
     running_ = true;
 
     BOOST_LOG(info) << "starbeam::udp: Initialized with relay " << relay_host
@@ -53,20 +124,16 @@ namespace udp {
 
     std::lock_guard<std::mutex> lock(mutex_);
 
-    for (auto &[type, channel] : channels_) {
-      if (channel) {
-        channel->running = false;
-        if (channel->socket) {
-          boost::system::error_code ec;
-          channel->socket->close(ec);
-        }
-        if (channel->relay_thread.joinable()) {
-          channel->relay_thread.join();
-        }
-      }
+    for (auto &[key, channel] : channels_) {
+      close_channel(channel);
     }
-
     channels_.clear();
+
+    // The relay thread returns once the pending waits of the channels are cancelled
+    work_guard_.reset();
+    if (relay_thread_.joinable()) {
+      relay_thread_.join();
+    }
     io_context_.reset();
 
     BOOST_LOG(info) << "starbeam::udp: Shutdown complete";
@@ -110,30 +177,45 @@ namespace udp {
     }
 
     // Check if channel already exists
-    auto it = channels_.find(setup.channel);
+    ChannelKey key {setup.session_id, setup.channel};
+    auto it = channels_.find(key);
     if (it != channels_.end() && it->second) {
       // Return existing channel info
       ack.relay_port = relay_port;
       ack.local_port = it->second->local_port;
+      ack.candidates = host_candidates(*it->second);
       return ack;
     }
 
     // Create new channel
-    auto channel = std::make_unique<Channel>();
+    auto channel = std::make_shared<Channel>();
+    channel->session_id = setup.session_id;
+    channel->type = setup.channel;
 
     try {
-      // Create UDP socket bound to any available port
-      channel->socket = std::make_unique<boost::asio::ip::udp::socket>(
-        *io_context_,
-        boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0)
+      // Create UDP socket bound to any available port. Direct routes can hold on to it
+      // past shutdown(), so it keeps the io_context alive until it's destroyed.
+      channel->socket = std::shared_ptr<boost::asio::ip::udp::socket>(
+        new boost::asio::ip::udp::socket(
+          *io_context_,
+          boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0)
+        ),
+        [io_context = io_context_](boost::asio::ip::udp::socket *socket) {
+          delete socket;
+        }
       );
 
       // Get the local port we bound to
       channel->local_port = channel->socket->local_endpoint().port();
 
-      // Set up relay endpoint (starbeam relay server)
+      // Best effort, the system may cap the sizes
+      boost::system::error_code ec;
+      channel->socket->set_option(boost::asio::socket_base::receive_buffer_size(SOCKET_BUFFER_SIZE), ec);
+      channel->socket->set_option(boost::asio::socket_base::send_buffer_size(SOCKET_BUFFER_SIZE), ec);
+
+      // Set up relay endpoint (starbeam relay server), reachable from the IPv4 socket
       boost::asio::ip::udp::resolver resolver(*io_context_);
-      auto endpoints = resolver.resolve(relay_host_, std::to_string(relay_port));
+      auto endpoints = resolver.resolve(boost::asio::ip::udp::v4(), relay_host_, std::to_string(relay_port));
       channel->relay_endpoint = *endpoints.begin();
 
       // Set up local sunshine endpoint
@@ -142,22 +224,31 @@ namespace udp {
         sunshine_port
       );
 
-      channel->running = true;
+      channel->timer.emplace(*io_context_);
+      channel->rate_timer.emplace(*io_context_);
 
-      // Start relay thread
-      auto channel_type = setup.channel;
-      channel->relay_thread = std::thread([this, channel_type]() {
-        run_relay(channel_type);
+      auto name = std::string("Starbeam: ") + protocol::channel_type_string(setup.channel) + " channel of session " + std::to_string(setup.session_id);
+      channel->bitrate_logger.emplace(debug, name + " bitrate to client", "Mb/s");
+      channel->loss_logger.emplace(debug, name + " drops", "%");
+
+      // Start relaying on the relay thread
+      boost::asio::post(*io_context_, [this, channel]() {
+        wait_readable(channel);
+
+        channel->sampled_at = std::chrono::steady_clock::now();
+        sample_rates(channel);
       });
 
       ack.relay_port = relay_port;
       ack.local_port = channel->local_port;
+      ack.candidates = host_candidates(*channel);
 
       BOOST_LOG(info) << "starbeam::udp: Created " << protocol::channel_type_string(setup.channel)
-                      << " channel (local:" << channel->local_port
+                      << " channel for session " << setup.session_id
+                      << " (local:" << channel->local_port
                       << " -> relay:" << relay_port << ")";
 
-      channels_[setup.channel] = std::move(channel);
+      channels_[key] = std::move(channel);
 
     } catch (const std::exception &e) {
       BOOST_LOG(error) << "starbeam::udp: Failed to create channel: " << e.what();
@@ -166,68 +257,567 @@ namespace udp {
     return ack;
   }
 
-  uint16_t ChannelManager::get_local_port(protocol::UdpChannelType channel) const {
+  void ChannelManager::handle_candidates(const protocol::UdpCandidatesMessage &msg) {
+    if (!config::starbeam.p2p) {
+      BOOST_LOG(debug) << "starbeam::udp: Ignoring candidates, peer-to-peer is disabled";
+      return;
+    }
+
+    if (msg.token.empty() || msg.token.size() > MAX_TOKEN_SIZE) {
+      BOOST_LOG(warning) << "starbeam::udp: Ignoring candidates with an invalid token for session " << msg.session_id;
+      return;
+    }
+
+    // Channels are IPv4 only
+    std::vector<boost::asio::ip::udp::endpoint> candidates;
+    for (auto &candidate : msg.candidates) {
+      boost::system::error_code ec;
+      auto colon = candidate.rfind(':');
+      auto address = boost::asio::ip::make_address_v4(candidate.substr(0, colon), ec);
+      if (ec || colon == std::string::npos) {
+        BOOST_LOG(debug) << "starbeam::udp: Skipping candidate " << candidate;
+        continue;
+      }
+
+      try {
+        candidates.emplace_back(address, (uint16_t) std::stoul(candidate.substr(colon + 1)));
+      } catch (const std::exception &) {
+        BOOST_LOG(debug) << "starbeam::udp: Skipping candidate " << candidate;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = channels_.find({msg.session_id, msg.channel});
+    if (it == channels_.end()) {
+      BOOST_LOG(warning) << "starbeam::udp: Candidates for unknown " << protocol::channel_type_string(msg.channel)
+                         << " channel of session " << msg.session_id;
+      return;
+    }
+
+    boost::asio::post(*io_context_, [this, channel = it->second, token = msg.token, candidates = std::move(candidates)]() mutable {
+      channel->token = std::move(token);
+      channel->candidates = std::move(candidates);
+      channel->punch_deadline = std::chrono::steady_clock::now() + PUNCH_TIMEOUT;
+
+      // Start over, in case the client was already being probed
+      channel->timer->cancel();
+      punch(std::move(channel));
+    });
+  }
+
+  void ChannelManager::set_path_handler(PathHandler handler) {
+    std::lock_guard<std::mutex> lock(path_handler_mutex_);
+    path_handler_ = std::move(handler);
+  }
+
+  void ChannelManager::close_session(uint64_t session_id) {
     std::lock_guard<std::mutex> lock(mutex_);
-    auto it = channels_.find(channel);
+
+    for (auto it = channels_.begin(); it != channels_.end();) {
+      auto &channel = it->second;
+      if (channel->session_id != session_id) {
+        ++it;
+        continue;
+      }
+
+      close_channel(channel);
+      BOOST_LOG(info) << "starbeam::udp: Closed " << protocol::channel_type_string(channel->type)
+                      << " channel for session " << session_id
+                      << " (to relay:" << channel->packets_to_relay
+                      << " to local:" << channel->packets_to_local
+                      << " to peer:" << channel->packets_to_peer
+                      << " dropped:" << channel->drops << ")";
+      it = channels_.erase(it);
+    }
+  }
+
+  uint16_t ChannelManager::get_local_port(uint64_t session_id, protocol::UdpChannelType channel) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = channels_.find({session_id, channel});
     if (it != channels_.end() && it->second) {
       return it->second->local_port;
     }
     return 0;
   }
 
+  std::optional<DirectRoute> ChannelManager::find_direct_route(const boost::asio::ip::udp::endpoint &local_peer) const {
+    if (!local_peer.address().is_loopback()) {
+      return std::nullopt;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &[key, channel] : channels_) {
+      if (channel->local_port == local_peer.port()) {
+        return DirectRoute {channel->socket, channel->relay_endpoint, {channel, &channel->direct_peer}, channel};
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  std::vector<ChannelStats> ChannelManager::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<ChannelStats> stats;
+    stats.reserve(channels_.size());
+    for (auto &[key, channel] : channels_) {
+      ChannelRates rates;
+      {
+        std::lock_guard<std::mutex> rates_lock(channel->rates_mutex);
+        rates = channel->rates;
+      }
+
+      stats.push_back({
+        channel->session_id,
+        channel->type,
+        channel->local_port,
+        channel->packets_to_relay.load(std::memory_order_relaxed),
+        channel->bytes_to_relay.load(std::memory_order_relaxed),
+        channel->packets_to_local.load(std::memory_order_relaxed),
+        channel->bytes_to_local.load(std::memory_order_relaxed),
+        channel->drops.load(std::memory_order_relaxed),
+        channel->packets_to_peer.load(std::memory_order_relaxed),
+        channel->bytes_to_peer.load(std::memory_order_relaxed),
+        channel->direct_peer.load(std::memory_order_relaxed) != 0,
+        channel->rtt_us.load(std::memory_order_relaxed),
+        rates,
+      });
+    }
+
+    return stats;
+  }
+
   bool ChannelManager::is_running() const {
     return running_;
   }
 
-  void ChannelManager::run_relay(protocol::UdpChannelType type) {
-    Channel *channel = nullptr;
-    {
-      std::lock_guard<std::mutex> lock(mutex_);
-      auto it = channels_.find(type);
-      if (it == channels_.end() || !it->second) {
+  void ChannelManager::wait_readable(std::shared_ptr<Channel> channel) {
+    auto &socket = *channel->socket;
+    socket.async_wait(boost::asio::ip::udp::socket::wait_read, [this, channel = std::move(channel)](const boost::system::error_code &ec) mutable {
+      if (ec || channel->closed) {
         return;
       }
-      channel = it->second.get();
+
+      for (int x = 0; x < MAX_BATCHES_PER_WAKEUP; ++x) {
+        if (relay_batch(*channel) < BATCH_SIZE) {
+          // Drained
+          break;
+        }
+      }
+
+      wait_readable(std::move(channel));
+    });
+  }
+
+  // Where a relayed datagram goes
+  enum class Hop : uint8_t {
+    Local,
+    Relay,
+    Peer
+  };
+
+  static void count_forwarded(std::atomic<uint64_t> &packets, std::atomic<uint64_t> &bytes, std::size_t len) {
+    packets.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(len, std::memory_order_relaxed);
+  }
+
+#ifdef __linux__
+  std::size_t ChannelManager::relay_batch(Channel &channel) {
+    std::array<mmsghdr, BATCH_SIZE> messages {};
+    std::array<iovec, BATCH_SIZE> iovecs;
+    std::array<sockaddr_in, BATCH_SIZE> senders;
+
+    for (std::size_t x = 0; x < BATCH_SIZE; ++x) {
+      iovecs[x] = {buffer_.data() + x * MAX_DATAGRAM_SIZE, MAX_DATAGRAM_SIZE};
+      messages[x].msg_hdr.msg_iov = &iovecs[x];
+      messages[x].msg_hdr.msg_iovlen = 1;
+      messages[x].msg_hdr.msg_name = &senders[x];
+      messages[x].msg_hdr.msg_namelen = sizeof(senders[x]);
     }
 
-    std::vector<uint8_t> buffer(65535);
-    boost::asio::ip::udp::endpoint sender_endpoint;
+    // Never block the relay thread, whatever mode the socket was left in
+    auto fd = channel.socket->native_handle();
+    auto received = recvmmsg(fd, messages.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+    if (received <= 0) {
+      return 0;
+    }
 
-    while (channel->running && running_) {
-      try {
-        boost::system::error_code ec;
-        size_t len = channel->socket->receive_from(
-          boost::asio::buffer(buffer), sender_endpoint, 0, ec);
-
-        if (ec) {
-          if (ec != boost::asio::error::operation_aborted) {
-            BOOST_LOG(warning) << "starbeam::udp: Receive error: " << ec.message();
-          }
+    // Forward the datagrams from the buffers they were received into, each addressed to the other side
+    auto relay_address = htonl(channel.relay_endpoint.address().to_v4().to_uint());
+    auto local_address = htonl(channel.local_endpoint.address().to_v4().to_uint());
+    auto now = std::chrono::steady_clock::now();
+    std::array<Hop, BATCH_SIZE> hops;
+    std::size_t count = 0;
+    for (int x = 0; x < received; ++x) {
+      auto message = messages[x];
+      if (message.msg_hdr.msg_flags & MSG_TRUNC) {
+        channel.drops.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      auto sender = pack_endpoint(ntohl(senders[x].sin_addr.s_addr), ntohs(senders[x].sin_port));
+      if (!channel.token.empty() && handle_probe(channel, (const char *) iovecs[x].iov_base, message.msg_len, unpack_endpoint(sender))) {
+        continue;
+      }
+
+      auto from_peer = channel.peer && sender == channel.direct_peer.load(std::memory_order_relaxed);
+      if (from_peer) {
+        channel.last_from_peer = now;
+      }
+
+      // The client's traffic reaches Sunshine through the relay or a validated peer, and Sunshine's
+      // goes to the relay, unless there's a direct path to the client. Anything else is dropped.
+      Hop hop;
+      if (from_peer || senders[x].sin_addr.s_addr == relay_address) {
+        hop = Hop::Local;
+      } else if (senders[x].sin_addr.s_addr == local_address) {
+        hop = channel.peer ? Hop::Peer : Hop::Relay;
+      } else {
+        channel.drops.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      auto &destination = hop == Hop::Local ? channel.local_endpoint : hop == Hop::Peer ? *channel.peer : channel.relay_endpoint;
+
+      iovecs[x].iov_len = message.msg_len;
+      message.msg_hdr.msg_name = destination.data();
+      message.msg_hdr.msg_namelen = destination.size();
+      message.msg_hdr.msg_flags = 0;
+
+      hops[count] = hop;
+      messages[count++] = message;
+    }
+
+    std::size_t sent = 0;
+    while (sent < count) {
+      auto result = sendmmsg(fd, messages.data() + sent, count - sent, MSG_DONTWAIT);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          // Drop the rest rather than stall every other channel
+          channel.drops.fetch_add(count - sent, std::memory_order_relaxed);
           break;
         }
 
-        // Determine where to forward the packet
-        boost::asio::ip::udp::endpoint dest;
-        if (sender_endpoint.address() == channel->relay_endpoint.address()) {
-          // From relay -> forward to local Sunshine
-          dest = channel->local_endpoint;
-        } else {
-          // From local Sunshine -> forward to relay
-          dest = channel->relay_endpoint;
+        // Skip the datagram that couldn't be sent
+        channel.drops.fetch_add(1, std::memory_order_relaxed);
+        ++sent;
+        continue;
+      }
+
+      for (auto x = sent; x < sent + result; ++x) {
+        switch (hops[x]) {
+          case Hop::Local:
+            count_forwarded(channel.packets_to_local, channel.bytes_to_local, messages[x].msg_len);
+            break;
+          case Hop::Relay:
+            count_forwarded(channel.packets_to_relay, channel.bytes_to_relay, messages[x].msg_len);
+            break;
+          case Hop::Peer:
+            count_forwarded(channel.packets_to_peer, channel.bytes_to_peer, messages[x].msg_len);
+            break;
         }
+      }
+      sent += result;
+    }
+
+    return received;
+  }
+#else
+  std::size_t ChannelManager::relay_batch(Channel &channel) {
+    std::size_t received = 0;
+    boost::system::error_code ec;
+
+    while (received < BATCH_SIZE && channel.socket->available(ec) > 0 && !ec) {
+      boost::asio::ip::udp::endpoint sender;
+      auto len = channel.socket->receive_from(boost::asio::buffer(buffer_.data(), MAX_DATAGRAM_SIZE), sender, 0, ec);
+      ++received;
+      if (ec) {
+        // Most likely larger than MAX_DATAGRAM_SIZE
+        channel.drops.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      if (!channel.token.empty() && handle_probe(channel, buffer_.data(), len, sender)) {
+        continue;
+      }
+
+      auto from_peer = channel.peer && sender == *channel.peer;
+      if (from_peer) {
+        channel.last_from_peer = std::chrono::steady_clock::now();
+      }
+
+      // The client's traffic reaches Sunshine through the relay or a validated peer, and Sunshine's
+      // goes to the relay, unless there's a direct path to the client. Anything else is dropped.
+      Hop hop;
+      if (from_peer || sender.address() == channel.relay_endpoint.address()) {
+        hop = Hop::Local;
+      } else if (sender.address() == channel.local_endpoint.address()) {
+        hop = channel.peer ? Hop::Peer : Hop::Relay;
+      } else {
+        channel.drops.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      auto &destination = hop == Hop::Local ? channel.local_endpoint : hop == Hop::Peer ? *channel.peer : channel.relay_endpoint;
+
+      channel.socket->send_to(boost::asio::buffer(buffer_.data(), len), destination, 0, ec);
+      if (ec) {
+        channel.drops.fetch_add(1, std::memory_order_relaxed);
+      } else if (hop == Hop::Local) {
+        count_forwarded(channel.packets_to_local, channel.bytes_to_local, len);
+      } else if (hop == Hop::Peer) {
+        count_forwarded(channel.packets_to_peer, channel.bytes_to_peer, len);
+      } else {
+        count_forwarded(channel.packets_to_relay, channel.bytes_to_relay, len);
+      }
+    }
+
+    return received;
+  }
+#endif
+
+  void ChannelManager::close_channel(const std::shared_ptr<Channel> &channel) {
+    channel->closed = true;
+
+    // Streams may still send through the socket, so it's only closed once the last route is released.
+    // The pending wait is cancelled on the relay thread, which owns the socket's asynchronous operations.
+    boost::asio::post(*io_context_, [channel]() {
+      boost::system::error_code ec;
+      channel->socket->cancel(ec);
+      if (channel->timer) {
+        channel->timer->cancel();
+      }
+      if (channel->rate_timer) {
+        channel->rate_timer->cancel();
+      }
+    });
+  }
+
+  std::vector<std::string> ChannelManager::host_candidates(const Channel &channel) {
+    if (!config::starbeam.p2p) {
+      return {};
+    }
+
+    // The address the host reaches the relay from, which a client on the same network can use.
+    // The relay learns the host's public address from the channel's traffic.
+    boost::system::error_code ec;
+    boost::asio::ip::udp::socket route(*io_context_);
+    route.open(boost::asio::ip::udp::v4(), ec);
+    if (!ec) {
+      route.connect(channel.relay_endpoint, ec);
+    }
+    if (ec) {
+      return {};
+    }
+
+    auto address = route.local_endpoint(ec).address();
+    if (ec || address.is_unspecified()) {
+      return {};
+    }
+
+    return {to_string({address, channel.local_port})};
+  }
 
-        channel->socket->send_to(boost::asio::buffer(buffer.data(), len), dest, 0, ec);
-        if (ec) {
-          BOOST_LOG(warning) << "starbeam::udp: Send error: " << ec.message();
+  void ChannelManager::punch(std::shared_ptr<Channel> channel) {
+    if (channel->closed) {
+      return;
+    }
+
+    auto schedule = [this, &channel](std::chrono::milliseconds interval) {
+      channel->timer->expires_after(interval);
+      channel->timer->async_wait([this, channel](const boost::system::error_code &ec) {
+        if (!ec) {
+          punch(channel);
         }
+      });
+    };
 
-      } catch (const std::exception &e) {
-        BOOST_LOG(error) << "starbeam::udp: Relay error: " << e.what();
-        break;
+    auto now = std::chrono::steady_clock::now();
+    if (channel->peer) {
+      if (now - channel->last_from_peer <= PEER_TIMEOUT) {
+        send_probe(*channel, *channel->peer, PROBE_REQUEST, now_ns());
+        schedule(KEEPALIVE_INTERVAL);
+        return;
       }
+
+      BOOST_LOG(info) << "starbeam::udp: Lost direct path to " << *channel->peer << " for "
+                      << protocol::channel_type_string(channel->type) << " channel of session " << channel->session_id
+                      << ", back on the relay";
+      set_peer(*channel, std::nullopt);
+      report_path(*channel);
+
+      // Try again, the client may only have moved to another address
+      channel->punch_deadline = now + PUNCH_TIMEOUT;
+    }
+
+    if (now >= channel->punch_deadline) {
+      BOOST_LOG(info) << "starbeam::udp: No direct path for " << protocol::channel_type_string(channel->type)
+                      << " channel of session " << channel->session_id << ", staying on the relay";
+      report_path(*channel);
+      return;
+    }
+
+    auto timestamp = now_ns();
+    for (auto &candidate : channel->candidates) {
+      send_probe(*channel, candidate, PROBE_REQUEST, timestamp);
+    }
+    schedule(PUNCH_INTERVAL);
+  }
+
+  bool ChannelManager::handle_probe(Channel &channel, const char *data, std::size_t len, const boost::asio::ip::udp::endpoint &sender) {
+    if (len < PROBE_HEADER_SIZE || std::memcmp(data, PROBE_MAGIC, sizeof(PROBE_MAGIC)) != 0) {
+      return false;
+    }
+
+    if (std::string_view(data + PROBE_HEADER_SIZE, len - PROBE_HEADER_SIZE) != channel.token) {
+      channel.drops.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    auto kind = (uint8_t) data[sizeof(PROBE_MAGIC)];
+    uint64_t timestamp = 0;
+    for (std::size_t x = sizeof(PROBE_MAGIC) + 1; x < PROBE_HEADER_SIZE; ++x) {
+      timestamp = timestamp << 8 | (uint8_t) data[x];
+    }
+
+    if (channel.peer && sender == *channel.peer) {
+      channel.last_from_peer = std::chrono::steady_clock::now();
+    }
+
+    if (kind == PROBE_REQUEST) {
+      send_probe(channel, sender, PROBE_RESPONSE, timestamp);
+
+      // The client's NAT may show it to the host at an address the relay doesn't know about,
+      // so probe back right away rather than waiting for one of the candidates to answer
+      if (!channel.peer) {
+        if (std::find(channel.candidates.begin(), channel.candidates.end(), sender) == channel.candidates.end()) {
+          channel.candidates.push_back(sender);
+        }
+        send_probe(channel, sender, PROBE_REQUEST, now_ns());
+      }
+      return true;
+    }
+
+    // Only responses to the host's own probes carry its clock
+    auto now = now_ns();
+    if (kind != PROBE_RESPONSE || timestamp > now) {
+      return true;
+    }
+
+    auto rtt = (uint32_t) std::min<uint64_t>((now - timestamp) / 1000, UINT32_MAX);
+    if (!channel.peer) {
+      channel.rtt_us.store(rtt, std::memory_order_relaxed);
+      set_peer(channel, sender);
+
+      BOOST_LOG(info) << "starbeam::udp: Direct path to " << sender << " for "
+                      << protocol::channel_type_string(channel.type) << " channel of session " << channel.session_id
+                      << " (rtt " << rtt << " us)";
+      report_path(channel);
+    } else if (sender == *channel.peer) {
+      // Smoothed like TCP's round trip time
+      auto smoothed = channel.rtt_us.load(std::memory_order_relaxed);
+      channel.rtt_us.store((uint32_t) (((uint64_t) smoothed * 7 + rtt) / 8), std::memory_order_relaxed);
+    }
+
+    return true;
+  }
+
+  void ChannelManager::send_probe(Channel &channel, const boost::asio::ip::udp::endpoint &destination, uint8_t kind, uint64_t timestamp) {
+    std::array<char, PROBE_HEADER_SIZE + MAX_TOKEN_SIZE> probe;
+    std::memcpy(probe.data(), PROBE_MAGIC, sizeof(PROBE_MAGIC));
+    probe[sizeof(PROBE_MAGIC)] = (char) kind;
+    for (std::size_t x = sizeof(PROBE_MAGIC) + 1; x < PROBE_HEADER_SIZE; ++x) {
+      probe[x] = (char) (timestamp >> (8 * (PROBE_HEADER_SIZE - 1 - x)));
+    }
+    std::memcpy(probe.data() + PROBE_HEADER_SIZE, channel.token.data(), channel.token.size());
+
+    // Best effort, probes are sent again until one is answered
+    boost::system::error_code ec;
+    channel.socket->send_to(boost::asio::buffer(probe.data(), PROBE_HEADER_SIZE + channel.token.size()), destination, 0, ec);
+  }
+
+  void ChannelManager::set_peer(Channel &channel, std::optional<boost::asio::ip::udp::endpoint> peer) {
+    channel.peer = peer;
+    channel.last_from_peer = std::chrono::steady_clock::now();
+    channel.direct_peer.store(peer ? pack_endpoint(*peer) : 0, std::memory_order_relaxed);
+  }
+
+  void ChannelManager::report_path(Channel &channel) {
+    // Only changes are reported
+    auto direct = channel.peer.has_value();
+    if (channel.reported_direct == direct) {
+      return;
+    }
+    channel.reported_direct = direct;
+
+    protocol::UdpPathMessage path;
+    path.session_id = channel.session_id;
+    path.channel = channel.type;
+    path.direct = direct;
+    if (direct) {
+      path.peer = to_string(*channel.peer);
+      path.rtt_us = channel.rtt_us.load(std::memory_order_relaxed);
+    }
+
+    PathHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(path_handler_mutex_);
+      handler = path_handler_;
+    }
+
+    if (handler) {
+      handler(path);
     }
   }
 
+  void ChannelManager::sample_rates(std::shared_ptr<Channel> channel) {
+    channel->rate_timer->expires_after(RATE_INTERVAL);
+    channel->rate_timer->async_wait([this, channel](const boost::system::error_code &ec) {
+      if (ec || channel->closed) {
+        return;
+      }
+
+      std::array<uint64_t, 5> counters {
+        channel->packets_to_relay.load(std::memory_order_relaxed) + channel->packets_to_peer.load(std::memory_order_relaxed),
+        channel->bytes_to_relay.load(std::memory_order_relaxed) + channel->bytes_to_peer.load(std::memory_order_relaxed),
+        channel->packets_to_local.load(std::memory_order_relaxed),
+        channel->bytes_to_local.load(std::memory_order_relaxed),
+        channel->drops.load(std::memory_order_relaxed),
+      };
+
+      auto now = std::chrono::steady_clock::now();
+      auto seconds = std::chrono::duration<double>(now - channel->sampled_at).count();
+
+      std::array<double, 5> deltas;
+      for (std::size_t x = 0; x < counters.size(); ++x) {
+        deltas[x] = (double) (counters[x] - channel->sampled[x]);
+      }
+      channel->sampled = counters;
+      channel->sampled_at = now;
+
+      auto datagrams = deltas[0] + deltas[2] + deltas[4];
+      ChannelRates rates {
+        deltas[0] / seconds,
+        deltas[1] / seconds,
+        deltas[2] / seconds,
+        deltas[3] / seconds,
+        datagrams > 0 ? deltas[4] / datagrams : 0,
+      };
+
+      {
+        std::lock_guard<std::mutex> lock(channel->rates_mutex);
+        channel->rates = rates;
+      }
+
+      channel->bitrate_logger->collect_and_log(rates.bytes_to_client * 8 / 1000000);
+      channel->loss_logger->collect_and_log(rates.loss * 100);
+
+      sample_rates(channel);
+    });
+  }
+
   uint16_t ChannelManager::get_sunshine_port(protocol::UdpChannelType type) {
     // Base port from config
     int base_port = config::sunshine.port;
@@ -253,6 +843,7 @@ namespace udp {
     std::lock_guard<std::mutex> lock(g_manager_mutex);
     if (!g_channel_manager) {
       g_channel_manager = std::make_unique<ChannelManager>();
+      g_channel_manager->set_path_handler(g_path_handler);
     }
     return *g_channel_manager;
   }
@@ -279,5 +870,43 @@ namespace udp {
     return get_channel_manager().handle_channel_setup(setup);
   }
 
+  void handle_candidates(const protocol::UdpCandidatesMessage &candidates) {
+    std::lock_guard<std::mutex> lock(g_manager_mutex);
+    if (g_channel_manager) {
+      g_channel_manager->handle_candidates(candidates);
+    }
+  }
+
+  void set_path_handler(PathHandler handler) {
+    std::lock_guard<std::mutex> lock(g_manager_mutex);
+    g_path_handler = handler;
+    if (g_channel_manager) {
+      g_channel_manager->set_path_handler(std::move(handler));
+    }
+  }
+
+  void close_session(uint64_t session_id) {
+    std::lock_guard<std::mutex> lock(g_manager_mutex);
+    if (g_channel_manager) {
+      g_channel_manager->close_session(session_id);
+    }
+  }
+
+  std::vector<ChannelStats> get_stats() {
+    std::lock_guard<std::mutex> lock(g_manager_mutex);
+    if (!g_channel_manager) {
+      return {};
+    }
+    return g_channel_manager->get_stats();
+  }
+
+  std::optional<DirectRoute> find_direct_route(const boost::asio::ip::udp::endpoint &local_peer) {
+    std::lock_guard<std::mutex> lock(g_manager_mutex);
+    if (!g_channel_manager || !config::starbeam.direct_udp) {
+      return std::nullopt;
+    }
+    return g_channel_manager->find_direct_route(local_peer);
+  }
+
 }  // namespace udp
 }  // namespace starbeam
@@ -4,29 +4,148 @@
  */
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 
+#include "../logging.h"
 #include "protocol.h"
 
 namespace starbeam {
 namespace udp {
 
+  /**
+   * @brief Traffic a channel sent towards its client, counted by the relay thread and the routes to the channel alike.
+   */
+  struct TrafficCounters {
+    std::atomic<uint64_t> packets_to_relay{0};
+    std::atomic<uint64_t> bytes_to_relay{0};
+    std::atomic<uint64_t> packets_to_peer{0};
+    std::atomic<uint64_t> bytes_to_peer{0};
+  };
+
+  /**
+   * @brief A way to send a channel's traffic to the relay without the loopback hop.
+   *
+   * Sending through the channel's own socket keeps the source port the relay
+   * already associates with the channel. The socket stays open for as long as
+   * a route to it is held, even after the channel is shut down. While the
+   * channel has a direct path to the client, the route sends there instead.
+   */
+  struct DirectRoute {
+    std::shared_ptr<boost::asio::ip::udp::socket> socket;
+    boost::asio::ip::udp::endpoint relay_endpoint;
+    std::shared_ptr<const std::atomic<uint64_t>> peer;  ///< The client on the direct path, 0 while relayed
+    std::shared_ptr<TrafficCounters> counters;
+
+    /**
+     * @brief Get where the channel's traffic goes right now.
+     * @return The client while there is a direct path, otherwise the relay
+     */
+    boost::asio::ip::udp::endpoint destination() const;
+
+    /**
+     * @brief Count datagrams sent through the route in the channel's traffic counters.
+     * @param packets Number of datagrams sent
+     * @param bytes Their total size
+     */
+    void count(uint64_t packets, uint64_t bytes) const;
+  };
+
+  /**
+   * @brief Traffic rates of a UDP channel, over the last ChannelManager::RATE_INTERVAL.
+   */
+  struct ChannelRates {
+    double packets_to_client;  ///< Per second, through the relay or the direct path
+    double bytes_to_client;
+    double packets_to_local;
+    double bytes_to_local;
+    double loss;  ///< Share of the channel's datagrams that were dropped, from 0 to 1
+  };
+
+  /**
+   * @brief Traffic counters of a UDP channel.
+   */
+  struct ChannelStats {
+    uint64_t session_id;
+    protocol::UdpChannelType channel;
+    uint16_t local_port;
+    uint64_t packets_to_relay;
+    uint64_t bytes_to_relay;
+    uint64_t packets_to_local;
+    uint64_t bytes_to_local;
+    uint64_t drops;  ///< Datagrams that were truncated or couldn't be forwarded
+    uint64_t packets_to_peer;  ///< Sent straight to the client over the direct path
+    uint64_t bytes_to_peer;
+    bool direct;  ///< Whether the channel has a direct path to the client
+    uint32_t rtt_us;  ///< Round trip time of the direct path, 0 if there was none yet
+    ChannelRates rates;  ///< All 0 until the channel was open for a RATE_INTERVAL
+  };
+
+  /**
+   * @brief Handler told whenever the path of a channel changes.
+   */
+  using PathHandler = std::function<void(const protocol::UdpPathMessage &)>;
+
   /**
    * @brief Manages UDP channels for relaying video/audio/control streams.
    *
    * When streaming through Starbeam, the relay allocates UDP ports that clients
    * connect to. This class creates local UDP sockets that forward data between
    * Sunshine's local streaming and the Starbeam relay server.
+   *
+   * Every session gets its own channels, and the channels of all sessions are
+   * relayed by a single event loop thread, moving datagrams in batches.
+   * Each channel samples its traffic rates every RATE_INTERVAL, and logs
+   * them periodically at debug level.
+   *
+   * Once the relay sends a client's candidate addresses for a channel, the
+   * channel tries to reach the client directly by sending probes to each of
+   * them from its socket, punching a hole into both ends' NATs:
+   *
+   *   "SBP1" | kind (1 byte) | timestamp (8 bytes) | token
+   *
+   * Kind 0 is a probe, answered with a kind 1 copy of it from the address it
+   * was sent to. The token is the one the relay handed to both ends. The
+   * first candidate to answer becomes the direct path, and the channel sends
+   * its client's traffic there rather than to the relay. When the client goes
+   * quiet, the channel falls back to the relay.
    */
   class ChannelManager {
   public:
+    // Datagrams moved per system call
+    static constexpr std::size_t BATCH_SIZE = 64;
+
+    // Larger than any datagram the streams send, anything bigger is dropped
+    static constexpr std::size_t MAX_DATAGRAM_SIZE = 4096;
+
+    // How often the candidates are probed, and for how long before staying on the relay
+    static constexpr auto PUNCH_INTERVAL = std::chrono::milliseconds(50);
+    static constexpr auto PUNCH_TIMEOUT = std::chrono::seconds(2);
+
+    // How often the direct path is probed, keeping the NAT bindings open and measuring the round trip time
+    static constexpr auto KEEPALIVE_INTERVAL = std::chrono::milliseconds(250);
+
+    // How long the client may stay quiet before the channel falls back to the relay
+    static constexpr auto PEER_TIMEOUT = std::chrono::seconds(1);
+
+    // Longest token accepted from the relay
+    static constexpr std::size_t MAX_TOKEN_SIZE = 64;
+
+    // How often the traffic rates of the channels are sampled
+    static constexpr auto RATE_INTERVAL = std::chrono::seconds(1);
+
     ChannelManager();
     ~ChannelManager();
 
@@ -60,11 +179,43 @@ namespace udp {
     );
 
     /**
-     * @brief Get local port for a channel type.
+     * @brief Try a direct path to the client of a channel.
+     * @param candidates The client's candidate addresses, from the relay
+     */
+    void handle_candidates(const protocol::UdpCandidatesMessage &candidates);
+
+    /**
+     * @brief Set the handler told whenever the path of a channel changes.
+     * @param handler Handler function, called on the relay thread
+     */
+    void set_path_handler(PathHandler handler);
+
+    /**
+     * @brief Close the channels of a session.
+     * @param session_id The session that ended
+     */
+    void close_session(uint64_t session_id);
+
+    /**
+     * @brief Get local port for a session's channel.
+     * @param session_id Session the channel belongs to
      * @param channel Channel type
      * @return Local port or 0 if not set up
      */
-    uint16_t get_local_port(protocol::UdpChannelType channel) const;
+    uint16_t get_local_port(uint64_t session_id, protocol::UdpChannelType channel) const;
+
+    /**
+     * @brief Find the channel Sunshine reaches a client through.
+     * @param local_peer The address a stream learned its client at, from the client's pings
+     * @return A direct route to the relay, or nullopt if the peer isn't a channel
+     */
+    std::optional<DirectRoute> find_direct_route(const boost::asio::ip::udp::endpoint &local_peer) const;
+
+    /**
+     * @brief Get the traffic counters and rates of all open channels.
+     * @return Counters, ordered by session and channel type
+     */
+    std::vector<ChannelStats> get_stats() const;
 
     /**
      * @brief Check if channel manager is running.
@@ -73,23 +224,77 @@ namespace udp {
     bool is_running() const;
 
   private:
-    struct Channel {
-      std::unique_ptr<boost::asio::ip::udp::socket> socket;
+    struct Channel: TrafficCounters {
+      uint64_t session_id;
+      protocol::UdpChannelType type;
+      std::shared_ptr<boost::asio::ip::udp::socket> socket;
       boost::asio::ip::udp::endpoint relay_endpoint;
       boost::asio::ip::udp::endpoint local_endpoint;
       uint16_t local_port;
-      std::thread relay_thread;
-      std::atomic<bool> running{false};
+      std::atomic<bool> closed{false};
+
+      // Declared after the socket, which keeps the io_context alive until the timers are gone
+      std::optional<boost::asio::steady_timer> timer;
+      std::optional<boost::asio::steady_timer> rate_timer;
+
+      // Direct path to the client, only accessed on the relay thread
+      std::string token;
+      std::vector<boost::asio::ip::udp::endpoint> candidates;
+      std::optional<boost::asio::ip::udp::endpoint> peer;
+      std::chrono::steady_clock::time_point punch_deadline;
+      std::chrono::steady_clock::time_point last_from_peer;
+      std::optional<bool> reported_direct;
+
+      // The peer for direct routes, 0 while relayed
+      std::atomic<uint64_t> direct_peer{0};
+      std::atomic<uint32_t> rtt_us{0};
+
+      std::atomic<uint64_t> packets_to_local{0};
+      std::atomic<uint64_t> bytes_to_local{0};
+      std::atomic<uint64_t> drops{0};
+
+      // Counters at the last rate sample and the loggers of the rates, only accessed on the relay thread
+      std::array<uint64_t, 5> sampled {};
+      std::chrono::steady_clock::time_point sampled_at;
+      std::optional<logging::min_max_avg_periodic_logger<double>> bitrate_logger;
+      std::optional<logging::min_max_avg_periodic_logger<double>> loss_logger;
+
+      ChannelRates rates {};
+      mutable std::mutex rates_mutex;
     };
 
-    void run_relay(protocol::UdpChannelType type);
+    using ChannelKey = std::pair<uint64_t, protocol::UdpChannelType>;
+
+    void wait_readable(std::shared_ptr<Channel> channel);
+    std::size_t relay_batch(Channel &channel);
+    void close_channel(const std::shared_ptr<Channel> &channel);
     uint16_t get_sunshine_port(protocol::UdpChannelType type);
+    std::vector<std::string> host_candidates(const Channel &channel);
 
-    std::unique_ptr<boost::asio::io_context> io_context_;
-    std::map<protocol::UdpChannelType, std::unique_ptr<Channel>> channels_;
+    // Hole punching, on the relay thread
+    void punch(std::shared_ptr<Channel> channel);
+    bool handle_probe(Channel &channel, const char *data, std::size_t len, const boost::asio::ip::udp::endpoint &sender);
+    void send_probe(Channel &channel, const boost::asio::ip::udp::endpoint &destination, uint8_t kind, uint64_t timestamp);
+    void set_peer(Channel &channel, std::optional<boost::asio::ip::udp::endpoint> peer);
+    void report_path(Channel &channel);
+
+    // Traffic rates, on the relay thread
+    void sample_rates(std::shared_ptr<Channel> channel);
+
+    std::shared_ptr<boost::asio::io_context> io_context_;
+    std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_guard_;
+    std::thread relay_thread_;
+    std::map<ChannelKey, std::shared_ptr<Channel>> channels_;
     mutable std::mutex mutex_;
     std::atomic<bool> running_{false};
 
+    // Only used by the relay thread
+    std::vector<char> buffer_;
+
+    // Separate from mutex_, which shutdown() holds while joining the relay thread
+    PathHandler path_handler_;
+    std::mutex path_handler_mutex_;
+
     std::string relay_host_;
     uint16_t relay_video_port_ = 0;
     uint16_t relay_audio_port_ = 0;
@@ -122,5 +327,36 @@ namespace udp {
     const protocol::UdpChannelSetupMessage &setup
   );
 
+  /**
+   * @brief Handle UDP candidates callback for starbeam client.
+   * @param candidates The client's candidate addresses
+   */
+  void handle_candidates(const protocol::UdpCandidatesMessage &candidates);
+
+  /**
+   * @brief Set the handler told whenever the path of a channel changes.
+   * @param handler Handler function, or nullptr to stop reporting
+   */
+  void set_path_handler(PathHandler handler);
+
+  /**
+   * @brief Handle session end callback for starbeam client.
+   * @param session_id The session that ended
+   */
+  void close_session(uint64_t session_id);
+
+  /**
+   * @brief Get the traffic counters and rates of all open channels.
+   * @return Counters, empty if no channel manager exists
+   */
+  std::vector<ChannelStats> get_stats();
+
+  /**
+   * @brief Find a direct route to the relay for a stream's client.
+   * @param local_peer The address the stream learned its client at
+   * @return A direct route, or nullopt if the client didn't arrive through Starbeam
+   */
+  std::optional<DirectRoute> find_direct_route(const boost::asio::ip::udp::endpoint &local_peer);
+
 }  // namespace udp
 }  // namespace starbeam
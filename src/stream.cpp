@@ -4,6 +4,7 @@
  */
 
 // standard includes
+#include <atomic>
 #include <fstream>
 #include <future>
 #include <queue>
@@ -21,17 +22,22 @@ extern "C" {
 
 // local includes
 #include "config.h"
+#include "congestion.h"
 #include "display_device.h"
 #include "globals.h"
 #include "input.h"
 #include "logging.h"
 #include "network.h"
+#include "pacing.h"
 #include "platform/common.h"
 #include "process.h"
+#include "starbeam/client.h"
+#include "starbeam/udp.h"
 #include "stream.h"
 #include "sync.h"
 #include "system_tray.h"
 #include "thread_safe.h"
+#include "trace.h"
 #include "utility.h"
 
 #define IDX_START_A 0
@@ -233,6 +239,120 @@ namespace stream {
 
 #pragma pack(pop)
 
+  /**
+   * @brief A buffer that grows to the largest size requested, without zeroing its contents.
+   */
+  template<class T>
+  class scratch_buffer_t {
+  public:
+    /**
+     * @brief Make sure the buffer can hold at least `elements` elements.
+     * @param elements The number of elements needed.
+     * @return `true` if the buffer had to be reallocated.
+     */
+    bool reserve(std::size_t elements) {
+      if (elements <= _capacity) {
+        return false;
+      }
+
+      // Unlike std::make_unique(), this doesn't value-initialize every element
+      _buf = std::make_unique_for_overwrite<T[]>(elements);
+      _capacity = elements;
+
+      return true;
+    }
+
+    T *data() {
+      return _buf.get();
+    }
+
+  private:
+    std::unique_ptr<T[]> _buf;
+    std::size_t _capacity {0};
+  };
+
+  /**
+   * @brief Storage for packetizing the video frames of a session.
+   * @details Buffers grow to the largest FEC block seen and are then reused for every
+   *          following block, so steady-state streaming doesn't allocate per frame.
+   */
+  struct video_arena_t {
+    scratch_buffer_t<char> headers;
+    scratch_buffer_t<char> shards;
+    scratch_buffer_t<uint8_t *> headers_p;
+    scratch_buffer_t<uint8_t *> shards_p;
+    scratch_buffer_t<char> prefixes;
+    scratch_buffer_t<char> ciphertext;
+
+    std::vector<std::string_view> pieces;
+    std::vector<platf::buffer_descriptor_t> payload_buffers;
+    std::vector<platf::buffer_descriptor_t> encrypted_buffers;
+
+    // The number of times any of the buffers had to grow. Only counts the arena's own
+    // allocations, not those made elsewhere while sending a frame.
+    std::size_t growths {0};
+
+    /**
+     * @brief Get storage for `elements` elements from one of the arena's buffers.
+     * @param buffer The buffer to use.
+     * @param elements The number of elements needed.
+     * @return The storage, with indeterminate contents.
+     */
+    template<class T>
+    T *get(scratch_buffer_t<T> &buffer, std::size_t elements) {
+      if (buffer.reserve(elements)) {
+        ++growths;
+      }
+
+      return buffer.data();
+    }
+
+    /**
+     * @brief Empty one of the arena's vectors, making sure it can hold `elements` elements without growing.
+     * @param vec The vector to reset.
+     * @param elements The number of elements needed.
+     */
+    template<class T>
+    void reset(std::vector<T> &vec, std::size_t elements) {
+      vec.clear();
+      if (vec.capacity() < elements) {
+        vec.reserve(elements);
+        ++growths;
+      }
+    }
+  };
+
+  /**
+   * @brief Where the datagrams of a stream are sent from and to.
+   */
+  struct send_target_t {
+    std::uintptr_t native_socket;
+    asio::ip::address address;
+    std::uint16_t port;
+    asio::ip::address source_address;
+  };
+
+  /**
+   * @brief Get where to send the datagrams of a stream.
+   * @details Clients that arrived through Starbeam are sent to straight from the relay channel's socket,
+   *          instead of to the channel on the loopback interface for it to forward to the relay.
+   *          While the channel has a direct path to the client, they are sent to without the relay.
+   * @param sock The stream's socket.
+   * @param peer The address the client pings the stream from.
+   * @param route The Starbeam channel the client is reached through, if any.
+   * @param local_address The address the client connected to.
+   * @return The target.
+   */
+  send_target_t send_target(udp::socket &sock, const udp::endpoint &peer, const std::optional<starbeam::udp::DirectRoute> &route, const asio::ip::address &local_address) {
+    if (route) {
+      // The channel socket is bound to all addresses, so let routing pick the source
+      auto destination = route->destination();
+      return {(std::uintptr_t) route->socket->native_handle(), destination.address(), destination.port(), asio::ip::address_v4::any()};
+    }
+
+    return {(std::uintptr_t) sock.native_handle(), peer.address(), peer.port(), local_address};
+  }
+
   constexpr std::size_t round_to_pkcs7_padded(std::size_t size) {
     return ((size + 15) / 16) * 16;
   }
@@ -362,11 +482,26 @@ namespace stream {
       int lowseq;
       udp::endpoint peer;
 
+      // Set when the client arrived through Starbeam, to send straight to the relay
+      std::optional<starbeam::udp::DirectRoute> starbeam_route;
+
       std::optional<crypto::cipher::gcm_t> cipher;
       std::uint64_t gcm_iv_counter;
 
+      // Additional contexts for the video key, used to encrypt shards on several threads at once
+      std::vector<crypto::cipher::gcm_t> shard_ciphers;
+
       safe::mail_raw_t::event_t<bool> idr_events;
       safe::mail_raw_t::event_t<std::pair<int64_t, int64_t>> invalidate_ref_frames_events;
+      safe::mail_raw_t::event_t<int> bitrate_events;
+
+      // Adapts the bitrate and FEC percentage to the client's losses (empty unless adaptive_bitrate is enabled)
+      std::optional<congestion::controller_t> congestion;
+
+      // Frames routed to this session's own send thread (null when using the shared broadcast thread)
+      std::shared_ptr<safe::ring_queue_t<video::packet_t>> send_queue;
+
+      video_arena_t arena;
 
       std::unique_ptr<platf::deinit_t> qos;
     } video;
@@ -380,11 +515,16 @@ namespace stream {
       std::uint32_t avRiKeyId;
       std::uint32_t timestamp;
       udp::endpoint peer;
+      std::optional<starbeam::udp::DirectRoute> starbeam_route;
 
       util::buffer_t<char> shards;
       util::buffer_t<uint8_t *> shards_p;
 
-      audio_fec_packet_t fec_packet;
+      // Headers of the datagrams waiting to be sent with those of other sessions
+      audio_packet_t packet;
+      std::array<audio_fec_packet_t, RTPA_FEC_SHARDS> fec_packets;
+      send_target_t target;
+
       std::unique_ptr<platf::deinit_t> qos;
     } audio;
 
@@ -402,6 +542,9 @@ namespace stream {
 
       platf::feedback_queue_t feedback_queue;
       safe::mail_raw_t::event_t<video::hdr_info_t> hdr_queue;
+
+      // Reused to decrypt each incoming message without allocating
+      std::vector<std::uint8_t> plaintext;
     } control;
 
     std::uint32_t launch_session_id;
@@ -607,30 +750,281 @@ namespace stream {
     }
   }
 
+  /**
+   * @brief Replaces the first occurrence of a byte sequence in a payload made of several pieces.
+   * @details The piece containing the match is split around it, so neither the payload nor
+   *          the replacement are copied. Matches spanning two pieces are not replaced.
+   * @param pieces The pieces of the payload, in order.
+   * @param old The bytes to replace.
+   * @param _new The replacement bytes, which must outlive the pieces.
+   */
+  void replace(std::vector<std::string_view> &pieces, const std::string_view &old, const std::string_view &_new) {
+    for (auto it = std::begin(pieces); it != std::end(pieces); ++it) {
+      auto pos = it->find(old);
+      if (pos == std::string_view::npos) {
+        continue;
+      }
+
+      auto before = it->substr(0, pos);
+      auto after = it->substr(pos + old.size());
+
+      it = pieces.erase(it);
+      if (!after.empty()) {
+        it = pieces.insert(it, after);
+      }
+      if (!_new.empty()) {
+        it = pieces.insert(it, _new);
+      }
+      if (!before.empty()) {
+        pieces.insert(it, before);
+      }
+
+      return;
+    }
+  }
+
+  /**
+   * @brief Returns a pointer to a slice of a payload made of several pieces, if the slice is contiguous.
+   * @param pieces The pieces of the payload, in order.
+   * @param offset The offset of the slice in the payload.
+   * @param size The size of the slice.
+   * @return A pointer to the slice, or `nullptr` if it spans pieces or runs past the end of the payload.
+   */
+  const char *slice_in_place(const std::vector<std::string_view> &pieces, size_t offset, size_t size) {
+    for (auto &piece : pieces) {
+      if (offset < piece.size()) {
+        return offset + size <= piece.size() ? piece.data() + offset : nullptr;
+      }
+
+      offset -= piece.size();
+    }
+
+    return nullptr;
+  }
+
+  /**
+   * @brief Copies a slice of a payload made of several pieces, zero-padding past the end of the payload.
+   * @param pieces The pieces of the payload, in order.
+   * @param offset The offset of the slice in the payload.
+   * @param size The size of the slice.
+   * @param dest The buffer to copy the slice into.
+   */
+  void copy_slice(const std::vector<std::string_view> &pieces, size_t offset, size_t size, char *dest) {
+    for (auto &piece : pieces) {
+      if (size == 0) {
+        break;
+      }
+
+      if (offset >= piece.size()) {
+        offset -= piece.size();
+        continue;
+      }
+
+      auto copy_len = std::min(size, piece.size() - offset);
+      std::memcpy(dest, piece.data() + offset, copy_len);
+
+      dest += copy_len;
+      size -= copy_len;
+      offset = 0;
+    }
+
+    // Zero any additional space after the end of the payload
+    std::memset(dest, 0, size);
+  }
+
   namespace fec {
     using rs_t = util::safe_ptr<reed_solomon, [](reed_solomon *rs) {
       reed_solomon_release(rs);
     }>;
 
+    /**
+     * @brief A bounded cache of Reed-Solomon encoder contexts keyed by shard geometry.
+     * @details Building a context computes the full parity matrix (including a matrix
+     *          inversion), so we keep contexts around instead of rebuilding them for
+     *          every FEC block. Contexts are only read during encoding, so a single
+     *          context may be shared by several threads at once.
+     */
+    class rs_cache_t {
+    public:
+      using rs_ptr = std::shared_ptr<reed_solomon>;
+
+      explicit rs_cache_t(std::size_t capacity):
+          _capacity {capacity} {
+      }
+
+      /**
+       * @brief Get an encoder context for the given geometry, building it on a miss.
+       * @param data_shards The number of data shards.
+       * @param parity_shards The number of parity shards.
+       * @param hit Set to `true` if the context was found in the cache.
+       * @return The encoder context.
+       */
+      rs_ptr get(int data_shards, int parity_shards, bool &hit) {
+        auto key = std::make_pair(data_shards, parity_shards);
+
+        {
+          std::lock_guard lg {_lock};
+
+          auto it = _contexts.find(key);
+          if (it != std::end(_contexts)) {
+            it->second.last_used = ++_use_counter;
+            ++_hits;
+
+            hit = true;
+            return it->second.rs;
+          }
+        }
+
+        hit = false;
+
+        // Build the context outside of the lock to avoid stalling other encoders
+        auto rs = build(data_shards, parity_shards);
+
+        std::lock_guard lg {_lock};
+        ++_misses;
+
+        auto [it, inserted] = _contexts.try_emplace(key, rs, ++_use_counter);
+        if (inserted && _contexts.size() > _capacity) {
+          evict();
+        }
+
+        return it->second.rs;
+      }
+
+      /**
+       * @brief Populate the cache with every geometry a frame of up to `max_data_shards` can produce.
+       * @param fecpercentage The FEC percentage in use.
+       * @param minparityshards The minimum number of parity shards required by the client.
+       * @param max_data_shards The largest number of data shards in a single FEC block.
+       */
+      void prewarm(size_t fecpercentage, size_t minparityshards, size_t max_data_shards) {
+        if (fecpercentage == 0) {
+          return;
+        }
+
+        for (size_t data_shards = 1; data_shards <= max_data_shards; ++data_shards) {
+          auto parity_shards = std::max((data_shards * fecpercentage + 99) / 100, minparityshards);
+          if (data_shards + parity_shards > DATA_SHARDS_MAX) {
+            break;
+          }
+
+          {
+            std::lock_guard lg {_lock};
+            if (_contexts.size() >= _capacity) {
+              break;
+            }
+
+            if (_contexts.contains(std::make_pair((int) data_shards, (int) parity_shards))) {
+              continue;
+            }
+          }
+
+          auto rs = build(data_shards, parity_shards);
+
+          std::lock_guard lg {_lock};
+          _contexts.try_emplace(std::make_pair((int) data_shards, (int) parity_shards), std::move(rs), 0);
+        }
+      }
+
+      /**
+       * @brief Get the average time spent building a context, which is the time saved by each cache hit.
+       * @return The average build time in milliseconds.
+       */
+      double average_build_time_ms() {
+        std::lock_guard lg {_lock};
+        return _builds ? _build_time_ms / _builds : 0.0;
+      }
+
+      std::size_t hits() {
+        std::lock_guard lg {_lock};
+        return _hits;
+      }
+
+      std::size_t misses() {
+        std::lock_guard lg {_lock};
+        return _misses;
+      }
+
+    private:
+      struct entry_t {
+        rs_ptr rs;
+        std::uint64_t last_used;
+      };
+
+      rs_ptr build(int data_shards, int parity_shards) {
+        auto start = std::chrono::steady_clock::now();
+        rs_ptr rs {reed_solomon_new(data_shards, parity_shards), [](reed_solomon *rs) {
+                     reed_solomon_release(rs);
+                   }};
+        std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - start;
+
+        std::lock_guard lg {_lock};
+        _build_time_ms += build_time.count();
+        ++_builds;
+
+        return rs;
+      }
+
+      // Caller must hold _lock
+      void evict() {
+        auto lru = std::min_element(std::begin(_contexts), std::end(_contexts), [](const auto &a, const auto &b) {
+          return a.second.last_used < b.second.last_used;
+        });
+
+        _contexts.erase(lru);
+      }
+
+      std::size_t _capacity;
+
+      std::mutex _lock;
+      std::map<std::pair<int, int>, entry_t> _contexts;
+      std::uint64_t _use_counter {0};
+
+      std::size_t _hits {0};
+      std::size_t _misses {0};
+      std::size_t _builds {0};
+      double _build_time_ms {0};
+    };
+
+    // Enough room for every data shard count of a few different FEC geometries
+    static rs_cache_t rs_cache {1024};
+
     struct fec_t {
       size_t data_shards;
       size_t nr_shards;
       size_t percentage;
 
+      size_t headersize;
       size_t blocksize;
       size_t prefixsize;
-      util::buffer_t<char> shards;
-      util::buffer_t<char> headers;
-      util::buffer_t<uint8_t *> shards_p;
 
-      std::vector<platf::buffer_descriptor_t> payload_buffers;
+      // The packet header of each shard, kept apart from the shard payloads
+      char *headers;
+      uint8_t **shards_p;
+
+      // If encryption is enabled, the encryption prefix and encrypted header+payload of each shard
+      char *prefixes;
+      char *ciphertext;
+
+      std::vector<platf::buffer_descriptor_t> &payload_buffers;
+
+      // Whether the encoder context came from the context cache
+      bool rs_cache_hit;
+
+      char *header(size_t el) {
+        return &headers[el * headersize];
+      }
 
       char *data(size_t el) {
         return (char *) shards_p[el];
       }
 
       char *prefix(size_t el) {
-        return prefixsize ? &headers[el * prefixsize] : nullptr;
+        return prefixsize ? &prefixes[el * prefixsize] : nullptr;
+      }
+
+      char *encrypted(size_t el) {
+        return &ciphertext[el * (headersize + blocksize)];
       }
 
       size_t size() const {
@@ -638,13 +1032,27 @@ namespace stream {
       }
     };
 
-    static fec_t encode(const std::string_view &payload, size_t blocksize, size_t fecpercentage, size_t minparityshards, size_t prefixsize) {
-      auto payload_size = payload.size();
-
-      auto pad = payload_size % blocksize != 0;
-
-      auto aligned_data_shards = payload_size / blocksize;
-      auto data_shards = aligned_data_shards + (pad ? 1 : 0);
+    /**
+     * @brief Generate the shards of a single FEC block without copying the frame.
+     * @details Data shards point straight into the pieces of the frame wherever a shard
+     *          lies within a single piece. Only the shards spanning pieces (or running past
+     *          the end of the frame) are copied. Since Reed-Solomon works bytewise, the
+     *          parity of the headers and the parity of the payloads are computed separately
+     *          with the same encoder, which gives the same result as encoding whole packets.
+     * @param arena The storage for the shards, which remains in use until the next call.
+     * @param pieces The frame, split into pieces that need not be contiguous in memory.
+     * @param first_shard The index of the first shard of this block within the frame.
+     * @param data_shards The number of data shards in this block.
+     * @param headersize The size of the header sent in front of each shard.
+     * @param blocksize The size of the payload of each shard.
+     * @param fecpercentage The FEC percentage to use.
+     * @param minparityshards The minimum number of parity shards required by the client.
+     * @param prefixsize The size of the encryption prefix, or 0 if encryption is disabled.
+     * @param init_header Called with the index and zeroed header of each data shard before parity is computed.
+     * @return The shards.
+     */
+    template<class F>
+    static fec_t encode(video_arena_t &arena, const std::vector<std::string_view> &pieces, size_t first_shard, size_t data_shards, size_t headersize, size_t blocksize, size_t fecpercentage, size_t minparityshards, size_t prefixsize, F &&init_header) {
       auto parity_shards = (data_shards * fecpercentage + 99) / 100;
 
       // increase the FEC percentage for this frame if the parity shard minimum is not met
@@ -657,128 +1065,83 @@ namespace stream {
 
       auto nr_shards = data_shards + parity_shards;
 
-      // If we need to store a zero-padded data shard, allocate that first to
-      // to keep the shards in order and reduce buffer fragmentation
-      auto parity_shard_offset = pad ? 1 : 0;
-      util::buffer_t<char> shards {(parity_shard_offset + parity_shards) * blocksize};
-      util::buffer_t<uint8_t *> shards_p {nr_shards};
-      std::vector<platf::buffer_descriptor_t> payload_buffers;
-      payload_buffers.reserve(2);
-
-      // Point into the payload buffer for all except the final padded data shard
-      auto next = std::begin(payload);
-      for (auto x = 0; x < aligned_data_shards; ++x) {
-        shards_p[x] = (uint8_t *) next;
-        next += blocksize;
-      }
-      payload_buffers.emplace_back(std::begin(payload), aligned_data_shards * blocksize);
-
-      // If the last data shard needs to be zero-padded, we must use the shards buffer
-      if (pad) {
-        shards_p[aligned_data_shards] = (uint8_t *) &shards[0];
-
-        // GCC doesn't figure out that std::copy_n() can be replaced with memcpy() here
-        // and ends up compiling a horribly slow element-by-element copy loop, so we
-        // help it by using memcpy()/memset() directly.
-        auto copy_len = std::min<size_t>(blocksize, std::end(payload) - next);
-        std::memcpy(shards_p[aligned_data_shards], next, copy_len);
-        if (copy_len < blocksize) {
-          // Zero any additional space after the end of the payload
-          std::memset(shards_p[aligned_data_shards] + copy_len, 0, blocksize - copy_len);
+      // The arena doesn't zero its buffers, but unused header fields must be zero
+      auto headers = arena.get(arena.headers, nr_shards * headersize);
+      std::memset(headers, 0, data_shards * headersize);
+      for (size_t x = 0; x < data_shards; ++x) {
+        init_header(x, &headers[x * headersize]);
+      }
+
+      // Point into the frame for every data shard that is contiguous there
+      auto shards_p = arena.get(arena.shards_p, nr_shards);
+      size_t copied_shards = 0;
+      for (size_t x = 0; x < data_shards; ++x) {
+        shards_p[x] = (uint8_t *) slice_in_place(pieces, (first_shard + x) * blocksize, blocksize);
+        if (!shards_p[x]) {
+          ++copied_shards;
         }
       }
 
-      // Add a payload buffer describing the shard buffer
-      payload_buffers.emplace_back(std::begin(shards), shards.size());
+      // The remaining data shards and the parity shards live in the arena, in order
+      auto next = arena.get(arena.shards, (copied_shards + parity_shards) * blocksize);
+      for (size_t x = 0; x < data_shards; ++x) {
+        if (!shards_p[x]) {
+          copy_slice(pieces, (first_shard + x) * blocksize, blocksize, next);
 
-      if (fecpercentage != 0) {
-        // Point into our allocated buffer for the parity shards
-        for (auto x = 0; x < parity_shards; ++x) {
-          shards_p[data_shards + x] = (uint8_t *) &shards[(parity_shard_offset + x) * blocksize];
+          shards_p[x] = (uint8_t *) next;
+          next += blocksize;
+        }
+      }
+
+      bool rs_cache_hit = false;
+      if (parity_shards != 0) {
+        auto headers_p = arena.get(arena.headers_p, nr_shards);
+        for (size_t x = 0; x < nr_shards; ++x) {
+          headers_p[x] = (uint8_t *) &headers[x * headersize];
+        }
+
+        // Point into the arena for the parity shards
+        for (size_t x = 0; x < parity_shards; ++x) {
+          shards_p[data_shards + x] = (uint8_t *) next;
+          next += blocksize;
         }
 
         // packets = parity_shards + data_shards
-        rs_t rs {reed_solomon_new(data_shards, parity_shards)};
+        auto rs = rs_cache.get(data_shards, parity_shards, rs_cache_hit);
+
+        reed_solomon_encode(rs.get(), headers_p, nr_shards, headersize);
+        reed_solomon_encode(rs.get(), shards_p, nr_shards, blocksize);
+      }
 
-        reed_solomon_encode(rs.get(), shards_p.begin(), nr_shards, blocksize);
+      // Describe the shard payloads, merging shards that are adjacent in memory
+      auto &payload_buffers = arena.payload_buffers;
+      arena.reset(payload_buffers, nr_shards);
+      for (size_t x = 0; x < nr_shards; ++x) {
+        auto data = (const char *) shards_p[x];
+        if (!payload_buffers.empty() && payload_buffers.back().buffer + payload_buffers.back().size == data) {
+          payload_buffers.back().size += blocksize;
+        } else {
+          payload_buffers.emplace_back(data, blocksize);
+        }
       }
 
       return {
         data_shards,
         nr_shards,
         fecpercentage,
+        headersize,
         blocksize,
         prefixsize,
-        std::move(shards),
-        util::buffer_t<char> {nr_shards * prefixsize},
-        std::move(shards_p),
-        std::move(payload_buffers),
+        headers,
+        shards_p,
+        prefixsize ? arena.get(arena.prefixes, nr_shards * prefixsize) : nullptr,
+        prefixsize ? arena.get(arena.ciphertext, nr_shards * (headersize + blocksize)) : nullptr,
+        payload_buffers,
+        rs_cache_hit,
       };
     }
   }  // namespace fec
 
-  /**
-   * @brief Combines two buffers and inserts new buffers at each slice boundary of the result.
-   * @param insert_size The number of bytes to insert.
-   * @param slice_size The number of bytes between insertions.
-   * @param data1 The first data buffer.
-   * @param data2 The second data buffer.
-   */
-  std::vector<uint8_t> concat_and_insert(uint64_t insert_size, uint64_t slice_size, const std::string_view &data1, const std::string_view &data2) {
-    auto data_size = data1.size() + data2.size();
-    auto pad = data_size % slice_size != 0;
-    auto elements = data_size / slice_size + (pad ? 1 : 0);
-
-    std::vector<uint8_t> result;
-    result.resize(elements * insert_size + data_size);
-
-    auto next = std::begin(data1);
-    auto end = std::end(data1);
-    for (auto x = 0; x < elements; ++x) {
-      void *p = &result[x * (insert_size + slice_size)];
-
-      // For the last iteration, only copy to the end of the data
-      if (x == elements - 1) {
-        slice_size = data_size - (x * slice_size);
-      }
-
-      // Test if this slice will extend into the next buffer
-      if (next + slice_size > end) {
-        // Copy the first portion from the first buffer
-        auto copy_len = end - next;
-        std::copy(next, end, (char *) p + insert_size);
-
-        // Copy the remaining portion from the second buffer
-        next = std::begin(data2);
-        end = std::end(data2);
-        std::copy(next, next + (slice_size - copy_len), (char *) p + copy_len + insert_size);
-        next += slice_size - copy_len;
-      } else {
-        std::copy(next, next + slice_size, (char *) p + insert_size);
-        next += slice_size;
-      }
-    }
-
-    return result;
-  }
-
-  std::vector<uint8_t> replace(const std::string_view &original, const std::string_view &old, const std::string_view &_new) {
-    std::vector<uint8_t> replaced;
-    replaced.reserve(original.size() + _new.size() - old.size());
-
-    auto begin = std::begin(original);
-    auto end = std::end(original);
-    auto next = std::search(begin, end, std::begin(old), std::end(old));
-
-    std::copy(begin, next, std::back_inserter(replaced));
-    if (next != end) {
-      std::copy(std::begin(_new), std::end(_new), std::back_inserter(replaced));
-      std::copy(next + old.size(), end, std::back_inserter(replaced));
-    }
-
-    return replaced;
-  }
-
   /**
    * @brief Pass gamepad feedback data back to the client.
    * @param session The session object.
@@ -939,6 +1302,10 @@ namespace stream {
 
       auto lastGoodFrame = stats[3];
 
+      if (session->video.congestion) {
+        session->video.congestion->loss_report(count);
+      }
+
       BOOST_LOG(verbose)
         << "type [IDX_LOSS_STATS]"sv << std::endl
         << "---begin stats---" << std::endl
@@ -951,6 +1318,8 @@ namespace stream {
     server->map(packetTypes[IDX_REQUEST_IDR_FRAME], [&](session_t *session, const std::string_view &payload) {
       BOOST_LOG(debug) << "type [IDX_REQUEST_IDR_FRAME]"sv;
 
+      // Not counted as loss, clients also request IDR frames at startup and when their decoder resets
+
       session->video.idr_events->raise(true);
     });
 
@@ -964,6 +1333,10 @@ namespace stream {
         << "firstFrame [" << firstFrame << ']' << std::endl
         << "lastFrame [" << lastFrame << ']';
 
+      if (session->video.congestion) {
+        session->video.congestion->frame_lost();
+      }
+
       session->video.invalidate_ref_frames_events->raise(std::make_pair(firstFrame, lastFrame));
     });
 
@@ -973,7 +1346,7 @@ namespace stream {
       auto tagged_cipher_length = util::endian::big(*(int32_t *) payload.data());
       std::string_view tagged_cipher {payload.data() + sizeof(tagged_cipher_length), (size_t) tagged_cipher_length};
 
-      std::vector<uint8_t> plaintext;
+      auto &plaintext = session->control.plaintext;
 
       auto &cipher = session->control.cipher;
       auto &iv = session->control.legacy_input_enc_iv;
@@ -990,7 +1363,7 @@ namespace stream {
         std::copy(payload.end() - 16, payload.end(), std::begin(iv));
       }
 
-      input::passthrough(session->input, std::move(plaintext));
+      input::passthrough(session->input, std::string_view {(char *) plaintext.data(), plaintext.size()});
     });
 
     server->map(packetTypes[IDX_ENCRYPTED], [server](session_t *session, const std::string_view &payload) {
@@ -1031,7 +1404,7 @@ namespace stream {
         iv[0] = (std::uint8_t) seq;
       }
 
-      std::vector<uint8_t> plaintext;
+      auto &plaintext = session->control.plaintext;
       if (cipher.decrypt(tagged_cipher, plaintext, &iv)) {
         // something went wrong :(
 
@@ -1052,15 +1425,14 @@ namespace stream {
 
       // IDX_INPUT_DATA callback will attempt to decrypt unencrypted data, therefore we need pass it directly
       if (type == packetTypes[IDX_INPUT_DATA]) {
-        plaintext.erase(std::begin(plaintext), std::begin(plaintext) + 4);
-        input::passthrough(session->input, std::move(plaintext));
+        input::passthrough(session->input, next_payload);
       } else {
         server->call(type, session, next_payload, true);
       }
     });
 
     // This thread handles latency-sensitive control messages
-    platf::adjust_thread_priority(platf::thread_priority_e::critical);
+    platf::adjust_thread_priority(platf::thread_priority_e::critical, platf::thread_role_e::input);
 
     // Check for both the full shutdown event and the shutdown event for this
     // broadcast to ensure we can inform connected clients of our graceful
@@ -1124,6 +1496,13 @@ namespace stream {
 
               send_hdr_mode(session, std::move(hdr_info));
             }
+
+            if (session->video.congestion) {
+              if (auto bitrate = session->video.congestion->update(now)) {
+                BOOST_LOG(debug) << "Adapting bitrate to "sv << *bitrate << " kbps, FEC to "sv << session->video.congestion->fec_percentage() << '%';
+                session->video.bitrate_events->raise(*bitrate);
+              }
+            }
           }
 
           ++pos;
@@ -1265,63 +1644,231 @@ namespace stream {
     }
   }
 
-  void videoBroadcastThread(udp::socket &sock) {
-    auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
-    auto packets = mail::man->queue<video::packet_t>(mail::video_packets);
-    auto video_epoch = std::chrono::steady_clock::now();
+  /**
+   * @brief Encrypts the shards of video FEC blocks, spreading large blocks across worker threads.
+   * @details Each shard is encrypted with its own IV, derived from the session's IV counter and
+   *          the shard index, so the IVs don't depend on which thread encrypts which shard.
+   */
+  class shard_encryptor_t {
+  public:
+    /**
+     * @param workers The number of worker threads to use in addition to the calling thread.
+     */
+    explicit shard_encryptor_t(int workers):
+        ivs(workers + 1, crypto::aes_t(12)) {
+      for (int x = 0; x < workers; ++x) {
+        threads.emplace_back(&shard_encryptor_t::worker_thread, this, (std::size_t) x + 1);
+      }
+    }
 
-    // Video traffic is sent on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::high);
+    ~shard_encryptor_t() {
+      {
+        std::lock_guard lg {lock};
+        stopping = true;
+      }
+      start_cv.notify_all();
 
-    logging::min_max_avg_periodic_logger<double> frame_processing_latency_logger(debug, "Frame processing latency", "ms");
+      for (auto &thread : threads) {
+        thread.join();
+      }
+    }
 
-    logging::time_delta_periodic_logger frame_send_batch_latency_logger(debug, "Network: each send_batch() latency");
-    logging::time_delta_periodic_logger frame_fec_latency_logger(debug, "Network: each FEC block latency");
-    logging::time_delta_periodic_logger frame_network_latency_logger(debug, "Network: frame's overall network latency");
+    /**
+     * @brief Encrypt every shard of an FEC block and advance the session's IV counter past them.
+     * @param session The session the FEC block is sent to.
+     * @param shards The FEC block.
+     * @param frame_index The index of the frame the FEC block belongs to.
+     */
+    void encrypt(session_t *session, fec::fec_t &shards, std::uint32_t frame_index) {
+      // Small blocks aren't worth waking up the workers for
+      constexpr size_t MIN_SHARDS_PER_WORKER = 16;
+      auto active = std::clamp<size_t>(shards.size() / MIN_SHARDS_PER_WORKER, 1, threads.size() + 1);
+
+      // The cipher context isn't thread-safe, so each worker needs its own for this session's key
+      auto &ciphers = session->video.shard_ciphers;
+      while (ciphers.size() < active - 1) {
+        ciphers.emplace_back(session->video.cipher->key, false);
+      }
 
-    crypto::aes_t iv(12);
+      job_t job {session, &shards, frame_index, session->video.gcm_iv_counter, active};
+      session->video.gcm_iv_counter += shards.size();
 
-    auto timer = platf::create_high_precision_timer();
-    if (!timer || !*timer) {
-      BOOST_LOG(error) << "Failed to create timer, aborting video broadcast thread";
-      return;
+      if (active > 1) {
+        {
+          std::lock_guard lg {lock};
+          current_job = job;
+          pending = active - 1;
+          ++generation;
+        }
+        start_cv.notify_all();
+      }
+
+      encrypt_range(job, 0);
+
+      if (active > 1) {
+        std::unique_lock ul {lock};
+        done_cv.wait(ul, [this]() {
+          return pending == 0;
+        });
+      }
     }
 
-    auto ratecontrol_next_frame_start = std::chrono::steady_clock::now();
+  private:
+    struct job_t {
+      session_t *session;
+      fec::fec_t *shards;
+      std::uint32_t frame_index;
+      std::uint64_t iv_base;
+      size_t active;
+    };
 
-    while (auto packet = packets->pop()) {
-      if (shutdown_event->peek()) {
-        break;
+    void worker_thread(std::size_t worker) {
+      platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::video_send);
+
+      std::uint64_t last_generation = 0;
+      while (true) {
+        job_t job;
+        {
+          std::unique_lock ul {lock};
+          start_cv.wait(ul, [&]() {
+            return stopping || generation != last_generation;
+          });
+
+          if (stopping) {
+            return;
+          }
+
+          last_generation = generation;
+          job = current_job;
+        }
+
+        if (worker < job.active) {
+          encrypt_range(job, worker);
+
+          std::lock_guard lg {lock};
+          if (--pending == 0) {
+            done_cv.notify_one();
+          }
+        }
       }
+    }
+
+    void encrypt_range(const job_t &job, std::size_t worker) {
+      auto &shards = *job.shards;
+      auto &cipher = worker == 0 ? *job.session->video.cipher : job.session->video.shard_ciphers[worker - 1];
+      auto &iv = ivs[worker];
 
+      auto begin = shards.size() * worker / job.active;
+      auto end = shards.size() * (worker + 1) / job.active;
+      for (auto x = begin; x < end; ++x) {
+        // We use the deterministic IV construction algorithm specified in NIST SP 800-38D
+        // Section 8.2.1. The sequence number is our "invocation" field and the 'V' in the
+        // high bytes is the "fixed" field. Because each client provides their own unique
+        // key, our values in the fixed field need only uniquely identify each independent
+        // use of the client's key with AES-GCM in our code.
+        //
+        // The IV counter is 64 bits long which allows for 2^64 encrypted video packets
+        // to be sent to each client before the IV repeats.
+        auto iv_counter = job.iv_base + x;
+        std::copy_n((uint8_t *) &iv_counter, sizeof(iv_counter), std::begin(iv));
+        iv[11] = 'V';  // Video stream
+
+        // Encrypt the header and payload into the ciphertext buffer
+        auto *prefix = (video_packet_enc_prefix_t *) shards.prefix(x);
+        prefix->frameNumber = job.frame_index;
+        std::copy(std::begin(iv), std::end(iv), prefix->iv);
+        cipher.encrypt(
+          std::string_view {shards.header(x), shards.headersize},
+          std::string_view {shards.data(x), shards.blocksize},
+          prefix->tag,
+          (uint8_t *) shards.encrypted(x),
+          &iv
+        );
+      }
+    }
+
+    // One IV buffer per worker, with the calling thread as worker 0
+    std::vector<crypto::aes_t> ivs;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    std::uint64_t generation {0};
+    size_t pending {0};
+    bool stopping {false};
+    job_t current_job {};
+  };
+
+  // Sessions sending video on a thread of their own, which are paced in parallel
+  static std::atomic<int> video_send_threads;
+
+  /**
+   * @brief Packetizes, protects and paces video frames for transmission.
+   * @details Each sender owns its own pacing state, so frames sent through
+   *          different senders never wait on each other's pacing delays.
+   */
+  class video_sender_t {
+  public:
+    explicit video_sender_t(udp::socket &sock):
+        sock {sock},
+        video_epoch {std::chrono::steady_clock::now()},
+        timer {platf::create_high_precision_timer()},
+        next_timer_log {video_epoch + 20s} {
+    }
+
+    /**
+     * @brief Check if the sender was created successfully.
+     * @return `true` if the sender can be used.
+     */
+    explicit operator bool() const {
+      return timer && *timer;
+    }
+
+    /**
+     * @brief Packetize and send a single encoded frame to the session it belongs to.
+     * @param packet The encoded frame.
+     */
+    void send(video::packet_t &packet) {
       frame_network_latency_logger.first_point_now();
+      trace::span_t send_frame {trace::span_e::send_frame, packet->frame_index()};
 
       auto session = (session_t *) packet->channel_data;
       auto lowseq = session->video.lowseq;
 
-      std::string_view payload {(char *) packet->data(), packet->data_size()};
-      std::vector<uint8_t> payload_with_replacements;
+      // Buffers used to packetize this frame are borrowed from the session's arena
+      auto &arena = session->video.arena;
+      auto arena_growths = arena.growths;
+
+      // The frame is described as a list of pieces referencing the encoded frame,
+      // the replacement buffers and the frame header, so none of them are copied.
+      // Each replacement can split a piece in three, and the frame header is added last.
+      auto &pieces = arena.pieces;
+      arena.reset(pieces, 2 + (packet->replacements ? 2 * packet->replacements->size() : 0));
+      pieces.emplace_back((char *) packet->data(), packet->data_size());
 
       // Apply replacements on the packet payload before performing any other operations.
       // We need to know the final frame size to calculate the last packet size, and we
       // must avoid matching replacements against the frame header or any other non-video
       // part of the payload.
       if (packet->is_idr() && packet->replacements) {
+        trace::span_t replacement_span {trace::span_e::replacement, packet->frame_index()};
         for (auto &replacement : *packet->replacements) {
-          auto frame_old = replacement.old;
-          auto frame_new = replacement._new;
-
-          payload_with_replacements = replace(payload, frame_old, frame_new);
-          payload = {(char *) payload_with_replacements.data(), payload_with_replacements.size()};
+          replace(pieces, replacement.old, replacement._new);
         }
       }
 
+      size_t payload_size = 0;
+      for (auto &piece : pieces) {
+        payload_size += piece.size();
+      }
+
       video_short_frame_header_t frame_header = {};
       frame_header.headerType = 0x01;  // Short header type
       frame_header.frameType = packet->is_idr()                     ? 2 :
                                packet->after_ref_frame_invalidation ? 5 :
                                                                       1;
-      frame_header.lastPayloadLen = (payload.size() + sizeof(frame_header)) % (session->config.packetsize - sizeof(NV_VIDEO_PACKET));
+      frame_header.lastPayloadLen = (payload_size + sizeof(frame_header)) % (session->config.packetsize - sizeof(NV_VIDEO_PACKET));
       if (frame_header.lastPayloadLen == 0) {
         frame_header.lastPayloadLen = session->config.packetsize - sizeof(NV_VIDEO_PACKET);
       }
@@ -1339,14 +1886,18 @@ namespace stream {
         frame_header.frame_processing_latency = 0;
       }
 
-      auto fecPercentage = config::stream.fec_percentage;
+      auto fecPercentage = session->video.congestion ? session->video.congestion->fec_percentage() : config::stream.fec_percentage;
 
-      // Insert space for packet headers
+      // Each shard is a packet header followed by a slice of the frame
       auto blocksize = session->config.packetsize + MAX_RTP_HEADER_SIZE;
       auto payload_blocksize = blocksize - sizeof(video_packet_raw_t);
-      auto payload_new = concat_and_insert(sizeof(video_packet_raw_t), payload_blocksize, std::string_view {(char *) &frame_header, sizeof(frame_header)}, payload);
+      pieces.emplace(std::begin(pieces), (char *) &frame_header, sizeof(frame_header));
+
+      auto data_size = payload_size + sizeof(frame_header);
+      auto total_shards = (data_size + (payload_blocksize - 1)) / payload_blocksize;
 
-      payload = std::string_view {(char *) payload_new.data(), payload_new.size()};
+      // The size of the frame once a packet header has been inserted in front of each slice
+      auto framed_size = data_size + total_shards * sizeof(video_packet_raw_t);
 
       // There are 2 bits for FEC block count for a maximum of 4 FEC blocks
       constexpr auto MAX_FEC_BLOCKS = 4;
@@ -1362,7 +1913,7 @@ namespace stream {
 
       // Compute the number of FEC blocks needed for this frame using the block size and max shards
       auto max_data_per_fec_block = max_data_shards_per_fec_block * blocksize;
-      auto fec_blocks_needed = (payload.size() + (max_data_per_fec_block - 1)) / max_data_per_fec_block;
+      auto fec_blocks_needed = (framed_size + (max_data_per_fec_block - 1)) / max_data_per_fec_block;
 
       // If the number of FEC blocks needed exceeds the protocol limit, turn off FEC for this frame.
       // For normal FEC percentages, this should only happen for enormous frames (over 800 packets at 20%).
@@ -1372,7 +1923,8 @@ namespace stream {
         fec_blocks_needed = MAX_FEC_BLOCKS;
       }
 
-      std::array<std::string_view, MAX_FEC_BLOCKS> fec_blocks;
+      // The first shard and number of data shards of each FEC block
+      std::array<std::pair<size_t, size_t>, MAX_FEC_BLOCKS> fec_blocks;
       decltype(fec_blocks)::iterator
         fec_blocks_begin = std::begin(fec_blocks),
         fec_blocks_end = std::begin(fec_blocks) + fec_blocks_needed;
@@ -1380,29 +1932,30 @@ namespace stream {
       BOOST_LOG(verbose) << "Generating "sv << fec_blocks_needed << " FEC blocks"sv;
 
       // Align individual FEC blocks to blocksize
-      auto unaligned_size = payload.size() / fec_blocks_needed;
-      auto aligned_size = ((unaligned_size + (blocksize - 1)) / blocksize) * blocksize;
+      auto unaligned_size = framed_size / fec_blocks_needed;
+      auto shards_per_block = (unaligned_size + (blocksize - 1)) / blocksize;
 
       // If we exceed the 10-bit FEC packet index (which means our frame exceeded 4096 packets),
       // the frame will be unrecoverable. Log an error for this case.
-      if (aligned_size / blocksize >= 1024) {
-        BOOST_LOG(error) << "Encoder produced a frame too large to send! Is the encoder broken? (needed "sv << (aligned_size / blocksize) << " packets)"sv;
+      if (shards_per_block >= 1024) {
+        BOOST_LOG(error) << "Encoder produced a frame too large to send! Is the encoder broken? (needed "sv << shards_per_block << " packets)"sv;
       }
 
-      // Split the data into aligned FEC blocks
+      // Split the shards into aligned FEC blocks
       for (int x = 0; x < fec_blocks_needed; ++x) {
+        auto first_shard = std::min<size_t>(x * shards_per_block, total_shards);
+
         if (x == fec_blocks_needed - 1) {
-          // The last block must extend to the end of the payload
-          fec_blocks[x] = payload.substr(x * aligned_size);
+          // The last block must extend to the end of the frame
+          fec_blocks[x] = {first_shard, total_shards - first_shard};
         } else {
           // Earlier blocks just extend to the next block offset
-          fec_blocks[x] = payload.substr(x * aligned_size, aligned_size);
+          fec_blocks[x] = {first_shard, std::min(shards_per_block, total_shards - first_shard)};
         }
       }
 
       try {
-        // Use around 80% of 1Gbps          1Gbps            percent    ms     packet      byte
-        size_t ratecontrol_packets_in_1ms = std::giga::num * 80 / 100 / 1000 / blocksize / 8;
+        pacer.set_rate(pacing_rate(session), blocksize);
 
         // Send less than 64K in a single batch.
         // On Windows, batches above 64K seem to bypass SO_SNDBUF regardless of its size,
@@ -1414,18 +1967,18 @@ namespace stream {
         // Generic Segmentation Offload on Linux can't do more than 64.
         send_batch_size = std::min<size_t>(64, send_batch_size);
 
-        // Don't ignore the last ratecontrol group of the previous frame
-        auto ratecontrol_frame_start = std::max(ratecontrol_next_frame_start, std::chrono::steady_clock::now());
-
-        size_t ratecontrol_frame_packets_sent = 0;
-        size_t ratecontrol_group_packets_sent = 0;
+        auto frame_start = std::chrono::steady_clock::now();
+        pacer.begin_frame(frame_start);
 
         auto blockIndex = 0;
-        std::for_each(fec_blocks_begin, fec_blocks_end, [&](std::string_view &current_payload) {
-          auto packets = (current_payload.size() + (blocksize - 1)) / blocksize;
+        std::for_each(fec_blocks_begin, fec_blocks_end, [&](std::pair<size_t, size_t> &current_block) {
+          auto [first_shard, packets] = current_block;
 
-          for (int x = 0; x < packets; ++x) {
-            auto *inspect = (video_packet_raw_t *) &current_payload[x * blocksize];
+          frame_fec_latency_logger.first_point_now();
+          trace::span_t fec_span {trace::span_e::fec, packet->frame_index()};
+          // If video encryption is enabled, we allocate space for the encryption header before each shard
+          auto shards = fec::encode(arena, pieces, first_shard, packets, sizeof(video_packet_raw_t), payload_blocksize, fecPercentage, session->config.minRequiredFecPackets, session->video.cipher ? sizeof(video_packet_enc_prefix_t) : 0, [&](size_t x, char *header) {
+            auto *inspect = (video_packet_raw_t *) header;
 
             inspect->packet.frameIndex = packet->frame_index();
             inspect->packet.streamPacketIndex = ((uint32_t) lowseq + x) << 8;
@@ -1441,25 +1994,37 @@ namespace stream {
             if (x == packets - 1) {
               inspect->packet.flags |= FLAG_EOF;
             }
+          });
+          fec_span.end();
+          frame_fec_latency_logger.second_point_now_and_log();
+
+          if (shards.percentage != 0) {
+            fec_rs_cache_hit_logger.collect_and_log(shards.rs_cache_hit ? 100.0 : 0.0);
+            fec_rs_cache_saved_logger.collect_and_log([&]() {
+              return shards.rs_cache_hit ? fec::rs_cache.average_build_time_ms() : 0.0;
+            });
           }
 
-          frame_fec_latency_logger.first_point_now();
-          // If video encryption is enabled, we allocate space for the encryption header before each shard
-          auto shards = fec::encode(current_payload, blocksize, fecPercentage, session->config.minRequiredFecPackets, session->video.cipher ? sizeof(video_packet_enc_prefix_t) : 0);
-          frame_fec_latency_logger.second_point_now_and_log();
+          // Encrypted shards are sent as the encryption prefix followed by the encrypted packet.
+          // Otherwise, the packet headers are sent in front of the shards in the frame itself.
+          auto &encrypted_buffers = arena.encrypted_buffers;
+          arena.reset(encrypted_buffers, 1);
+          if (session->video.cipher) {
+            encrypted_buffers.emplace_back(shards.ciphertext, shards.size() * (shards.headersize + shards.blocksize));
+          }
 
-          auto peer_address = session->video.peer.address();
+          auto target = send_target(sock, session->video.peer, session->video.starbeam_route, session->localAddress);
           auto batch_info = platf::batched_send_info_t {
-            shards.headers.begin(),
-            shards.prefixsize,
-            shards.payload_buffers,
-            shards.blocksize,
+            session->video.cipher ? shards.prefixes : shards.headers,
+            session->video.cipher ? shards.prefixsize : shards.headersize,
+            session->video.cipher ? encrypted_buffers : shards.payload_buffers,
+            session->video.cipher ? shards.headersize + shards.blocksize : shards.blocksize,
             0,
             0,
-            (uintptr_t) sock.native_handle(),
-            peer_address,
-            session->video.peer.port(),
-            session->localAddress,
+            target.native_socket,
+            target.address,
+            target.port,
+            target.source_address,
           };
 
           size_t next_shard_to_send = 0;
@@ -1468,7 +2033,7 @@ namespace stream {
           // When a timestamp isn't available (duplicate frames), the timestamp from rate control is used instead.
           bool frame_is_dupe = false;
           if (!packet->frame_timestamp) {
-            packet->frame_timestamp = ratecontrol_next_frame_start;
+            packet->frame_timestamp = std::max(pacer.next_frame_start(), video_epoch);
             frame_is_dupe = true;
           }
           using rtp_tick = std::chrono::duration<uint32_t, std::ratio<1, 90000>>;
@@ -1476,7 +2041,7 @@ namespace stream {
 
           // set FEC info now that we know for sure what our percentage will be for this frame
           for (auto x = 0; x < shards.size(); ++x) {
-            auto *inspect = (video_packet_raw_t *) shards.data(x);
+            auto *inspect = (video_packet_raw_t *) shards.header(x);
 
             inspect->packet.fecInfo =
               (x << 12 |
@@ -1489,45 +2054,29 @@ namespace stream {
 
             inspect->packet.multiFecBlocks = (blockIndex << 4) | ((fec_blocks_needed - 1) << 6);
             inspect->packet.frameIndex = packet->frame_index();
+          }
 
-            // Encrypt this shard if video encryption is enabled
-            if (session->video.cipher) {
-              // We use the deterministic IV construction algorithm specified in NIST SP 800-38D
-              // Section 8.2.1. The sequence number is our "invocation" field and the 'V' in the
-              // high bytes is the "fixed" field. Because each client provides their own unique
-              // key, our values in the fixed field need only uniquely identify each independent
-              // use of the client's key with AES-GCM in our code.
-              //
-              // The IV counter is 64 bits long which allows for 2^64 encrypted video packets
-              // to be sent to each client before the IV repeats.
-              std::copy_n((uint8_t *) &session->video.gcm_iv_counter, sizeof(session->video.gcm_iv_counter), std::begin(iv));
-              iv[11] = 'V';  // Video stream
-              session->video.gcm_iv_counter++;
-
-              // Encrypt the target buffer in place
-              auto *prefix = (video_packet_enc_prefix_t *) shards.prefix(x);
-              prefix->frameNumber = packet->frame_index();
-              std::copy(std::begin(iv), std::end(iv), prefix->iv);
-              session->video.cipher->encrypt(std::string_view {(char *) inspect, (size_t) blocksize}, prefix->tag, (uint8_t *) inspect, &iv);
+          // Encrypt the shards if video encryption is enabled
+          if (session->video.cipher) {
+            frame_encryption_latency_logger.first_point_now();
+            trace::span_t encryption_span {trace::span_e::encryption, packet->frame_index()};
+            if (!encryptor) {
+              encryptor.emplace(std::clamp<int>(std::thread::hardware_concurrency() / 4, 0, 3));
             }
+            encryptor->encrypt(session, shards, packet->frame_index());
+            encryption_span.end();
+            frame_encryption_latency_logger.second_point_now_and_log();
+          }
 
+          for (auto x = 0; x < shards.size(); ++x) {
             if (x - next_shard_to_send + 1 >= send_batch_size ||
                 x + 1 == shards.size()) {
               // Do pacing within the frame.
-              // Also trigger pacing before the first send_batch() of the frame
-              // to account for the last send_batch() of the previous frame.
-              if (ratecontrol_group_packets_sent >= ratecontrol_packets_in_1ms ||
-                  ratecontrol_frame_packets_sent == 0) {
-                auto due = ratecontrol_frame_start +
-                           std::chrono::duration_cast<std::chrono::nanoseconds>(1ms) *
-                             ratecontrol_frame_packets_sent / ratecontrol_packets_in_1ms;
-
-                auto now = std::chrono::steady_clock::now();
-                if (now < due) {
-                  timer->sleep_for(due - now);
+              if (auto due = pacer.next_send_time()) {
+                if (std::chrono::steady_clock::now() < *due) {
+                  trace::span_t sleep_span {trace::span_e::pacing_sleep, packet->frame_index()};
+                  timer->sleep_until(*due);
                 }
-
-                ratecontrol_group_packets_sent = 0;
               }
 
               size_t current_batch_size = x - next_shard_to_send + 1;
@@ -1535,40 +2084,41 @@ namespace stream {
               batch_info.block_count = current_batch_size;
 
               frame_send_batch_latency_logger.first_point_now();
+              trace::span_t send_batch_span {trace::span_e::send_batch, packet->frame_index()};
               // Use a batched send if it's supported on this platform
               if (!platf::send_batch(batch_info)) {
                 // Batched send is not available, so send each packet individually
                 BOOST_LOG(verbose) << "Falling back to unbatched send"sv;
                 for (auto y = 0; y < current_batch_size; y++) {
+                  auto shard = next_shard_to_send + y;
                   auto send_info = platf::send_info_t {
-                    shards.prefix(next_shard_to_send + y),
-                    shards.prefixsize,
-                    shards.data(next_shard_to_send + y),
-                    shards.blocksize,
-                    (uintptr_t) sock.native_handle(),
-                    peer_address,
-                    session->video.peer.port(),
-                    session->localAddress,
+                    session->video.cipher ? shards.prefix(shard) : shards.header(shard),
+                    session->video.cipher ? shards.prefixsize : shards.headersize,
+                    session->video.cipher ? shards.encrypted(shard) : shards.data(shard),
+                    session->video.cipher ? shards.headersize + shards.blocksize : shards.blocksize,
+                    target.native_socket,
+                    target.address,
+                    target.port,
+                    target.source_address,
                   };
 
                   platf::send(send_info);
                 }
               }
+              send_batch_span.end();
               frame_send_batch_latency_logger.second_point_now_and_log();
 
-              ratecontrol_group_packets_sent += current_batch_size;
-              ratecontrol_frame_packets_sent += current_batch_size;
+              pacer.packets_sent(current_batch_size);
               next_shard_to_send = x + 1;
             }
           }
 
-          // remember this in case the next frame comes immediately
-          ratecontrol_next_frame_start = ratecontrol_frame_start +
-                                         std::chrono::duration_cast<std::chrono::nanoseconds>(1ms) *
-                                           ratecontrol_frame_packets_sent / ratecontrol_packets_in_1ms;
-
           frame_network_latency_logger.second_point_now_and_log();
 
+          if (session->video.starbeam_route) {
+            session->video.starbeam_route->count(shards.size(), shards.size() * (batch_info.header_size + batch_info.payload_size));
+          }
+
           BOOST_LOG(verbose) << "Sent Frame seq ["sv << packet->frame_index() << "] pts ["sv << timestamp
                              << "] shards ["sv << shards.size() << "/"sv << shards.percentage << "%]"sv
                              << (frame_is_dupe ? " Dupe" : "")
@@ -1580,20 +2130,179 @@ namespace stream {
         });
 
         session->video.lowseq = lowseq;
+
+        if (session->video.congestion) {
+          session->video.congestion->frame_sent(std::chrono::steady_clock::now() - frame_start);
+        }
+
+        frame_arena_growth_logger.collect_and_log(arena.growths - arena_growths);
+        log_timer_wakeups();
       } catch (const std::exception &e) {
         BOOST_LOG(error) << "Broadcast video failed "sv << e.what();
         std::this_thread::sleep_for(100ms);
       }
     }
 
+  private:
+    /**
+     * @brief Periodically log how late the pacing timer woke up, then start over.
+     */
+    void log_timer_wakeups() {
+      auto &histogram = timer->wakeup_histogram();
+
+      auto now = std::chrono::steady_clock::now();
+      if (now < next_timer_log || !histogram.count) {
+        return;
+      }
+      next_timer_log = now + 20s;
+
+      auto us = [](std::chrono::nanoseconds duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+      };
+      BOOST_LOG(debug) << "Network: pacing timer wake-up error over "sv << histogram.count << " sleeps (p50/p99/max): "sv
+                       << us(histogram.percentile(0.5)) << "us/"sv << us(histogram.percentile(0.99)) << "us/"sv << us(histogram.max) << "us"sv;
+
+      histogram = {};
+    }
+
+    /**
+     * @brief Get the rate to pace the video of a session at.
+     * @param session The session.
+     * @return The pacing rate in bits per second.
+     */
+    static std::uint64_t pacing_rate(session_t *session) {
+      // Sessions with their own send thread split the link rate, so together they don't exceed it
+      auto link_rate = (std::uint64_t) config::stream.pacing_link_rate * 1000 * 1000 / std::max(1, video_send_threads.load());
+      if (config::stream.pacing_mode != "bitrate"sv) {
+        return link_rate;
+      }
+
+      // Account for the FEC shards sent along with the encoded video
+      auto bitrate = session->config.monitor.bitrate;
+      auto fec_percentage = config::stream.fec_percentage;
+      if (session->video.congestion) {
+        bitrate = session->video.congestion->bitrate();
+        fec_percentage = session->video.congestion->fec_percentage();
+      } else if (config::video.max_bitrate > 0) {
+        bitrate = std::min(bitrate, config::video.max_bitrate);
+      }
+      auto bitrate_with_fec = (std::uint64_t) bitrate * (100 + fec_percentage) / 100;
+
+      return std::min(link_rate, pacing::rate_from_bitrate(bitrate_with_fec));
+    }
+
+    udp::socket &sock;
+    std::chrono::steady_clock::time_point video_epoch;
+
+    logging::min_max_avg_periodic_logger<double> frame_processing_latency_logger {debug, "Frame processing latency", "ms"};
+
+    logging::time_delta_periodic_logger frame_send_batch_latency_logger {debug, "Network: each send_batch() latency"};
+    logging::time_delta_periodic_logger frame_fec_latency_logger {debug, "Network: each FEC block latency"};
+    logging::time_delta_periodic_logger frame_encryption_latency_logger {debug, "Network: each FEC block encryption latency"};
+    logging::time_delta_periodic_logger frame_network_latency_logger {debug, "Network: frame's overall network latency"};
+
+    logging::min_max_avg_periodic_logger<double> fec_rs_cache_hit_logger {debug, "Network: FEC encoder context cache hit rate", "%"};
+    logging::min_max_avg_periodic_logger<double> fec_rs_cache_saved_logger {debug, "Network: FEC encoder context build time saved per FEC block", "ms"};
+    // Stands in for a count of every allocation made while sending a frame, which would need a hook
+    // into the global allocator. Opening a log record may allocate even when the record is filtered
+    // out, so such a count wouldn't settle at zero anyway. A steady zero here shows the packetization
+    // buffers, which are the only per-frame allocations proportional to the frame size, are reused.
+    logging::min_max_avg_periodic_logger<int> frame_arena_growth_logger {debug, "Network: packetization arena growths per frame", ""};
+
+    // Created on the first encrypted frame
+    std::optional<shard_encryptor_t> encryptor;
+
+    std::unique_ptr<platf::high_precision_timer> timer;
+    std::chrono::steady_clock::time_point next_timer_log;
+
+    pacing::pacer_t pacer;
+  };
+
+  /**
+   * @brief Warn about packets a full queue dropped since the last check.
+   * @param packets The queue to check.
+   * @param last_overflows The number of dropped packets seen by the last check.
+   * @param name The name of the queue to log.
+   */
+  template<class T>
+  void log_overflows(const safe::ring_queue_t<T> &packets, std::uint64_t &last_overflows, const std::string_view &name) {
+    auto overflows = packets.overflows();
+    if (overflows != last_overflows) {
+      BOOST_LOG(warning) << name << " queue is full, dropped "sv << overflows - last_overflows << " oldest packet(s)"sv;
+      last_overflows = overflows;
+    }
+  }
+
+  /**
+   * @brief Send the video frames of a single session.
+   * @param session The session to send frames for.
+   * @param sock The socket to send video traffic on.
+   */
+  void videoSendThread(session_t *session, udp::socket &sock) {
+    // Video traffic is sent on this thread
+    platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::video_send);
+
+    ++video_send_threads;
+    auto fg = util::fail_guard([]() {
+      --video_send_threads;
+    });
+
+    video_sender_t sender {sock};
+    if (!sender) {
+      BOOST_LOG(error) << "Failed to create timer, aborting video send thread";
+      session::stop(*session);
+      return;
+    }
+
+    auto &packets = session->video.send_queue;
+    std::uint64_t overflows = 0;
+    while (auto packet = packets->pop()) {
+      log_overflows(*packets, overflows, "Video send"sv);
+
+      sender.send(packet);
+    }
+  }
+
+  void videoBroadcastThread(udp::socket &sock) {
+    auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
+    auto packets = mail::man->ring_queue<video::packet_t>(mail::video_packets);
+
+    // Video traffic is sent on this thread
+    platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::video_send);
+
+    // Used for sessions without their own send thread
+    video_sender_t sender {sock};
+    if (!sender) {
+      BOOST_LOG(error) << "Failed to create timer, aborting video broadcast thread";
+      return;
+    }
+
+    std::uint64_t overflows = 0;
+    while (auto packet = packets->pop()) {
+      if (shutdown_event->peek()) {
+        break;
+      }
+
+      log_overflows(*packets, overflows, "Video packet"sv);
+
+      auto session = (session_t *) packet->channel_data;
+
+      // Hand the frame off to the session's own send thread if it has one
+      if (session->video.send_queue) {
+        session->video.send_queue->raise(std::move(packet));
+        continue;
+      }
+
+      sender.send(packet);
+    }
+
     shutdown_event->raise(true);
   }
 
   void audioBroadcastThread(udp::socket &sock) {
     auto shutdown_event = mail::man->event<bool>(mail::broadcast_shutdown);
-    auto packets = mail::man->queue<audio::packet_t>(mail::audio_packets);
+    auto packets = mail::man->ring_queue<audio::packet_t>(mail::audio_packets);
 
-    audio_packet_t audio_packet;
     fec::rs_t rs {reed_solomon_new(RTPA_DATA_SHARDS, RTPA_FEC_SHARDS)};
     crypto::aes_t iv(16);
 
@@ -1605,21 +2314,44 @@ namespace stream {
     const unsigned char parity[] = {0x77, 0x40, 0x38, 0x0e, 0xc7, 0xa7, 0x0d, 0x6c};
     memcpy(rs.get()->p, parity, sizeof(parity));
 
-    audio_packet.rtp.header = 0x80;
-    audio_packet.rtp.packetType = 97;
-    audio_packet.rtp.ssrc = 0;
+    // Datagrams ready at the same time, across sessions and including the FEC shards
+    // closing a block, are sent together. Each session has a single data packet in a batch,
+    // as its shard buffers are reused by the next packets. A batch goes through a single
+    // socket, while sessions relayed by Starbeam are sent to from their channel's socket.
+    std::vector<platf::send_info_t> batch;
+    std::vector<session_t *> batched_sessions;
 
-    // Audio traffic is sent on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::high);
+    auto flush = [&]() {
+      if (batch.empty()) {
+        return;
+      }
 
-    while (auto packet = packets->pop()) {
-      if (shutdown_event->peek()) {
-        break;
+      try {
+        platf::send_multi(batch);
+      } catch (const std::exception &e) {
+        BOOST_LOG(error) << "Broadcast audio failed "sv << e.what();
+        std::this_thread::sleep_for(100ms);
       }
 
-      TUPLE_2D_REF(channel_data, packet_data, *packet);
+      batch.clear();
+      batched_sessions.clear();
+    };
+
+    auto prepare = [&](audio::packet_t &packet) {
+      TUPLE_2D_REF(channel_data, packet_data, packet);
       auto session = (session_t *) channel_data;
 
+      if (std::find(std::begin(batched_sessions), std::end(batched_sessions), session) != std::end(batched_sessions)) {
+        flush();
+      }
+
+      auto &target = session->audio.target;
+      target = send_target(sock, session->audio.peer, session->audio.starbeam_route, session->localAddress);
+      if (!batch.empty() && batch.front().native_socket != target.native_socket) {
+        flush();
+      }
+      batched_sessions.emplace_back(session);
+
       auto sequenceNumber = session->audio.sequenceNumber;
       auto timestamp = session->audio.timestamp;
 
@@ -1627,66 +2359,103 @@ namespace stream {
 
       auto &shards_p = session->audio.shards_p;
 
-      auto bytes = encode_audio(session->config.encryptionFlagsEnabled & SS_ENC_AUDIO, packet_data, shards_p[sequenceNumber % RTPA_DATA_SHARDS], iv, session->audio.cipher);
+      auto bytes = encode_audio(session->config.encryptionFlagsEnabled & SS_ENC_AUDIO, *packet_data, shards_p[sequenceNumber % RTPA_DATA_SHARDS], iv, session->audio.cipher);
       if (bytes < 0) {
         BOOST_LOG(error) << "Couldn't encode audio packet"sv;
-        break;
+        return false;
       }
 
       BOOST_LOG(verbose) << "Audio [seq "sv << sequenceNumber << ", pts "sv << timestamp << "] ::  send..."sv;
 
+      auto &audio_packet = session->audio.packet;
       audio_packet.rtp.sequenceNumber = util::endian::big(sequenceNumber);
       audio_packet.rtp.timestamp = util::endian::big(timestamp);
 
       session->audio.sequenceNumber++;
       session->audio.timestamp += session->config.audio.packetDuration;
 
-      auto peer_address = session->audio.peer.address();
-      try {
-        auto send_info = platf::send_info_t {
-          (const char *) &audio_packet,
-          sizeof(audio_packet),
-          (const char *) shards_p[sequenceNumber % RTPA_DATA_SHARDS],
-          (size_t) bytes,
-          (uintptr_t) sock.native_handle(),
-          peer_address,
-          session->audio.peer.port(),
-          session->localAddress,
-        };
-        platf::send(send_info);
+      batch.push_back(platf::send_info_t {
+        (const char *) &audio_packet,
+        sizeof(audio_packet),
+        (const char *) shards_p[sequenceNumber % RTPA_DATA_SHARDS],
+        (size_t) bytes,
+        target.native_socket,
+        target.address,
+        target.port,
+        target.source_address,
+      });
 
-        auto &fec_packet = session->audio.fec_packet;
-        // initialize the FEC header at the beginning of the FEC block
-        if (sequenceNumber % RTPA_DATA_SHARDS == 0) {
+      auto &fec_packets = session->audio.fec_packets;
+      // initialize the FEC headers at the beginning of the FEC block
+      if (sequenceNumber % RTPA_DATA_SHARDS == 0) {
+        for (auto &fec_packet : fec_packets) {
           fec_packet.fecHeader.baseSequenceNumber = util::endian::big(sequenceNumber);
           fec_packet.fecHeader.baseTimestamp = util::endian::big(timestamp);
         }
+      }
 
-        // generate parity shards at the end of the FEC block
-        if ((sequenceNumber + 1) % RTPA_DATA_SHARDS == 0) {
-          reed_solomon_encode(rs.get(), shards_p.begin(), RTPA_TOTAL_SHARDS, bytes);
-
-          for (auto x = 0; x < RTPA_FEC_SHARDS; ++x) {
-            fec_packet.rtp.sequenceNumber = util::endian::big<std::uint16_t>(sequenceNumber + x + 1);
-            fec_packet.fecHeader.fecShardIndex = x;
-
-            auto send_info = platf::send_info_t {
-              (const char *) &fec_packet,
-              sizeof(fec_packet),
-              (const char *) shards_p[RTPA_DATA_SHARDS + x],
-              (size_t) bytes,
-              (uintptr_t) sock.native_handle(),
-              peer_address,
-              session->audio.peer.port(),
-              session->localAddress,
-            };
-            platf::send(send_info);
-            BOOST_LOG(verbose) << "Audio FEC ["sv << (sequenceNumber & ~(RTPA_DATA_SHARDS - 1)) << ' ' << x << "] ::  send..."sv;
-          }
+      // generate parity shards at the end of the FEC block
+      if ((sequenceNumber + 1) % RTPA_DATA_SHARDS == 0) {
+        reed_solomon_encode(rs.get(), shards_p.begin(), RTPA_TOTAL_SHARDS, bytes);
+
+        for (auto x = 0; x < RTPA_FEC_SHARDS; ++x) {
+          fec_packets[x].rtp.sequenceNumber = util::endian::big<std::uint16_t>(sequenceNumber + x + 1);
+
+          batch.push_back(platf::send_info_t {
+            (const char *) &fec_packets[x],
+            sizeof(fec_packets[x]),
+            (const char *) shards_p[RTPA_DATA_SHARDS + x],
+            (size_t) bytes,
+            target.native_socket,
+            target.address,
+            target.port,
+            target.source_address,
+          });
+          BOOST_LOG(verbose) << "Audio FEC ["sv << (sequenceNumber & ~(RTPA_DATA_SHARDS - 1)) << ' ' << x << "] ::  send..."sv;
         }
-      } catch (const std::exception &e) {
-        BOOST_LOG(error) << "Broadcast audio failed "sv << e.what();
-        std::this_thread::sleep_for(100ms);
+      }
+
+      if (session->audio.starbeam_route) {
+        auto fec_shards = (sequenceNumber + 1) % RTPA_DATA_SHARDS == 0 ? RTPA_FEC_SHARDS : 0;
+        session->audio.starbeam_route->count(1 + fec_shards, sizeof(audio_packet) + bytes + fec_shards * (sizeof(fec_packets[0]) + bytes));
+      }
+
+      return true;
+    };
+
+    // Audio traffic is sent on this thread
+    platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::audio_send);
+
+    auto &send_stats = platf::thread_send_stats();
+    auto logged_send_stats = send_stats;
+    auto next_send_stats_log = std::chrono::steady_clock::now() + 10s;
+
+    std::uint64_t overflows = 0;
+    while (auto packet = packets->pop()) {
+      if (shutdown_event->peek()) {
+        break;
+      }
+
+      log_overflows(*packets, overflows, "Audio packet"sv);
+
+      // Take along the packets that are ready by now, e.g. the same one encoded for several sessions
+      auto prepared = prepare(*packet);
+      while (prepared && packets->peek()) {
+        packet = packets->pop();
+        prepared = packet && prepare(*packet);
+      }
+
+      flush();
+      if (!prepared) {
+        break;
+      }
+
+      if (auto now = std::chrono::steady_clock::now(); now >= next_send_stats_log) {
+        BOOST_LOG(debug) << "Audio: sent "sv << send_stats.datagrams - logged_send_stats.datagrams << " datagrams with "sv
+                         << send_stats.syscalls - logged_send_stats.syscalls << " system calls"sv;
+
+        logged_send_stats = send_stats;
+        next_send_stats_log = now + 10s;
       }
     }
 
@@ -1721,6 +2490,14 @@ namespace stream {
       BOOST_LOG(error) << "Failed to set video socket send buffer size (SO_SENDBUF)";
     }
 
+    // The socket is shared by all sessions, so the kernel can only cap their combined rate
+    if (config::stream.pacing_kernel_offload) {
+      auto link_rate = (std::uint64_t) config::stream.pacing_link_rate * 1000 * 1000;
+      if (platf::set_socket_pacing_rate(ctx.video_sock.native_handle(), link_rate / 8)) {
+        BOOST_LOG(info) << "Kernel video pacing enabled at "sv << config::stream.pacing_link_rate << " Mbps"sv;
+      }
+    }
+
     auto bind_addr_str = net::get_bind_address(address_family);
     const auto bind_addr = boost::asio::ip::make_address(bind_addr_str, ec);
     if (ec) {
@@ -1765,8 +2542,8 @@ namespace stream {
 
     broadcast_shutdown_event->raise(true);
 
-    auto video_packets = mail::man->queue<video::packet_t>(mail::video_packets);
-    auto audio_packets = mail::man->queue<audio::packet_t>(mail::audio_packets);
+    auto video_packets = mail::man->ring_queue<video::packet_t>(mail::video_packets);
+    auto audio_packets = mail::man->ring_queue<audio::packet_t>(mail::audio_packets);
 
     // Minimize delay stopping video/audio threads
     video_packets->stop();
@@ -1847,6 +2624,31 @@ namespace stream {
     return -1;
   }
 
+  /**
+   * @brief Log the Starbeam link a session starts streaming video through.
+   * @details The relay's round trip time and jitter are part of the stream's latency, so putting them
+   *          next to the stream's bitrate shows when the relay rather than the host holds a stream back.
+   *          The channel's rates are logged periodically from then on.
+   * @param session The session.
+   */
+  void log_starbeam_link(const session_t &session) {
+    auto &route = *session.video.starbeam_route;
+    auto direct = route.destination() != route.relay_endpoint;
+    BOOST_LOG(info) << "Streaming "sv << session.config.monitor.bitrate << " kbps of video "sv
+                    << (direct ? "straight to the Starbeam client"sv : "through the Starbeam relay"sv);
+
+    auto client = starbeam::get_client();
+    auto link = client ? client->get_link_stats() : starbeam::LinkStats {};
+    if (!link.rtt_ms) {
+      BOOST_LOG(info) << "Starbeam relay round trip time unknown, it didn't answer any pings yet"sv;
+      return;
+    }
+
+    auto f = stat_trackers::two_digits_after_decimal();
+    BOOST_LOG(info) << "Starbeam relay round trip time "sv << f % *link.rtt_ms << "ms, jitter "sv << f % link.jitter_ms << "ms, "sv
+                    << link.lost << " of "sv << link.pings << " pings lost"sv;
+  }
+
   void videoThread(session_t *session) {
     auto fg = util::fail_guard([&]() {
       session::stop(*session);
@@ -1860,9 +2662,49 @@ namespace stream {
       return;
     }
 
+    session->video.starbeam_route = starbeam::udp::find_direct_route(session->video.peer);
+    if (session->video.starbeam_route) {
+      BOOST_LOG(debug) << "Sending video straight to the Starbeam relay at "sv << session->video.starbeam_route->relay_endpoint;
+      log_starbeam_link(*session);
+    }
+
     // Enable local prioritization and QoS tagging on video traffic if requested by the client
-    auto address = session->video.peer.address();
-    session->video.qos = platf::enable_socket_qos(ref->video_sock.native_handle(), address, session->video.peer.port(), platf::qos_data_type_e::video, session->config.videoQosType != 0);
+    auto target = send_target(ref->video_sock, session->video.peer, session->video.starbeam_route, session->localAddress);
+    session->video.qos = platf::enable_socket_qos(target.native_socket, target.address, target.port, platf::qos_data_type_e::video, session->config.videoQosType != 0);
+
+    // Build the FEC encoder contexts for this session's geometry in the background,
+    // so the broadcast thread doesn't have to build them while sending the first frames.
+    // Percentages the congestion controller adapts to later are built on demand.
+    auto fec_percentage = session->video.congestion ? session->video.congestion->fec_percentage() : config::stream.fec_percentage;
+    std::thread prewarm_thread {[fec_percentage = (size_t) fec_percentage, min_parity_shards = (size_t) session->config.minRequiredFecPackets]() {
+      platf::adjust_thread_priority(platf::thread_priority_e::low);
+
+      auto max_data_shards = (DATA_SHARDS_MAX * 100) / (100 + fec_percentage);
+      fec::rs_cache.prewarm(fec_percentage, min_parity_shards, max_data_shards);
+
+      BOOST_LOG(debug) << "FEC encoder context cache prewarmed up to "sv << max_data_shards << " data shards"sv;
+    }};
+
+    // The session must not outlive the thread filling the cache, which would otherwise race its destruction at exit
+    auto prewarm_thread_fg = util::fail_guard([&]() {
+      prewarm_thread.join();
+    });
+
+    // Give this session its own send thread, so its frames and pacing don't delay other sessions
+    std::thread send_thread;
+    if (config::stream.video_send_per_session) {
+      session->video.send_queue = std::make_shared<safe::ring_queue_t<video::packet_t>>(32);
+      send_thread = std::thread {videoSendThread, session, std::ref(ref->video_sock)};
+    }
+
+    auto send_thread_fg = util::fail_guard([&]() {
+      if (send_thread.joinable()) {
+        session->video.send_queue->stop();
+
+        BOOST_LOG(debug) << "Waiting for video send thread to end..."sv;
+        send_thread.join();
+      }
+    });
 
     BOOST_LOG(debug) << "Start capturing Video"sv;
     video::capture(session->mail, session->config.monitor, session);
@@ -1881,14 +2723,50 @@ namespace stream {
       return;
     }
 
+    session->audio.starbeam_route = starbeam::udp::find_direct_route(session->audio.peer);
+    if (session->audio.starbeam_route) {
+      BOOST_LOG(debug) << "Sending audio straight to the Starbeam relay at "sv << session->audio.starbeam_route->relay_endpoint;
+    }
+
     // Enable local prioritization and QoS tagging on audio traffic if requested by the client
-    auto address = session->audio.peer.address();
-    session->audio.qos = platf::enable_socket_qos(ref->audio_sock.native_handle(), address, session->audio.peer.port(), platf::qos_data_type_e::audio, session->config.audioQosType != 0);
+    auto target = send_target(ref->audio_sock, session->audio.peer, session->audio.starbeam_route, session->localAddress);
+    session->audio.qos = platf::enable_socket_qos(target.native_socket, target.address, target.port, platf::qos_data_type_e::audio, session->config.audioQosType != 0);
 
     BOOST_LOG(debug) << "Start capturing Audio"sv;
     audio::capture(session->mail, session->config.audio, session);
   }
 
+#ifdef SUNSHINE_TESTS
+  /**
+   * @brief Send a session's video to a peer without waiting for the peer to ping first.
+   * @param session The session.
+   * @param peer The address to send the video to.
+   * @param send_thread Whether the session gets its own send thread, instead of sending on the broadcast thread.
+   * @return The queue of frames for `videoSendThread()`, or null.
+   */
+  std::shared_ptr<safe::ring_queue_t<video::packet_t>> connect_video(session_t &session, const udp::endpoint &peer, bool send_thread) {
+    session.localAddress = peer.address();
+    session.video.peer = peer;
+    if (send_thread) {
+      session.video.send_queue = std::make_shared<safe::ring_queue_t<video::packet_t>>(32);
+    }
+
+    return session.video.send_queue;
+  }
+
+  /**
+   * @brief Send a session's audio to a peer without waiting for the peer to ping first.
+   * @param session The session.
+   * @param peer The address to send the audio to.
+   * @param route The Starbeam channel to send it through instead, if any.
+   */
+  void connect_audio(session_t &session, const udp::endpoint &peer, std::optional<starbeam::udp::DirectRoute> route) {
+    session.localAddress = peer.address();
+    session.audio.peer = peer;
+    session.audio.starbeam_route = std::move(route);
+  }
+#endif
+
   namespace session {
     std::atomic_uint running_sessions;
 
@@ -2017,6 +2895,14 @@ namespace stream {
 
       session->video.idr_events = mail->event<bool>(mail::idr);
       session->video.invalidate_ref_frames_events = mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames);
+      session->video.bitrate_events = mail->event<int>(mail::bitrate);
+      if (config::stream.adaptive_bitrate) {
+        auto bitrate = config.monitor.bitrate;
+        if (config::video.max_bitrate > 0) {
+          bitrate = std::min(bitrate, config::video.max_bitrate);
+        }
+        session->video.congestion.emplace(bitrate, config::stream.fec_percentage, std::chrono::nanoseconds {1s} / std::max(config.monitor.framerate, 1), std::chrono::steady_clock::now());
+      }
       session->video.lowseq = 0;
       session->video.ping_payload = launch_session.av_ping_payload;
       if (config.encryptionFlagsEnabled & SS_ENC_VIDEO) {
@@ -2042,13 +2928,22 @@ namespace stream {
       session->audio.shards = std::move(shards);
       session->audio.shards_p = std::move(shards_p);
 
-      session->audio.fec_packet.rtp.header = 0x80;
-      session->audio.fec_packet.rtp.packetType = 127;
-      session->audio.fec_packet.rtp.timestamp = 0;
-      session->audio.fec_packet.rtp.ssrc = 0;
+      session->audio.packet.rtp.header = 0x80;
+      session->audio.packet.rtp.packetType = 97;
+      session->audio.packet.rtp.ssrc = 0;
 
-      session->audio.fec_packet.fecHeader.payloadType = 97;
-      session->audio.fec_packet.fecHeader.ssrc = 0;
+      for (auto x = 0; x < RTPA_FEC_SHARDS; ++x) {
+        auto &fec_packet = session->audio.fec_packets[x];
+
+        fec_packet.rtp.header = 0x80;
+        fec_packet.rtp.packetType = 127;
+        fec_packet.rtp.timestamp = 0;
+        fec_packet.rtp.ssrc = 0;
+
+        fec_packet.fecHeader.fecShardIndex = x;
+        fec_packet.fecHeader.payloadType = 97;
+        fec_packet.fecHeader.ssrc = 0;
+      }
 
       session->audio.cipher = crypto::cipher::cbc_t {
         launch_session.gcm_key,
@@ -5,12 +5,17 @@
 #pragma once
 
 // standard includes
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <bit>
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <utility>
 #include <vector>
 
 // local includes
@@ -346,6 +351,282 @@ namespace safe {
     std::vector<T> _queue;
   };
 
+  /**
+   * @brief A bounded queue that producers and consumers access without taking a lock.
+   * @details Each slot carries a sequence number telling whether it is ready to be written
+   *          or read, so any number of producers and consumers may use the queue at once.
+   *          When the queue is full, the oldest element is dropped to make room for the new
+   *          one. A mutex is only taken to wake up a consumer that is sleeping in `pop()`.
+   */
+  template<class T>
+  class ring_queue_t {
+  public:
+    using status_t = util::optional_t<T>;
+
+    /**
+     * @param max_elements The capacity of the queue, rounded up to a power of two.
+     */
+    ring_queue_t(std::uint32_t max_elements = 32):
+        _slots(std::bit_ceil(std::max<std::size_t>(max_elements, 1))),
+        _mask {_slots.size() - 1} {
+      for (std::size_t x = 0; x < _slots.size(); ++x) {
+        _slots[x].sequence.store(x * 2, std::memory_order_relaxed);
+      }
+    }
+
+    template<class... Args>
+    void raise(Args &&...args) {
+      if (!_continue) {
+        return;
+      }
+
+      T val(std::forward<Args>(args)...);
+      while (!try_push(val)) {
+        // Drop the oldest element, unless a consumer beat us to it
+        if (try_pop()) {
+          _overflows.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+
+      // Pairs with the fence in wait(), so either the consumer sees the element or we see the consumer
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (_waiters.load(std::memory_order_relaxed)) {
+        std::lock_guard lg {_lock};
+        _cv.notify_all();
+      }
+    }
+
+    bool peek() {
+      return _continue && !empty();
+    }
+
+    template<class Rep, class Period>
+    status_t pop(std::chrono::duration<Rep, Period> delay) {
+      auto deadline = std::chrono::steady_clock::now() + delay;
+
+      return wait([&](std::unique_lock<std::mutex> &ul) {
+        return _cv.wait_until(ul, deadline) != std::cv_status::timeout;
+      });
+    }
+
+    status_t pop() {
+      return wait([&](std::unique_lock<std::mutex> &ul) {
+        _cv.wait(ul);
+        return true;
+      });
+    }
+
+    void stop() {
+      std::lock_guard lg {_lock};
+
+      _continue = false;
+
+      _cv.notify_all();
+    }
+
+    [[nodiscard]] bool running() const {
+      return _continue;
+    }
+
+    /**
+     * @brief Get the number of elements dropped because the queue was full.
+     */
+    [[nodiscard]] std::uint64_t overflows() const {
+      return _overflows.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Get the capacity of the queue.
+     */
+    [[nodiscard]] std::size_t capacity() const {
+      return _slots.size();
+    }
+
+  private:
+    // A slot is ready to be written at position `pos` when its sequence is `pos * 2`,
+    // and ready to be read when its sequence is `pos * 2 + 1`. Doubling the position
+    // keeps the two states apart even when the queue holds a single element.
+    struct slot_t {
+      std::atomic<std::size_t> sequence;
+      T val;
+    };
+
+    template<class F>
+    status_t wait(F &&sleep) {
+      if (!_continue) {
+        return util::false_v<status_t>;
+      }
+
+      if (auto val = try_pop()) {
+        return val;
+      }
+
+      std::unique_lock ul {_lock};
+      _waiters.fetch_add(1, std::memory_order_relaxed);
+      auto fg = util::fail_guard([this]() {
+        _waiters.fetch_sub(1, std::memory_order_relaxed);
+      });
+
+      while (true) {
+        // Pairs with the fence in raise()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (!_continue) {
+          return util::false_v<status_t>;
+        }
+
+        if (auto val = try_pop()) {
+          return val;
+        }
+
+        if (!sleep(ul)) {
+          return try_pop();
+        }
+      }
+    }
+
+    bool try_push(T &val) {
+      auto pos = _tail.load(std::memory_order_relaxed);
+      while (true) {
+        auto &slot = _slots[pos & _mask];
+        auto seq = slot.sequence.load(std::memory_order_acquire);
+        auto diff = (std::intptr_t) seq - (std::intptr_t) (pos * 2);
+
+        if (diff == 0) {
+          if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            slot.val = std::move(val);
+            slot.sequence.store(pos * 2 + 1, std::memory_order_release);
+
+            return true;
+          }
+        } else if (diff < 0) {
+          // Full
+          return false;
+        } else {
+          pos = _tail.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    status_t try_pop() {
+      auto pos = _head.load(std::memory_order_relaxed);
+      while (true) {
+        auto &slot = _slots[pos & _mask];
+        auto seq = slot.sequence.load(std::memory_order_acquire);
+        auto diff = (std::intptr_t) seq - (std::intptr_t) (pos * 2 + 1);
+
+        if (diff == 0) {
+          if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            // Leave an empty value behind, so the slot doesn't keep the element alive
+            status_t val {std::exchange(slot.val, T {})};
+            slot.sequence.store((pos + _slots.size()) * 2, std::memory_order_release);
+
+            return val;
+          }
+        } else if (diff < 0) {
+          // Empty
+          return util::false_v<status_t>;
+        } else {
+          pos = _head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    bool empty() const {
+      auto pos = _head.load(std::memory_order_relaxed);
+      auto seq = _slots[pos & _mask].sequence.load(std::memory_order_acquire);
+
+      return (std::intptr_t) seq - (std::intptr_t) (pos * 2 + 1) < 0;
+    }
+
+    std::atomic<bool> _continue {true};
+
+    std::vector<slot_t> _slots;
+    std::size_t _mask;
+
+    // Producers and consumers are kept on separate cache lines
+    alignas(64) std::atomic<std::size_t> _tail {0};
+    alignas(64) std::atomic<std::size_t> _head {0};
+
+    alignas(64) std::atomic<std::uint64_t> _overflows {0};
+    std::atomic<std::uint32_t> _waiters {0};
+
+    std::mutex _lock;
+    std::condition_variable _cv;
+  };
+
+  /**
+   * @brief A fixed number of objects, handed out and given back without allocating.
+   * @details All objects are created along with the pool. The handle returned by `pop()` gives
+   *          its object back when destroyed, on whichever thread that happens, and keeps the
+   *          pool alive until then.
+   */
+  template<class T>
+  class pool_t: public std::enable_shared_from_this<pool_t<T>> {
+  public:
+    struct deleter_t {
+      // Released along with the object, an empty handle doesn't keep the pool alive
+      mutable std::shared_ptr<pool_t> pool;
+
+      void operator()(T *object) const {
+        auto owner = std::move(pool);
+        owner->push(object);
+      }
+    };
+
+    using ptr_t = std::unique_ptr<T, deleter_t>;
+
+    /**
+     * @param size The number of objects.
+     * @param val The value each object starts out as.
+     */
+    pool_t(std::size_t size, const T &val):
+        _objects(size, val) {
+      _free.reserve(size);
+      for (auto &object : _objects) {
+        _free.emplace_back(&object);
+      }
+    }
+
+    /**
+     * @brief Take an object out of the pool.
+     * @return The object, or an empty handle if all of them are in use.
+     */
+    ptr_t pop() {
+      std::lock_guard lg {_lock};
+
+      if (_free.empty()) {
+        return nullptr;
+      }
+
+      auto object = _free.back();
+      _free.pop_back();
+
+      return ptr_t {object, deleter_t {this->shared_from_this()}};
+    }
+
+    /**
+     * @brief Get the number of objects that aren't in use.
+     */
+    std::size_t available() {
+      std::lock_guard lg {_lock};
+
+      return _free.size();
+    }
+
+  private:
+    void push(T *object) {
+      std::lock_guard lg {_lock};
+
+      _free.emplace_back(object);
+    }
+
+    std::vector<T> _objects;
+
+    std::mutex _lock;
+    std::vector<T *> _free;
+  };
+
   template<class T>
   class shared_t {
   public:
@@ -505,6 +786,9 @@ namespace safe {
     template<class T>
     using queue_t = std::shared_ptr<post_t<queue_t<T>>>;
 
+    template<class T>
+    using ring_queue_t = std::shared_ptr<post_t<ring_queue_t<T>>>;
+
     template<class T>
     event_t<T> event(const std::string_view &id) {
       std::lock_guard lg {mutex};
@@ -535,6 +819,21 @@ namespace safe {
       return post;
     }
 
+    template<class T>
+    ring_queue_t<T> ring_queue(const std::string_view &id) {
+      std::lock_guard lg {mutex};
+
+      auto it = id_to_post.find(id);
+      if (it != std::end(id_to_post)) {
+        return lock<ring_queue_t<T>>(it->second);
+      }
+
+      auto post = std::make_shared<typename ring_queue_t<T>::element_type>(shared_from_this(), 32);
+      id_to_post.emplace(std::pair<std::string, std::weak_ptr<void>> {std::string {id}, post});
+
+      return post;
+    }
+
     void cleanup() {
       std::lock_guard lg {mutex};
 
@@ -0,0 +1,157 @@
+/**
+ * @file src/trace.cpp
+ * @brief Definitions for tracing the time frames spend in each stage of the video pipeline.
+ */
+// standard includes
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <format>
+#include <iterator>
+
+// local includes
+#include "trace.h"
+
+namespace trace {
+  namespace {
+    constexpr std::array<std::string_view, 11> SPAN_NAMES {
+      "capture",
+      "pull_free_image",
+      "convert",
+      "encode_submit",
+      "encode_receive",
+      "replacement",
+      "fec",
+      "encryption",
+      "send_batch",
+      "pacing_sleep",
+      "send_frame",
+    };
+
+    // Set once before the streaming threads start, and kept until exit
+    std::unique_ptr<ring_t> ring;
+
+    std::atomic<std::uint32_t> next_thread {1};
+
+    /**
+     * @brief Get a small number identifying the calling thread in traces.
+     * @return The number.
+     */
+    std::uint32_t thread_id() {
+      thread_local auto id = next_thread.fetch_add(1, std::memory_order_relaxed);
+      return id;
+    }
+  }  // namespace
+
+  std::string_view name(span_e span) {
+    return SPAN_NAMES[(std::size_t) span];
+  }
+
+  ring_t::ring_t(std::size_t capacity):
+      slots {std::make_unique<slot_t[]>(std::bit_ceil(std::max<std::size_t>(capacity, 1)))},
+      mask {std::bit_ceil(std::max<std::size_t>(capacity, 1)) - 1},
+      head {0} {
+  }
+
+  void ring_t::push(const event_t &event) {
+    auto index = head.fetch_add(1, std::memory_order_relaxed);
+    auto &slot = slots[index & mask];
+
+    // An odd sequence number marks the slot as being written
+    slot.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.span_and_thread.store((std::uint64_t) event.thread << 8 | (std::uint64_t) event.span, std::memory_order_relaxed);
+    slot.frame.store(event.frame, std::memory_order_relaxed);
+    slot.start.store(event.start.time_since_epoch().count(), std::memory_order_relaxed);
+    slot.duration.store(event.duration.count(), std::memory_order_relaxed);
+
+    slot.sequence.store(index * 2 + 2, std::memory_order_release);
+  }
+
+  std::vector<event_t> ring_t::snapshot() const {
+    auto end = head.load(std::memory_order_acquire);
+    auto begin = end > mask + 1 ? end - (mask + 1) : 0;
+
+    std::vector<event_t> events;
+    events.reserve(end - begin);
+    for (auto index = begin; index < end; ++index) {
+      auto &slot = slots[index & mask];
+
+      auto sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence != index * 2 + 2) {
+        // Still being written, or already overwritten by a newer event
+        continue;
+      }
+
+      auto span_and_thread = slot.span_and_thread.load(std::memory_order_relaxed);
+      event_t event {
+        (span_e) (span_and_thread & 0xFF),
+        (std::uint32_t) (span_and_thread >> 8),
+        slot.frame.load(std::memory_order_relaxed),
+        clock::time_point {clock::duration {slot.start.load(std::memory_order_relaxed)}},
+        clock::duration {slot.duration.load(std::memory_order_relaxed)},
+      };
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+        continue;
+      }
+
+      events.push_back(event);
+    }
+
+    return events;
+  }
+
+  std::size_t ring_t::capacity() const {
+    return mask + 1;
+  }
+
+  void init(std::size_t capacity) {
+    ring = std::make_unique<ring_t>(capacity);
+  }
+
+  bool enabled() {
+    return (bool) ring;
+  }
+
+  void record(span_e span, std::int64_t frame, clock::time_point start, clock::time_point end) {
+    if (!ring) {
+      return;
+    }
+
+    ring->push({span, thread_id(), frame, start, end - start});
+  }
+
+  std::string to_json(const std::vector<event_t> &events) {
+    // Timestamps are relative to the earliest span, in microseconds
+    auto epoch = events.empty() ? clock::time_point {} : std::min_element(std::begin(events), std::end(events), [](auto &a, auto &b) {
+                                                           return a.start < b.start;
+                                                         })->start;
+    auto us = [](clock::duration duration) {
+      return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    std::string json = R"({"displayTimeUnit":"ms","traceEvents":[)";
+    json.reserve(json.size() + events.size() * 128);
+
+    auto out = std::back_inserter(json);
+    for (std::size_t x = 0; x < events.size(); ++x) {
+      auto &event = events[x];
+
+      std::format_to(out, R"({}{{"name":"{}","cat":"video","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f})", x ? "," : "", name(event.span), event.thread, us(event.start - epoch), us(event.duration));
+      if (event.frame >= 0) {
+        std::format_to(out, R"(,"args":{{"frame":{}}})", event.frame);
+      }
+      json += '}';
+    }
+
+    json += "]}";
+    return json;
+  }
+
+  std::string dump() {
+    return to_json(ring ? ring->snapshot() : std::vector<event_t> {});
+  }
+}  // namespace trace
@@ -0,0 +1,183 @@
+/**
+ * @file src/trace.h
+ * @brief Declarations for tracing the time frames spend in each stage of the video pipeline.
+ */
+#pragma once
+
+// standard includes
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace trace {
+  using clock = std::chrono::steady_clock;
+
+  // Enough for about a minute of spans at 4K120
+  constexpr std::size_t DEFAULT_CAPACITY = 128 * 1024;
+
+  /**
+   * @brief The stages of the video pipeline a frame is traced through.
+   */
+  enum class span_e : std::uint8_t {
+    capture,  ///< From the capture of a frame until the encoder picks it up
+    pull_free_image,  ///< Waiting for a free image to capture into
+    convert,  ///< Converting a captured image for the encoder
+    encode_submit,  ///< Handing a frame to the encoder
+    encode_receive,  ///< Waiting for and receiving an encoded frame
+    replacement,  ///< Replacing parameter sets in an IDR frame
+    fec,  ///< Computing the FEC shards of a block
+    encryption,  ///< Encrypting the shards of a block
+    send_batch,  ///< Sending a batch of packets
+    pacing_sleep,  ///< Sleeping to pace out the packets of a frame
+    send_frame,  ///< Packetizing and sending a whole frame
+  };
+
+  /**
+   * @brief Get the name a span is shown with in a trace.
+   * @param span The span.
+   * @return The name.
+   */
+  std::string_view name(span_e span);
+
+  /**
+   * @brief A single span, as recorded.
+   */
+  struct event_t {
+    span_e span;
+    std::uint32_t thread;
+    std::int64_t frame;  ///< The frame the span belongs to, or -1 if it isn't known yet
+    clock::time_point start;
+    clock::duration duration;
+  };
+
+  /**
+   * @brief A fixed size buffer of the most recent events, written to without locks.
+   * @details Writers claim slots with a single atomic increment, so recording never waits on
+   *          other threads or on a reader. Each slot carries a sequence number that is odd
+   *          while the slot is being written, so a reader skips events that are overwritten
+   *          while it copies them.
+   */
+  class ring_t {
+  public:
+    /**
+     * @brief Create a ring buffer.
+     * @param capacity The number of events to keep, rounded up to a power of two.
+     */
+    explicit ring_t(std::size_t capacity);
+
+    /**
+     * @brief Add an event, overwriting the oldest one once the buffer is full.
+     * @param event The event.
+     */
+    void push(const event_t &event);
+
+    /**
+     * @brief Copy out the events in the buffer.
+     * @return The events, oldest first.
+     */
+    std::vector<event_t> snapshot() const;
+
+    /**
+     * @brief Get the number of events the buffer keeps.
+     * @return The capacity.
+     */
+    std::size_t capacity() const;
+
+  private:
+    struct slot_t {
+      std::atomic<std::uint64_t> sequence;
+      std::atomic<std::uint64_t> span_and_thread;
+      std::atomic<std::int64_t> frame;
+      std::atomic<std::int64_t> start;
+      std::atomic<std::int64_t> duration;
+    };
+
+    std::unique_ptr<slot_t[]> slots;
+    std::size_t mask;
+
+    // Kept apart from the slots, every writer modifies it
+    alignas(64) std::atomic<std::uint64_t> head;
+  };
+
+  /**
+   * @brief Start recording spans.
+   * @param capacity The number of spans to keep.
+   */
+  void init(std::size_t capacity);
+
+  /**
+   * @brief Check if spans are recorded.
+   * @return `true` if tracing was started.
+   */
+  bool enabled();
+
+  /**
+   * @brief Record a span, if tracing is enabled.
+   * @param span The span.
+   * @param frame The frame the span belongs to, or -1 if it isn't known yet.
+   * @param start The start of the span.
+   * @param end The end of the span.
+   */
+  void record(span_e span, std::int64_t frame, clock::time_point start, clock::time_point end);
+
+  /**
+   * @brief Format events in the Trace Event format, as loaded by Perfetto and chrome://tracing.
+   * @param events The events.
+   * @return The trace as JSON.
+   */
+  std::string to_json(const std::vector<event_t> &events);
+
+  /**
+   * @brief Format the recorded spans in the Trace Event format.
+   * @return The trace as JSON, without any events if tracing is disabled.
+   */
+  std::string dump();
+
+  /**
+   * @brief Records a span from its construction until it ends or goes out of scope.
+   * @examples
+   * {
+   *   trace::span_t span {trace::span_e::convert, frame_nr};
+   *   session->convert(*img);
+   * }
+   * @examples_end
+   */
+  class span_t {
+  public:
+    explicit span_t(span_e span, std::int64_t frame = -1):
+        span {span},
+        frame {frame},
+        active {enabled()} {
+      if (active) {
+        start = clock::now();
+      }
+    }
+
+    span_t(const span_t &) = delete;
+    span_t &operator=(const span_t &) = delete;
+
+    ~span_t() {
+      end();
+    }
+
+    /**
+     * @brief End the span before it goes out of scope.
+     */
+    void end() {
+      if (active) {
+        record(span, frame, start, clock::now());
+        active = false;
+      }
+    }
+
+  private:
+    span_e span;
+    std::int64_t frame;
+    bool active;
+    clock::time_point start;
+  };
+}  // namespace trace
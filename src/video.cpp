@@ -5,7 +5,9 @@
 // standard includes
 #include <atomic>
 #include <bitset>
+#include <functional>
 #include <list>
+#include <mutex>
 #include <thread>
 
 // lib includes
@@ -28,6 +30,7 @@ extern "C" {
 #include "nvenc/nvenc_base.h"
 #include "platform/common.h"
 #include "sync.h"
+#include "trace.h"
 #include "video.h"
 
 #ifdef _WIN32
@@ -367,6 +370,27 @@ namespace video {
       request_idr_frame();
     }
 
+    void set_bitrate(int bitrate_kbps) override {
+      auto ctx = avcodec_ctx.get();
+      if (!ctx || ctx->rc_max_rate <= 0) {
+        return;
+      }
+
+      // libx264 and FFmpeg's NVENC pick these up on the next frame, other encoders keep their initial bitrate.
+      // Keep the offset that forces VBR mode and the buffer at the same number of frames.
+      int64_t bitrate = (int64_t) bitrate_kbps * 1000;
+      if (ctx->rc_buffer_size > 0) {
+        ctx->rc_buffer_size = (int) (ctx->rc_buffer_size * bitrate / ctx->rc_max_rate);
+      }
+      if (ctx->rc_min_rate > 0) {
+        ctx->rc_min_rate = bitrate;
+      }
+      ctx->bit_rate = bitrate - (ctx->rc_max_rate - ctx->bit_rate);
+      ctx->rc_max_rate = bitrate;
+
+      BOOST_LOG(debug) << "Streaming bitrate changed to " << bitrate;
+    }
+
     avcodec_ctx_t avcodec_ctx;
     std::unique_ptr<platf::avcodec_encode_device_t> device;
 
@@ -410,6 +434,14 @@ namespace video {
       }
     }
 
+    void set_bitrate(int bitrate_kbps) override {
+      if (!device || !device->nvenc) {
+        return;
+      }
+
+      device->nvenc->set_bitrate(bitrate_kbps);
+    }
+
     nvenc::nvenc_encoded_frame encode_frame(uint64_t frame_index) {
       if (!device || !device->nvenc) {
         return {};
@@ -428,8 +460,9 @@ namespace video {
   struct sync_session_ctx_t {
     safe::signal_t *join_event;
     safe::mail_raw_t::event_t<bool> shutdown_event;
-    safe::mail_raw_t::queue_t<packet_t> packets;
+    safe::mail_raw_t::ring_queue_t<packet_t> packets;
     safe::mail_raw_t::event_t<bool> idr_events;
+    safe::mail_raw_t::event_t<int> bitrate_events;
     safe::mail_raw_t::event_t<hdr_info_t> hdr_events;
     safe::mail_raw_t::event_t<input::touch_port_t> touch_port_events;
 
@@ -1209,6 +1242,8 @@ namespace video {
     };
 
     auto pull_free_image_callback = [&](std::shared_ptr<platf::img_t> &img_out) -> bool {
+      trace::span_t wait {trace::span_e::pull_free_image};
+
       img_out.reset();
       while (capture_ctx_queue->running()) {
         // pick first allocated but unused
@@ -1253,7 +1288,7 @@ namespace video {
     };
 
     // Capture takes place on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::critical);
+    platf::adjust_thread_priority(platf::thread_priority_e::critical, platf::thread_role_e::capture);
 
     while (capture_ctx_queue->running()) {
       bool artificial_reinit = false;
@@ -1371,7 +1406,10 @@ namespace video {
     }
   }
 
-  int encode_avcodec(int64_t frame_nr, avcodec_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
+  // Receives the packets of an encoded frame
+  using packet_sink_t = std::function<void(packet_t &&)>;
+
+  int encode_avcodec(int64_t frame_nr, avcodec_encode_session_t &session, const packet_sink_t &send_packet, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
     auto &frame = session.device->frame;
     frame->pts = frame_nr;
 
@@ -1381,7 +1419,9 @@ namespace video {
     auto &vps = session.vps;
 
     // send the frame to the encoder
+    trace::span_t submit {trace::span_e::encode_submit, frame_nr};
     auto ret = avcodec_send_frame(ctx.get(), frame);
+    submit.end();
     if (ret < 0) {
       char err_str[AV_ERROR_MAX_STRING_SIZE] {0};
       BOOST_LOG(error) << "Could not send a frame for encoding: "sv << av_make_error_string(err_str, AV_ERROR_MAX_STRING_SIZE, ret);
@@ -1393,7 +1433,9 @@ namespace video {
       auto packet = std::make_unique<packet_raw_avcodec>();
       auto av_packet = packet.get()->av_packet;
 
+      trace::span_t receive {trace::span_e::encode_receive, frame_nr};
       ret = avcodec_receive_packet(ctx.get(), av_packet);
+      receive.end();
       if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
         return 0;
       } else if (ret < 0) {
@@ -1438,14 +1480,13 @@ namespace video {
       }
 
       packet->replacements = &session.replacements;
-      packet->channel_data = channel_data;
-      packets->raise(std::move(packet));
+      send_packet(std::move(packet));
     }
 
     return 0;
   }
 
-  int encode_nvenc(int64_t frame_nr, nvenc_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
+  int encode_nvenc(int64_t frame_nr, nvenc_encode_session_t &session, const packet_sink_t &send_packet, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
     auto encoded_frame = session.encode_frame(frame_nr);
     if (encoded_frame.data.empty()) {
       BOOST_LOG(error) << "NvENC returned empty packet";
@@ -1457,19 +1498,18 @@ namespace video {
     }
 
     auto packet = std::make_unique<packet_raw_generic>(std::move(encoded_frame.data), encoded_frame.frame_index, encoded_frame.idr);
-    packet->channel_data = channel_data;
     packet->after_ref_frame_invalidation = encoded_frame.after_ref_frame_invalidation;
     packet->frame_timestamp = frame_timestamp;
-    packets->raise(std::move(packet));
+    send_packet(std::move(packet));
 
     return 0;
   }
 
-  int encode(int64_t frame_nr, encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
+  int encode(int64_t frame_nr, encode_session_t &session, const packet_sink_t &send_packet, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
     if (auto avcodec_session = dynamic_cast<avcodec_encode_session_t *>(&session)) {
-      return encode_avcodec(frame_nr, *avcodec_session, packets, channel_data, frame_timestamp);
+      return encode_avcodec(frame_nr, *avcodec_session, send_packet, frame_timestamp);
     } else if (auto nvenc_session = dynamic_cast<nvenc_encode_session_t *>(&session)) {
-      return encode_nvenc(frame_nr, *nvenc_session, packets, channel_data, frame_timestamp);
+      return encode_nvenc(frame_nr, *nvenc_session, send_packet, frame_timestamp);
     }
 
     return -1;
@@ -1873,17 +1913,90 @@ namespace video {
     return nullptr;
   }
 
+  encode_subscriber_t::encode_subscriber_t(safe::mail_t &mail, int bitrate, void *channel_data):
+      shutdown_event {mail->event<bool>(mail::shutdown)},
+      idr_events {mail->event<bool>(mail::idr)},
+      invalidate_ref_frames_events {mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames)},
+      bitrate_events {mail->event<int>(mail::bitrate)},
+      touch_port_event {mail->event<input::touch_port_t>(mail::touch_port)},
+      hdr_event {mail->event<hdr_info_t>(mail::hdr)},
+      channel_data {channel_data},
+      bitrate {bitrate} {
+  }
+
+  void encode_group_t::send(safe::ring_queue_t<packet_t> &packets, packet_t &&packet) {
+    // The only client gets the frames as they are
+    if (subscribers.size() == 1 && subscribers.front()->frame_offset == 0) {
+      packet->channel_data = subscribers.front()->channel_data;
+      packets.raise(std::move(packet));
+      return;
+    }
+
+    std::shared_ptr<packet_raw_t> shared_packet = std::move(packet);
+    for (auto &subscriber : subscribers) {
+      // Clients that just joined can't decode anything before an IDR frame
+      if (!subscriber->frame_offset) {
+        if (!shared_packet->is_idr()) {
+          continue;
+        }
+        subscriber->frame_offset = shared_packet->frame_index() - 1;
+      }
+
+      packets.raise(std::make_unique<packet_raw_shared>(shared_packet, *subscriber->frame_offset, subscriber->channel_data));
+    }
+  }
+
+  encode_group_t::requests_t encode_group_t::take_requests() {
+    requests_t requests {config.bitrate, false, std::nullopt};
+
+    for (auto &subscriber : subscribers) {
+      if (subscriber->bitrate_events->peek()) {
+        if (auto requested_bitrate = subscriber->bitrate_events->pop(0ms)) {
+          subscriber->bitrate = *requested_bitrate;
+        }
+      }
+
+      // The encoder can't go faster than the slowest client
+      requests.bitrate = std::min(requests.bitrate, subscriber->bitrate);
+
+      // Invalidate every frame lost by any client, so all of them can keep decoding
+      auto &invalidated_frames = requests.invalidated_frames;
+      while (subscriber->invalidate_ref_frames_events->peek()) {
+        auto frames = subscriber->invalidate_ref_frames_events->pop(0ms);
+        if (!frames || !subscriber->frame_offset) {
+          continue;
+        }
+
+        auto first = frames->first + *subscriber->frame_offset;
+        auto last = frames->second + *subscriber->frame_offset;
+        if (invalidated_frames) {
+          invalidated_frames->first = std::min(invalidated_frames->first, first);
+          invalidated_frames->second = std::max(invalidated_frames->second, last);
+        } else {
+          invalidated_frames.emplace(first, last);
+        }
+      }
+
+      if (subscriber->idr_events->peek()) {
+        requests.idr_frame = true;
+        subscriber->idr_events->pop();
+      }
+    }
+
+    return requests;
+  }
+
   void encode_run(
-    int &frame_nr,  // Store progress of the frame number
-    safe::mail_t mail,
-    img_event_t images,
-    config_t config,
+    encode_group_t &group,
     std::shared_ptr<platf::display_t> disp,
     std::unique_ptr<platf::encode_device_t> encode_device,
     safe::signal_t &reinit_event,
-    const encoder_t &encoder,
-    void *channel_data
+    const encoder_t &encoder
   ) {
+    auto &config = group.config;
+    auto &images = group.images;
+    auto &frame_nr = group.frame_nr;
+
     auto session = make_encode_session(disp.get(), encoder, config, disp->width, disp->height, std::move(encode_device));
     if (!session) {
       return;
@@ -1911,10 +2024,15 @@ namespace video {
     std::chrono::duration<double, std::milli> max_frametime {1000.0 / minimum_fps_target};
     BOOST_LOG(info) << "Minimum FPS target set to ~"sv << (minimum_fps_target / 2) << "fps ("sv << max_frametime.count() * 2 << "ms)"sv;
 
-    auto shutdown_event = mail->event<bool>(mail::shutdown);
-    auto packets = mail::man->queue<packet_t>(mail::video_packets);
-    auto idr_events = mail->event<bool>(mail::idr);
-    auto invalidate_ref_frames_events = mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames);
+    auto packets = mail::man->ring_queue<packet_t>(mail::video_packets);
+
+    // A new encoder starts at the configured bitrate
+    auto bitrate = config.bitrate;
+
+    auto send_packet = [&](packet_t &&packet) {
+      std::lock_guard lg {group.mutex};
+      group.send(*packets, std::move(packet));
+    };
 
     {
       // Load a dummy image into the AVFrame to ensure we have something to encode
@@ -1929,39 +2047,50 @@ namespace video {
 
     while (true) {
       // Break out of the encoding loop if any of the following are true:
-      // a) The stream is ending
+      // a) The streams of all clients are ending
       // b) Sunshine is quitting
       // c) The capture side is waiting to reinit and we've encoded at least one frame
       //
       // If we have to reinit before we have received any captured frames, we will encode
       // the blank dummy frame just to let Moonlight know that we're alive.
-      if (shutdown_event->peek() || !images->running() || (reinit_event.peek() && frame_nr > 1)) {
+      if (!images->running() || (reinit_event.peek() && frame_nr > 1)) {
         break;
       }
 
-      bool requested_idr_frame = false;
-
-      while (invalidate_ref_frames_events->peek()) {
-        if (auto frames = invalidate_ref_frames_events->pop(0ms)) {
-          session->invalidate_ref_frames(frames->first, frames->second);
+      encode_group_t::requests_t requests;
+      {
+        std::lock_guard lg {group.mutex};
+        if (!group.prune()) {
+          break;
         }
+
+        requests = group.take_requests();
       }
 
-      if (idr_events->peek()) {
-        requested_idr_frame = true;
-        idr_events->pop();
+      if (requests.bitrate != bitrate) {
+        bitrate = requests.bitrate;
+        session->set_bitrate(bitrate);
       }
 
-      if (requested_idr_frame) {
+      if (requests.invalidated_frames) {
+        session->invalidate_ref_frames(requests.invalidated_frames->first, requests.invalidated_frames->second);
+      }
+
+      if (requests.idr_frame) {
         session->request_idr_frame();
       }
 
       std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
 
       // Encode at a minimum FPS to avoid image quality issues with static content
-      if (!requested_idr_frame || images->peek()) {
+      if (!requests.idr_frame || images->peek()) {
         if (auto img = images->pop(max_frametime)) {
           frame_timestamp = img->frame_timestamp;
+          if (frame_timestamp && trace::enabled()) {
+            trace::record(trace::span_e::capture, frame_nr, *frame_timestamp, trace::clock::now());
+          }
+
+          trace::span_t convert {trace::span_e::convert, frame_nr};
           if (session->convert(*img)) {
             BOOST_LOG(error) << "Could not convert image"sv;
             return;
@@ -1971,7 +2100,7 @@ namespace video {
         }
       }
 
-      if (encode(frame_nr++, *session, packets, channel_data, frame_timestamp)) {
+      if (encode(frame_nr++, *session, send_packet, frame_timestamp)) {
         BOOST_LOG(error) << "Could not encode video packet"sv;
         return;
       }
@@ -2200,11 +2329,10 @@ namespace video {
             ctx->idr_events->pop();
           }
 
-          if (frame_captured && pos->session->convert(*img)) {
-            BOOST_LOG(error) << "Could not convert image"sv;
-            ctx->shutdown_event->raise(true);
-
-            continue;
+          if (ctx->bitrate_events->peek()) {
+            if (auto bitrate = ctx->bitrate_events->pop(0ms)) {
+              pos->session->set_bitrate(*bitrate);
+            }
           }
 
           std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
@@ -2212,7 +2340,26 @@ namespace video {
             frame_timestamp = img->frame_timestamp;
           }
 
-          if (encode(ctx->frame_nr++, *pos->session, ctx->packets, ctx->channel_data, frame_timestamp)) {
+          if (frame_captured && frame_timestamp && trace::enabled()) {
+            trace::record(trace::span_e::capture, ctx->frame_nr, *frame_timestamp, trace::clock::now());
+          }
+
+          if (frame_captured) {
+            trace::span_t convert {trace::span_e::convert, ctx->frame_nr};
+            if (pos->session->convert(*img)) {
+              BOOST_LOG(error) << "Could not convert image"sv;
+              ctx->shutdown_event->raise(true);
+
+              continue;
+            }
+          }
+
+          auto send_packet = [ctx](packet_t &&packet) {
+            packet->channel_data = ctx->channel_data;
+            ctx->packets->raise(std::move(packet));
+          };
+
+          if (encode(ctx->frame_nr++, *pos->session, send_packet, frame_timestamp)) {
             BOOST_LOG(error) << "Could not encode video packet"sv;
             ctx->shutdown_event->raise(true);
 
@@ -2273,24 +2420,27 @@ namespace video {
     });
 
     // Encoding and capture takes place on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::high);
+    platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::encode);
 
     std::vector<std::string> display_names;
     int display_p = -1;
     while (encode_run_sync(synced_session_ctxs, ctx, display_names, display_p) == encode_e::reinit) {}
   }
 
-  void capture_async(
-    safe::mail_t mail,
-    config_t &config,
-    void *channel_data
-  ) {
-    auto shutdown_event = mail->event<bool>(mail::shutdown);
-
-    auto images = std::make_shared<img_event_t::element_type>();
+  /**
+   * @brief Capture and encode frames for the clients of a group until they have all left.
+   * @param group The group to encode for.
+   */
+  void encode_group_run(encode_group_t &group) {
     auto lg = util::fail_guard([&]() {
-      images->stop();
-      shutdown_event->raise(true);
+      group.images->stop();
+
+      // End the streams of the clients still waiting for frames
+      std::lock_guard lg {group.mutex};
+      group.stopped = true;
+      for (auto &subscriber : group.subscribers) {
+        subscriber->shutdown_event->raise(true);
+      }
     });
 
     auto ref = capture_thread_async.ref();
@@ -2298,21 +2448,21 @@ namespace video {
       return;
     }
 
-    ref->capture_ctx_queue->raise(capture_ctx_t {images, config});
+    ref->capture_ctx_queue->raise(capture_ctx_t {group.images, group.config});
 
     if (!ref->capture_ctx_queue->running()) {
       return;
     }
 
-    int frame_nr = 1;
-
-    auto touch_port_event = mail->event<input::touch_port_t>(mail::touch_port);
-    auto hdr_event = mail->event<hdr_info_t>(mail::hdr);
-
     // Encoding takes place on this thread
-    platf::adjust_thread_priority(platf::thread_priority_e::high);
+    platf::adjust_thread_priority(platf::thread_priority_e::high, platf::thread_role_e::encode);
 
-    while (!shutdown_event->peek() && images->running()) {
+    auto has_subscribers = [&group]() {
+      std::lock_guard lg {group.mutex};
+      return group.prune();
+    };
+
+    while (group.images->running() && has_subscribers()) {
       // Wait for the main capture event when the display is being reinitialized
       if (ref->reinit_event.peek()) {
         std::this_thread::sleep_for(20ms);
@@ -2331,39 +2481,128 @@ namespace video {
 
       auto &encoder = *chosen_encoder;
 
-      auto encode_device = make_encode_device(*display, encoder, config);
+      auto encode_device = make_encode_device(*display, encoder, group.config);
       if (!encode_device) {
         return;
       }
 
-      // absolute mouse coordinates require that the dimensions of the screen are known
-      touch_port_event->raise(make_port(display.get(), config));
+      {
+        std::lock_guard lg {group.mutex};
 
-      // Update client with our current HDR display state
-      hdr_info_t hdr_info = std::make_unique<hdr_info_raw_t>(false);
-      if (colorspace_is_hdr(encode_device->colorspace)) {
-        if (display->get_hdr_metadata(hdr_info->metadata)) {
-          hdr_info->enabled = true;
-        } else {
-          BOOST_LOG(error) << "Couldn't get display hdr metadata when colorspace selection indicates it should have one";
+        // absolute mouse coordinates require that the dimensions of the screen are known
+        group.touch_port = make_port(display.get(), group.config);
+
+        // Update clients with our current HDR display state
+        group.hdr_info.emplace(false);
+        if (colorspace_is_hdr(encode_device->colorspace)) {
+          if (display->get_hdr_metadata(group.hdr_info->metadata)) {
+            group.hdr_info->enabled = true;
+          } else {
+            BOOST_LOG(error) << "Couldn't get display hdr metadata when colorspace selection indicates it should have one";
+          }
+        }
+
+        for (auto &subscriber : group.subscribers) {
+          group.send_display_info(*subscriber);
         }
       }
-      hdr_event->raise(std::move(hdr_info));
 
       encode_run(
-        frame_nr,
-        mail,
-        images,
-        config,
+        group,
         display,
         std::move(encode_device),
         ref->reinit_event,
-        *ref->encoder_p,
-        channel_data
+        *ref->encoder_p
       );
     }
   }
 
+  // Encoders shared by the clients streaming the same configuration
+  sync_util::sync_t<std::vector<std::shared_ptr<encode_group_t>>> encode_groups;
+
+  /**
+   * @brief Join the group encoding the configuration, or start a new one.
+   * @param config The stream configuration.
+   * @param subscriber The client joining.
+   * @param run Captures and encodes for a new group, on the group's own thread.
+   * @return The group the client joined.
+   */
+  std::shared_ptr<encode_group_t> join_encode_group(const config_t &config, const std::shared_ptr<encode_subscriber_t> &subscriber, void (*run)(encode_group_t &)) {
+    auto lg = encode_groups.lock();
+
+    for (auto &group : *encode_groups) {
+      if (group->config != config) {
+        continue;
+      }
+
+      std::lock_guard group_lg {group->mutex};
+      if (group->stopped) {
+        continue;
+      }
+
+      BOOST_LOG(info) << "Sharing the encoder of "sv << group->subscribers.size() << " other client(s)"sv;
+
+      // The client can't decode anything before the next IDR frame
+      subscriber->idr_events->raise(true);
+
+      group->subscribers.emplace_back(subscriber);
+      group->send_display_info(*subscriber);
+      return group;
+    }
+
+    auto group = std::make_shared<encode_group_t>(config);
+
+    // The group's frame numbers are the first client's
+    subscriber->frame_offset = 0;
+    group->subscribers.emplace_back(subscriber);
+
+    // The thread only borrows the group, the last client to leave joins it
+    group->thread = std::thread {run, std::ref(*group)};
+
+    encode_groups->emplace_back(group);
+    return group;
+  }
+
+  /**
+   * @brief Stop sending frames to a client, and stop the group once no clients are left.
+   * @param group The group the client joined.
+   * @param subscriber The client leaving.
+   */
+  void leave_encode_group(const std::shared_ptr<encode_group_t> &group, const std::shared_ptr<encode_subscriber_t> &subscriber) {
+    auto lg = encode_groups.lock();
+    std::lock_guard group_lg {group->mutex};
+
+    std::erase(group->subscribers, subscriber);
+    if (group->subscribers.empty()) {
+      group->stopped = true;
+      std::erase(*encode_groups, group);
+    }
+  }
+
+  void capture_async(
+    safe::mail_t mail,
+    config_t &config,
+    void *channel_data
+  ) {
+    auto subscriber = std::make_shared<encode_subscriber_t>(mail, config.bitrate, channel_data);
+
+    if (!config::video.shared_encode) {
+      encode_group_t group {config};
+      subscriber->frame_offset = 0;
+      group.subscribers.emplace_back(subscriber);
+
+      encode_group_run(group);
+      return;
+    }
+
+    auto group = join_encode_group(config, subscriber, encode_group_run);
+
+    // Frames are encoded on the group's thread until the stream ends
+    subscriber->shutdown_event->view();
+
+    leave_encode_group(group, subscriber);
+  }
+
   void capture(
     safe::mail_t mail,
     config_t config,
@@ -2380,8 +2619,9 @@ namespace video {
       ref->encode_session_ctx_queue.raise(sync_session_ctx_t {
         &join_event,
         mail->event<bool>(mail::shutdown),
-        mail::man->queue<packet_t>(mail::video_packets),
+        mail::man->ring_queue<packet_t>(mail::video_packets),
         std::move(idr_events),
+        mail->event<int>(mail::bitrate),
         mail->event<hdr_info_t>(mail::hdr),
         mail->event<input::touch_port_t>(mail::touch_port),
         config,
@@ -2419,9 +2659,12 @@ namespace video {
 
     session->request_idr_frame();
 
-    auto packets = mail::man->queue<packet_t>(mail::video_packets);
+    auto packets = mail::man->ring_queue<packet_t>(mail::video_packets);
+    auto send_packet = [&packets](packet_t &&packet) {
+      packets->raise(std::move(packet));
+    };
     while (!packets->peek()) {
-      if (encode(1, *session, packets, nullptr, {})) {
+      if (encode(1, *session, send_packet, {})) {
         return -1;
       }
     }
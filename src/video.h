@@ -4,6 +4,12 @@
  */
 #pragma once
 
+// standard includes
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
 // local includes
 #include "input.h"
 #include "platform/common.h"
@@ -43,6 +49,8 @@ namespace video {
     int chromaSamplingType;  // 0 - 4:2:0, 1 - 4:4:4
 
     int enableIntraRefresh;  // 0 - disabled, 1 - enabled
+
+    bool operator==(const config_t &) const = default;
   };
 
   platf::mem_type_e map_base_dev_type(AVHWDeviceType type);
@@ -56,7 +64,7 @@ namespace video {
   using avcodec_frame_t = util::safe_ptr<AVFrame, free_frame>;
   using avcodec_buffer_t = util::safe_ptr<AVBufferRef, free_buffer>;
   using sws_t = util::safe_ptr<SwsContext, sws_freeContext>;
-  using img_event_t = std::shared_ptr<safe::event_t<std::shared_ptr<platf::img_t>>>;
+  using img_event_t = std::shared_ptr<safe::ring_queue_t<std::shared_ptr<platf::img_t>>>;
 
   struct encoder_platform_formats_t {
     virtual ~encoder_platform_formats_t() = default;
@@ -208,6 +216,12 @@ namespace video {
     virtual void request_normal_frame() = 0;
 
     virtual void invalidate_ref_frames(int64_t first_frame, int64_t last_frame) = 0;
+
+    /**
+     * @brief Change the bitrate of the running encoder, if it supports that.
+     * @param bitrate_kbps The new bitrate in kilobits per second.
+     */
+    virtual void set_bitrate(int bitrate_kbps) = 0;
   };
 
   // encoders
@@ -315,6 +329,41 @@ namespace video {
     bool idr;
   };
 
+  /**
+   * @brief A packet from an encoder shared by several clients, as seen by one of them.
+   * @details Clients number frames from their first IDR frame, so the encoder's frame index
+   *          is offset by the frames it encoded before the client joined.
+   */
+  struct packet_raw_shared: packet_raw_t {
+    packet_raw_shared(std::shared_ptr<packet_raw_t> packet, int64_t frame_offset, void *channel_data):
+        packet {std::move(packet)},
+        frame_offset {frame_offset} {
+      this->replacements = this->packet->replacements;
+      this->channel_data = channel_data;
+      this->after_ref_frame_invalidation = this->packet->after_ref_frame_invalidation;
+      this->frame_timestamp = this->packet->frame_timestamp;
+    }
+
+    bool is_idr() override {
+      return packet->is_idr();
+    }
+
+    int64_t frame_index() override {
+      return packet->frame_index() - frame_offset;
+    }
+
+    uint8_t *data() override {
+      return packet->data();
+    }
+
+    size_t data_size() override {
+      return packet->data_size();
+    }
+
+    std::shared_ptr<packet_raw_t> packet;
+    int64_t frame_offset;
+  };
+
   using packet_t = std::unique_ptr<packet_raw_t>;
 
   struct hdr_info_raw_t {
@@ -331,6 +380,120 @@ namespace video {
 
   using hdr_info_t = std::unique_ptr<hdr_info_raw_t>;
 
+  /**
+   * @brief A client receiving the frames of an encoder.
+   */
+  struct encode_subscriber_t {
+    encode_subscriber_t(safe::mail_t &mail, int bitrate, void *channel_data);
+
+    safe::mail_raw_t::event_t<bool> shutdown_event;
+    safe::mail_raw_t::event_t<bool> idr_events;
+    safe::mail_raw_t::event_t<std::pair<int64_t, int64_t>> invalidate_ref_frames_events;
+    safe::mail_raw_t::event_t<int> bitrate_events;
+    safe::mail_raw_t::event_t<input::touch_port_t> touch_port_event;
+    safe::mail_raw_t::event_t<hdr_info_t> hdr_event;
+    void *channel_data;
+
+    // The encoder's index of the frame before the client's first one, known from its first IDR frame
+    std::optional<int64_t> frame_offset;
+
+    // The bitrate the client last asked for
+    int bitrate;
+  };
+
+  /**
+   * @brief An encoder and the clients it sends frames to.
+   * @details With shared encoding, clients asking for the same stream configuration join the
+   *          same group, which captures and encodes on its own thread until the last one leaves.
+   */
+  struct encode_group_t {
+    explicit encode_group_t(const config_t &config):
+        config {config},
+        images {std::make_shared<img_event_t::element_type>(1)} {
+    }
+
+    ~encode_group_t() {
+      images->stop();
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+
+    /**
+     * @brief Stop sending frames to the clients whose stream ended.
+     * @return `false` once no clients are left, after which no more can join.
+     * @note The mutex must be held.
+     */
+    bool prune() {
+      std::erase_if(subscribers, [](const auto &subscriber) {
+        return subscriber->shutdown_event->peek();
+      });
+
+      if (subscribers.empty()) {
+        stopped = true;
+      }
+
+      return !stopped;
+    }
+
+    /**
+     * @brief Tell a client about the display being encoded.
+     * @note The mutex must be held.
+     */
+    void send_display_info(encode_subscriber_t &subscriber) {
+      if (touch_port) {
+        subscriber.touch_port_event->raise(*touch_port);
+      }
+      if (hdr_info) {
+        subscriber.hdr_event->raise(std::make_unique<hdr_info_raw_t>(*hdr_info));
+      }
+    }
+
+    /**
+     * @brief Send an encoded frame to every client able to decode it.
+     * @param packets The queue of frames to send.
+     * @param packet The frame.
+     * @note The mutex must be held.
+     */
+    void send(safe::ring_queue_t<packet_t> &packets, packet_t &&packet);
+
+    /**
+     * @brief What the clients asked the encoder for.
+     */
+    struct requests_t {
+      // The lowest bitrate any client asked for
+      int bitrate;
+      bool idr_frame;
+
+      // The range of the encoder's frames lost by any of the clients
+      std::optional<std::pair<int64_t, int64_t>> invalidated_frames;
+    };
+
+    /**
+     * @brief Take what the clients asked for since the last call.
+     * @return The requests, merged so that every client can keep decoding.
+     * @note The mutex must be held.
+     */
+    requests_t take_requests();
+
+    const config_t config;
+
+    // Only the most recent image is kept, older ones are replaced before they are encoded
+    img_event_t images;
+
+    int frame_nr = 1;
+
+    std::thread thread;
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<encode_subscriber_t>> subscribers;
+    bool stopped = false;
+
+    // The state of the display, for clients joining later
+    std::optional<input::touch_port_t> touch_port;
+    std::optional<hdr_info_raw_t> hdr_info;
+  };
+
   extern int active_hevc_mode;
   extern int active_av1_mode;
   extern bool last_encoder_probe_supported_ref_frames_invalidation;
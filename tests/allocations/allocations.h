@@ -0,0 +1,22 @@
+/**
+ * @file tests/allocations/allocations.h
+ * @brief Declarations for counting allocations in tests.
+ */
+#pragma once
+
+// standard includes
+#include <cstddef>
+
+namespace allocations {
+  /**
+   * @brief Start or stop counting the allocations made by the calling thread.
+   * @param enabled Whether to count them.
+   */
+  void count_on_this_thread(bool enabled);
+
+  /**
+   * @brief Get the number of allocations counted so far, on any thread.
+   * @return The number of allocations.
+   */
+  std::size_t counted();
+}  // namespace allocations
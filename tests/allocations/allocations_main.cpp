@@ -0,0 +1,56 @@
+/**
+ * @file tests/allocations/allocations_main.cpp
+ * @brief Entry point and global operator new for the allocation tests.
+ */
+// standard includes
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// local includes
+#include "../tests_common.h"
+#include "../tests_environment.h"
+#include "../tests_events.h"
+#include "allocations.h"
+
+namespace {
+  // Allocations made by the threads that opted in to counting them
+  thread_local bool count_allocations = false;
+  std::atomic<std::size_t> allocations_counted {0};
+}  // namespace
+
+void *operator new(std::size_t size) {
+  if (count_allocations) {
+    allocations_counted.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (auto ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc {};
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace allocations {
+  void count_on_this_thread(bool enabled) {
+    count_allocations = enabled;
+  }
+
+  std::size_t counted() {
+    return allocations_counted.load(std::memory_order_relaxed);
+  }
+}  // namespace allocations
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  testing::AddGlobalTestEnvironment(new SunshineEnvironment);
+  testing::UnitTest::GetInstance()->listeners().Append(new SunshineEventListener);
+  return RUN_ALL_TESTS();
+}
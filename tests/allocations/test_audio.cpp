@@ -0,0 +1,133 @@
+/**
+ * @file tests/allocations/test_audio.cpp
+ * @brief Test that streaming audio doesn't allocate.
+ */
+#include "../tests_common.h"
+
+// standard includes
+#include <array>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// local includes
+#include "allocations.h"
+#include <src/audio.h>
+
+using namespace audio;
+
+TEST(AudioBufferTests, SteadyStateStreamingDoesNotAllocate) {
+  constexpr int warm_up_frames = 100;
+  constexpr int frames = 2000;
+  constexpr int sessions = 3;
+
+  // Faster than a microphone delivers samples, but slow enough for the other threads to keep up
+  constexpr auto frame_interval = 100us;
+
+  // 5 ms of stereo at 48 kHz
+  constexpr int samples_per_frame = 240 * 2;
+
+  // The same queues and pools as the capture, encode and broadcast threads use
+  auto samples = std::make_shared<safe::ring_queue_t<safe::pool_t<std::vector<float>>::ptr_t>>(30);
+  auto sample_buffers = samples->capacity() + 2;
+  auto sample_pool = std::make_shared<safe::pool_t<std::vector<float>>>(sample_buffers, std::vector<float>(samples_per_frame));
+
+  auto packets = std::make_shared<safe::ring_queue_t<packet_t>>(32);
+  auto packet_pool = make_packet_pool(*packets);
+  auto packet_buffers = packet_pool->available();
+
+  std::array<int, sessions> channel_data {};
+  std::vector<void *> subscribers;
+  for (auto &data : channel_data) {
+    subscribers.emplace_back(&data);
+  }
+
+  auto allocations_before = allocations::counted();
+
+  // Packets the encoder had no buffer for
+  std::size_t skipped = 0;
+
+  std::thread capture {[&]() {
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < warm_up_frames + frames; ++frame) {
+      allocations::count_on_this_thread(frame >= warm_up_frames);
+      std::this_thread::sleep_until(start + frame * frame_interval);
+
+      auto sample = sample_pool->pop();
+      while (!sample) {
+        std::this_thread::yield();
+        sample = sample_pool->pop();
+      }
+
+      std::fill(std::begin(*sample), std::end(*sample), (float) frame);
+      samples->raise(std::move(sample));
+    }
+
+    allocations::count_on_this_thread(false);
+
+    // Stopping the queue drops what's left in it, so let the encoder catch up first
+    while (sample_pool->available() < sample_buffers) {
+      std::this_thread::yield();
+    }
+    samples->stop();
+  }};
+
+  std::thread encode {[&]() {
+    int frame = 0;
+    while (auto sample = samples->pop()) {
+      allocations::count_on_this_thread(frame++ >= warm_up_frames);
+
+      auto packet = packet_pool->pop();
+      if (!packet) {
+        skipped += sessions;
+        continue;
+      }
+
+      // Stands in for the Opus encoder
+      packet->fake_resize(MAX_PACKET_SIZE);
+      auto bytes = std::min(packet->size(), sample->size());
+      for (std::size_t x = 0; x < bytes; ++x) {
+        (*packet)[x] = (std::uint8_t) (*sample)[x];
+      }
+      packet->fake_resize(bytes);
+
+      skipped += sessions - send_to_sessions(*packets, *packet_pool, std::move(packet), subscribers);
+    }
+
+    allocations::count_on_this_thread(false);
+
+    while (packet_pool->available() < packet_buffers) {
+      std::this_thread::yield();
+    }
+    packets->stop();
+  }};
+
+  std::size_t received = 0;
+  std::thread broadcast {[&]() {
+    while (auto packet = packets->pop()) {
+      allocations::count_on_this_thread(received >= warm_up_frames * sessions);
+
+      ++*(int *) packet->first;
+      received += packet->second->size() > 0;
+    }
+
+    allocations::count_on_this_thread(false);
+  }};
+
+  capture.join();
+  encode.join();
+  broadcast.join();
+
+  auto allocated = allocations::counted() - allocations_before;
+  auto dropped = samples->overflows() * sessions + skipped + packets->overflows();
+  BOOST_LOG(tests) << "Streamed "sv << received << " audio packets, dropped "sv << dropped << ", "sv
+                   << allocated << " allocation(s) after warming up"sv;
+
+  ASSERT_EQ(received + dropped, (warm_up_frames + frames) * sessions);
+  ASSERT_GT(received, frames);
+  ASSERT_EQ(allocated, 0);
+
+  // Every buffer went back to its pool
+  ASSERT_EQ(sample_pool->available(), sample_buffers);
+  ASSERT_EQ(packet_pool->available(), packet_buffers);
+}
@@ -0,0 +1,146 @@
+/**
+ * @file tests/unit/platform/linux/test_synthetic.cpp
+ * @brief Test src/platform/linux/synthetic.*
+ */
+#include "../../../tests_common.h"
+
+// standard includes
+#include <cstring>
+#include <vector>
+
+// local includes
+#include <src/config.h>
+#include <src/platform/linux/synthetic.h>
+#include <src/video.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+namespace {
+  struct frame_t {
+    std::uint32_t marker;
+    std::chrono::steady_clock::time_point timestamp;
+    std::vector<std::uint8_t> pixels;
+  };
+
+  /**
+   * @brief Create a synthetic display for a stream.
+   * @param pattern The test pattern to draw.
+   * @param width The width of the stream.
+   * @param height The height of the stream.
+   * @param framerate_x100 The frame rate of the stream, times 100.
+   * @return The display.
+   */
+  std::shared_ptr<platf::display_t> make_display(const std::string &pattern, int width, int height, int framerate_x100) {
+    config::video.synthetic_pattern = pattern;
+
+    ::video::config_t config {};
+    config.width = width;
+    config.height = height;
+    config.framerate = framerate_x100 / 100;
+    config.framerateX100 = framerate_x100;
+
+    return platf::synthetic::display(platf::mem_type_e::system, "synthetic", config);
+  }
+
+  /**
+   * @brief Capture frames from a display, recycling a couple of images like the capture thread does.
+   * @param disp The display to capture from.
+   * @param count The number of frames to capture.
+   * @param copy_pixels Whether to keep a copy of the pixels of every frame.
+   * @return The frames.
+   */
+  std::vector<frame_t> capture(platf::display_t &disp, int count, bool copy_pixels = true) {
+    std::vector<std::shared_ptr<platf::img_t>> images {disp.alloc_img(), disp.alloc_img()};
+    std::vector<frame_t> frames;
+
+    auto pull_free_image = [&](std::shared_ptr<platf::img_t> &img_out) {
+      img_out = images[frames.size() % images.size()];
+      return true;
+    };
+    auto push_captured_image = [&](std::shared_ptr<platf::img_t> &&img, bool frame_captured) {
+      EXPECT_TRUE(frame_captured);
+      frames.push_back({
+        platf::synthetic::read_frame_marker(img->data, img->row_pitch),
+        *img->frame_timestamp,
+      });
+      if (copy_pixels) {
+        frames.back().pixels.assign(img->data, img->data + img->height * img->row_pitch);
+      }
+      return frames.size() < (std::size_t) count;
+    };
+
+    bool cursor = false;
+    EXPECT_EQ(disp.capture(push_captured_image, pull_free_image, &cursor), platf::capture_e::ok);
+
+    return frames;
+  }
+}  // namespace
+
+class SyntheticPatternTest: public testing::TestWithParam<std::string> {};
+
+TEST_P(SyntheticPatternTest, MarksFramesWithExactTimestamps) {
+  // NTSC rates don't divide a second into whole nanoseconds, so rounding errors would add up
+  constexpr int framerate_x100 = 5994;
+
+  auto disp = make_display(GetParam(), 640, 360, framerate_x100);
+  ASSERT_TRUE(disp);
+
+  auto frames = capture(*disp, 30);
+  ASSERT_EQ(frames.size(), 30);
+
+  auto first = frames.front();
+  for (std::size_t x = 1; x < frames.size(); ++x) {
+    auto &frame = frames[x];
+
+    // Frames may only be skipped if the capture falls behind
+    ASSERT_GT(frame.marker, frames[x - 1].marker);
+
+    auto expected = std::chrono::nanoseconds {(std::int64_t) (frame.marker * 100'000'000'000ull / framerate_x100)};
+    ASSERT_EQ(frame.timestamp - first.timestamp, expected);
+  }
+}
+
+TEST_P(SyntheticPatternTest, MovesUnlessStatic) {
+  constexpr int width = 640;
+  constexpr int height = 360;
+
+  auto disp = make_display(GetParam(), width, height, 6000);
+  ASSERT_TRUE(disp);
+
+  auto frames = capture(*disp, 5);
+  ASSERT_EQ(frames.size(), 5);
+
+  // Leave out the rows of the frame marker, it changes with every frame
+  auto offset = platf::synthetic::MARKER_CELL_SIZE * width * 4;
+  for (std::size_t x = 1; x < frames.size(); ++x) {
+    auto same = std::memcmp(frames[x].pixels.data() + offset, frames[x - 1].pixels.data() + offset, frames[x].pixels.size() - offset) == 0;
+    ASSERT_EQ(same, GetParam() == "static") << "frame " << x;
+  }
+}
+
+TEST_P(SyntheticPatternTest, DrawThroughput) {
+  // Far more frames than can be drawn, so the capture never sleeps
+  auto disp = make_display(GetParam(), 1920, 1080, 100'000'00);
+  ASSERT_TRUE(disp);
+
+  constexpr int count = 200;
+
+  auto start = std::chrono::steady_clock::now();
+  auto frames = capture(*disp, count, false);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(frames.size(), count);
+
+  BOOST_LOG(tests) << "Synthetic "sv << GetParam() << " pattern at 1080p: "sv << (int) (count / elapsed.count()) << " frames per second"sv;
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  SyntheticPatternTests,
+  SyntheticPatternTest,
+  testing::Values("static", "scroll", "noise", "mixed")
+);
+
+TEST(SyntheticDisplayTests, RejectsFramesTooSmallForTheMarker) {
+  ASSERT_FALSE(make_display("mixed", platf::synthetic::MARKER_BITS * platf::synthetic::MARKER_CELL_SIZE - 1, 360, 6000));
+}
+
+#endif
@@ -4,7 +4,26 @@
  */
 #include "../../tests_common.h"
 
+// standard includes
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+  #include <sched.h>
+  #include <sys/resource.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+// lib includes
 #include <boost/asio/ip/host_name.hpp>
+
+// local includes
+#include <src/config.h>
 #include <src/platform/common.h>
 
 struct SetEnvTest: ::testing::TestWithParam<std::tuple<std::string, std::string, int>> {
@@ -53,3 +72,181 @@ TEST(HostnameTests, TestAsioEquality) {
   // These should be equivalent on all platforms for ASCII hostnames
   ASSERT_EQ(platf::get_host_name(), boost::asio::ip::host_name());
 }
+
+namespace {
+  /**
+   * @brief Sleep repeatedly for short, varying durations and log how late each sleep woke up.
+   * @param label What sleeps.
+   * @param sleep_until Sleeps until the given time.
+   * @return How late each sleep woke up, sorted.
+   */
+  template<class F>
+  std::vector<std::chrono::nanoseconds> log_overshoot(std::string_view label, F &&sleep_until) {
+    constexpr int sleeps = 2000;
+
+    std::vector<std::chrono::nanoseconds> overshoot;
+    overshoot.reserve(sleeps);
+
+    for (int x = 0; x < sleeps; ++x) {
+      // Between 50 us and 1 ms, like the waits between groups of paced video packets
+      auto deadline = std::chrono::steady_clock::now() + 50us + (x * 7919 % 20) * 50us;
+      sleep_until(deadline);
+      overshoot.emplace_back(std::chrono::steady_clock::now() - deadline);
+    }
+
+    std::sort(std::begin(overshoot), std::end(overshoot));
+    auto percentile = [&](double p) {
+      return std::chrono::duration<double, std::micro>(overshoot[(std::size_t) (p * (overshoot.size() - 1))]).count();
+    };
+
+    BOOST_LOG(tests) << label << " overshoot: p50 "sv << percentile(0.5) << " us, p90 "sv << percentile(0.9)
+                     << " us, p99 "sv << percentile(0.99) << " us, max "sv << percentile(1.0) << " us"sv;
+
+    return overshoot;
+  }
+}  // namespace
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(HighPrecisionTimerTests, DISABLED_WakeUpOvershoot) {
+  auto timer = platf::create_high_precision_timer();
+  ASSERT_TRUE(timer && *timer);
+
+  log_overshoot("std::this_thread::sleep_until"sv, [](auto deadline) {
+    std::this_thread::sleep_until(deadline);
+  });
+  auto overshoot = log_overshoot("high_precision_timer::sleep_until"sv, [&](auto deadline) {
+    timer->sleep_until(deadline);
+  });
+
+  auto &histogram = timer->wakeup_histogram();
+  BOOST_LOG(tests) << "Wake-up error histogram: p50 < "sv << std::chrono::duration<double, std::micro>(histogram.percentile(0.5)).count()
+                   << " us, p99 < "sv << std::chrono::duration<double, std::micro>(histogram.percentile(0.99)).count() << " us"sv;
+
+  ASSERT_EQ(histogram.count, overshoot.size());
+  ASSERT_LE(histogram.percentile(0.5), histogram.percentile(0.99));
+  ASSERT_LE(histogram.percentile(0.99), histogram.max);
+
+#ifdef __linux__
+  // The timer spins until the deadline rather than waking up early
+  ASSERT_GE(overshoot.front(), 0ns);
+#endif
+}
+
+#ifdef __linux__
+namespace {
+  /**
+   * @brief Run a function on a new thread and wait for it.
+   * @param f The function to run.
+   */
+  template<class F>
+  void run_on_thread(F &&f) {
+    std::thread {std::forward<F>(f)}.join();
+  }
+
+  /**
+   * @brief Sleep until each frame is due, and log how late the thread woke up.
+   * @param frames The number of frames.
+   * @param priority The priority to run at, or `std::nullopt` to leave the thread alone.
+   * @return The number of frames sent.
+   */
+  std::size_t log_frame_send_jitter(int frames, std::optional<platf::thread_priority_e> priority) {
+    constexpr auto frame_interval = 2ms;
+
+    std::vector<std::chrono::nanoseconds> delays;
+    delays.reserve(frames);
+
+    std::string_view scheduling;
+    int nice;
+    run_on_thread([&]() {
+      if (priority) {
+        platf::adjust_thread_priority(*priority, platf::thread_role_e::video_send);
+      }
+
+      scheduling = (sched_getscheduler(0) & ~SCHED_RESET_ON_FORK) == SCHED_RR ? "SCHED_RR"sv : "SCHED_OTHER"sv;
+      nice = getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid));
+
+      auto next_frame = std::chrono::steady_clock::now() + frame_interval;
+      for (int frame = 0; frame < frames; ++frame) {
+        std::this_thread::sleep_until(next_frame);
+        delays.emplace_back(std::chrono::steady_clock::now() - next_frame);
+        next_frame += frame_interval;
+      }
+    });
+
+    std::sort(std::begin(delays), std::end(delays));
+    auto percentile = [&](double p) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(delays[(std::size_t) (p * (delays.size() - 1))]).count();
+    };
+
+    BOOST_LOG(tests) << "Frame send jitter with "sv << scheduling << ", nice "sv << nice << ": p50 "sv << percentile(0.5)
+                     << " us, p99 "sv << percentile(0.99) << " us, max "sv << percentile(1.0) << " us"sv;
+
+    return delays.size();
+  }
+}  // namespace
+
+TEST(ThreadPriorityTests, LowPriorityRaisesNiceValue) {
+  run_on_thread([]() {
+    // Lowering the nice value back to 10 would need privileges
+    auto tid = (id_t) syscall(SYS_gettid);
+    auto nice = getpriority(PRIO_PROCESS, tid);
+    if (nice > 10) {
+      GTEST_SKIP() << "The tests already run with a nice value of " << nice;
+    }
+
+    platf::adjust_thread_priority(platf::thread_priority_e::low);
+
+    ASSERT_EQ(sched_getscheduler(0) & ~SCHED_RESET_ON_FORK, SCHED_OTHER);
+    ASSERT_EQ(getpriority(PRIO_PROCESS, tid), 10);
+  });
+}
+
+TEST(ThreadPriorityTests, PinsThreadToCpusOfItsRole) {
+  auto capture_cpus = config::stream.capture_cpus;
+  auto fg = util::fail_guard([&]() {
+    config::stream.capture_cpus = capture_cpus;
+  });
+  // The tests may be restricted to some CPUs, so pin to the first one they're allowed on
+  cpu_set_t allowed;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+  int cpu = 0;
+  while (!CPU_ISSET(cpu, &allowed)) {
+    ++cpu;
+  }
+  config::stream.capture_cpus = {cpu};
+
+  run_on_thread([cpu]() {
+    platf::adjust_thread_priority(platf::thread_priority_e::normal, platf::thread_role_e::capture);
+
+    cpu_set_t set;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(set), &set), 0);
+    ASSERT_EQ(CPU_COUNT(&set), 1);
+    ASSERT_TRUE(CPU_ISSET(cpu, &set));
+  });
+}
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(ThreadPriorityTests, DISABLED_FrameSendJitterUnderLoad) {
+  constexpr int frames = 1000;
+
+  // Keep every CPU busy with threads at the default priority, like a game would
+  std::atomic_bool stop {false};
+  std::vector<std::thread> load;
+  for (unsigned x = 0; x < std::max(std::thread::hardware_concurrency(), 1u); ++x) {
+    load.emplace_back([&stop]() {
+      while (!stop.load(std::memory_order_relaxed)) {}
+    });
+  }
+
+  auto without = log_frame_send_jitter(frames, std::nullopt);
+  auto with = log_frame_send_jitter(frames, platf::thread_priority_e::high);
+
+  stop = true;
+  for (auto &thread : load) {
+    thread.join();
+  }
+
+  ASSERT_EQ(without, frames);
+  ASSERT_EQ(with, frames);
+}
+#endif
@@ -45,18 +45,18 @@ TEST_P(AudioTest, TestEncode) {
     // Terminate the audio capture after 100 ms
     std::this_thread::sleep_for(100ms);
     const auto shutdown_event = m_mail->event<bool>(mail::shutdown);
-    const auto audio_packets = m_mail->queue<packet_t>(mail::audio_packets);
+    const auto audio_packets = m_mail->ring_queue<packet_t>(mail::audio_packets);
     shutdown_event->raise(true);
     audio_packets->stop();
   });
   std::thread capture([&] {
-    const auto packets = m_mail->queue<packet_t>(mail::audio_packets);
+    const auto packets = m_mail->ring_queue<packet_t>(mail::audio_packets);
     const auto shutdown_event = m_mail->event<bool>(mail::shutdown);
     while (const auto packet = packets->pop()) {
       if (shutdown_event->peek()) {
         break;
       }
-      if (auto packet_data = packet->second; packet_data.size() == 0) {
+      if (packet->second->size() == 0) {
         FAIL() << "Empty packet data";
       }
     }
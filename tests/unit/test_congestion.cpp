@@ -0,0 +1,250 @@
+/**
+ * @file tests/unit/test_congestion.cpp
+ * @brief Test src/congestion.*
+ */
+#include "../tests_common.h"
+
+// standard includes
+#include <chrono>
+#include <functional>
+#include <random>
+#include <vector>
+
+// local includes
+#include <src/congestion.h>
+
+using namespace std::literals;
+
+namespace {
+  constexpr int FRAMERATE = 60;
+  constexpr auto FRAME_INTERVAL = std::chrono::nanoseconds {1s} / FRAMERATE;
+  constexpr int PACKET_PAYLOAD = 1400;
+
+  // Moonlight sends loss statistics every 50 ms
+  constexpr auto LOSS_REPORT_INTERVAL = 50ms;
+
+  /**
+   * @brief A synthetic network link and client.
+   */
+  struct link_t {
+    // Capacity in kilobits per second at each point of the simulation
+    std::function<double(std::chrono::duration<double>)> capacity;
+
+    // Share of packets lost regardless of the traffic, e.g. to Wi-Fi interference
+    double random_loss = 0;
+
+    // If set, the host can't send faster than the capacity, so frames are delayed rather than dropped
+    bool host_limited = false;
+
+    // Whether the client sends loss statistics, or only asks to recover lost frames
+    bool loss_stats = true;
+  };
+
+  struct sample_t {
+    std::chrono::duration<double> time;
+    int bitrate;
+    int fec;
+    double wire_rate;
+    bool lost;
+  };
+
+  /**
+   * @brief Stream frames over a synthetic link, feeding what happens back to a controller.
+   * @param link The link to stream over.
+   * @param max_bitrate The bitrate requested by the client.
+   * @param fec_percentage The initial FEC percentage.
+   * @param duration The length of the simulation.
+   * @return The state of the stream for each frame.
+   */
+  std::vector<sample_t> simulate(const link_t &link, int max_bitrate, int fec_percentage, std::chrono::seconds duration) {
+    std::mt19937 rng {1234};
+
+    auto start = congestion::clock::time_point {} + 1h;
+    congestion::controller_t controller {max_bitrate, fec_percentage, FRAME_INTERVAL, start};
+
+    std::vector<sample_t> samples;
+
+    int lost_since_report = 0;
+    auto next_report = start + LOSS_REPORT_INTERVAL;
+
+    for (auto now = start; now < start + duration; now += FRAME_INTERVAL) {
+      std::chrono::duration<double> time = now - start;
+
+      auto bitrate = controller.bitrate();
+      auto fec = controller.fec_percentage();
+      auto capacity = link.capacity(time);
+
+      auto frame_bits = bitrate * 1000.0 / FRAMERATE;
+      auto data_packets = (int) std::ceil(frame_bits / (PACKET_PAYLOAD * 8));
+      auto parity_packets = (int) std::ceil(data_packets * fec / 100.0);
+      auto wire_rate = bitrate * (100.0 + fec) / 100;
+
+      // Traffic beyond the capacity overflows the bottleneck's queue
+      auto overflow = link.host_limited ? 0.0 : std::max(0.0, 1.0 - capacity / wire_rate);
+      auto packet_loss = 1.0 - (1.0 - overflow) * (1.0 - link.random_loss);
+
+      std::binomial_distribution<int> lost_packets {data_packets + parity_packets, packet_loss};
+      auto lost = lost_packets(rng) > parity_packets;
+
+      std::chrono::duration<double> send_time {0};
+      if (link.host_limited) {
+        send_time = std::chrono::duration<double> {frame_bits * (100.0 + fec) / 100 / (capacity * 1000)};
+      }
+      controller.frame_sent(std::chrono::duration_cast<congestion::clock::duration>(send_time));
+
+      if (lost) {
+        controller.frame_lost();
+        ++lost_since_report;
+      }
+
+      if (link.loss_stats && now >= next_report) {
+        controller.loss_report(lost_since_report);
+        lost_since_report = 0;
+        next_report += LOSS_REPORT_INTERVAL;
+      }
+
+      controller.update(now);
+
+      samples.push_back({time, bitrate, fec, wire_rate, lost});
+    }
+
+    return samples;
+  }
+
+  struct summary_t {
+    double bitrate;
+    double fec;
+    double wire_rate;
+    double frame_loss;
+  };
+
+  /**
+   * @brief Average the samples within a part of the simulation.
+   * @param samples The samples of the simulation.
+   * @param from The start of the part to average.
+   * @param to The end of the part to average.
+   * @return The averages.
+   */
+  summary_t summarize(const std::vector<sample_t> &samples, std::chrono::duration<double> from, std::chrono::duration<double> to) {
+    summary_t summary {};
+    int count = 0;
+    for (auto &sample : samples) {
+      if (sample.time >= from && sample.time < to) {
+        summary.bitrate += sample.bitrate;
+        summary.fec += sample.fec;
+        summary.wire_rate += sample.wire_rate;
+        summary.frame_loss += sample.lost;
+        ++count;
+      }
+    }
+
+    summary.bitrate /= count;
+    summary.fec /= count;
+    summary.wire_rate /= count;
+    summary.frame_loss /= count;
+    return summary;
+  }
+
+  void log_summary(const char *scenario, const summary_t &summary) {
+    BOOST_LOG(tests) << scenario << ": bitrate "sv << (int) summary.bitrate << " kbps, FEC "sv << (int) summary.fec
+                     << "%, on the wire "sv << (int) summary.wire_rate << " kbps, frame loss "sv << summary.frame_loss * 100 << '%';
+  }
+}  // namespace
+
+struct CongestionConvergenceTest: testing::TestWithParam<bool> {};
+
+TEST_P(CongestionConvergenceTest, ConvergesBelowCapacity) {
+  constexpr double capacity = 20000;
+
+  link_t link;
+  link.capacity = [](auto) {
+    return capacity;
+  };
+  link.loss_stats = GetParam();
+
+  auto samples = simulate(link, 50000, 20, 60s);
+  auto summary = summarize(samples, 40s, 60s);
+  log_summary(link.loss_stats ? "Congested link with loss statistics" : "Congested link without loss statistics", summary);
+
+  // The bottleneck doesn't queue, so FEC can make up for sending slightly more than fits
+  ASSERT_GT(summary.bitrate, capacity * 0.6);
+  ASSERT_LT(summary.bitrate, capacity);
+  ASSERT_LT(summary.wire_rate, capacity * 1.2);
+  ASSERT_LT(summary.frame_loss, 0.02);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  CongestionConvergenceTests,
+  CongestionConvergenceTest,
+  testing::Bool()
+);
+
+TEST(CongestionTests, CleanLinkKeepsFullBitrateAndLowersFec) {
+  link_t link;
+  link.capacity = [](auto) {
+    return 1e6;
+  };
+
+  auto samples = simulate(link, 50000, 20, 30s);
+
+  for (auto &sample : samples) {
+    ASSERT_EQ(sample.bitrate, 50000);
+    ASSERT_FALSE(sample.lost);
+  }
+  ASSERT_EQ(samples.back().fec, 5);
+}
+
+TEST(CongestionTests, RandomLossRaisesFecWithoutStarvingBitrate) {
+  link_t link;
+  link.capacity = [](auto) {
+    return 1e6;
+  };
+  link.random_loss = 0.08;
+
+  auto samples = simulate(link, 30000, 10, 60s);
+  auto summary = summarize(samples, 40s, 60s);
+  log_summary("Random loss", summary);
+
+  ASSERT_GT(summary.fec, 10);
+  ASSERT_GT(summary.bitrate, 30000 * 0.7);
+  ASSERT_LT(summary.frame_loss, 0.01);
+}
+
+TEST(CongestionTests, AdaptsToCapacityDrop) {
+  link_t link;
+  link.capacity = [](auto time) {
+    return time < 20s ? 60000.0 : 10000.0;
+  };
+
+  auto samples = simulate(link, 40000, 20, 50s);
+
+  auto before = summarize(samples, 15s, 20s);
+  auto reaction = summarize(samples, 23s, 24s);
+  auto after = summarize(samples, 30s, 50s);
+  log_summary("Before capacity drop", before);
+  log_summary("After capacity drop", after);
+
+  ASSERT_GT(before.bitrate, 40000 * 0.9);
+  ASSERT_LT(reaction.wire_rate, 10000 * 1.2);
+  ASSERT_GT(after.bitrate, 10000 * 0.6);
+  ASSERT_LT(after.bitrate, 10000);
+  ASSERT_LT(after.frame_loss, 0.02);
+}
+
+TEST(CongestionTests, LateFramesLowerBitrateButNotFec) {
+  constexpr double capacity = 15000;
+
+  link_t link;
+  link.capacity = [](auto) {
+    return capacity;
+  };
+  link.host_limited = true;
+
+  auto samples = simulate(link, 30000, 20, 60s);
+  auto summary = summarize(samples, 40s, 60s);
+  log_summary("Host limited link", summary);
+
+  ASSERT_GT(summary.wire_rate, capacity * 0.6);
+  ASSERT_LT(summary.wire_rate, capacity * 1.05);
+  ASSERT_LE(samples.back().fec, 20);
+}
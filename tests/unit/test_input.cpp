@@ -0,0 +1,324 @@
+/**
+ * @file tests/unit/test_input.cpp
+ * @brief Test src/input.*
+ */
+extern "C" {
+#include <moonlight-common-c/src/Input.h>
+#include <moonlight-common-c/src/Limelight.h>
+}
+
+#include "../tests_common.h"
+
+// standard includes
+#include <mutex>
+#include <thread>
+
+// local includes
+#include <src/input.h>
+#include <src/utility.h>
+
+namespace input {
+  enum class batch_result_e {
+    batched,
+    not_batchable,
+    terminate_batch,
+  };
+
+  batch_result_e batch(PNV_INPUT_HEADER dest, PNV_INPUT_HEADER src);
+}  // namespace input
+
+namespace {
+  NV_REL_MOUSE_MOVE_PACKET rel_mouse_move(short deltaX, short deltaY) {
+    NV_REL_MOUSE_MOVE_PACKET packet {};
+    packet.header.magic = util::endian::little<std::uint32_t>(MOUSE_MOVE_REL_MAGIC_GEN5);
+    packet.deltaX = util::endian::big(deltaX);
+    packet.deltaY = util::endian::big(deltaY);
+    return packet;
+  }
+
+  NV_SCROLL_PACKET scroll(short amount) {
+    NV_SCROLL_PACKET packet {};
+    packet.header.magic = util::endian::little<std::uint32_t>(SCROLL_MAGIC_GEN5);
+    packet.scrollAmt1 = util::endian::big(amount);
+    packet.scrollAmt2 = packet.scrollAmt1;
+    return packet;
+  }
+
+  NV_KEYBOARD_PACKET key(short keyCode, bool down) {
+    NV_KEYBOARD_PACKET packet {};
+    packet.header.magic = util::endian::little<std::uint32_t>(down ? KEY_DOWN_EVENT_MAGIC : KEY_UP_EVENT_MAGIC);
+    packet.keyCode = util::endian::little(keyCode);
+    return packet;
+  }
+
+  template<class T>
+  std::string_view message(const T &packet) {
+    return {(const char *) &packet, sizeof(packet)};
+  }
+
+  short delta_x(PNV_INPUT_HEADER header) {
+    return util::endian::big(((PNV_REL_MOUSE_MOVE_PACKET) header)->deltaX);
+  }
+
+  short scroll_amount(PNV_INPUT_HEADER header) {
+    return util::endian::big(((PNV_SCROLL_PACKET) header)->scrollAmt1);
+  }
+
+  short key_code(PNV_INPUT_HEADER header) {
+    return util::endian::little(((PNV_KEYBOARD_PACKET) header)->keyCode);
+  }
+
+  bool is_mouse_move(PNV_INPUT_HEADER header) {
+    return header->magic == util::endian::little<std::uint32_t>(MOUSE_MOVE_REL_MAGIC_GEN5);
+  }
+
+  bool is_key_up(PNV_INPUT_HEADER header) {
+    return header->magic == util::endian::little<std::uint32_t>(KEY_UP_EVENT_MAGIC);
+  }
+}  // namespace
+
+TEST(InputBatchTests, RelativeMouseMovesAreSummed) {
+  auto dest = rel_mouse_move(10, -20);
+  auto src = rel_mouse_move(5, 7);
+
+  ASSERT_EQ(input::batch(&dest.header, &src.header), input::batch_result_e::batched);
+  ASSERT_EQ(util::endian::big(dest.deltaX), 15);
+  ASSERT_EQ(util::endian::big(dest.deltaY), -13);
+}
+
+TEST(InputBatchTests, RelativeMouseMoveOverflowIsNotBatched) {
+  auto dest = rel_mouse_move(32000, 0);
+  auto src = rel_mouse_move(1000, 0);
+
+  ASSERT_EQ(input::batch(&dest.header, &src.header), input::batch_result_e::terminate_batch);
+  ASSERT_EQ(util::endian::big(dest.deltaX), 32000);
+}
+
+TEST(InputBatchTests, ScrollsAreSummed) {
+  auto dest = scroll(120);
+  auto src = scroll(-40);
+
+  ASSERT_EQ(input::batch(&dest.header, &src.header), input::batch_result_e::batched);
+  ASSERT_EQ(util::endian::big(dest.scrollAmt1), 80);
+  ASSERT_EQ(util::endian::big(dest.scrollAmt2), 80);
+}
+
+TEST(InputBatchTests, DifferentMessagesAreNotBatched) {
+  auto dest = rel_mouse_move(1, 1);
+  auto src = scroll(120);
+
+  ASSERT_EQ(input::batch(&dest.header, (PNV_INPUT_HEADER) &src), input::batch_result_e::terminate_batch);
+}
+
+TEST(InputRingTests, PushFrontAndPop) {
+  auto ring = std::make_unique<input::input_ring_t>();
+  ASSERT_EQ(ring->front(), nullptr);
+
+  // Messages of different types are neither merged nor batched
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(1, 2))));
+  ASSERT_TRUE(ring->push(message(scroll(120))));
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(3, 4))));
+
+  auto front = ring->front();
+  ASSERT_TRUE(is_mouse_move(front));
+  ASSERT_EQ(delta_x(front), 1);
+  ring->pop_front();
+
+  front = ring->front();
+  ASSERT_FALSE(is_mouse_move(front));
+  ASSERT_EQ(scroll_amount(front), 120);
+  ring->pop_front();
+
+  front = ring->front();
+  ASSERT_TRUE(is_mouse_move(front));
+  ASSERT_EQ(delta_x(front), 3);
+  ring->pop_front();
+
+  ASSERT_EQ(ring->front(), nullptr);
+}
+
+TEST(InputRingTests, RejectsMessagesThatDontFitASlot) {
+  auto ring = std::make_unique<input::input_ring_t>();
+
+  std::string too_large(input::input_ring_t::SLOT_SIZE + 1, '\0');
+  ASSERT_FALSE(ring->push(too_large));
+  std::string too_small(sizeof(NV_INPUT_HEADER) - 1, '\0');
+  ASSERT_FALSE(ring->push(too_small));
+  ASSERT_EQ(ring->front(), nullptr);
+}
+
+TEST(InputRingTests, CoalescesIntoTail) {
+  auto ring = std::make_unique<input::input_ring_t>();
+
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(1, 1))));
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(2, 3))));
+
+  auto front = ring->front();
+  ASSERT_EQ(delta_x(front), 3);
+  ASSERT_EQ(util::endian::big(((PNV_REL_MOUSE_MOVE_PACKET) front)->deltaY), 4);
+  ring->pop_front();
+  ASSERT_EQ(ring->front(), nullptr);
+}
+
+TEST(InputRingTests, DoesNotCoalesceIntoMessageBeingSent) {
+  auto ring = std::make_unique<input::input_ring_t>();
+
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(1, 0))));
+  auto front = ring->front();
+
+  // The message at the front stays untouched until it's popped
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(5, 0))));
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(5, 0))));
+  ASSERT_EQ(delta_x(front), 1);
+  ring->pop_front();
+
+  front = ring->front();
+  ASSERT_EQ(delta_x(front), 10);
+  ring->pop_front();
+  ASSERT_EQ(ring->front(), nullptr);
+}
+
+TEST(InputRingTests, WrapsAroundAndEvictsOldestMovementWhenFull) {
+  auto ring = std::make_unique<input::input_ring_t>();
+  constexpr auto SLOTS = (int) input::input_ring_t::SLOTS;
+
+  // Alternate movement and scrolling, so no message is merged into the one before it
+  auto push = [&](int x) {
+    return x % 2 ? ring->push(message(scroll(x))) : ring->push(message(rel_mouse_move(x, 0)));
+  };
+  auto pop = [&](int x) {
+    auto front = ring->front();
+    ASSERT_NE(front, nullptr);
+    ASSERT_EQ(is_mouse_move(front) ? delta_x(front) : scroll_amount(front), x);
+    ring->pop_front();
+  };
+
+  int pushed = 0;
+  int popped = 0;
+  for (; pushed < SLOTS; ++pushed) {
+    ASSERT_TRUE(push(pushed));
+  }
+
+  // Full, so the message is merged into the newest one, or else the oldest one makes room
+  ASSERT_TRUE(ring->push(message(scroll(0))));
+  ASSERT_EQ(ring->dropped(), 0);
+  ASSERT_TRUE(push(pushed++));
+  ASSERT_EQ(ring->dropped(), 1);
+  ++popped;
+
+  // Keep the ring half full while going round it a few times
+  for (; popped < SLOTS / 2; ++popped) {
+    pop(popped);
+  }
+  for (; pushed < 4 * SLOTS; ++pushed, ++popped) {
+    ASSERT_TRUE(push(pushed));
+    pop(popped);
+  }
+  for (; popped < pushed; ++popped) {
+    pop(popped);
+  }
+
+  ASSERT_EQ(ring->front(), nullptr);
+}
+
+TEST(InputRingTests, NeverDropsKeyMessagesWhenFull) {
+  auto ring = std::make_unique<input::input_ring_t>();
+  constexpr auto SLOTS = (int) input::input_ring_t::SLOTS;
+
+  // The message being sent can't be evicted
+  ASSERT_TRUE(ring->push(message(rel_mouse_move(1, 0))));
+  ASSERT_NE(ring->front(), nullptr);
+
+  for (int x = 0; x < SLOTS; ++x) {
+    ASSERT_TRUE(ring->push(message(key(x, x % 2 == 0))));
+  }
+
+  // Movement has nowhere to go, but key messages wait for room
+  ASSERT_FALSE(ring->push(message(rel_mouse_move(2, 0))));
+  ASSERT_EQ(ring->dropped(), 1);
+  ASSERT_TRUE(ring->push(message(key(SLOTS, true))));
+  ASSERT_TRUE(ring->push(message(key(SLOTS + 1, false))));
+
+  auto front = ring->front();
+  ASSERT_TRUE(is_mouse_move(front));
+  ASSERT_EQ(delta_x(front), 1);
+  ring->pop_front();
+
+  for (int x = 0; x < SLOTS + 2; ++x) {
+    front = ring->front();
+    ASSERT_NE(front, nullptr);
+    ASSERT_EQ(key_code(front), x);
+    ASSERT_EQ(is_key_up(front), x % 2 == 1);
+    ring->pop_front();
+  }
+
+  ASSERT_EQ(ring->front(), nullptr);
+}
+
+TEST(InputRingTests, ConcurrentProducerAndConsumer) {
+  auto ring = std::make_unique<input::input_ring_t>();
+  std::mutex lock;
+
+  constexpr int messages = 100000;
+  constexpr int key_every = 100;
+  constexpr int keys = messages / key_every;
+
+  // Queued the way the control stream does, while messages are sent the way passthrough_next_message() does
+  int rejected_keys = 0;
+  bool produced = false;
+  std::thread producer {[&]() {
+    auto move_packet = rel_mouse_move(1, 0);
+    for (int x = 0; x < messages; ++x) {
+      std::lock_guard lg {lock};
+      if (x % key_every) {
+        ring->push(message(move_packet));
+      } else {
+        auto code = x / key_every;
+        rejected_keys += !ring->push(message(key(code, code % 2 == 0)));
+      }
+    }
+
+    std::lock_guard lg {lock};
+    produced = true;
+  }};
+
+  int moved = 0;
+  int pressed = 0;
+  while (true) {
+    PNV_INPUT_HEADER front;
+    {
+      std::lock_guard lg {lock};
+      front = ring->front();
+      if (!front && produced) {
+        break;
+      }
+    }
+    if (!front) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    // The message is read without holding the lock
+    if (is_mouse_move(front)) {
+      moved += delta_x(front);
+    } else {
+      ASSERT_EQ(key_code(front), pressed);
+      ASSERT_EQ(is_key_up(front), pressed % 2 == 1);
+      ++pressed;
+    }
+
+    std::lock_guard lg {lock};
+    ring->pop_front();
+  }
+
+  producer.join();
+
+  // Movement may have been dropped to make room, but never a key
+  ASSERT_EQ(rejected_keys, 0);
+  ASSERT_EQ(pressed, keys);
+  if (ring->dropped()) {
+    ASSERT_LT(moved, messages - keys);
+  } else {
+    ASSERT_EQ(moved, messages - keys);
+  }
+}
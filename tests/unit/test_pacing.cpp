@@ -0,0 +1,183 @@
+/**
+ * @file tests/unit/test_pacing.cpp
+ * @brief Test src/pacing.*
+ */
+#include "../tests_common.h"
+
+// standard includes
+#include <chrono>
+#include <vector>
+
+// local includes
+#include <src/pacing.h>
+
+using namespace std::literals;
+
+namespace {
+  constexpr std::size_t PACKET_SIZE = 1416;
+  constexpr std::size_t BATCH_SIZE = 64 * 1024 / PACKET_SIZE;
+
+  struct departure_t {
+    pacing::clock::time_point time;
+    std::size_t packets;
+  };
+
+  /**
+   * @brief Replay frames through a pacer, treating every send as instantaneous.
+   * @param pacer The pacer to use.
+   * @param start The time the first frame arrives.
+   * @param frame_interval The time between frame arrivals.
+   * @param frame_packets The number of packets in each frame.
+   * @return The departure time and size of each batch.
+   */
+  std::vector<std::vector<departure_t>> replay(pacing::pacer_t &pacer, pacing::clock::time_point start, pacing::clock::duration frame_interval, const std::vector<std::size_t> &frame_packets) {
+    std::vector<std::vector<departure_t>> frames;
+
+    auto now = start;
+    for (std::size_t frame = 0; frame < frame_packets.size(); ++frame) {
+      now = std::max(now, start + frame_interval * (int) frame);
+      pacer.begin_frame(now);
+
+      auto &departures = frames.emplace_back();
+      for (auto remaining = frame_packets[frame]; remaining > 0;) {
+        auto batch = std::min(remaining, BATCH_SIZE);
+
+        if (auto due = pacer.next_send_time()) {
+          now = std::max(now, *due);
+        }
+
+        departures.push_back({now, batch});
+        pacer.packets_sent(batch);
+        remaining -= batch;
+      }
+    }
+
+    return frames;
+  }
+
+  pacing::clock::duration packet_interval(std::uint64_t bits_per_second) {
+    return std::chrono::nanoseconds {PACKET_SIZE * 8 * std::nano::den / bits_per_second};
+  }
+}  // namespace
+
+struct PacingRateTest: testing::TestWithParam<std::uint64_t> {};
+
+TEST_P(PacingRateTest, DeparturesNeverExceedRate) {
+  auto rate = GetParam();
+
+  pacing::pacer_t pacer;
+  pacer.set_rate(rate, PACKET_SIZE);
+
+  // P-frames with an IDR frame and a burst of large frames in between
+  std::vector<std::size_t> frame_packets {20, 20, 600, 20, 20, 150, 150, 150, 20, 1, 20};
+  auto frames = replay(pacer, pacing::clock::time_point {} + 1h, 16667us, frame_packets);
+
+  std::vector<departure_t> departures;
+  for (auto &frame : frames) {
+    departures.insert(std::end(departures), std::begin(frame), std::end(frame));
+  }
+
+  // Within any window, no more than one millisecond worth of packets plus a batch may be sent early
+  auto interval = packet_interval(rate);
+  auto burst = std::max<std::size_t>(1ms / interval, 1) + BATCH_SIZE;
+  for (std::size_t first = 0; first < departures.size(); ++first) {
+    std::size_t packets = 0;
+    for (auto last = first; last < departures.size(); ++last) {
+      auto allowed = (departures[last].time - departures[first].time) / interval + burst;
+      ASSERT_LE(packets, allowed) << "Batches " << first << " to " << last << " departed too quickly";
+
+      packets += departures[last].packets;
+    }
+  }
+}
+
+TEST_P(PacingRateTest, IdrFrameDrainsAtRate) {
+  auto rate = GetParam();
+
+  pacing::pacer_t pacer;
+  pacer.set_rate(rate, PACKET_SIZE);
+
+  auto start = pacing::clock::time_point {} + 1h;
+  auto frames = replay(pacer, start, 16667us, {600});
+
+  // The last batch leaves once every packet before it has been paid off, give or take a group
+  auto &idr = frames.front();
+  auto expected_ms = std::chrono::duration<double, std::milli>(packet_interval(rate) * (int) (600 - idr.back().packets)).count();
+  auto actual_ms = std::chrono::duration<double, std::milli>(idr.back().time - start).count();
+  EXPECT_NEAR(actual_ms, expected_ms, 1.0);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  PacingRateTests,
+  PacingRateTest,
+  testing::Values(
+    40'000'000,
+    800'000'000,
+    10'000'000'000
+  )
+);
+
+TEST(PacingTests, FrameAfterIdleIsSentImmediately) {
+  pacing::pacer_t pacer;
+  pacer.set_rate(800'000'000, PACKET_SIZE);
+
+  auto start = pacing::clock::time_point {} + 1h;
+  auto frames = replay(pacer, start, 100ms, {600, 20});
+
+  ASSERT_EQ(frames[0].front().time, start);
+  ASSERT_EQ(frames[1].front().time, start + 100ms);
+}
+
+TEST(PacingTests, FrameWaitsForPreviousFrame) {
+  pacing::pacer_t pacer;
+  pacer.set_rate(800'000'000, PACKET_SIZE);
+
+  // Both frames arrive at once, so the second frame must wait for the first to be paid off
+  auto start = pacing::clock::time_point {} + 1h;
+  auto frames = replay(pacer, start, 0ms, {600, 20});
+
+  ASSERT_GE(frames[1].front().time, start + packet_interval(800'000'000) * 600);
+}
+
+TEST(PacingTests, LinkRateLimitsIdrBurst) {
+  auto start = pacing::clock::time_point {} + 1h;
+
+  pacing::pacer_t slow;
+  slow.set_rate(800'000'000, PACKET_SIZE);
+  auto slow_idr = replay(slow, start, 16667us, {600}).front();
+
+  pacing::pacer_t fast;
+  fast.set_rate(10'000'000'000, PACKET_SIZE);
+  auto fast_idr = replay(fast, start, 16667us, {600}).front();
+
+  // A 10GbE link rate lets an IDR frame out almost 12 times faster
+  ASSERT_GT(slow_idr.back().time - start, 7ms);
+  ASSERT_LT(fast_idr.back().time - start, 1ms);
+}
+
+TEST(PacingTests, BitrateModeSendsAverageFrameInHalfInterval) {
+  constexpr auto bitrate_kbps = 20000;
+  constexpr auto framerate = 60;
+
+  auto rate = pacing::rate_from_bitrate(bitrate_kbps);
+  ASSERT_EQ(rate, 40'000'000);
+
+  pacing::pacer_t pacer;
+  pacer.set_rate(rate, PACKET_SIZE);
+
+  auto frame_interval = std::chrono::nanoseconds {std::nano::den / framerate};
+  auto average_frame_packets = (std::size_t) bitrate_kbps * 1000 / framerate / 8 / PACKET_SIZE;
+
+  ASSERT_LE(packet_interval(rate) * (int) average_frame_packets, frame_interval / 2);
+
+  auto start = pacing::clock::time_point {} + 1h;
+  auto frames = replay(pacer, start, frame_interval, std::vector<std::size_t>(10, average_frame_packets));
+
+  for (std::size_t x = 0; x < frames.size(); ++x) {
+    auto arrival = start + frame_interval * (int) x;
+
+    // Each frame starts as soon as it arrives and is done within half of the frame interval
+    ASSERT_EQ(frames[x].front().time, arrival);
+    ASSERT_LE(frames[x].back().time - arrival, frame_interval / 2);
+  }
+}
@@ -2,12 +2,20 @@
  * @file tests/unit/test_rswrapper.cpp
  * @brief Test src/rswrapper.*
  */
+// standard includes
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+
 extern "C" {
 #include <src/rswrapper.h>
 }
 
 #include "../tests_common.h"
 
+using namespace std::literals;
+
 TEST(ReedSolomonWrapperTests, InitTest) {
   reed_solomon_init();
 
@@ -34,3 +42,139 @@ TEST(ReedSolomonWrapperTests, EncodeTest) {
 
   reed_solomon_release(rs);
 }
+
+namespace {
+  constexpr int data_shards = 40;
+  constexpr int parity_shards = 8;
+  constexpr int total_shards = data_shards + parity_shards;
+  constexpr int block_size = 1416;
+
+  /**
+   * @brief Encode a fixed pseudo-random FEC block with the active RS variant.
+   * @return The data shards followed by the parity shards.
+   */
+  std::vector<std::vector<uint8_t>> encode_block() {
+    std::vector<std::vector<uint8_t>> shards(total_shards, std::vector<uint8_t>(block_size));
+
+    std::uint32_t state = 0x12345678;
+    for (int x = 0; x < data_shards; ++x) {
+      for (auto &byte : shards[x]) {
+        state = state * 1664525 + 1013904223;
+        byte = (uint8_t) (state >> 24);
+      }
+    }
+
+    std::array<uint8_t *, total_shards> shard_ptrs;
+    for (int x = 0; x < total_shards; ++x) {
+      shard_ptrs[x] = shards[x].data();
+    }
+
+    auto rs = reed_solomon_new(data_shards, parity_shards);
+    EXPECT_NE(rs, nullptr);
+    EXPECT_EQ(reed_solomon_encode(rs, shard_ptrs.data(), total_shards, block_size), 0);
+    reed_solomon_release(rs);
+
+    return shards;
+  }
+}  // namespace
+
+class ReedSolomonIsaTests: public testing::TestWithParam<reed_solomon_isa_e> {
+protected:
+  void SetUp() override {
+    if (!reed_solomon_isa_supported(GetParam())) {
+      GTEST_SKIP() << reed_solomon_isa_name(GetParam()) << " is not supported on this CPU";
+    }
+  }
+
+  void TearDown() override {
+    reed_solomon_init();
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(
+  ReedSolomonWrapperTests,
+  ReedSolomonIsaTests,
+  testing::Values(REED_SOLOMON_ISA_BASELINE, REED_SOLOMON_ISA_SSSE3, REED_SOLOMON_ISA_AVX2, REED_SOLOMON_ISA_AVX512),
+  [](const auto &info) {
+    return std::string {reed_solomon_isa_name(info.param)};
+  }
+);
+
+TEST_P(ReedSolomonIsaTests, MatchesScalarEncode) {
+  ASSERT_EQ(reed_solomon_init_isa(REED_SOLOMON_ISA_SCALAR), 0);
+  auto expected = encode_block();
+
+  ASSERT_EQ(reed_solomon_init_isa(GetParam()), 0);
+  ASSERT_EQ(reed_solomon_get_isa(), GetParam());
+  auto actual = encode_block();
+
+  for (int x = data_shards; x < total_shards; ++x) {
+    ASSERT_EQ(actual[x], expected[x]) << "Parity shard " << (x - data_shards) << " differs from the scalar encoder";
+  }
+}
+
+TEST_P(ReedSolomonIsaTests, DecodeRecoversLostShards) {
+  ASSERT_EQ(reed_solomon_init_isa(GetParam()), 0);
+  auto shards = encode_block();
+  auto original = shards;
+
+  // Drop as many data shards as we have parity shards
+  std::array<uint8_t, total_shards> marks {};
+  for (int x = 0; x < parity_shards; ++x) {
+    auto lost = x * 5;
+    std::fill(std::begin(shards[lost]), std::end(shards[lost]), 0);
+    marks[lost] = 1;
+  }
+
+  std::array<uint8_t *, total_shards> shard_ptrs;
+  for (int x = 0; x < total_shards; ++x) {
+    shard_ptrs[x] = shards[x].data();
+  }
+
+  auto rs = reed_solomon_new(data_shards, parity_shards);
+  ASSERT_NE(rs, nullptr);
+  ASSERT_EQ(reed_solomon_decode(rs, shard_ptrs.data(), marks.data(), total_shards, block_size), 0);
+  reed_solomon_release(rs);
+
+  for (int x = 0; x < data_shards; ++x) {
+    ASSERT_EQ(shards[x], original[x]) << "Data shard " << x << " was not recovered";
+  }
+}
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(ReedSolomonWrapperTests, DISABLED_EncodeThroughputBenchmark) {
+  std::vector<std::vector<uint8_t>> shards(total_shards, std::vector<uint8_t>(block_size, 0x5A));
+  std::array<uint8_t *, total_shards> shard_ptrs;
+  for (int x = 0; x < total_shards; ++x) {
+    shard_ptrs[x] = shards[x].data();
+  }
+
+  for (int isa = 0; isa < REED_SOLOMON_ISA_COUNT; ++isa) {
+    if (reed_solomon_init_isa((reed_solomon_isa_e) isa)) {
+      continue;
+    }
+
+    auto rs = reed_solomon_new(data_shards, parity_shards);
+    ASSERT_NE(rs, nullptr);
+
+    // Run for a fixed amount of time so slow CI machines don't time out
+    std::size_t iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    do {
+      reed_solomon_encode(rs, shard_ptrs.data(), total_shards, block_size);
+      ++iterations;
+      elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(100));
+
+    reed_solomon_release(rs);
+
+    // Report the amount of data protected per second
+    auto seconds = std::chrono::duration<double>(elapsed).count();
+    auto gb_per_second = (double) iterations * data_shards * block_size / seconds / 1e9;
+    BOOST_LOG(tests) << "Reed-Solomon encode ["sv << reed_solomon_isa_name((reed_solomon_isa_e) isa) << "]: "sv
+                     << gb_per_second << " GB/s ("sv << data_shards << '+' << parity_shards << " shards of "sv << block_size << " bytes)"sv;
+  }
+
+  reed_solomon_init();
+}
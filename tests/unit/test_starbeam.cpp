@@ -0,0 +1,1684 @@
+/**
+ * @file tests/unit/test_starbeam.cpp
+ * @brief Test src/starbeam/*
+ */
+#include "../tests_common.h"
+
+// standard includes
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+// lib includes
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/beast/websocket.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+// local includes
+#include <src/config.h>
+#include <src/starbeam/client.h>
+#include <src/starbeam/connection_pool.h>
+#include <src/starbeam/framing.h>
+#include <src/starbeam/handler.h>
+#include <src/starbeam/udp.h>
+
+using namespace std::literals;
+using starbeam::handler::ResponseParser;
+
+TEST(ResponseParserTests, ParsesResponseFedByteByByte) {
+  constexpr auto response = "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: 5\r\n\r\nhello"sv;
+
+  ResponseParser parser;
+  for (std::size_t x = 0; x < response.size() - 1; ++x) {
+    ASSERT_EQ(parser.feed(response.substr(x, 1)), ResponseParser::Result::NeedMore);
+  }
+  ASSERT_EQ(parser.feed(response.substr(response.size() - 1)), ResponseParser::Result::Complete);
+
+  ASSERT_EQ(parser.status(), 200);
+  ASSERT_EQ(parser.reason(), "OK");
+  ASSERT_EQ(parser.header("content-type"), "text/xml");
+  ASSERT_EQ(parser.body(), "hello");
+  ASSERT_TRUE(parser.keep_alive());
+}
+
+TEST(ResponseParserTests, IgnoresDataAfterResponse) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.feed("HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\nHTTP/1.1"), ResponseParser::Result::Complete);
+  ASSERT_EQ(parser.status(), 204);
+  ASSERT_TRUE(parser.body().empty());
+}
+
+TEST(ResponseParserTests, BodyWithoutLengthEndsWithConnection) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.feed("HTTP/1.1 200 OK\r\n\r\nsome"), ResponseParser::Result::NeedMore);
+  ASSERT_EQ(parser.feed(" data"), ResponseParser::Result::NeedMore);
+  ASSERT_EQ(parser.finish(), ResponseParser::Result::Complete);
+
+  ASSERT_EQ(parser.body(), "some data");
+  ASSERT_FALSE(parser.keep_alive());
+}
+
+TEST(ResponseParserTests, TruncatedResponseIsAnError) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.feed("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort"), ResponseParser::Result::NeedMore);
+  ASSERT_EQ(parser.finish(), ResponseParser::Result::Error);
+}
+
+TEST(ResponseParserTests, ConnectionCloseIsNotKeptAlive) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.feed("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"), ResponseParser::Result::Complete);
+  ASSERT_FALSE(parser.keep_alive());
+
+  parser.reset();
+  ASSERT_EQ(parser.feed("HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n"), ResponseParser::Result::Complete);
+  ASSERT_FALSE(parser.keep_alive());
+}
+
+TEST(ResponseParserTests, ParsesRtspResponse) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.feed("RTSP/1.0 404 Not Found\r\nCSeq: 3\r\nContent-Length: 0\r\n\r\n"), ResponseParser::Result::Complete);
+
+  ASSERT_EQ(parser.status(), 404);
+  ASSERT_EQ(parser.reason(), "Not Found");
+  ASSERT_EQ(parser.headers().at("CSeq"), "3");
+}
+
+TEST(ResponseParserTests, RejectsMalformedResponses) {
+  ResponseParser parser;
+  ASSERT_EQ(parser.feed("SIP/2.0 200 OK\r\n"), ResponseParser::Result::Error);
+
+  parser.reset();
+  ASSERT_EQ(parser.feed("HTTP/1.1 OK\r\n"), ResponseParser::Result::Error);
+
+  parser.reset();
+  ASSERT_EQ(parser.feed("HTTP/1.1 200 OK\r\nContent-Length: ten\r\n"), ResponseParser::Result::Error);
+
+  parser.reset();
+  ASSERT_EQ(parser.feed("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n"), ResponseParser::Result::Error);
+}
+
+namespace {
+  namespace asio = boost::asio;
+  namespace websocket = boost::beast::websocket;
+  using tcp = asio::ip::tcp;
+  using clock = std::chrono::steady_clock;
+
+  constexpr auto SLOW_DELAY = 250ms;
+
+  /**
+   * @brief Keep-alive HTTP server standing in for nvhttp.
+   *
+   * Requests for /slow are answered after SLOW_DELAY, anything else right away.
+   */
+  class MockHttpServer {
+  public:
+    MockHttpServer():
+        acceptor {io_context, {asio::ip::address_v4::loopback(), 0}} {
+      thread = std::thread {[this]() {
+        accept();
+      }};
+    }
+
+    ~MockHttpServer() {
+      // Closing the acceptor doesn't interrupt a blocking accept, so connect to wake it up
+      stopping = true;
+      tcp::socket wake_up {io_context};
+      wake_up.connect(acceptor.local_endpoint());
+      thread.join();
+
+      for (auto &connection : connections) {
+        connection.join();
+      }
+    }
+
+    uint16_t port() const {
+      return acceptor.local_endpoint().port();
+    }
+
+    std::atomic<int> accepted {};
+
+  private:
+    void accept() {
+      while (true) {
+        boost::system::error_code ec;
+        tcp::socket socket {io_context};
+        acceptor.accept(socket, ec);
+        if (ec || stopping) {
+          return;
+        }
+
+        ++accepted;
+        connections.emplace_back([socket = std::move(socket)]() mutable {
+          serve(socket);
+        });
+      }
+    }
+
+    static void serve(tcp::socket &socket) {
+      std::string buffer;
+      while (true) {
+        boost::system::error_code ec;
+        auto size = asio::read_until(socket, asio::dynamic_buffer(buffer), "\r\n\r\n", ec);
+        if (ec) {
+          return;
+        }
+
+        auto request_line = buffer.substr(0, buffer.find("\r\n"));
+        buffer.erase(0, size);
+
+        if (request_line.find(" /slow ") != std::string::npos) {
+          std::this_thread::sleep_for(SLOW_DELAY);
+        }
+
+        constexpr auto response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nok"sv;
+        asio::write(socket, asio::buffer(response), ec);
+        if (ec) {
+          return;
+        }
+      }
+    }
+
+    asio::io_context io_context;
+    tcp::acceptor acceptor;
+    std::atomic<bool> stopping {};
+    std::thread thread;
+    std::vector<std::thread> connections;
+  };
+
+  std::string http_request(uint64_t id, const std::string &path) {
+    return R"({"type":"http_request","id":)" + std::to_string(id) +
+           R"(,"method":"GET","path":")" + path +
+           R"(","headers":{},"is_https":false,"client_addr":"127.0.0.1"})";
+  }
+
+  /**
+   * @brief Read messages from the client until the awaited responses have arrived.
+   * @param ws Relay end of the WebSocket.
+   * @param awaiting Request ids without a response, with the time they were sent.
+   * @param latencies Receives the latency of each response, by request id.
+   * @param first_id Only wait for requests with this id or later.
+   */
+  void read_responses(websocket::stream<tcp::socket> &ws, std::map<uint64_t, clock::time_point> &awaiting, std::map<uint64_t, clock::duration> &latencies, uint64_t first_id = 0) {
+    boost::beast::flat_buffer buffer;
+    while (awaiting.lower_bound(first_id) != std::end(awaiting)) {
+      ws.read(buffer);
+
+      std::istringstream ss {boost::beast::buffers_to_string(buffer.data())};
+      buffer.consume(buffer.size());
+
+      boost::property_tree::ptree tree;
+      boost::property_tree::read_json(ss, tree);
+      if (tree.get<std::string>("type") != "http_response") {
+        continue;
+      }
+
+      ASSERT_EQ(tree.get<int>("status"), 200);
+      ASSERT_EQ(tree.get<std::string>("body"), "ok");
+
+      auto id = tree.get<uint64_t>("id");
+      auto sent = awaiting.find(id);
+      ASSERT_NE(sent, awaiting.end());
+
+      latencies[id] = clock::now() - sent->second;
+      awaiting.erase(sent);
+    }
+  }
+}  // namespace
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(StarbeamRelayLoadTest, DISABLED_SlowRequestsDontDelayOthers) {
+  constexpr int slow_requests = 2;
+  constexpr int rounds = 50;
+  constexpr int per_round = 8;
+
+  MockHttpServer http;
+
+  // The relay's end of the WebSocket
+  asio::io_context io_context;
+  tcp::acceptor acceptor {io_context, {asio::ip::address_v4::loopback(), 0}};
+
+  auto client = std::make_shared<starbeam::Client>("ws://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()), "key");
+  client->set_http_handler([port = http.port()](const starbeam::protocol::HttpRequestMessage &req) {
+    auto [status, content_type, body] = starbeam::handler::forward_http_request(
+      port,
+      req.method,
+      req.path,
+      req.query.value_or(""),
+      req.headers,
+      req.body.value_or(""),
+      req.client_addr
+    );
+
+    starbeam::protocol::HttpResponseMessage resp;
+    resp.id = req.id;
+    resp.status = status;
+    resp.body = body;
+    return resp;
+  });
+  client->start();
+
+  websocket::stream<tcp::socket> ws {acceptor.accept()};
+  ws.next_layer().set_option(tcp::no_delay(true));
+  ws.accept();
+
+  std::map<uint64_t, clock::time_point> awaiting;
+  std::map<uint64_t, clock::duration> latencies;
+
+  uint64_t id = 0;
+  for (; id < slow_requests; ++id) {
+    awaiting[id] = clock::now();
+    ws.write(asio::buffer(http_request(id, "/slow")));
+  }
+
+  // Send the fast requests while the slow ones are still pending
+  for (int round = 0; round < rounds; ++round) {
+    for (int x = 0; x < per_round; ++x, ++id) {
+      awaiting[id] = clock::now();
+      ws.write(asio::buffer(http_request(id, "/fast")));
+    }
+
+    read_responses(ws, awaiting, latencies, slow_requests);
+  }
+  read_responses(ws, awaiting, latencies);
+
+  ws.close(websocket::close_code::normal);
+  client->stop();
+  starbeam::handler::shutdown();
+
+  std::vector<clock::duration> fast;
+  for (auto &[request, latency] : latencies) {
+    if (request >= slow_requests) {
+      fast.emplace_back(latency);
+    }
+  }
+  std::sort(std::begin(fast), std::end(fast));
+
+  auto percentile = [&](double p) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(fast[(std::size_t) (p * (fast.size() - 1))]);
+  };
+
+  BOOST_LOG(tests) << "Relayed "sv << latencies.size() << " requests over "sv << http.accepted << " connection(s): p50 "sv
+                   << percentile(0.5).count() << " us, p99 "sv << percentile(0.99).count() << " us"sv;
+
+  ASSERT_EQ(fast.size(), rounds * per_round);
+  ASSERT_LT(percentile(0.99), SLOW_DELAY);
+
+  // Connections are reused rather than opened for every request
+  ASSERT_LT(http.accepted, slow_requests + per_round);
+}
+
+TEST(StarbeamConnectionPoolTests, TimesOutUnresponsiveServer) {
+  // Connections complete in the backlog, but nothing ever answers them
+  asio::io_context io_context;
+  tcp::acceptor acceptor {io_context, {asio::ip::address_v4::loopback(), 0}};
+
+  starbeam::handler::ConnectionPool pool {4, 1s, 100ms};
+  ResponseParser response;
+  std::string failure;
+
+  auto start = clock::now();
+  ASSERT_FALSE(pool.exchange(acceptor.local_endpoint().port(), "GET / HTTP/1.1\r\n\r\n", response, true, failure));
+  ASSERT_LT(clock::now() - start, 1s);
+  ASSERT_NE(failure.find(boost::system::error_code {asio::error::timed_out}.message()), std::string::npos);
+}
+
+namespace {
+  using udp = boost::asio::ip::udp;
+
+  constexpr std::size_t PACKET_SIZE = 1200;
+
+  // Another loopback address, so the channel can tell the relay apart from Sunshine
+  const auto RELAY_ADDRESS = boost::asio::ip::make_address_v4("127.0.0.2");
+
+  /**
+   * @brief What the mock relay measured of a stream of packets.
+   */
+  struct relay_stats_t {
+    std::size_t sent;
+    std::size_t received;
+    double packets_per_second;
+    std::chrono::microseconds latency_p50;
+    std::chrono::microseconds latency_p99;
+  };
+
+  /**
+   * @brief A video channel of a ChannelManager, with a mock relay at the other end.
+   */
+  class RelayedChannel {
+  public:
+    RelayedChannel():
+        relay {io_context, {RELAY_ADDRESS, 0}},
+        sunshine {io_context, {boost::asio::ip::address_v4::loopback(), 0}} {
+      relay.set_option(udp::socket::receive_buffer_size(8 * 1024 * 1024));
+
+      auto port = relay.local_endpoint().port();
+      manager.initialize(RELAY_ADDRESS.to_string(), port, port, port);
+
+      starbeam::protocol::UdpChannelSetupMessage setup;
+      setup.session_id = 1;
+      setup.channel = starbeam::protocol::UdpChannelType::Video;
+      channel = {boost::asio::ip::address_v4::loopback(), manager.handle_channel_setup(setup).local_port};
+    }
+
+    /**
+     * @brief Send packets the way the stream did before direct routes, to the channel for it to forward.
+     * @return A function sending one packet.
+     */
+    std::function<void(const std::vector<char> &)> forwarded() {
+      return [this](const std::vector<char> &packet) {
+        sunshine.send_to(boost::asio::buffer(packet), channel);
+      };
+    }
+
+    /**
+     * @brief Send packets the way the stream does with a direct route, on the native socket.
+     * @return A function sending one packet.
+     */
+    std::function<void(const std::vector<char> &)> direct() {
+      auto route = manager.find_direct_route(channel);
+      return [route](const std::vector<char> &packet) {
+        ::sendto(route->socket->native_handle(), packet.data(), (int) packet.size(), 0, route->relay_endpoint.data(), (int) route->relay_endpoint.size());
+      };
+    }
+
+    /**
+     * @brief Measure the latency the relay sees, one packet in flight at a time.
+     * @param send Sends one packet.
+     * @param count The number of packets to send.
+     * @return The measurements.
+     */
+    relay_stats_t latency(const std::function<void(const std::vector<char> &)> &send, std::size_t count) {
+      std::vector<char> packet(PACKET_SIZE);
+      std::vector<char> received(PACKET_SIZE);
+
+      std::vector<clock::duration> latencies;
+      for (std::size_t x = 0; x < count; ++x) {
+        auto start = clock::now();
+        send(packet);
+        relay.receive(boost::asio::buffer(received));
+        latencies.emplace_back(clock::now() - start);
+      }
+      std::sort(std::begin(latencies), std::end(latencies));
+
+      auto percentile = [&](double p) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(latencies[(std::size_t) (p * (latencies.size() - 1))]);
+      };
+
+      return {count, count, 0.0, percentile(0.5), percentile(0.99)};
+    }
+
+    /**
+     * @brief Measure how many packets a second reach the relay when sent as fast as possible.
+     * @param send Sends one packet.
+     * @param count The number of packets to send.
+     * @return The measurements.
+     */
+    relay_stats_t throughput(const std::function<void(const std::vector<char> &)> &send, std::size_t count) {
+      std::size_t received = 0;
+      clock::time_point last_received;
+
+      std::thread receiver {[&]() {
+        std::vector<char> packet(PACKET_SIZE);
+        while (relay.receive(boost::asio::buffer(packet)) == PACKET_SIZE) {
+          ++received;
+          last_received = clock::now();
+        }
+      }};
+
+      std::vector<char> packet(PACKET_SIZE);
+      auto start = clock::now();
+      for (std::size_t x = 0; x < count; ++x) {
+        send(packet);
+      }
+
+      // Let the channel drain, then tell the receiver to stop
+      std::this_thread::sleep_for(200ms);
+      sunshine.send_to(boost::asio::buffer(packet.data(), 1), relay.local_endpoint());
+      receiver.join();
+
+      std::chrono::duration<double> elapsed = last_received - start;
+      return {count, received, received ? received / elapsed.count() : 0.0, {}, {}};
+    }
+
+    asio::io_context io_context;
+    udp::socket relay;
+    udp::socket sunshine;
+
+    starbeam::udp::ChannelManager manager;
+    udp::endpoint channel;
+  };
+}  // namespace
+
+TEST(StarbeamUdpTests, FindsDirectRouteOnlyForChannels) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  RelayedChannel relayed;
+
+  auto route = relayed.manager.find_direct_route(relayed.channel);
+  ASSERT_TRUE(route);
+  EXPECT_EQ(route->relay_endpoint, relayed.relay.local_endpoint());
+
+  EXPECT_FALSE(relayed.manager.find_direct_route({boost::asio::ip::address_v4::loopback(), (std::uint16_t) (relayed.channel.port() + 1)}));
+  EXPECT_FALSE(relayed.manager.find_direct_route({boost::asio::ip::make_address("192.0.2.1"), relayed.channel.port()}));
+}
+
+TEST(StarbeamUdpTests, DirectRouteKeepsTheChannelPort) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  RelayedChannel relayed;
+
+  std::vector<char> packet(PACKET_SIZE);
+  std::vector<char> received(PACKET_SIZE);
+  udp::endpoint from;
+
+  // The relay must see both kinds of packets from the same address, it only knows the channel's
+  relayed.forwarded()(packet);
+  relayed.relay.receive_from(boost::asio::buffer(received), from);
+  auto forwarded_from = from;
+
+  relayed.direct()(packet);
+  relayed.relay.receive_from(boost::asio::buffer(received), from);
+  EXPECT_EQ(from.port(), forwarded_from.port());
+  EXPECT_EQ(from.port(), relayed.channel.port());
+}
+
+TEST(StarbeamUdpTests, DirectRouteOutlivesShutdown) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  RelayedChannel relayed;
+
+  auto send = relayed.direct();
+  relayed.manager.shutdown();
+  EXPECT_FALSE(relayed.manager.find_direct_route(relayed.channel));
+
+  // A session that's still streaming keeps sending until it ends
+  std::vector<char> packet(PACKET_SIZE);
+  send(packet);
+  EXPECT_EQ(relayed.relay.receive(boost::asio::buffer(packet)), PACKET_SIZE);
+}
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(StarbeamUdpTests, DISABLED_DirectRouteBenchmark) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  constexpr std::size_t latency_packets = 2'000;
+  constexpr std::size_t throughput_packets = 100'000;
+
+  RelayedChannel relayed;
+
+  auto log = [](std::string_view mode, const relay_stats_t &latency, const relay_stats_t &throughput) {
+    BOOST_LOG(tests) << "Starbeam "sv << mode << ": latency p50 "sv << latency.latency_p50.count() << " us, p99 "sv
+                     << latency.latency_p99.count() << " us, "sv << (std::size_t) throughput.packets_per_second << " packets/s, "sv
+                     << throughput.received << '/' << throughput.sent << " received"sv;
+  };
+
+  auto forwarded_latency = relayed.latency(relayed.forwarded(), latency_packets);
+  auto forwarded_throughput = relayed.throughput(relayed.forwarded(), throughput_packets);
+  log("loopback hop"sv, forwarded_latency, forwarded_throughput);
+
+  auto direct_latency = relayed.latency(relayed.direct(), latency_packets);
+  auto direct_throughput = relayed.throughput(relayed.direct(), throughput_packets);
+  log("direct"sv, direct_latency, direct_throughput);
+
+  ASSERT_GT(forwarded_throughput.received, 0);
+  ASSERT_GT(direct_throughput.received, 0);
+
+  // Skipping a hop can't make delivery slower in any meaningful way
+  ASSERT_LE(direct_latency.latency_p50, forwarded_latency.latency_p50 + 50us);
+}
+
+namespace {
+  /**
+   * @brief Stands in for the relay server, sending every datagram back where it came from.
+   */
+  class EchoRelay {
+  public:
+    EchoRelay():
+        socket {io_context, {RELAY_ADDRESS, 0}} {
+      socket.set_option(udp::socket::receive_buffer_size(8 * 1024 * 1024));
+
+      thread = std::thread {[this]() {
+        std::vector<char> packet(PACKET_SIZE);
+        udp::endpoint sender;
+        while (true) {
+          auto len = socket.receive_from(boost::asio::buffer(packet), sender);
+          if (len != PACKET_SIZE) {
+            break;
+          }
+
+          boost::system::error_code ec;
+          socket.send_to(boost::asio::buffer(packet.data(), len), sender, 0, ec);
+        }
+      }};
+    }
+
+    ~EchoRelay() {
+      udp::socket stop {io_context, udp::v4()};
+      stop.send_to(boost::asio::buffer("x", 1), socket.local_endpoint());
+      thread.join();
+    }
+
+    uint16_t port() const {
+      return socket.local_endpoint().port();
+    }
+
+  private:
+    asio::io_context io_context;
+    udp::socket socket;
+    std::thread thread;
+  };
+
+  /**
+   * @brief Stands in for Sunshine's video socket, which every session's video channel forwards to.
+   */
+  class SunshineVideo {
+  public:
+    SunshineVideo():
+        socket {io_context, {boost::asio::ip::address_v4::loopback(), 0}},
+        base_port {config::sunshine.port} {
+      socket.set_option(udp::socket::receive_buffer_size(8 * 1024 * 1024));
+
+      // Channels forward to the video port, 9 above the base port
+      config::sunshine.port = socket.local_endpoint().port() - 9;
+    }
+
+    ~SunshineVideo() {
+      config::sunshine.port = base_port;
+    }
+
+    asio::io_context io_context;
+    udp::socket socket;
+
+  private:
+    std::uint16_t base_port;
+  };
+
+  /**
+   * @brief Set up the video channel of a session.
+   * @param manager The channel manager.
+   * @param session_id The session.
+   * @return The channel's local address.
+   */
+  udp::endpoint setup_video(starbeam::udp::ChannelManager &manager, std::uint64_t session_id) {
+    starbeam::protocol::UdpChannelSetupMessage setup;
+    setup.session_id = session_id;
+    setup.channel = starbeam::protocol::UdpChannelType::Video;
+    return {boost::asio::ip::address_v4::loopback(), manager.handle_channel_setup(setup).local_port};
+  }
+
+  /**
+   * @brief Wait for a condition to become true.
+   * @param condition The condition.
+   * @param timeout How long to wait at most.
+   * @return Whether it became true in time.
+   */
+  bool eventually(const std::function<bool()> &condition, clock::duration timeout = 3s) {
+    auto deadline = clock::now() + timeout;
+    while (!condition()) {
+      if (clock::now() > deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(5ms);
+    }
+    return true;
+  }
+}  // namespace
+
+TEST(StarbeamUdpTests, ChannelsArePerSession) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  EchoRelay relay;
+  SunshineVideo sunshine;
+
+  starbeam::udp::ChannelManager manager;
+  manager.initialize(RELAY_ADDRESS.to_string(), relay.port(), relay.port(), relay.port());
+
+  auto first = setup_video(manager, 1);
+  auto second = setup_video(manager, 2);
+  ASSERT_NE(first.port(), 0);
+  ASSERT_NE(second.port(), 0);
+  EXPECT_NE(first.port(), second.port());
+  EXPECT_EQ(setup_video(manager, 1), first);
+  EXPECT_EQ(manager.get_local_port(2, starbeam::protocol::UdpChannelType::Video), second.port());
+
+  // A round trip through each session's channel
+  std::vector<char> packet(PACKET_SIZE);
+  for (auto &channel : {first, second}) {
+    udp::endpoint from;
+    sunshine.socket.send_to(boost::asio::buffer(packet), channel);
+    ASSERT_EQ(sunshine.socket.receive_from(boost::asio::buffer(packet), from), PACKET_SIZE);
+    EXPECT_EQ(from, channel);
+  }
+
+  // Datagrams are counted once they were forwarded
+  ASSERT_TRUE(eventually([&]() {
+    auto stats = manager.get_stats();
+    return std::all_of(std::begin(stats), std::end(stats), [](auto &channel) {
+      return channel.packets_to_local == 1;
+    });
+  }));
+
+  auto stats = manager.get_stats();
+  ASSERT_EQ(stats.size(), 2);
+  for (auto &channel : stats) {
+    EXPECT_EQ(channel.packets_to_relay, 1);
+    EXPECT_EQ(channel.bytes_to_relay, PACKET_SIZE);
+    EXPECT_EQ(channel.packets_to_local, 1);
+    EXPECT_EQ(channel.bytes_to_local, PACKET_SIZE);
+    EXPECT_EQ(channel.drops, 0);
+  }
+
+  manager.close_session(1);
+  EXPECT_EQ(manager.get_local_port(1, starbeam::protocol::UdpChannelType::Video), 0);
+  ASSERT_EQ(manager.get_stats().size(), 1);
+  EXPECT_EQ(manager.get_stats().front().session_id, 2);
+}
+
+TEST(StarbeamUdpTests, DropsOversizedDatagrams) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  EchoRelay relay;
+  SunshineVideo sunshine;
+
+  starbeam::udp::ChannelManager manager;
+  manager.initialize(RELAY_ADDRESS.to_string(), relay.port(), relay.port(), relay.port());
+  auto channel = setup_video(manager, 1);
+
+  std::vector<char> packet(starbeam::udp::ChannelManager::MAX_DATAGRAM_SIZE + 1);
+  sunshine.socket.send_to(boost::asio::buffer(packet), channel);
+
+  // Followed by one that fits, to know when the first one was handled
+  packet.resize(PACKET_SIZE);
+  sunshine.socket.send_to(boost::asio::buffer(packet), channel);
+  ASSERT_EQ(sunshine.socket.receive(boost::asio::buffer(packet)), PACKET_SIZE);
+
+  auto stats = manager.get_stats();
+  ASSERT_EQ(stats.size(), 1);
+  EXPECT_EQ(stats.front().drops, 1);
+  EXPECT_EQ(stats.front().packets_to_relay, 1);
+}
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(StarbeamUdpTests, DISABLED_MultiSessionRelayBenchmark) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  constexpr std::size_t sessions = 8;
+  constexpr std::size_t packets = 200'000;
+
+  EchoRelay relay;
+  SunshineVideo sunshine;
+
+  starbeam::udp::ChannelManager manager;
+  manager.initialize(RELAY_ADDRESS.to_string(), relay.port(), relay.port(), relay.port());
+
+  std::vector<udp::endpoint> channels;
+  for (std::size_t x = 0; x < sessions; ++x) {
+    channels.emplace_back(setup_video(manager, x + 1));
+  }
+
+  std::size_t received = 0;
+  clock::time_point last_received;
+  std::thread receiver {[&]() {
+    std::vector<char> packet(PACKET_SIZE);
+    while (sunshine.socket.receive(boost::asio::buffer(packet)) == PACKET_SIZE) {
+      ++received;
+      last_received = clock::now();
+    }
+  }};
+
+  // Interleave the sessions, as concurrent streams would
+  std::vector<char> packet(PACKET_SIZE);
+  auto start = clock::now();
+  for (std::size_t x = 0; x < packets; ++x) {
+    sunshine.socket.send_to(boost::asio::buffer(packet), channels[x % sessions]);
+  }
+
+  std::vector<starbeam::udp::ChannelStats> stats;
+  std::uint64_t to_relay = 0;
+  std::uint64_t to_local = 0;
+  std::uint64_t drops = 0;
+
+  // Let the channels drain until nothing moves anymore, then tell the receiver to stop
+  for (std::uint64_t forwarded = -1; forwarded != to_relay + to_local;) {
+    forwarded = to_relay + to_local;
+    std::this_thread::sleep_for(200ms);
+
+    stats = manager.get_stats();
+    to_relay = to_local = drops = 0;
+    for (auto &channel : stats) {
+      to_relay += channel.packets_to_relay;
+      to_local += channel.packets_to_local;
+      drops += channel.drops;
+    }
+  }
+  sunshine.socket.send_to(boost::asio::buffer(packet.data(), 1), sunshine.socket.local_endpoint());
+  receiver.join();
+
+  std::chrono::duration<double> elapsed = last_received - start;
+  BOOST_LOG(tests) << "Starbeam relay, "sv << sessions << " sessions: "sv << (std::size_t) (received / elapsed.count()) << " round trips/s, "sv
+                   << received << '/' << packets << " received, "sv << to_relay << " to relay, "sv << to_local << " to local, "sv
+                   << drops << " dropped"sv;
+
+  ASSERT_EQ(stats.size(), sessions);
+  for (auto &channel : stats) {
+    EXPECT_GT(channel.packets_to_relay, 0);
+    EXPECT_GT(channel.packets_to_local, 0);
+  }
+  ASSERT_GT(received, 0);
+  ASSERT_LE(received, to_local);
+}
+
+namespace {
+  // Yet another loopback address, for a client that can be reached without the relay
+  const auto PEER_ADDRESS = boost::asio::ip::make_address_v4("127.0.0.3");
+
+  constexpr auto PROBE_MAGIC = "SBP1"sv;
+  constexpr auto TOKEN = "0123456789abcdef";
+
+  /**
+   * @brief Stands in for a client on the other end of a direct path, answering hole punching probes.
+   */
+  class MockPeer {
+  public:
+    /**
+     * @param token The token the relay handed out.
+     * @param answer_token The token probes are answered with.
+     */
+    MockPeer(std::string token, std::string answer_token):
+        token {std::move(token)},
+        answer_token {std::move(answer_token)},
+        socket {io_context, {PEER_ADDRESS, 0}} {
+      thread = std::thread {[this]() {
+        run();
+      }};
+    }
+
+    ~MockPeer() {
+      stopping = true;
+      udp::socket stop {io_context, udp::v4()};
+      stop.send_to(boost::asio::buffer("x", 1), endpoint());
+      thread.join();
+    }
+
+    udp::endpoint endpoint() const {
+      return socket.local_endpoint();
+    }
+
+    /**
+     * @brief Send a probe of its own, as a client does once it has the host's candidates.
+     * @param destination Where to send it.
+     * @param timestamp Echoed back in the response.
+     */
+    void probe(const udp::endpoint &destination, std::uint64_t timestamp) {
+      send(destination, 0, timestamp, token);
+    }
+
+    /**
+     * @brief Send a datagram that isn't a probe.
+     * @param destination Where to send it.
+     */
+    void send_media(const udp::endpoint &destination) {
+      std::vector<char> packet(PACKET_SIZE);
+      socket.send_to(boost::asio::buffer(packet), destination);
+    }
+
+    const std::string token;
+    const std::string answer_token;
+
+    // Whether probes are answered
+    std::atomic<bool> answer {true};
+
+    std::atomic<int> requests {};
+    std::atomic<int> responses {};
+    std::atomic<int> media {};
+    std::atomic<std::uint64_t> response_timestamp {};
+
+  private:
+    void run() {
+      std::vector<char> packet(PACKET_SIZE);
+      udp::endpoint sender;
+      while (true) {
+        auto len = socket.receive_from(boost::asio::buffer(packet), sender);
+        if (stopping) {
+          return;
+        }
+
+        if (len < PROBE_MAGIC.size() + 9 || std::string_view(packet.data(), PROBE_MAGIC.size()) != PROBE_MAGIC) {
+          ++media;
+          continue;
+        }
+
+        std::uint64_t timestamp = 0;
+        for (std::size_t x = PROBE_MAGIC.size() + 1; x < PROBE_MAGIC.size() + 9; ++x) {
+          timestamp = timestamp << 8 | (std::uint8_t) packet[x];
+        }
+
+        if (packet[PROBE_MAGIC.size()] == 0) {
+          ++requests;
+          if (answer) {
+            send(sender, 1, timestamp, answer_token);
+          }
+        } else {
+          response_timestamp = timestamp;
+          ++responses;
+        }
+      }
+    }
+
+    void send(const udp::endpoint &destination, char kind, std::uint64_t timestamp, const std::string &with_token) {
+      std::string probe {PROBE_MAGIC};
+      probe += kind;
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        probe += (char) (timestamp >> shift);
+      }
+      probe += with_token;
+
+      boost::system::error_code ec;
+      socket.send_to(boost::asio::buffer(probe), destination, 0, ec);
+    }
+
+    asio::io_context io_context;
+    udp::socket socket;
+    std::atomic<bool> stopping {};
+    std::thread thread;
+  };
+
+  /**
+   * @brief Turns on peer-to-peer, which is off by default, for as long as it lives.
+   */
+  struct P2pEnabled {
+    P2pEnabled() {
+      config::starbeam.p2p = true;
+    }
+
+    ~P2pEnabled() {
+      config::starbeam.p2p = false;
+    }
+  };
+
+  /**
+   * @brief A video channel with a mock relay and a client it can reach directly.
+   */
+  class PunchedChannel {
+  public:
+    /**
+     * @param answer_token The token the client answers probes with.
+     */
+    explicit PunchedChannel(const std::string &answer_token = TOKEN):
+        peer {TOKEN, answer_token} {
+      manager.initialize(RELAY_ADDRESS.to_string(), relay.port(), relay.port(), relay.port());
+      manager.set_path_handler([this](const starbeam::protocol::UdpPathMessage &path) {
+        std::lock_guard lock {paths_mutex};
+        paths.push_back(path);
+      });
+      channel = setup_video(manager, 1);
+    }
+
+    /**
+     * @brief Hand the channel the client's candidates, as the relay does.
+     * @param candidates The candidates.
+     */
+    void send_candidates(std::vector<std::string> candidates) {
+      starbeam::protocol::UdpCandidatesMessage msg;
+      msg.session_id = 1;
+      msg.channel = starbeam::protocol::UdpChannelType::Video;
+      msg.token = peer.token;
+      msg.candidates = std::move(candidates);
+      manager.handle_candidates(msg);
+    }
+
+    std::vector<starbeam::protocol::UdpPathMessage> reported_paths() {
+      std::lock_guard lock {paths_mutex};
+      return paths;
+    }
+
+    starbeam::udp::ChannelStats stats() {
+      return manager.get_stats().at(0);
+    }
+
+    P2pEnabled p2p;
+    EchoRelay relay;
+    SunshineVideo sunshine;
+    MockPeer peer;
+
+    starbeam::udp::ChannelManager manager;
+    udp::endpoint channel;
+
+  private:
+    std::mutex paths_mutex;
+    std::vector<starbeam::protocol::UdpPathMessage> paths;
+  };
+
+  /**
+   * @brief Receive a datagram without blocking forever.
+   * @param socket The socket.
+   * @param timeout How long to wait at most.
+   * @return The size of the datagram, 0 if none arrived in time.
+   */
+  std::size_t receive_within(udp::socket &socket, clock::duration timeout = 1s) {
+    if (!eventually([&]() {
+          return socket.available() > 0;
+        },
+                    timeout)) {
+      return 0;
+    }
+
+    std::vector<char> packet(starbeam::udp::ChannelManager::MAX_DATAGRAM_SIZE);
+    return socket.receive(boost::asio::buffer(packet));
+  }
+}  // namespace
+
+TEST(StarbeamUdpTests, OffersHostCandidates) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  P2pEnabled p2p;
+  EchoRelay relay;
+  starbeam::udp::ChannelManager manager;
+  manager.initialize(RELAY_ADDRESS.to_string(), relay.port(), relay.port(), relay.port());
+
+  starbeam::protocol::UdpChannelSetupMessage setup;
+  setup.session_id = 1;
+  setup.channel = starbeam::protocol::UdpChannelType::Video;
+  auto ack = manager.handle_channel_setup(setup);
+
+  // The address the relay is reached from, with the channel's port
+  ASSERT_EQ(ack.candidates.size(), 1);
+  ASSERT_TRUE(ack.candidates[0].ends_with(":" + std::to_string(ack.local_port)));
+  ASSERT_NE(ack.to_json().find(R"("candidates":[")"), std::string::npos);
+
+  config::starbeam.p2p = false;
+  setup.session_id = 2;
+  ack = manager.handle_channel_setup(setup);
+  config::starbeam.p2p = true;
+  ASSERT_TRUE(ack.candidates.empty());
+  ASSERT_EQ(ack.to_json().find("candidates"), std::string::npos);
+
+  constexpr auto candidates = R"({"type":"udp_candidates","session_id":1,"channel":"audio","token":"abc","candidates":["198.51.100.7:50000","10.0.0.2:50000"]})";
+  ASSERT_EQ(starbeam::protocol::parse_message_type(candidates), starbeam::protocol::MessageType::UdpCandidates);
+
+  auto msg = starbeam::protocol::UdpCandidatesMessage::from_json(candidates);
+  ASSERT_EQ(msg.channel, starbeam::protocol::UdpChannelType::Audio);
+  ASSERT_EQ(msg.token, "abc");
+  ASSERT_EQ(msg.candidates, (std::vector<std::string> {"198.51.100.7:50000", "10.0.0.2:50000"}));
+}
+
+TEST(StarbeamUdpTests, PunchesDirectPathToPeer) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  PunchedChannel punched;
+
+  // Candidates that don't answer are probed too, but don't get in the way
+  punched.send_candidates({"192.0.2.1:9", "not an address", "[::1]:9", punched.peer.endpoint().address().to_string() + ":" + std::to_string(punched.peer.endpoint().port())});
+  ASSERT_TRUE(eventually([&]() {
+    return punched.stats().direct;
+  }));
+
+  // The path is reported right after the channel switches to it
+  ASSERT_TRUE(eventually([&]() {
+    return !punched.reported_paths().empty();
+  }));
+  auto paths = punched.reported_paths();
+  ASSERT_EQ(paths.size(), 1);
+  EXPECT_TRUE(paths[0].direct);
+  EXPECT_EQ(paths[0].session_id, 1);
+  EXPECT_EQ(paths[0].peer, "127.0.0.3:" + std::to_string(punched.peer.endpoint().port()));
+  EXPECT_TRUE(paths[0].rtt_us);
+  EXPECT_NE(paths[0].to_json().find(R"("path":"direct")"), std::string::npos);
+
+  // Streams send straight to the client
+  auto route = punched.manager.find_direct_route(punched.channel);
+  ASSERT_TRUE(route);
+  EXPECT_EQ(route->destination(), punched.peer.endpoint());
+
+  // And so does the channel, while the client's traffic reaches Sunshine from either path
+  std::vector<char> packet(PACKET_SIZE);
+  punched.sunshine.socket.send_to(boost::asio::buffer(packet), punched.channel);
+  ASSERT_TRUE(eventually([&]() {
+    return punched.peer.media > 0;
+  }));
+
+  punched.peer.send_media(punched.channel);
+  ASSERT_EQ(receive_within(punched.sunshine.socket), PACKET_SIZE);
+
+  auto stats = punched.stats();
+  EXPECT_EQ(stats.packets_to_peer, 1);
+  EXPECT_EQ(stats.packets_to_relay, 0);
+  EXPECT_EQ(stats.packets_to_local, 1);
+  EXPECT_GT(stats.rtt_us, 0);
+
+  // Keepalives keep the path open
+  std::this_thread::sleep_for(starbeam::udp::ChannelManager::PEER_TIMEOUT * 2);
+  EXPECT_TRUE(punched.stats().direct);
+  EXPECT_EQ(punched.reported_paths().size(), 1);
+}
+
+TEST(StarbeamUdpTests, FallsBackToRelayWhenPeerGoesQuiet) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  PunchedChannel punched;
+
+  punched.send_candidates({"127.0.0.3:" + std::to_string(punched.peer.endpoint().port())});
+  ASSERT_TRUE(eventually([&]() {
+    return punched.stats().direct;
+  }));
+
+  punched.peer.answer = false;
+  ASSERT_TRUE(eventually([&]() {
+    return !punched.stats().direct;
+  }));
+
+  ASSERT_TRUE(eventually([&]() {
+    return punched.reported_paths().size() == 2;
+  }));
+  auto paths = punched.reported_paths();
+  ASSERT_EQ(paths.size(), 2);
+  EXPECT_FALSE(paths[1].direct);
+  EXPECT_FALSE(paths[1].peer);
+  EXPECT_NE(paths[1].to_json().find(R"("path":"relay")"), std::string::npos);
+
+  auto route = punched.manager.find_direct_route(punched.channel);
+  EXPECT_EQ(route->destination(), route->relay_endpoint);
+
+  // Sunshine's traffic goes through the relay again, which sends it back here
+  std::vector<char> packet(PACKET_SIZE);
+  punched.sunshine.socket.send_to(boost::asio::buffer(packet), punched.channel);
+  ASSERT_EQ(receive_within(punched.sunshine.socket), PACKET_SIZE);
+  EXPECT_EQ(punched.stats().packets_to_relay, 1);
+
+  // The client is probed for a while longer, but the path isn't reported again
+  std::this_thread::sleep_for(starbeam::udp::ChannelManager::PUNCH_TIMEOUT + 200ms);
+  EXPECT_EQ(punched.reported_paths().size(), 2);
+}
+
+TEST(StarbeamUdpTests, StaysOnRelayWithoutValidAnswer) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  PunchedChannel punched {"not the token"};
+
+  punched.send_candidates({"127.0.0.3:" + std::to_string(punched.peer.endpoint().port())});
+  ASSERT_TRUE(eventually([&]() {
+    return !punched.reported_paths().empty();
+  }));
+
+  auto paths = punched.reported_paths();
+  ASSERT_EQ(paths.size(), 1);
+  EXPECT_FALSE(paths[0].direct);
+
+  auto stats = punched.stats();
+  EXPECT_FALSE(stats.direct);
+  EXPECT_GT(punched.peer.requests, 1);
+  EXPECT_GT(stats.drops, 0);
+}
+
+TEST(StarbeamUdpTests, AnswersPeerProbes) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  PunchedChannel punched;
+
+  // Without a token from the relay, a probe is just a datagram from an unknown address, which is dropped
+  punched.peer.probe(punched.channel, 42);
+  ASSERT_TRUE(eventually([&]() {
+    return punched.stats().drops == 1;
+  }));
+  EXPECT_EQ(punched.stats().packets_to_relay, 0);
+
+  // The client may reach the host from an address the relay didn't know about.
+  // Like the host, it keeps probing until it gets an answer.
+  punched.send_candidates({});
+  ASSERT_TRUE(eventually([&]() {
+    punched.peer.probe(punched.channel, 42);
+    return punched.peer.responses > 0;
+  }));
+  EXPECT_EQ(punched.peer.response_timestamp, 42);
+
+  // It's probed right back, which makes a direct path
+  ASSERT_TRUE(eventually([&]() {
+    return punched.stats().direct;
+  }));
+  EXPECT_EQ(punched.reported_paths().back().peer, "127.0.0.3:" + std::to_string(punched.peer.endpoint().port()));
+}
+
+namespace {
+  using namespace starbeam::protocol;
+  namespace framing = starbeam::framing;
+
+  // Bytes like an image has, including NULs and invalid UTF-8 unless limited to 7 bits
+  std::string binary_body(std::size_t size, int max = 255) {
+    std::mt19937 gen {size};
+    std::uniform_int_distribution<int> byte {0, max};
+
+    std::string body(size, '\0');
+    for (auto &c : body) {
+      c = (char) byte(gen);
+    }
+    return body;
+  }
+
+  template<class T>
+  T round_trip(const T &message, std::size_t chunk_size = framing::DEFAULT_CHUNK_SIZE) {
+    framing::Decoder decoder;
+    auto frames = framing::encode(message, chunk_size);
+    for (std::size_t x = 0; x + 1 < frames.size(); ++x) {
+      EXPECT_FALSE(decoder.feed(frames[x]));
+    }
+
+    auto decoded = decoder.feed(frames.back());
+    EXPECT_TRUE(decoded);
+    EXPECT_EQ(decoder.pending(), 0);
+    return std::get<T>(*decoded);
+  }
+}  // namespace
+
+TEST(StarbeamFramingTests, HttpRequestRoundTrip) {
+  HttpRequestMessage req;
+  req.id = 0x0123456789abcdef;
+  req.method = "POST";
+  req.path = "/pair";
+  req.query = "uniqueid=0123&phrase=getservercert";
+  req.headers = {{"Content-Type", "application/octet-stream"}, {"Host", "relay"}};
+  req.body = binary_body(1000);
+  req.is_https = true;
+  req.client_addr = "203.0.113.7";
+
+  auto decoded = round_trip(req);
+  ASSERT_EQ(decoded.id, req.id);
+  ASSERT_EQ(decoded.method, req.method);
+  ASSERT_EQ(decoded.path, req.path);
+  ASSERT_EQ(decoded.query, req.query);
+  ASSERT_EQ(decoded.headers, req.headers);
+  ASSERT_EQ(decoded.body, req.body);
+  ASSERT_TRUE(decoded.is_https);
+  ASSERT_EQ(decoded.client_addr, req.client_addr);
+
+  // An empty query or body is kept apart from none at all
+  req.query = "";
+  req.body.reset();
+  req.is_https = false;
+  decoded = round_trip(req);
+  ASSERT_EQ(decoded.query, ""s);
+  ASSERT_FALSE(decoded.body);
+  ASSERT_FALSE(decoded.is_https);
+
+  req.query.reset();
+  req.body = "";
+  decoded = round_trip(req);
+  ASSERT_FALSE(decoded.query);
+  ASSERT_EQ(decoded.body, ""s);
+}
+
+TEST(StarbeamFramingTests, ResponsesRoundTrip) {
+  HttpResponseMessage http;
+  http.id = 7;
+  http.status = 200;
+  http.headers = {{"Content-Type", "image/png"}};
+  http.body = binary_body(4096);
+
+  auto decoded_http = round_trip(http);
+  ASSERT_EQ(decoded_http.id, http.id);
+  ASSERT_EQ(decoded_http.status, http.status);
+  ASSERT_EQ(decoded_http.headers, http.headers);
+  ASSERT_EQ(decoded_http.body, http.body);
+
+  RtspRequestMessage rtsp_req;
+  rtsp_req.id = 8;
+  rtsp_req.method = "ANNOUNCE";
+  rtsp_req.uri = "rtsp://relay:48010";
+  rtsp_req.headers = {{"CSeq", "5"}};
+  rtsp_req.body = "v=0\r\no=android 0 14 IN IPv4 0.0.0.0\r\n";
+  rtsp_req.client_addr = "203.0.113.7";
+
+  auto decoded_rtsp_req = round_trip(rtsp_req);
+  ASSERT_EQ(decoded_rtsp_req.id, rtsp_req.id);
+  ASSERT_EQ(decoded_rtsp_req.method, rtsp_req.method);
+  ASSERT_EQ(decoded_rtsp_req.uri, rtsp_req.uri);
+  ASSERT_EQ(decoded_rtsp_req.headers, rtsp_req.headers);
+  ASSERT_EQ(decoded_rtsp_req.body, rtsp_req.body);
+  ASSERT_EQ(decoded_rtsp_req.client_addr, rtsp_req.client_addr);
+
+  RtspResponseMessage rtsp_resp;
+  rtsp_resp.id = 9;
+  rtsp_resp.status = 200;
+  rtsp_resp.reason = "OK";
+  rtsp_resp.headers = {{"CSeq", "5"}, {"Session", "DEADBEEFCAFE;timeout = 90"}};
+
+  auto decoded_rtsp_resp = round_trip(rtsp_resp);
+  ASSERT_EQ(decoded_rtsp_resp.id, rtsp_resp.id);
+  ASSERT_EQ(decoded_rtsp_resp.status, rtsp_resp.status);
+  ASSERT_EQ(decoded_rtsp_resp.reason, rtsp_resp.reason);
+  ASSERT_EQ(decoded_rtsp_resp.headers, rtsp_resp.headers);
+  ASSERT_FALSE(decoded_rtsp_resp.body);
+}
+
+TEST(StarbeamFramingTests, ChunksLargeBodies) {
+  HttpResponseMessage resp;
+  resp.id = 1;
+  resp.status = 200;
+  resp.body = binary_body(1000);
+
+  auto frames = framing::encode(resp, 300);
+  ASSERT_EQ(frames.size(), 4);
+  for (std::size_t x = 1; x < frames.size(); ++x) {
+    ASSERT_LE(frames[x].size(), framing::HEADER_SIZE + 300);
+  }
+
+  ASSERT_EQ(round_trip(resp, 300).body, resp.body);
+
+  // A body that fills its last chunk exactly doesn't need an empty frame after it
+  resp.body = binary_body(900);
+  ASSERT_EQ(framing::encode(resp, 300).size(), 3);
+  ASSERT_EQ(round_trip(resp, 300).body, resp.body);
+}
+
+TEST(StarbeamFramingTests, InterleavedMessages) {
+  HttpResponseMessage first;
+  first.id = 1;
+  first.status = 200;
+  first.body = binary_body(500);
+
+  // Same id, but another type
+  RtspResponseMessage second;
+  second.id = 1;
+  second.status = 200;
+  second.reason = "OK";
+  second.body = binary_body(400);
+
+  auto first_frames = framing::encode(first, 100);
+  auto second_frames = framing::encode(second, 100);
+
+  framing::Decoder decoder;
+  std::vector<framing::Message> decoded;
+  for (std::size_t x = 0; x < std::max(first_frames.size(), second_frames.size()); ++x) {
+    for (auto frames : {&second_frames, &first_frames}) {
+      if (x < frames->size()) {
+        if (auto message = decoder.feed((*frames)[x])) {
+          decoded.emplace_back(std::move(*message));
+        }
+      }
+    }
+  }
+
+  ASSERT_EQ(decoded.size(), 2);
+  ASSERT_EQ(std::get<RtspResponseMessage>(decoded[0]).body, second.body);
+  ASSERT_EQ(std::get<HttpResponseMessage>(decoded[1]).body, first.body);
+  ASSERT_EQ(decoder.pending(), 0);
+}
+
+TEST(StarbeamFramingTests, RejectsMalformedFrames) {
+  RtspRequestMessage req;
+  req.id = 3;
+  req.method = "SETUP";
+  req.uri = "streamid=video/0/0";
+  req.headers = {{"CSeq", "3"}};
+  req.body = binary_body(200);
+  req.client_addr = "203.0.113.7";
+
+  auto frames = framing::encode(req, 100);
+  ASSERT_EQ(frames.size(), 2);
+
+  framing::Decoder decoder;
+  ASSERT_THROW(decoder.feed(""), std::runtime_error);
+  ASSERT_THROW(decoder.feed(frames[0].substr(0, framing::HEADER_SIZE - 1)), std::runtime_error);
+  ASSERT_THROW(decoder.feed(frames[0].substr(0, framing::HEADER_SIZE + 3)), std::runtime_error);
+
+  // The rest of a message that never started
+  ASSERT_THROW(decoder.feed(frames[1]), std::runtime_error);
+
+  // Only HTTP and RTSP messages are framed
+  auto ping = frames[0];
+  ping[0] = (char) MessageType::Ping;
+  ASSERT_THROW(decoder.feed(ping), std::runtime_error);
+
+  ASSERT_EQ(decoder.pending(), 0);
+  ASSERT_FALSE(decoder.feed(frames[0]));
+  ASSERT_TRUE(decoder.feed(frames[1]));
+
+  req.uri = std::string(70000, 'a');
+  ASSERT_THROW(framing::encode(req), std::length_error);
+}
+
+TEST(StarbeamFramingTests, CapsPendingMessages) {
+  auto first_frame = [](uint64_t id) {
+    HttpResponseMessage resp;
+    resp.id = id;
+    resp.status = 200;
+    resp.body = binary_body(200);
+    return framing::encode(resp, 100)[0];
+  };
+
+  framing::Decoder decoder;
+  for (uint64_t id = 0; id < framing::MAX_PENDING_MESSAGES; ++id) {
+    ASSERT_FALSE(decoder.feed(first_frame(id)));
+  }
+  ASSERT_THROW(decoder.feed(first_frame(framing::MAX_PENDING_MESSAGES)), std::length_error);
+  ASSERT_EQ(decoder.pending(), framing::MAX_PENDING_MESSAGES);
+
+  // The message that didn't fit was dropped
+  HttpResponseMessage resp;
+  resp.id = framing::MAX_PENDING_MESSAGES;
+  resp.status = 200;
+  resp.body = binary_body(200);
+  auto frames = framing::encode(resp, 100);
+  ASSERT_THROW(decoder.feed(frames[1]), std::runtime_error);
+
+  // Restarting a pending message doesn't count twice
+  ASSERT_FALSE(decoder.feed(first_frame(0)));
+  ASSERT_EQ(decoder.pending(), framing::MAX_PENDING_MESSAGES);
+}
+
+TEST(StarbeamFramingTests, CapsPendingBodySize) {
+  HttpResponseMessage resp;
+  resp.id = 1;
+  resp.status = 200;
+  resp.body = binary_body(200);
+
+  auto frames = framing::encode(resp, 100);
+  ASSERT_EQ(frames.size(), 2);
+
+  // Continues the body without ever ending it
+  auto more = frames[1].substr(0, framing::HEADER_SIZE);
+  more[1] |= framing::More;
+  more.append(framing::MAX_PENDING_SIZE / 4, 'x');
+
+  framing::Decoder decoder;
+  ASSERT_FALSE(decoder.feed(frames[0]));
+  for (int x = 0; x < 3; ++x) {
+    ASSERT_FALSE(decoder.feed(more));
+  }
+  ASSERT_THROW(decoder.feed(more), std::length_error);
+
+  // The message was dropped, along with its body
+  ASSERT_EQ(decoder.pending(), 0);
+  ASSERT_THROW(decoder.feed(frames[1]), std::runtime_error);
+
+  ASSERT_FALSE(decoder.feed(frames[0]));
+  ASSERT_TRUE(decoder.feed(frames[1]));
+}
+
+TEST(StarbeamFramingTests, NegotiatedDuringRegistration) {
+  RegisterMessage reg;
+  reg.hostname = "host";
+  reg.unique_id = "0123";
+  reg.auth_key = "key";
+  reg.framing = {"json", framing::NAME};
+
+  std::istringstream ss {reg.to_json()};
+  boost::property_tree::ptree tree;
+  boost::property_tree::read_json(ss, tree);
+
+  std::vector<std::string> offered;
+  for (auto &[key, value] : tree.get_child("framing")) {
+    offered.emplace_back(value.get_value<std::string>());
+  }
+  ASSERT_EQ(offered, (std::vector<std::string> {"json", "binary"}));
+
+  constexpr auto ack = R"({"type":"register_ack","host_id":"host","ports":{"http":1,"https":2,"rtsp":3,"video":4,"audio":5,"control":6})"sv;
+  ASSERT_FALSE(RegisterAckMessage::from_json(std::string {ack} + "}").framing);
+  ASSERT_EQ(RegisterAckMessage::from_json(std::string {ack} + R"(,"framing":"binary"})").framing, "binary"s);
+}
+
+TEST(StarbeamFramingTests, ClientUsesNegotiatedFraming) {
+  asio::io_context io_context;
+  tcp::acceptor acceptor {io_context, {asio::ip::address_v4::loopback(), 0}};
+
+  auto client = std::make_shared<starbeam::Client>("ws://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()), "key");
+  client->set_http_handler([](const HttpRequestMessage &req) {
+    HttpResponseMessage resp;
+    resp.id = req.id;
+    resp.status = 200;
+    resp.headers = {{"Content-Type", "image/png"}};
+    resp.body = req.body;
+    return resp;
+  });
+  client->start();
+
+  websocket::stream<tcp::socket> ws {acceptor.accept()};
+  ws.accept();
+
+  boost::beast::flat_buffer buffer;
+  ws.read(buffer);
+  ASSERT_FALSE(ws.got_binary());
+  ASSERT_NE(boost::beast::buffers_to_string(buffer.data()).find(R"("framing":["json","binary"])"), std::string::npos);
+  buffer.consume(buffer.size());
+
+  ws.write(asio::buffer(R"({"type":"register_ack","host_id":"host","ports":{"http":1,"https":2,"rtsp":3,"video":4,"audio":5,"control":6},"framing":"binary"})"sv));
+
+  HttpRequestMessage req;
+  req.id = 42;
+  req.method = "GET";
+  req.path = "/appasset";
+  req.is_https = true;
+  req.client_addr = "203.0.113.7";
+  req.body = binary_body(framing::DEFAULT_CHUNK_SIZE * 2 + 100);
+
+  ws.binary(true);
+  for (auto &frame : framing::encode(req)) {
+    ws.write(asio::buffer(frame));
+  }
+
+  framing::Decoder decoder;
+  std::optional<framing::Message> decoded;
+  while (!decoded) {
+    ws.read(buffer);
+    auto message = boost::beast::buffers_to_string(buffer.data());
+    buffer.consume(buffer.size());
+
+    if (!ws.got_binary()) {
+      // Once registered, the client pings the relay in JSON
+      ASSERT_EQ(starbeam::protocol::parse_message_type(message), starbeam::protocol::MessageType::Ping);
+      continue;
+    }
+    decoded = decoder.feed(message);
+  }
+
+  auto &resp = std::get<HttpResponseMessage>(*decoded);
+  ASSERT_EQ(resp.id, req.id);
+  ASSERT_EQ(resp.status, 200);
+  ASSERT_EQ(resp.body, req.body);
+
+  ws.close(websocket::close_code::normal);
+  client->stop();
+  starbeam::udp::shutdown();
+}
+
+// Timing-dependent benchmark, run with --gtest_also_run_disabled_tests
+TEST(StarbeamFramingTests, DISABLED_FramingBenchmark) {
+  struct sample_t {
+    const char *name;
+    HttpResponseMessage resp;
+  };
+
+  std::vector<sample_t> samples(2);
+  samples[0].name = "serverinfo";
+  samples[0].resp = {1, 200, {{"Content-Type", "application/xml"}}, R"(<?xml version="1.0" encoding="utf-8"?>)"
+                                                                    R"(<root status_code="200"><hostname>Sunshine</hostname><appversion>7.1.431.-1</appversion>)"
+                                                                    R"(<GfeVersion>3.23.0.74</GfeVersion><PairStatus>1</PairStatus><currentgame>0</currentgame></root>)"};
+  // JSON can't carry invalid UTF-8 at all, so compare with a body it can carry
+  samples[1].name = "appasset";
+  samples[1].resp = {2, 200, {{"Content-Type", "image/png"}}, binary_body(256 * 1024, 127)};
+
+  constexpr auto duration = 200ms;
+
+  for (auto &[name, resp] : samples) {
+    // Messages per second and bytes on the wire, including the relay parsing the message
+    auto measure = [&](auto &&send_one) {
+      std::size_t count = 0;
+      std::size_t bytes = 0;
+      auto start = clock::now();
+      while (clock::now() - start < duration) {
+        bytes = send_one();
+        ++count;
+      }
+      return std::pair {count / std::chrono::duration<double>(clock::now() - start).count(), bytes};
+    };
+
+    auto [json_rate, json_bytes] = measure([&]() {
+      auto json = resp.to_json();
+
+      std::istringstream ss {json};
+      boost::property_tree::ptree tree;
+      boost::property_tree::read_json(ss, tree);
+      EXPECT_EQ(tree.get<std::string>("body").size(), resp.body->size());
+      return json.size();
+    });
+
+    auto [binary_rate, binary_bytes] = measure([&]() {
+      framing::Decoder decoder;
+      std::size_t size = 0;
+      std::optional<framing::Message> decoded;
+      for (auto &frame : framing::encode(resp)) {
+        size += frame.size();
+        decoded = decoder.feed(frame);
+      }
+      EXPECT_EQ(std::get<HttpResponseMessage>(*decoded).body->size(), resp.body->size());
+      return size;
+    });
+
+    BOOST_LOG(tests) << name << " ("sv << resp.body->size() << " byte body): JSON "sv << (int) json_rate << " msg/s, "sv << json_bytes
+                     << " bytes, binary "sv << (int) binary_rate << " msg/s, "sv << binary_bytes << " bytes"sv;
+
+    ASSERT_LE(binary_bytes, json_bytes);
+    ASSERT_GT(binary_rate, json_rate);
+  }
+}
+
+namespace {
+  /**
+   * @brief Read messages from the client until it pings.
+   * @param ws The relay's end of the connection.
+   * @return The ping's timestamp.
+   */
+  uint64_t read_ping(websocket::stream<tcp::socket> &ws) {
+    boost::beast::flat_buffer buffer;
+    while (true) {
+      ws.read(buffer);
+      auto message = boost::beast::buffers_to_string(buffer.data());
+      buffer.consume(buffer.size());
+
+      if (starbeam::protocol::parse_message_type(message) == starbeam::protocol::MessageType::Ping) {
+        return starbeam::protocol::PingMessage::from_json(message).ts;
+      }
+    }
+  }
+
+  void send_pong(websocket::stream<tcp::socket> &ws, uint64_t ts) {
+    ws.write(asio::buffer(starbeam::protocol::PongMessage {ts}.to_json()));
+  }
+}  // namespace
+
+TEST(StarbeamTelemetryTests, ClientMeasuresRelayRoundTrip) {
+  asio::io_context io_context;
+  tcp::acceptor acceptor {io_context, {asio::ip::address_v4::loopback(), 0}};
+
+  auto client = std::make_shared<starbeam::Client>("ws://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()), "key");
+  client->set_ping_interval(200ms);
+  client->start();
+
+  websocket::stream<tcp::socket> ws {acceptor.accept()};
+  ws.accept();
+  ws.write(asio::buffer(R"({"type":"register_ack","host_id":"host","ports":{"http":1,"https":2,"rtsp":3,"video":4,"audio":5,"control":6}})"sv));
+
+  // The relay takes a while to answer
+  auto ts = read_ping(ws);
+  std::this_thread::sleep_for(20ms);
+  send_pong(ws, ts);
+
+  ASSERT_TRUE(eventually([&]() {
+    return client->get_link_stats().rtt_ms.has_value();
+  }));
+  auto link = client->get_link_stats();
+  EXPECT_GE(*link.rtt_ms, 20);
+  EXPECT_LT(*link.rtt_ms, 200);
+  EXPECT_EQ(link.jitter_ms, 0);
+  EXPECT_EQ(link.lost, 0);
+
+  // A ping that isn't answered before the next one counts as lost, and its late pong is ignored
+  auto unanswered = read_ping(ws);
+  ts = read_ping(ws);
+  send_pong(ws, unanswered);
+  send_pong(ws, ts);
+
+  auto first_rtt_ms = *link.rtt_ms;
+  ASSERT_TRUE(eventually([&]() {
+    link = client->get_link_stats();
+    return *link.rtt_ms < first_rtt_ms;
+  }));
+  EXPECT_EQ(link.lost, 1);
+  EXPECT_GE(link.pings, 3);
+  EXPECT_GT(link.jitter_ms, 0);
+
+  ws.close(websocket::close_code::normal);
+  client->stop();
+  starbeam::udp::shutdown();
+
+  // Measurements start over with the next connection
+  EXPECT_FALSE(client->get_link_stats().rtt_ms);
+  EXPECT_EQ(client->get_link_stats().pings, 0);
+}
+
+TEST(StarbeamTelemetryTests, ChannelReportsRates) {
+#ifdef __APPLE__
+  GTEST_SKIP() << "127.0.0.2 isn't a loopback address on macOS by default";
+#endif
+  EchoRelay relay;
+  SunshineVideo sunshine;
+
+  starbeam::udp::ChannelManager manager;
+  manager.initialize(RELAY_ADDRESS.to_string(), relay.port(), relay.port(), relay.port());
+  auto channel = setup_video(manager, 1);
+
+  // Round trips through the relay, and a datagram too large to relay
+  constexpr int round_trips = 10;
+  std::vector<char> packet(PACKET_SIZE);
+  for (int x = 0; x < round_trips; ++x) {
+    sunshine.socket.send_to(boost::asio::buffer(packet), channel);
+    ASSERT_EQ(sunshine.socket.receive(boost::asio::buffer(packet)), PACKET_SIZE);
+  }
+
+  std::vector<char> oversized(starbeam::udp::ChannelManager::MAX_DATAGRAM_SIZE + 1);
+  sunshine.socket.send_to(boost::asio::buffer(oversized), channel);
+
+  // Streams sending through the channel's socket count their traffic too
+  auto route = manager.find_direct_route(channel);
+  ASSERT_TRUE(route);
+  route->count(round_trips, round_trips * PACKET_SIZE);
+
+  starbeam::udp::ChannelRates rates;
+  ASSERT_TRUE(eventually([&]() {
+    rates = manager.get_stats().front().rates;
+    return rates.packets_to_client > 0;
+  }));
+
+  // Sampled about a second after the channel was set up
+  EXPECT_NEAR(rates.packets_to_client, 2 * round_trips, round_trips / 2.0);
+  EXPECT_NEAR(rates.packets_to_local, round_trips, round_trips / 4.0);
+  EXPECT_NEAR(rates.bytes_to_client / rates.packets_to_client, PACKET_SIZE, 1e-6);
+  EXPECT_NEAR(rates.bytes_to_local / rates.packets_to_local, PACKET_SIZE, 1e-6);
+  EXPECT_DOUBLE_EQ(rates.loss, 1.0 / (3 * round_trips + 1));
+
+  // Nothing was sent since
+  ASSERT_TRUE(eventually([&]() {
+    rates = manager.get_stats().front().rates;
+    return rates.packets_to_client == 0;
+  }));
+  EXPECT_EQ(rates.bytes_to_local, 0);
+  EXPECT_EQ(rates.loss, 0);
+}
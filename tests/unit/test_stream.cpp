@@ -3,37 +3,573 @@
  * @brief Test src/stream.*
  */
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <functional>
+#include <map>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-namespace stream {
-  std::vector<uint8_t> concat_and_insert(uint64_t insert_size, uint64_t slice_size, const std::string_view &data1, const std::string_view &data2);
+#include <boost/asio.hpp>
+
+extern "C" {
+  // clang-format off
+#include <moonlight-common-c/src/Limelight-internal.h>
+#include <src/rswrapper.h>
+  // clang-format on
 }
 
+#include <src/rtsp.h>
+#include <src/starbeam/udp.h>
+#include <src/stream.h>
+
+namespace stream {
+  void replace(std::vector<std::string_view> &pieces, const std::string_view &old, const std::string_view &_new);
+  const char *slice_in_place(const std::vector<std::string_view> &pieces, size_t offset, size_t size);
+  void copy_slice(const std::vector<std::string_view> &pieces, size_t offset, size_t size, char *dest);
+
+  std::shared_ptr<safe::ring_queue_t<video::packet_t>> connect_video(session_t &session, const boost::asio::ip::udp::endpoint &peer, bool send_thread);
+  void videoSendThread(session_t *session, boost::asio::ip::udp::socket &sock);
+  void videoBroadcastThread(boost::asio::ip::udp::socket &sock);
+
+  void connect_audio(session_t &session, const boost::asio::ip::udp::endpoint &peer, std::optional<starbeam::udp::DirectRoute> route);
+  void audioBroadcastThread(boost::asio::ip::udp::socket &sock);
+}  // namespace stream
+
 #include "../tests_common.h"
 
-TEST(ConcatAndInsertTests, ConcatNoInsertionTest) {
-  char b1[] = {'a', 'b'};
-  char b2[] = {'c', 'd', 'e'};
-  auto res = stream::concat_and_insert(0, 2, std::string_view {b1, sizeof(b1)}, std::string_view {b2, sizeof(b2)});
-  auto expected = std::vector<uint8_t> {'a', 'b', 'c', 'd', 'e'};
-  ASSERT_EQ(res, expected);
+using namespace std::literals;
+
+namespace {
+  std::string join(const std::vector<std::string_view> &pieces) {
+    std::string result;
+    for (auto &piece : pieces) {
+      result += piece;
+    }
+    return result;
+  }
+}  // namespace
+
+TEST(PayloadPiecesTests, ReplaceSplitsPiece) {
+  std::string_view payload = "abcdef";
+  std::vector<std::string_view> pieces {payload};
+
+  stream::replace(pieces, "cd"sv, "XYZ"sv);
+
+  ASSERT_EQ(pieces.size(), 3);
+  ASSERT_EQ(join(pieces), "abXYZef");
+
+  // The untouched parts still reference the original payload
+  ASSERT_EQ(pieces[0].data(), payload.data());
+  ASSERT_EQ(pieces[2].data(), payload.data() + 4);
 }
 
-TEST(ConcatAndInsertTests, ConcatLargeStrideTest) {
-  char b1[] = {'a', 'b'};
-  char b2[] = {'c', 'd', 'e'};
-  auto res = stream::concat_and_insert(1, sizeof(b1) + sizeof(b2) + 1, std::string_view {b1, sizeof(b1)}, std::string_view {b2, sizeof(b2)});
-  auto expected = std::vector<uint8_t> {0, 'a', 'b', 'c', 'd', 'e'};
-  ASSERT_EQ(res, expected);
+TEST(PayloadPiecesTests, ReplaceOnlyFirstMatch) {
+  std::vector<std::string_view> pieces {"abab"sv};
+
+  stream::replace(pieces, "ab"sv, "c"sv);
+
+  ASSERT_EQ(join(pieces), "cab");
+}
+
+TEST(PayloadPiecesTests, ReplaceAtEdgesAndWithEmpty) {
+  std::vector<std::string_view> pieces {"abcd"sv};
+
+  stream::replace(pieces, "ab"sv, ""sv);
+  ASSERT_EQ(pieces.size(), 1);
+  ASSERT_EQ(join(pieces), "cd");
+
+  stream::replace(pieces, "cd"sv, "e"sv);
+  ASSERT_EQ(pieces.size(), 1);
+  ASSERT_EQ(join(pieces), "e");
+}
+
+TEST(PayloadPiecesTests, ReplaceNoMatch) {
+  std::vector<std::string_view> pieces {"ab"sv, "cd"sv};
+
+  // Matches spanning pieces are not replaced
+  stream::replace(pieces, "bc"sv, "X"sv);
+
+  ASSERT_EQ(pieces.size(), 2);
+  ASSERT_EQ(join(pieces), "abcd");
+}
+
+TEST(PayloadPiecesTests, SliceInPlace) {
+  std::string_view first = "ab";
+  std::string_view second = "cdef";
+  std::vector<std::string_view> pieces {first, second};
+
+  ASSERT_EQ(stream::slice_in_place(pieces, 0, 2), first.data());
+  ASSERT_EQ(stream::slice_in_place(pieces, 2, 2), second.data());
+  ASSERT_EQ(stream::slice_in_place(pieces, 4, 2), second.data() + 2);
+
+  // Slices spanning pieces or running past the end must be copied
+  ASSERT_EQ(stream::slice_in_place(pieces, 1, 2), nullptr);
+  ASSERT_EQ(stream::slice_in_place(pieces, 5, 2), nullptr);
+  ASSERT_EQ(stream::slice_in_place(pieces, 6, 2), nullptr);
+}
+
+TEST(PayloadPiecesTests, CopySliceAcrossPiecesWithPadding) {
+  std::vector<std::string_view> pieces {"ab"sv, "c"sv, "de"sv};
+
+  std::string slice(3, 'X');
+  stream::copy_slice(pieces, 1, 3, slice.data());
+  ASSERT_EQ(slice, "bcd"sv);
+
+  slice.assign(3, 'X');
+  stream::copy_slice(pieces, 3, 3, slice.data());
+  ASSERT_EQ(slice, "de\0"sv);
+
+  slice.assign(3, 'X');
+  stream::copy_slice(pieces, 6, 3, slice.data());
+  ASSERT_EQ(slice, "\0\0\0"sv);
 }
 
-TEST(ConcatAndInsertTests, ConcatSmallStrideTest) {
-  char b1[] = {'a', 'b'};
-  char b2[] = {'c', 'd', 'e'};
-  auto res = stream::concat_and_insert(1, 1, std::string_view {b1, sizeof(b1)}, std::string_view {b2, sizeof(b2)});
-  auto expected = std::vector<uint8_t> {0, 'a', 0, 'b', 0, 'c', 0, 'd', 0, 'e'};
-  ASSERT_EQ(res, expected);
+namespace {
+  using udp = boost::asio::ip::udp;
+
+  // The headers in front of each unencrypted video datagram, as laid out by src/stream.cpp
+  struct video_packet_raw_t {
+    RTP_PACKET rtp;
+    char reserved[4];
+    NV_VIDEO_PACKET packet;
+  };
+
+  struct datagram_t {
+    std::chrono::steady_clock::time_point received;
+    std::string data;
+
+    const video_packet_raw_t &header() const {
+      return *(const video_packet_raw_t *) data.data();
+    }
+  };
+
+  /**
+   * @brief A client receiving the video of a session on the loopback interface.
+   */
+  struct video_client_t {
+    video_client_t(boost::asio::io_context &io_context, bool send_thread):
+        sock {io_context, udp::endpoint {boost::asio::ip::address_v4::loopback(), 0}} {
+      sock.set_option(udp::socket::receive_buffer_size {8 * 1024 * 1024});
+
+      stream::config_t config {};
+      config.packetsize = 1024;
+      config.minRequiredFecPackets = 2;
+      config.monitor.framerate = 60;
+      config.monitor.bitrate = 20000;
+
+      rtsp_stream::launch_session_t launch_session {};
+      launch_session.gcm_key = crypto::aes_t(16);
+      launch_session.iv = crypto::aes_t(16);
+
+      session = stream::session::alloc(config, launch_session);
+      send_queue = stream::connect_video(*session, sock.local_endpoint(), send_thread);
+
+      thread = std::thread {[this]() {
+        std::array<char, 2048> buffer;
+        while (true) {
+          auto bytes = sock.receive(boost::asio::buffer(buffer));
+
+          // The test ends the stream with an empty datagram
+          if (bytes <= 1) {
+            break;
+          }
+          datagrams.emplace_back(std::chrono::steady_clock::now(), std::string {buffer.data(), bytes});
+        }
+      }};
+    }
+
+    /**
+     * @brief Get when the last datagram of each frame arrived.
+     * @return The arrival times by frame index.
+     */
+    std::map<std::uint32_t, std::chrono::steady_clock::time_point> frames_received() const {
+      std::map<std::uint32_t, std::chrono::steady_clock::time_point> frames;
+      for (auto &datagram : datagrams) {
+        frames[datagram.header().packet.frameIndex] = datagram.received;
+      }
+      return frames;
+    }
+
+    udp::socket sock;
+    std::shared_ptr<stream::session_t> session;
+    std::shared_ptr<safe::ring_queue_t<video::packet_t>> send_queue;
+
+    std::thread thread;
+    std::vector<datagram_t> datagrams;
+  };
+
+  /**
+   * @brief Streams synthetic video frames to clients on the loopback interface through the
+   *        broadcast thread, and through the sessions' own send threads if they have them.
+   */
+  struct VideoSendTest: testing::Test {
+    void SetUp() override {
+      reed_solomon_init();
+
+      // The broadcast thread raises the shutdown event when it ends
+      previous_mail = std::exchange(mail::man, std::make_shared<safe::mail_raw_t>());
+    }
+
+    void TearDown() override {
+      mail::man = previous_mail;
+    }
+
+    void add_clients(int count, bool send_thread) {
+      for (int x = 0; x < count; ++x) {
+        clients.emplace_back(std::make_unique<video_client_t>(io_context, send_thread));
+      }
+    }
+
+    void start() {
+      packets = mail::man->ring_queue<video::packet_t>(mail::video_packets);
+      broadcast_thread = std::thread {stream::videoBroadcastThread, std::ref(sock)};
+
+      for (auto &client : clients) {
+        if (client->send_queue) {
+          send_threads.emplace_back(stream::videoSendThread, client->session.get(), std::ref(sock));
+        }
+      }
+    }
+
+    /**
+     * @brief Send a frame to every client.
+     * @param frame The frame's payload.
+     * @param frame_index The frame's index.
+     * @return When the frame was handed to the broadcast thread.
+     */
+    std::chrono::steady_clock::time_point raise(const std::vector<std::uint8_t> &frame, int64_t frame_index) {
+      auto now = std::chrono::steady_clock::now();
+      for (auto &client : clients) {
+        video::packet_t packet = std::make_unique<video::packet_raw_generic>(std::vector<std::uint8_t> {frame}, frame_index, frame_index == 0);
+        packet->channel_data = client->session.get();
+        packet->frame_timestamp = now;
+        packets->raise(std::move(packet));
+      }
+      return now;
+    }
+
+    /**
+     * @brief Wait for every frame to be sent, then stop the threads and the clients.
+     */
+    void stop() {
+      // Stopping a queue drops what's left in it
+      auto drain = [](auto &queue) {
+        while (queue->peek()) {
+          std::this_thread::sleep_for(1ms);
+        }
+        queue->stop();
+      };
+
+      drain(packets);
+      broadcast_thread.join();
+
+      for (auto &client : clients) {
+        if (client->send_queue) {
+          drain(client->send_queue);
+        }
+      }
+      for (auto &thread : send_threads) {
+        thread.join();
+      }
+
+      for (auto &client : clients) {
+        sock.send_to(boost::asio::buffer("", 1), client->sock.local_endpoint());
+        client->thread.join();
+      }
+    }
+
+    std::shared_ptr<safe::mail_raw_t> previous_mail;
+
+    boost::asio::io_context io_context;
+    udp::socket sock {io_context, udp::endpoint {udp::v4(), 0}};
+
+    std::vector<std::unique_ptr<video_client_t>> clients;
+
+    std::shared_ptr<safe::ring_queue_t<video::packet_t>> packets;
+    std::thread broadcast_thread;
+    std::vector<std::thread> send_threads;
+  };
+
+  /**
+   * @brief Get a percentile of a list of samples.
+   * @param samples The samples, sorted in ascending order.
+   * @param percentile The percentile, from 0 to 1.
+   * @return The sample at that percentile.
+   */
+  double percentile(const std::vector<double> &samples, double percentile) {
+    return samples[std::min<std::size_t>(samples.size() * percentile, samples.size() - 1)];
+  }
+}  // namespace
+
+class VideoSendLatencyBenchmark: public VideoSendTest, public testing::WithParamInterface<std::tuple<int, bool>> {};
+
+INSTANTIATE_TEST_SUITE_P(
+  Sessions,
+  VideoSendLatencyBenchmark,
+  testing::Combine(testing::Values(1, 4, 8), testing::Bool()),
+  [](const auto &info) {
+    return std::to_string(std::get<0>(info.param)) + (std::get<1>(info.param) ? "_PerSession"s : "_Broadcast"s);
+  }
+);
+
+TEST_P(VideoSendLatencyBenchmark, FrameSendLatency) {
+  auto [sessions, send_thread] = GetParam();
+
+  // Large enough for pacing to take a while, with time to send it to every session before the next one
+  constexpr int frames = 30;
+  constexpr std::size_t frame_size = 128 * 1024;
+  constexpr auto frame_interval = 30ms;
+
+  add_clients(sessions, send_thread);
+  start();
+
+  std::vector<std::uint8_t> frame(frame_size, 0x55);
+  std::vector<std::chrono::steady_clock::time_point> raised;
+  auto next_frame = std::chrono::steady_clock::now();
+  for (int x = 0; x < frames; ++x) {
+    std::this_thread::sleep_until(next_frame);
+    next_frame += frame_interval;
+
+    raised.emplace_back(raise(frame, x));
+  }
+
+  stop();
+
+  // Time from handing a frame to the broadcast thread until its last datagram arrived
+  std::vector<double> latencies;
+  double worst_client_average = 0;
+  for (auto &client : clients) {
+    auto received = client->frames_received();
+    ASSERT_FALSE(received.empty());
+
+    double total = 0;
+    for (auto &[frame_index, last_datagram] : received) {
+      ASSERT_LT(frame_index, frames);
+
+      auto latency = std::chrono::duration<double, std::milli>(last_datagram - raised[frame_index]).count();
+      latencies.emplace_back(latency);
+      total += latency;
+    }
+    worst_client_average = std::max(worst_client_average, total / received.size());
+  }
+  std::sort(std::begin(latencies), std::end(latencies));
+
+  BOOST_LOG(tests) << "Video send latency with "sv << sessions << " session(s) on "sv << (send_thread ? "their own threads"sv : "the broadcast thread"sv)
+                   << " (p50/p99/max): "sv << percentile(latencies, 0.5) << "ms/"sv << percentile(latencies, 0.99) << "ms/"sv << latencies.back()
+                   << "ms, worst client average "sv << worst_client_average << "ms, "sv << sessions * frames - latencies.size() << " frame(s) lost"sv;
+}
+
+namespace {
+  // The payload carried by each video datagram, with the packet size the test clients request
+  constexpr std::size_t payload_blocksize = 1024 + MAX_RTP_HEADER_SIZE - sizeof(video_packet_raw_t);
+
+  // Where the fields of the headers set after computing parity are
+  constexpr std::size_t rtp_offset = offsetof(video_packet_raw_t, rtp);
+  constexpr std::size_t fec_info_offset = offsetof(video_packet_raw_t, packet) + offsetof(NV_VIDEO_PACKET, fecInfo);
+
+  /**
+   * @brief Group the datagrams of a frame by FEC block.
+   * @param datagrams The datagrams.
+   * @return The shards of each block by block index, in shard order.
+   */
+  std::map<int, std::vector<const datagram_t *>> fec_blocks(const std::vector<datagram_t> &datagrams) {
+    std::map<int, std::vector<const datagram_t *>> blocks;
+    for (auto &datagram : datagrams) {
+      auto &header = datagram.header();
+
+      auto &shards = blocks[(header.packet.multiFecBlocks >> 4) & 0x3];
+      shards.resize(std::max<std::size_t>(shards.size(), ((header.packet.fecInfo >> 12) & 0x3FF) + 1));
+      shards[(header.packet.fecInfo >> 12) & 0x3FF] = &datagram;
+    }
+    return blocks;
+  }
+
+  std::vector<std::uint8_t> make_frame(std::size_t size) {
+    std::vector<std::uint8_t> frame(size);
+    for (std::size_t x = 0; x < size; ++x) {
+      frame[x] = (std::uint8_t) (x * 7 + x / 251);
+    }
+    return frame;
+  }
+}  // namespace
+
+TEST_F(VideoSendTest, PacketizesShortLastShardAcrossFecBlocks) {
+  // Spans two FEC blocks and doesn't fill the last shard
+  auto frame = make_frame(300 * 1024 + 123);
+
+  add_clients(1, false);
+  start();
+  raise(frame, 0);
+  stop();
+
+  auto blocks = fec_blocks(clients[0]->datagrams);
+  ASSERT_EQ(blocks.size(), 2);
+
+  std::string payload;
+  std::uint16_t sequence_number = 0;
+  for (auto &[block_index, shards] : blocks) {
+    auto data_shards = shards.front()->header().packet.fecInfo >> 22;
+    ASSERT_GT(shards.size(), data_shards);
+
+    for (std::size_t x = 0; x < shards.size(); ++x) {
+      ASSERT_NE(shards[x], nullptr);
+      auto &header = shards[x]->header();
+
+      ASSERT_EQ(shards[x]->data.size(), sizeof(video_packet_raw_t) + payload_blocksize);
+      ASSERT_EQ(util::endian::big(header.rtp.sequenceNumber), sequence_number++);
+      ASSERT_EQ(header.packet.frameIndex, 0);
+      ASSERT_EQ(header.packet.multiFecBlocks, (block_index << 4) | (1 << 6));
+
+      if (x < data_shards) {
+        ASSERT_EQ((header.packet.flags & FLAG_SOF) != 0, x == 0);
+        ASSERT_EQ((header.packet.flags & FLAG_EOF) != 0, x == data_shards - 1);
+
+        payload += shards[x]->data.substr(sizeof(video_packet_raw_t));
+      }
+    }
+  }
+
+  // The short frame header, followed by the frame and zero padding
+  constexpr std::size_t frame_header_size = 8;
+  auto last_payload_len = (frame.size() + frame_header_size) % payload_blocksize;
+  ASSERT_NE(last_payload_len, 0);
+
+  ASSERT_EQ(payload[0], 0x01);
+  ASSERT_EQ((std::uint8_t) payload[4] | (std::uint8_t) payload[5] << 8, last_payload_len);
+  ASSERT_EQ(payload.size(), frame_header_size + frame.size() + payload_blocksize - last_payload_len);
+  ASSERT_TRUE(std::equal(std::begin(frame), std::end(frame), std::begin(payload) + frame_header_size, [](std::uint8_t a, char b) {
+    return a == (std::uint8_t) b;
+  }));
+  ASSERT_EQ(payload.find_first_not_of('\0', frame_header_size + frame.size()), std::string::npos);
+}
+
+TEST_F(VideoSendTest, ParityMatchesEncodingWholePackets) {
+  // Sent from shards copied around the frame header, shards pointing into the frame,
+  // and a last shard padded with zeroes
+  auto frame = make_frame(300 * 1024 + 123);
+
+  add_clients(1, false);
+  start();
+  raise(frame, 0);
+  stop();
+
+  auto blocks = fec_blocks(clients[0]->datagrams);
+  ASSERT_EQ(blocks.size(), 2);
+
+  for (auto &[block_index, shards] : blocks) {
+    std::size_t data_shards = shards.front()->header().packet.fecInfo >> 22;
+    auto parity_shards = shards.size() - data_shards;
+    auto shard_size = sizeof(video_packet_raw_t) + payload_blocksize;
+
+    // Whole packets as they were before the RTP header and FEC info were filled in,
+    // which is what parity used to be computed over
+    std::vector<std::string> packets;
+    for (std::size_t x = 0; x < shards.size(); ++x) {
+      ASSERT_NE(shards[x], nullptr);
+
+      auto &packet = packets.emplace_back(x < data_shards ? shards[x]->data : std::string(shard_size, '\0'));
+      if (x < data_shards) {
+        std::fill_n(std::begin(packet) + rtp_offset, sizeof(RTP_PACKET), '\0');
+        std::fill_n(std::begin(packet) + fec_info_offset, sizeof(std::uint32_t), '\0');
+      }
+    }
+
+    std::vector<std::uint8_t *> packets_p;
+    for (auto &packet : packets) {
+      packets_p.emplace_back((std::uint8_t *) packet.data());
+    }
+
+    auto rs = reed_solomon_new(data_shards, parity_shards);
+    ASSERT_NE(rs, nullptr);
+    reed_solomon_encode(rs, packets_p.data(), shards.size(), shard_size);
+    reed_solomon_release(rs);
+
+    for (auto x = data_shards; x < shards.size(); ++x) {
+      auto expected = packets[x];
+
+      // Fields set on every shard after computing parity
+      auto &received = shards[x]->data;
+      std::copy_n(std::begin(received) + rtp_offset, sizeof(RTP_PACKET), std::begin(expected) + rtp_offset);
+      std::copy_n(std::begin(received) + fec_info_offset, sizeof(std::uint32_t), std::begin(expected) + fec_info_offset);
+
+      auto &header = *(video_packet_raw_t *) expected.data();
+      header.packet.frameIndex = shards[x]->header().packet.frameIndex;
+      header.packet.multiFecBlocks = shards[x]->header().packet.multiFecBlocks;
+
+      ASSERT_EQ(expected, received) << "Parity shard "sv << x << " of FEC block "sv << block_index;
+    }
+  }
+}
+
+TEST(AudioSendTests, BatchesOnlyDatagramsForTheSameSocket) {
+  reed_solomon_init();
+
+  // The broadcast thread raises the shutdown event when it ends
+  auto previous_mail = std::exchange(mail::man, std::make_shared<safe::mail_raw_t>());
+  auto fg = util::fail_guard([&]() {
+    mail::man = previous_mail;
+  });
+
+  boost::asio::io_context io_context;
+  udp::socket sock {io_context, udp::endpoint {udp::v4(), 0}};
+
+  // The socket of the Starbeam channel the second client is relayed through
+  auto channel_sock = std::make_shared<udp::socket>(io_context, udp::endpoint {udp::v4(), 0});
+
+  std::array<udp::socket, 2> clients {
+    udp::socket {io_context, udp::endpoint {boost::asio::ip::address_v4::loopback(), 0}},
+    udp::socket {io_context, udp::endpoint {boost::asio::ip::address_v4::loopback(), 0}},
+  };
+
+  stream::config_t config {};
+  config.audio.packetDuration = 5;
+
+  rtsp_stream::launch_session_t launch_session {};
+  launch_session.gcm_key = crypto::aes_t(16);
+  launch_session.iv = crypto::aes_t(16);
+
+  std::array<std::shared_ptr<stream::session_t>, 2> sessions {
+    stream::session::alloc(config, launch_session),
+    stream::session::alloc(config, launch_session),
+  };
+  stream::connect_audio(*sessions[0], clients[0].local_endpoint(), std::nullopt);
+  stream::connect_audio(*sessions[1], clients[1].local_endpoint(), starbeam::udp::DirectRoute {channel_sock, clients[1].local_endpoint()});
+
+  // Queue a packet for each session before starting, so they are sent together
+  auto packets = mail::man->ring_queue<audio::packet_t>(mail::audio_packets);
+  auto pool = std::make_shared<audio::buffer_pool_t>(sessions.size(), audio::buffer_t {100});
+  for (std::size_t x = 0; x < sessions.size(); ++x) {
+    auto buffer = pool->pop();
+    std::fill(std::begin(*buffer), std::end(*buffer), (std::uint8_t) x);
+    packets->raise(sessions[x].get(), std::move(buffer));
+  }
+
+  std::thread broadcast_thread {stream::audioBroadcastThread, std::ref(sock)};
+
+  std::array<std::uint16_t, 2> expected_ports {sock.local_endpoint().port(), channel_sock->local_endpoint().port()};
+  for (std::size_t x = 0; x < clients.size(); ++x) {
+    auto deadline = std::chrono::steady_clock::now() + 1s;
+    while (!clients[x].available() && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(1ms);
+    }
+    ASSERT_GT(clients[x].available(), 0) << "Client "sv << x;
+
+    std::array<char, 2048> buffer;
+    udp::endpoint sender;
+    auto bytes = clients[x].receive_from(boost::asio::buffer(buffer), sender);
+
+    // Each client gets its own packet, sent from its session's socket
+    ASSERT_GT(bytes, 100);
+    ASSERT_EQ(buffer[bytes - 1], (char) x);
+    ASSERT_EQ(sender.port(), expected_ports[x]) << "Client "sv << x;
+  }
+
+  packets->stop();
+  broadcast_thread.join();
 }
@@ -0,0 +1,275 @@
+/**
+ * @file tests/unit/test_thread_safe.cpp
+ * @brief Test src/thread_safe.h
+ */
+#include "../tests_common.h"
+
+// standard includes
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// local includes
+#include <src/thread_safe.h>
+
+using namespace std::literals;
+
+TEST(RingQueueTests, PopsInOrder) {
+  safe::ring_queue_t<std::unique_ptr<int>> queue {8};
+
+  for (int x = 0; x < 5; ++x) {
+    queue.raise(std::make_unique<int>(x));
+  }
+
+  for (int x = 0; x < 5; ++x) {
+    ASSERT_TRUE(queue.peek());
+
+    auto val = queue.pop();
+    ASSERT_TRUE(val);
+    ASSERT_EQ(*val, x);
+  }
+
+  ASSERT_FALSE(queue.peek());
+  ASSERT_EQ(queue.overflows(), 0);
+}
+
+TEST(RingQueueTests, CapacityIsRoundedToPowerOfTwo) {
+  ASSERT_EQ(safe::ring_queue_t<int> {1}.capacity(), 1);
+  ASSERT_EQ(safe::ring_queue_t<int> {30}.capacity(), 32);
+  ASSERT_EQ(safe::ring_queue_t<int> {32}.capacity(), 32);
+}
+
+TEST(RingQueueTests, DropsOldestWhenFull) {
+  safe::ring_queue_t<int> queue {4};
+
+  for (int x = 0; x < 6; ++x) {
+    queue.raise(x);
+  }
+
+  // Only the two oldest elements are dropped, not the whole queue
+  ASSERT_EQ(queue.overflows(), 2);
+  for (int x = 2; x < 6; ++x) {
+    ASSERT_EQ(queue.pop(0ms), x);
+  }
+  ASSERT_FALSE(queue.pop(0ms));
+}
+
+TEST(RingQueueTests, SingleElementKeepsLatest) {
+  safe::ring_queue_t<std::shared_ptr<int>> queue {1};
+
+  auto first = std::make_shared<int>(1);
+  queue.raise(first);
+  queue.raise(std::make_shared<int>(2));
+
+  // The replaced element is no longer referenced by the queue
+  ASSERT_EQ(first.use_count(), 1);
+  ASSERT_EQ(*queue.pop(), 2);
+  ASSERT_EQ(queue.overflows(), 1);
+}
+
+TEST(RingQueueTests, PopTimesOut) {
+  safe::ring_queue_t<int> queue;
+
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(queue.pop(10ms));
+  ASSERT_GE(std::chrono::steady_clock::now() - start, 10ms);
+}
+
+TEST(RingQueueTests, StopWakesUpConsumer) {
+  safe::ring_queue_t<int> queue;
+
+  std::thread consumer {[&queue]() {
+    ASSERT_FALSE(queue.pop());
+  }};
+
+  std::this_thread::sleep_for(10ms);
+  queue.stop();
+  consumer.join();
+
+  // Elements raised after stopping are ignored
+  queue.raise(1);
+  ASSERT_FALSE(queue.running());
+  ASSERT_FALSE(queue.peek());
+}
+
+TEST(RingQueueTests, ManyProducersLoseNothingWhenNotFull) {
+  constexpr int producers = 4;
+  constexpr int per_producer = 10000;
+
+  safe::ring_queue_t<int> queue {producers * per_producer};
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&queue, p]() {
+      for (int x = 0; x < per_producer; ++x) {
+        queue.raise(p * per_producer + x);
+      }
+    });
+  }
+
+  std::vector<int> last(producers, -1);
+  for (int x = 0; x < producers * per_producer; ++x) {
+    auto val = queue.pop(1s);
+    ASSERT_TRUE(val);
+
+    // Elements of each producer arrive in the order they were raised
+    auto p = *val / per_producer;
+    ASSERT_GT(*val, last[p]);
+    last[p] = *val;
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(queue.overflows(), 0);
+}
+
+TEST(PoolTests, HandsOutEachObjectOnce) {
+  auto pool = std::make_shared<safe::pool_t<int>>(2, 7);
+
+  auto first = pool->pop();
+  auto second = pool->pop();
+  ASSERT_TRUE(first);
+  ASSERT_TRUE(second);
+  ASSERT_NE(first.get(), second.get());
+  ASSERT_EQ(*first, 7);
+
+  // The pool doesn't grow once every object is in use
+  ASSERT_FALSE(pool->pop());
+  ASSERT_EQ(pool->available(), 0);
+
+  *first = 8;
+  auto object = first.get();
+  first.reset();
+  ASSERT_EQ(pool->available(), 1);
+
+  // Objects keep their state, it's up to the user to reset them
+  auto again = pool->pop();
+  ASSERT_EQ(again.get(), object);
+  ASSERT_EQ(*again, 8);
+}
+
+TEST(PoolTests, ObjectsOutliveThePool) {
+  auto pool = std::make_shared<safe::pool_t<std::vector<int>>>(1, std::vector<int>(16, 1));
+  std::weak_ptr<safe::pool_t<std::vector<int>>> weak_pool = pool;
+
+  auto object = pool->pop();
+  pool.reset();
+
+  ASSERT_FALSE(weak_pool.expired());
+  ASSERT_EQ(object->size(), 16);
+
+  object.reset();
+  ASSERT_TRUE(weak_pool.expired());
+}
+
+TEST(PoolTests, ObjectsReturnFromOtherThreads) {
+  constexpr int rounds = 10000;
+
+  auto pool = std::make_shared<safe::pool_t<int>>(4, 0);
+
+  {
+    safe::ring_queue_t<safe::pool_t<int>::ptr_t> queue {4};
+
+    std::thread consumer {[&queue]() {
+      while (auto object = queue.pop()) {
+      }
+    }};
+
+    for (int x = 0; x < rounds; ++x) {
+      auto object = pool->pop();
+      while (!object) {
+        std::this_thread::yield();
+        object = pool->pop();
+      }
+
+      *object = x;
+      queue.raise(std::move(object));
+    }
+
+    queue.stop();
+    consumer.join();
+  }
+
+  // Including those still in the queue when it was stopped
+  ASSERT_EQ(pool->available(), 4);
+}
+
+namespace {
+  using clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Measure the time elements spend between being raised and being popped.
+   * @param queue The queue to measure.
+   * @param producers The number of threads raising elements at once.
+   * @return The sorted latency of each element that was popped.
+   */
+  template<class Q>
+  std::vector<clock::duration> handoff_latency(Q &queue, int producers) {
+    constexpr int per_producer = 20000;
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+      threads.emplace_back([&queue]() {
+        for (int x = 0; x < per_producer; ++x) {
+          queue.raise(clock::now());
+
+          // Keep the queue from filling up, so we measure the handoff rather than overflows
+          if (x % 16 == 0) {
+            std::this_thread::yield();
+          }
+        }
+      });
+    }
+
+    std::vector<clock::duration> latencies;
+    latencies.reserve(producers * per_producer);
+    while (auto raised = queue.pop(100ms)) {
+      latencies.emplace_back(clock::now() - *raised);
+    }
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    std::sort(std::begin(latencies), std::end(latencies));
+    return latencies;
+  }
+
+  void report(const char *name, int producers, const std::vector<clock::duration> &latencies) {
+    auto percentile = [&](double p) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(latencies[(std::size_t) (p * (latencies.size() - 1))]).count();
+    };
+
+    BOOST_LOG(tests) << name << " handoff with "sv << producers << " producer(s): "sv
+                     << latencies.size() << " elements, p50 "sv << percentile(0.5) << " ns, p99 "sv
+                     << percentile(0.99) << " ns, max "sv << percentile(1.0) << " ns"sv;
+  }
+}  // namespace
+
+struct QueueHandoffBenchmark: testing::TestWithParam<int> {};
+
+TEST_P(QueueHandoffBenchmark, CompareWithLockedQueue) {
+  auto producers = GetParam();
+
+  safe::queue_t<clock::time_point> locked {32};
+  auto locked_latencies = handoff_latency(locked, producers);
+  ASSERT_FALSE(locked_latencies.empty());
+  report("safe::queue_t", producers, locked_latencies);
+
+  safe::ring_queue_t<clock::time_point> ring {32};
+  auto ring_latencies = handoff_latency(ring, producers);
+  ASSERT_FALSE(ring_latencies.empty());
+  report("safe::ring_queue_t", producers, ring_latencies);
+
+  BOOST_LOG(tests) << "safe::ring_queue_t dropped "sv << ring.overflows() << " element(s)"sv;
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  QueueHandoffBenchmarks,
+  QueueHandoffBenchmark,
+  testing::Values(1, 2, 4)
+);
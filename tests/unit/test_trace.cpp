@@ -0,0 +1,158 @@
+/**
+ * @file tests/unit/test_trace.cpp
+ * @brief Test src/trace.*
+ */
+#include "../tests_common.h"
+
+// standard includes
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// lib includes
+#include <nlohmann/json.hpp>
+
+// local includes
+#include <src/trace.h>
+
+using namespace std::literals;
+
+namespace {
+  /**
+   * @brief Make an event whose fields can all be told apart by a single number.
+   * @param thread The thread recording the event.
+   * @param n The number.
+   * @return The event.
+   */
+  trace::event_t make_event(std::uint32_t thread, std::int64_t n) {
+    return {
+      (trace::span_e) (n % 11),
+      thread,
+      n,
+      trace::clock::time_point {std::chrono::microseconds {n}},
+      std::chrono::microseconds {n * 2},
+    };
+  }
+}  // namespace
+
+TEST(TraceRingTests, RoundsCapacityUpToAPowerOfTwo) {
+  EXPECT_EQ(trace::ring_t {1}.capacity(), 1);
+  EXPECT_EQ(trace::ring_t {5}.capacity(), 8);
+  EXPECT_EQ(trace::ring_t {64}.capacity(), 64);
+}
+
+TEST(TraceRingTests, KeepsTheNewestEventsInOrder) {
+  trace::ring_t ring {8};
+
+  EXPECT_TRUE(ring.snapshot().empty());
+
+  for (auto x = 0; x < 5; ++x) {
+    ring.push(make_event(1, x));
+  }
+  auto events = ring.snapshot();
+  ASSERT_EQ(events.size(), 5);
+  EXPECT_EQ(events.front().frame, 0);
+
+  for (auto x = 5; x < 20; ++x) {
+    ring.push(make_event(1, x));
+  }
+  events = ring.snapshot();
+  ASSERT_EQ(events.size(), 8);
+  for (std::size_t x = 0; x < events.size(); ++x) {
+    auto expected = make_event(1, 12 + x);
+    EXPECT_EQ(events[x].frame, expected.frame);
+    EXPECT_EQ(events[x].span, expected.span);
+    EXPECT_EQ(events[x].start, expected.start);
+    EXPECT_EQ(events[x].duration, expected.duration);
+  }
+}
+
+TEST(TraceRingTests, ConcurrentWritersNeverTearEvents) {
+  constexpr int writers = 4;
+  constexpr int events_per_writer = 200'000;
+
+  // Small enough to wrap many times while the reader copies it
+  trace::ring_t ring {256};
+
+  std::atomic<bool> done {false};
+  std::vector<std::thread> threads;
+  for (auto t = 0; t < writers; ++t) {
+    threads.emplace_back([&ring, t]() {
+      for (auto x = 0; x < events_per_writer; ++x) {
+        ring.push(make_event(t + 1, (std::int64_t) x * writers + t));
+      }
+    });
+  }
+
+  std::size_t snapshots = 0;
+  std::size_t checked = 0;
+  std::thread reader {[&]() {
+    while (!done) {
+      for (auto &event : ring.snapshot()) {
+        auto expected = make_event(event.thread, event.frame);
+        ASSERT_EQ(event.frame % writers, event.thread - 1);
+        ASSERT_EQ(event.span, expected.span);
+        ASSERT_EQ(event.start, expected.start);
+        ASSERT_EQ(event.duration, expected.duration);
+        ++checked;
+      }
+      ++snapshots;
+    }
+  }};
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  done = true;
+  reader.join();
+
+  EXPECT_GT(checked, 0);
+  EXPECT_EQ(ring.snapshot().size(), ring.capacity());
+  BOOST_LOG(tests) << "Checked "sv << checked << " events over "sv << snapshots << " snapshots"sv;
+}
+
+TEST(TraceRingTests, PushThroughput) {
+  constexpr int count = 1'000'000;
+  trace::ring_t ring {trace::DEFAULT_CAPACITY};
+
+  auto start = trace::clock::now();
+  for (auto x = 0; x < count; ++x) {
+    ring.push(make_event(1, x));
+  }
+  std::chrono::duration<double, std::nano> elapsed = trace::clock::now() - start;
+
+  EXPECT_EQ(ring.snapshot().size(), trace::DEFAULT_CAPACITY);
+  BOOST_LOG(tests) << "Trace event push: "sv << elapsed.count() / count << " ns"sv;
+}
+
+TEST(TraceJsonTests, ExportsCompleteEventsRelativeToTheFirstSpan) {
+  auto start = trace::clock::now();
+  std::vector<trace::event_t> events {
+    {trace::span_e::send_batch, 2, 7, start + 1500us, 250us},
+    {trace::span_e::pull_free_image, 1, -1, start, 1ms},
+  };
+
+  auto json = nlohmann::json::parse(trace::to_json(events));
+  auto &trace_events = json["traceEvents"];
+  ASSERT_EQ(trace_events.size(), 2);
+
+  auto &batch = trace_events[0];
+  EXPECT_EQ(batch["name"], "send_batch");
+  EXPECT_EQ(batch["ph"], "X");
+  EXPECT_EQ(batch["tid"], 2);
+  EXPECT_DOUBLE_EQ(batch["ts"].get<double>(), 1500.0);
+  EXPECT_DOUBLE_EQ(batch["dur"].get<double>(), 250.0);
+  EXPECT_EQ(batch["args"]["frame"], 7);
+
+  // Spans recorded before the frame number is known carry no frame
+  auto &wait = trace_events[1];
+  EXPECT_EQ(wait["name"], "pull_free_image");
+  EXPECT_DOUBLE_EQ(wait["ts"].get<double>(), 0.0);
+  EXPECT_FALSE(wait.contains("args"));
+}
+
+TEST(TraceJsonTests, ExportsAnEmptyTrace) {
+  auto json = nlohmann::json::parse(trace::to_json({}));
+  EXPECT_TRUE(json["traceEvents"].empty());
+}
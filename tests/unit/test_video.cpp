@@ -6,6 +6,13 @@
 
 #include <src/video.h>
 
+namespace video {
+  std::shared_ptr<encode_group_t> join_encode_group(const config_t &config, const std::shared_ptr<encode_subscriber_t> &subscriber, void (*run)(encode_group_t &));
+  void leave_encode_group(const std::shared_ptr<encode_group_t> &group, const std::shared_ptr<encode_subscriber_t> &subscriber);
+}  // namespace video
+
+using namespace std::literals;
+
 struct EncoderTest: PlatformTestSuite, testing::WithParamInterface<video::encoder_t *> {
   void SetUp() override {
     auto &encoder = *GetParam();
@@ -76,3 +83,205 @@ INSTANTIATE_TEST_SUITE_P(
     std::make_tuple(9498, AVRational {4749, 50})  // from my LG 27GN950
   )
 );
+
+namespace {
+  /**
+   * @brief Stands in for capturing and encoding, until the group is destroyed.
+   */
+  void wait_for_stop(video::encode_group_t &group) {
+    while (group.images->pop()) {}
+  }
+
+  video::packet_t make_packet(int64_t frame_index, bool idr) {
+    return std::make_unique<video::packet_raw_generic>(std::vector<std::uint8_t>(16), frame_index, idr);
+  }
+}  // namespace
+
+struct EncodeGroupTest: testing::Test {
+  struct client_t {
+    explicit client_t(int bitrate = 20000):
+        mail {std::make_shared<safe::mail_raw_t>()},
+        subscriber {std::make_shared<video::encode_subscriber_t>(mail, bitrate, this)} {
+    }
+
+    safe::mail_t mail;
+    std::shared_ptr<video::encode_subscriber_t> subscriber;
+  };
+
+  void SetUp() override {
+    config.width = 1920;
+    config.height = 1080;
+    config.framerate = 60;
+    config.bitrate = 20000;
+  }
+
+  std::shared_ptr<video::encode_group_t> join(client_t &client) {
+    return video::join_encode_group(config, client.subscriber, wait_for_stop);
+  }
+
+  void send(video::encode_group_t &group, int64_t frame_index, bool idr) {
+    std::lock_guard lg {group.mutex};
+    group.send(packets, make_packet(frame_index, idr));
+  }
+
+  /**
+   * @brief Take the next frame sent, and check who it was sent to.
+   * @param client The client it must be sent to.
+   * @return The frame index the client sees.
+   */
+  int64_t received(client_t &client) {
+    auto packet = packets.pop(0ms);
+    EXPECT_TRUE(packet);
+    if (!packet) {
+      return -1;
+    }
+
+    EXPECT_EQ(packet->channel_data, &client);
+    return packet->frame_index();
+  }
+
+  video::encode_group_t::requests_t take_requests(video::encode_group_t &group) {
+    std::lock_guard lg {group.mutex};
+    return group.take_requests();
+  }
+
+  video::config_t config {};
+  safe::ring_queue_t<video::packet_t> packets;
+};
+
+TEST_F(EncodeGroupTest, JoinAndLeave) {
+  client_t first;
+  client_t second;
+  client_t other;
+
+  auto group = join(first);
+  ASSERT_EQ(join(second), group);
+
+  // Clients streaming something else get their own encoder
+  config.bitrate = 10000;
+  auto other_group = join(other);
+  ASSERT_NE(other_group, group);
+  config.bitrate = 20000;
+
+  ASSERT_EQ(group->subscribers.size(), 2);
+
+  video::leave_encode_group(group, first.subscriber);
+  ASSERT_EQ(group->subscribers.size(), 1);
+  ASSERT_FALSE(group->stopped);
+
+  video::leave_encode_group(group, second.subscriber);
+  ASSERT_TRUE(group->subscribers.empty());
+  ASSERT_TRUE(group->stopped);
+
+  // The stopped group can't be joined anymore
+  auto next_group = join(first);
+  ASSERT_NE(next_group, group);
+
+  video::leave_encode_group(next_group, first.subscriber);
+  video::leave_encode_group(other_group, other.subscriber);
+}
+
+TEST_F(EncodeGroupTest, FramesAreNumberedFromEachClientsFirstIdr) {
+  client_t first;
+  client_t second;
+
+  auto group = join(first);
+
+  // The first client gets the frames as they are
+  send(*group, 1, true);
+  send(*group, 2, false);
+  ASSERT_EQ(received(first), 1);
+  ASSERT_EQ(received(first), 2);
+
+  join(second);
+
+  // The second client only gets frames from the next IDR frame on
+  send(*group, 3, false);
+  ASSERT_EQ(received(first), 3);
+  ASSERT_FALSE(packets.peek());
+
+  send(*group, 4, true);
+  ASSERT_EQ(received(first), 4);
+  ASSERT_EQ(received(second), 1);
+  ASSERT_EQ(second.subscriber->frame_offset, 3);
+
+  send(*group, 5, false);
+  ASSERT_EQ(received(first), 5);
+  ASSERT_EQ(received(second), 2);
+
+  // Once alone, the second client keeps its own numbering
+  video::leave_encode_group(group, first.subscriber);
+  send(*group, 6, false);
+  ASSERT_EQ(received(second), 3);
+  ASSERT_FALSE(packets.peek());
+
+  video::leave_encode_group(group, second.subscriber);
+}
+
+TEST_F(EncodeGroupTest, ClientJoiningMidStreamGetsIdr) {
+  client_t first;
+  client_t second;
+
+  auto group = join(first);
+  send(*group, 1, true);
+  ASSERT_EQ(received(first), 1);
+  ASSERT_FALSE(take_requests(*group).idr_frame);
+
+  join(second);
+  ASSERT_TRUE(take_requests(*group).idr_frame);
+  ASSERT_FALSE(take_requests(*group).idr_frame);
+
+  video::leave_encode_group(group, first.subscriber);
+  video::leave_encode_group(group, second.subscriber);
+}
+
+TEST_F(EncodeGroupTest, MergesRequestsOfAllClients) {
+  client_t first;
+  client_t second;
+  client_t third;
+
+  auto group = join(first);
+  send(*group, 1, true);
+  ASSERT_EQ(received(first), 1);
+
+  join(second);
+  send(*group, 5, true);
+  ASSERT_EQ(received(first), 5);
+  ASSERT_EQ(received(second), 1);
+
+  join(third);
+  take_requests(*group);
+
+  // The encoder runs at the lowest bitrate any client asked for
+  first.mail->event<int>(mail::bitrate)->raise(15000);
+  second.mail->event<int>(mail::bitrate)->raise(10000);
+
+  // Frames lost by each client, in their own numbering, are invalidated as one range of the encoder's.
+  // The third client hasn't received any frames yet, so it can't have lost any.
+  first.mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames)->raise(10, 12);
+  second.mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames)->raise(3, 9);
+  third.mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames)->raise(1, 20);
+
+  second.mail->event<bool>(mail::idr)->raise(true);
+
+  auto requests = take_requests(*group);
+  ASSERT_EQ(requests.bitrate, 10000);
+  ASSERT_TRUE(requests.idr_frame);
+  ASSERT_TRUE(requests.invalidated_frames);
+  ASSERT_EQ(requests.invalidated_frames->first, 7);
+  ASSERT_EQ(requests.invalidated_frames->second, 13);
+
+  // Only new requests are taken, but the bitrates the clients asked for stay in effect
+  requests = take_requests(*group);
+  ASSERT_EQ(requests.bitrate, 10000);
+  ASSERT_FALSE(requests.idr_frame);
+  ASSERT_FALSE(requests.invalidated_frames);
+
+  // A client asking for more doesn't raise it above what the others asked for
+  second.mail->event<int>(mail::bitrate)->raise(30000);
+  ASSERT_EQ(take_requests(*group).bitrate, 15000);
+
+  video::leave_encode_group(group, first.subscriber);
+  video::leave_encode_group(group, second.subscriber);
+  video::leave_encode_group(group, third.subscriber);
+}
@@ -0,0 +1,1628 @@
+/**
+ * @file tools/loadgen.cpp
+ * @brief Drives a host with virtual Moonlight clients to benchmark streaming end to end.
+ * @details Only built when the `SUNSHINE_BUILD_TOOLS` CMake option is enabled.
+ */
+// standard includes
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// lib includes
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+#include <enet/enet.h>
+#include <nlohmann/json.hpp>
+#include <Simple-Web-Server/client_http.hpp>
+#include <Simple-Web-Server/client_https.hpp>
+#include <Simple-Web-Server/crypto.hpp>
+
+extern "C" {
+  // clang-format off
+#include <moonlight-common-c/src/Limelight-internal.h>
+#include <moonlight-common-c/src/Rtsp.h>
+#include "src/rswrapper.h"
+  // clang-format on
+}
+
+// local includes
+#include "src/crypto.h"
+#include "src/utility.h"
+
+using namespace std::literals;
+
+namespace asio = boost::asio;
+namespace pt = boost::property_tree;
+
+using http_client_t = SimpleWeb::Client<SimpleWeb::HTTP>;
+using https_client_t = SimpleWeb::Client<SimpleWeb::HTTPS>;
+
+namespace loadgen {
+  using clock = std::chrono::steady_clock;
+
+  // Every virtual client shares the identity of the tool, Moonlight sends the same unique ID too
+  constexpr auto UNIQUE_ID = "0123456789ABCDEF"sv;
+  constexpr auto DEVICE_NAME = "loadgen"sv;
+
+  // Offsets of the other ports from the base port of the host
+  constexpr int HTTPS_PORT_OFFSET = -5;
+  constexpr int WEB_UI_PORT_OFFSET = 1;
+
+  // Control stream message types
+  constexpr std::uint16_t CONTROL_ENCRYPTED = 0x0001;
+  constexpr std::uint16_t CONTROL_PERIODIC_PING = 0x0200;
+  constexpr std::uint16_t CONTROL_LOSS_STATS = 0x0201;
+  constexpr std::uint16_t CONTROL_REQUEST_IDR_FRAME = 0x0302;
+  constexpr std::uint16_t CONTROL_START_A = 0x0305;
+  constexpr std::uint16_t CONTROL_START_B = 0x0307;
+  constexpr std::uint16_t CONTROL_TERMINATION = 0x0109;
+  constexpr int CONTROL_CHANNEL_COUNT = 0x10;
+
+  constexpr std::uint8_t AUDIO_PAYLOAD_TYPE = 97;
+  constexpr std::uint8_t AUDIO_FEC_PAYLOAD_TYPE = 127;
+
+  // Moonlight pings the video and audio ports throughout the stream, and the control stream more often
+  constexpr auto PING_INTERVAL = 500ms;
+  constexpr auto CONTROL_PING_INTERVAL = 100ms;
+  constexpr auto LOSS_STATS_INTERVAL = 50ms;
+
+  // An incomplete frame is given up on once packets of a frame this much newer arrive
+  constexpr std::uint32_t FRAME_REORDER_WINDOW = 2;
+
+  // Audio FEC blocks this far behind the newest one won't receive any more packets
+  constexpr std::uint16_t AUDIO_BLOCK_WINDOW = 16 * RTPA_DATA_SHARDS;
+
+  constexpr auto CONNECT_TIMEOUT = 10s;
+
+#pragma pack(push, 1)
+
+  struct video_short_frame_header_t {
+    std::uint8_t headerType;
+    std::uint16_t frame_processing_latency;  // LE, in 1/10 ms units
+    std::uint8_t frameType;
+    std::uint16_t lastPayloadLen;  // LE
+    std::uint8_t unknown[2];
+  };
+
+  struct video_packet_raw_t {
+    RTP_PACKET rtp;
+    char reserved[4];
+    NV_VIDEO_PACKET packet;
+  };
+
+  struct video_packet_enc_prefix_t {
+    std::uint8_t iv[12];
+    std::uint32_t frameNumber;
+    std::uint8_t tag[16];
+  };
+
+  struct audio_fec_packet_t {
+    RTP_PACKET rtp;
+    AUDIO_FEC_HEADER fecHeader;
+  };
+
+  struct encrypted_rtsp_header_t {
+    static constexpr std::uint32_t ENCRYPTED_MESSAGE_TYPE_BIT = 0x80000000;
+
+    std::uint32_t typeAndLength;  // BE
+    std::uint32_t sequenceNumber;  // BE
+    std::uint8_t tag[16];
+  };
+
+  struct control_encrypted_t {
+    std::uint16_t encryptedHeaderType;  // LE 0x0001
+    std::uint16_t length;  // LE, sizeof(seq) + 16 byte tag + secondary header and data
+    std::uint32_t seq;  // LE
+
+    uint8_t *payload() {
+      return (uint8_t *) (this + 1);
+    }
+  };
+
+#pragma pack(pop)
+
+  struct options_t {
+    std::string host = "127.0.0.1";
+    int port = 47989;
+    int clients = 1;
+    std::chrono::seconds duration = 30s;
+    std::chrono::seconds report_interval = 5s;
+    int width = 1920;
+    int height = 1080;
+    int fps = 60;
+    int bitrate = 20000;
+    int packet_size = 1392;
+    int video_format = 0;
+    std::string app = "Desktop";
+    std::string pin;
+    std::string username;
+    std::string password;
+    std::filesystem::path state_dir = "loadgen";
+  } options;
+
+  // The host keeps a single launch pending, so clients hand it over to the control stream one by one
+  std::mutex handshake_lock;
+
+  /**
+   * @brief Totals of the statistics of a client at one point in time.
+   */
+  struct totals_t {
+    std::uint64_t video_packets;
+    std::uint64_t video_lost;
+    std::uint64_t video_recovered;
+    std::uint64_t frames;
+    std::uint64_t frames_lost;
+    std::uint64_t audio_packets;
+    std::uint64_t audio_lost;
+    std::uint64_t audio_recovered;
+    std::uint64_t wire_bytes;
+    std::uint64_t goodput_bytes;
+    std::uint64_t host_latency_us;
+    std::uint64_t delivery_us;
+    double jitter_ms;
+
+    totals_t &operator+=(const totals_t &other) {
+      video_packets += other.video_packets;
+      video_lost += other.video_lost;
+      video_recovered += other.video_recovered;
+      frames += other.frames;
+      frames_lost += other.frames_lost;
+      audio_packets += other.audio_packets;
+      audio_lost += other.audio_lost;
+      audio_recovered += other.audio_recovered;
+      wire_bytes += other.wire_bytes;
+      goodput_bytes += other.goodput_bytes;
+      host_latency_us += other.host_latency_us;
+      delivery_us += other.delivery_us;
+      jitter_ms += other.jitter_ms;
+
+      return *this;
+    }
+
+    totals_t operator-(const totals_t &other) const {
+      auto diff = *this;
+      diff.video_packets -= other.video_packets;
+      diff.video_lost -= other.video_lost;
+      diff.video_recovered -= other.video_recovered;
+      diff.frames -= other.frames;
+      diff.frames_lost -= other.frames_lost;
+      diff.audio_packets -= other.audio_packets;
+      diff.audio_lost -= other.audio_lost;
+      diff.audio_recovered -= other.audio_recovered;
+      diff.wire_bytes -= other.wire_bytes;
+      diff.goodput_bytes -= other.goodput_bytes;
+      diff.host_latency_us -= other.host_latency_us;
+      diff.delivery_us -= other.delivery_us;
+
+      // Jitter is a running estimate rather than a total
+      return diff;
+    }
+  };
+
+  /**
+   * @brief Statistics of a client, updated by its threads while the reporter reads them.
+   */
+  struct stats_t {
+    std::atomic<std::uint64_t> video_packets {};
+    std::atomic<std::uint64_t> video_lost {};
+    std::atomic<std::uint64_t> video_recovered {};
+    std::atomic<std::uint64_t> frames {};
+    std::atomic<std::uint64_t> frames_lost {};
+    std::atomic<std::uint64_t> audio_packets {};
+    std::atomic<std::uint64_t> audio_lost {};
+    std::atomic<std::uint64_t> audio_recovered {};
+    std::atomic<std::uint64_t> wire_bytes {};
+    std::atomic<std::uint64_t> goodput_bytes {};
+    std::atomic<std::uint64_t> host_latency_us {};
+    std::atomic<std::uint64_t> delivery_us {};
+    std::atomic<double> jitter_ms {};
+
+    totals_t totals() const {
+      return {
+        video_packets.load(std::memory_order_relaxed),
+        video_lost.load(std::memory_order_relaxed),
+        video_recovered.load(std::memory_order_relaxed),
+        frames.load(std::memory_order_relaxed),
+        frames_lost.load(std::memory_order_relaxed),
+        audio_packets.load(std::memory_order_relaxed),
+        audio_lost.load(std::memory_order_relaxed),
+        audio_recovered.load(std::memory_order_relaxed),
+        wire_bytes.load(std::memory_order_relaxed),
+        goodput_bytes.load(std::memory_order_relaxed),
+        host_latency_us.load(std::memory_order_relaxed),
+        delivery_us.load(std::memory_order_relaxed),
+        jitter_ms.load(std::memory_order_relaxed),
+      };
+    }
+  };
+
+  /**
+   * @brief Counts the packets lost from an RTP stream, as described in RFC 3550.
+   */
+  class sequence_tracker_t {
+  public:
+    /**
+     * @brief Record a received packet.
+     * @param seq The RTP sequence number of the packet.
+     * @return The number of packets newly found to be lost.
+     */
+    std::uint64_t received(std::uint16_t seq) {
+      if (!started) {
+        started = true;
+        max_seq = seq;
+        return 0;
+      }
+
+      auto delta = (std::int16_t) (seq - max_seq);
+      if (delta <= 0) {
+        // A late or duplicate packet, which was either counted lost already or is ignored
+        return 0;
+      }
+
+      max_seq = seq;
+      return delta - 1;
+    }
+
+  private:
+    bool started {false};
+    std::uint16_t max_seq {0};
+  };
+
+  using rs_t = util::safe_ptr<reed_solomon, [](reed_solomon *rs) {
+    reed_solomon_release(rs);
+  }>;
+
+  std::string address(int port) {
+    // IPv6 literals need brackets when followed by a port
+    if (options.host.find(':') != std::string::npos) {
+      return "[" + options.host + "]:" + std::to_string(port);
+    }
+
+    return options.host + ":" + std::to_string(port);
+  }
+
+  std::filesystem::path cert_path() {
+    return options.state_dir / "cert.pem";
+  }
+
+  std::filesystem::path key_path() {
+    return options.state_dir / "key.pem";
+  }
+
+  /**
+   * @brief Build the path and query of a request to the host.
+   * @param path The path of the request.
+   * @param args The arguments of the request, besides the unique ID.
+   * @return The path and query.
+   */
+  std::string query(std::string_view path, const std::vector<std::pair<std::string_view, std::string>> &args = {}) {
+    std::ostringstream ss;
+    ss << path << "?uniqueid="sv << UNIQUE_ID;
+    for (auto &[name, value] : args) {
+      ss << '&' << name << '=' << value;
+    }
+
+    return ss.str();
+  }
+
+  /**
+   * @brief Send a request to the host and parse its XML response.
+   * @param client The client to send the request with.
+   * @param path The path and query of the request.
+   * @return The response, or `std::nullopt` if the request failed.
+   */
+  template<class T>
+  std::optional<pt::ptree> get_xml(SimpleWeb::Client<T> &client, const std::string &path) {
+    pt::ptree tree;
+    try {
+      auto response = client.request("GET", path);
+      pt::read_xml(response->content, tree);
+    } catch (const std::exception &e) {
+      std::cout << "Request to "sv << path.substr(0, path.find('?')) << " failed: "sv << e.what() << std::endl;
+      return std::nullopt;
+    }
+
+    auto status = tree.get("root.<xmlattr>.status_code", 0);
+    if (status != 200) {
+      std::cout << "Request to "sv << path.substr(0, path.find('?')) << " failed: ["sv << status << "] "sv
+                << tree.get("root.<xmlattr>.status_message", ""s) << std::endl;
+      return std::nullopt;
+    }
+
+    return tree;
+  }
+
+  std::optional<pt::ptree> get_http(const std::string &path) {
+    http_client_t client {address(options.port)};
+    return get_xml(client, path);
+  }
+
+  std::optional<pt::ptree> get_https(const std::string &path) {
+    https_client_t client {address(options.port + HTTPS_PORT_OFFSET), false, cert_path().string(), key_path().string()};
+    return get_xml(client, path);
+  }
+
+  std::optional<std::string> read_file(const std::filesystem::path &path) {
+    std::ifstream in {path, std::ios::binary};
+    if (!in) {
+      return std::nullopt;
+    }
+
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+  }
+
+  /**
+   * @brief Load the certificate the tool identifies with, creating it on first use.
+   * @return The certificate and private key, or `std::nullopt` if they couldn't be stored.
+   */
+  std::optional<crypto::creds_t> load_identity() {
+    auto cert = read_file(cert_path());
+    auto key = read_file(key_path());
+    if (cert && key) {
+      return crypto::creds_t {std::move(*cert), std::move(*key)};
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(options.state_dir, ec);
+
+    auto creds = crypto::gen_creds("Sunshine Load Generator"sv, 2048);
+    std::ofstream cert_out {cert_path(), std::ios::binary};
+    std::ofstream key_out {key_path(), std::ios::binary};
+    cert_out << creds.x509;
+    key_out << creds.pkey;
+    if (!cert_out || !key_out) {
+      std::cout << "Couldn't store the client certificate in "sv << options.state_dir << std::endl;
+      return std::nullopt;
+    }
+
+    return creds;
+  }
+
+  /**
+   * @brief Enter the PIN in the web UI of the host on behalf of the user, once pairing waits for it.
+   * @param pin The PIN.
+   * @return `true` if the host accepted the PIN.
+   */
+  bool send_pin(const std::string &pin) {
+    https_client_t client {address(options.port + WEB_UI_PORT_OFFSET), false};
+
+    SimpleWeb::CaseInsensitiveMultimap headers;
+    headers.emplace("Content-Type", "application/json");
+    headers.emplace("Authorization", "Basic " + SimpleWeb::Crypto::Base64::encode(options.username + ":" + options.password));
+
+    nlohmann::json body;
+    body["pin"] = pin;
+    body["name"] = DEVICE_NAME;
+
+    try {
+      auto response = client.request("POST", "/api/pin", body.dump(), headers);
+      auto output = nlohmann::json::parse(response->content.string());
+      return output.value("status", false);
+    } catch (const std::exception &e) {
+      return false;
+    }
+  }
+
+  /**
+   * @brief Pair with the host, unless it already trusts the certificate of the tool.
+   * @param creds The certificate and private key of the tool.
+   * @return `true` if the tool is paired.
+   */
+  bool pair(const crypto::creds_t &creds) {
+    if (auto tree = get_https(query("/serverinfo"sv)); tree && tree->get("root.PairStatus", 0) == 1) {
+      return true;
+    }
+
+    auto pin = options.pin;
+    if (pin.empty()) {
+      pin = std::to_string(10000 + std::random_device {}() % 10000).substr(1);
+    }
+
+    std::atomic<bool> done {false};
+    std::thread pin_thread;
+    if (!options.username.empty()) {
+      // Pairing waits for the PIN, so it has to be entered from another thread
+      pin_thread = std::thread {[&]() {
+        while (!done && !send_pin(pin)) {
+          std::this_thread::sleep_for(200ms);
+        }
+      }};
+    } else {
+      std::cout << "Enter PIN "sv << pin << " in the web UI of the host to pair"sv << std::endl;
+    }
+
+    auto fg = util::fail_guard([&]() {
+      done = true;
+      if (pin_thread.joinable()) {
+        pin_thread.join();
+      }
+    });
+
+    auto salt_str = crypto::rand(16);
+    std::array<std::uint8_t, 16> salt;
+    std::copy_n(std::begin(salt_str), salt.size(), std::begin(salt));
+
+    crypto::cipher::ecb_t cipher {crypto::gen_aes_key(salt, pin), false};
+    auto client_x509 = crypto::x509(creds.x509);
+    auto client_pkey = crypto::pkey(creds.pkey);
+
+    auto pair_query = [](std::string_view name, const std::string &value) {
+      return query("/pair"sv, {{"devicename"sv, std::string {DEVICE_NAME}}, {"updateState"sv, "1"s}, {name, value}});
+    };
+
+    // The host answers once the PIN is entered
+    auto tree = get_http(pair_query("phrase"sv, "getservercert&salt="s + util::hex_vec(salt, true) + "&clientcert="s + util::hex_vec(creds.x509, true)));
+    if (!tree || tree->get("root.paired", 0) != 1) {
+      std::cout << "The host refused to pair"sv << std::endl;
+      return false;
+    }
+    auto server_x509 = crypto::x509(util::from_hex_vec(tree->get("root.plaincert", ""s), true));
+    if (!server_x509) {
+      std::cout << "The host sent an invalid certificate"sv << std::endl;
+      return false;
+    }
+
+    auto client_challenge = crypto::rand(16);
+    std::vector<std::uint8_t> encrypted;
+    cipher.encrypt(client_challenge, encrypted);
+
+    tree = get_http(pair_query("clientchallenge"sv, util::hex_vec(encrypted, true)));
+    if (!tree || tree->get("root.paired", 0) != 1) {
+      return false;
+    }
+
+    std::vector<std::uint8_t> challenge_response;
+    cipher.decrypt(util::from_hex_vec(tree->get("root.challengeresponse", ""s), true), challenge_response);
+    if (challenge_response.size() < 48) {
+      return false;
+    }
+    std::string server_hash {std::begin(challenge_response), std::begin(challenge_response) + 32};
+    std::string server_challenge {std::begin(challenge_response) + 32, std::begin(challenge_response) + 48};
+
+    auto client_secret = crypto::rand(16);
+    auto client_hash = crypto::hash(server_challenge + std::string {crypto::signature(client_x509)} + client_secret);
+    cipher.encrypt(std::string_view {(char *) client_hash.data(), client_hash.size()}, encrypted);
+
+    tree = get_http(pair_query("serverchallengeresp"sv, util::hex_vec(encrypted, true)));
+    if (!tree || tree->get("root.paired", 0) != 1) {
+      return false;
+    }
+
+    // The host proves it knows the PIN too
+    auto pairing_secret = util::from_hex_vec(tree->get("root.pairingsecret", ""s), true);
+    if (pairing_secret.size() <= 16) {
+      return false;
+    }
+    auto server_secret = pairing_secret.substr(0, 16);
+    auto expected_hash = crypto::hash(client_challenge + std::string {crypto::signature(server_x509)} + server_secret);
+    if (server_hash != std::string_view {(char *) expected_hash.data(), expected_hash.size()} ||
+        !crypto::verify256(server_x509, server_secret, std::string_view {pairing_secret}.substr(16))) {
+      std::cout << "Pairing failed, the PIN is incorrect"sv << std::endl;
+      return false;
+    }
+
+    auto client_signature = crypto::sign256(client_pkey, client_secret);
+    tree = get_http(pair_query("clientpairingsecret"sv, util::hex_vec(client_secret + std::string {std::begin(client_signature), std::end(client_signature)}, true)));
+    if (!tree || tree->get("root.paired", 0) != 1) {
+      return false;
+    }
+
+    tree = get_https(pair_query("phrase"sv, "pairchallenge"s));
+    if (!tree || tree->get("root.paired", 0) != 1) {
+      return false;
+    }
+
+    std::cout << "Paired with the host"sv << std::endl;
+    return true;
+  }
+
+  /**
+   * @brief Find the application the clients stream.
+   * @return The ID of the application, or `std::nullopt` if the host has no such application.
+   */
+  std::optional<int> find_app() {
+    auto tree = get_https(query("/applist"sv));
+    if (!tree) {
+      return std::nullopt;
+    }
+
+    for (auto &[name, app] : tree->get_child("root")) {
+      if (name == "App"sv && app.get("AppTitle", ""s) == options.app) {
+        return app.get("ID", 0);
+      }
+    }
+
+    std::cout << "The host has no application named \""sv << options.app << '"' << std::endl;
+    return std::nullopt;
+  }
+
+  /**
+   * @brief A virtual client streaming from the host.
+   */
+  class client_t {
+  public:
+    client_t(int id, int appid):
+        id {id},
+        appid {appid} {
+    }
+
+    /**
+     * @brief Launch a session and connect to the host.
+     * @return `true` if the host accepted the session.
+     */
+    bool start() {
+      std::lock_guard lg {handshake_lock};
+
+      boost::system::error_code ec;
+      host_address = asio::ip::make_address(options.host, ec);
+      if (ec) {
+        std::cout << "The host must be given as an IP address: "sv << options.host << std::endl;
+        return false;
+      }
+
+      if (!launch() || !setup_rtsp() || !connect_control()) {
+        std::cout << "Client "sv << id << " couldn't start streaming"sv << std::endl;
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+     * @brief Receive the stream until the deadline, or until the host ends the session.
+     * @param until The deadline.
+     */
+    void run(clock::time_point until) {
+      std::thread control {&client_t::control_thread, this};
+      std::thread media {&client_t::media_thread, this};
+
+      while (!stopping && clock::now() < until) {
+        std::this_thread::sleep_for(100ms);
+      }
+      stopping = true;
+
+      media.join();
+      control.join();
+    }
+
+    const int id;
+    stats_t stats;
+
+  private:
+    struct rtsp_response_t {
+      int status;
+      std::map<std::string, std::string, std::less<>> headers;
+      std::string payload;
+    };
+
+    struct video_block_t {
+      int data_shards;
+      int received;
+      bool done;
+      std::vector<std::vector<std::uint8_t>> shards;
+    };
+
+    struct frame_t {
+      int blocks;
+      int blocks_done;
+      clock::time_point first_packet;
+      std::array<video_block_t, 4> block;
+    };
+
+    struct audio_block_t {
+      int received;
+      bool done;
+      std::array<std::vector<std::uint8_t>, RTPA_TOTAL_SHARDS> shards;
+    };
+
+    /**
+     * @brief Ask the host to start streaming, or to add this client to the stream already running.
+     * @return `true` on success.
+     */
+    bool launch() {
+      auto serverinfo = get_https(query("/serverinfo"sv));
+      if (!serverinfo) {
+        return false;
+      }
+
+      rikey = crypto::rand(16);
+      std::uniform_int_distribution<std::int32_t> distribution {0, std::numeric_limits<std::int32_t>::max()};
+      std::random_device rd;
+
+      auto path = serverinfo->get("root.currentgame", 0) == 0 ? "/launch"sv : "/resume"sv;
+      auto tree = get_https(query(path, {
+                                          {"appid"sv, std::to_string(appid)},
+                                          {"mode"sv, std::to_string(options.width) + "x" + std::to_string(options.height) + "x" + std::to_string(options.fps)},
+                                          {"sops"sv, "0"s},
+                                          {"rikey"sv, util::hex_vec(rikey, true)},
+                                          {"rikeyid"sv, std::to_string(distribution(rd))},
+                                          {"localAudioPlayMode"sv, "0"s},
+                                          {"surroundAudioInfo"sv, "196610"s},
+                                          {"corever"sv, "1"s},
+                                        }));
+      if (!tree) {
+        return false;
+      }
+
+      // The URL looks like rtspenc://127.0.0.1:48010
+      rtsp_url = tree->get("root.sessionUrl0", ""s);
+      auto port_pos = rtsp_url.rfind(':');
+      if (port_pos == std::string::npos) {
+        std::cout << "The host sent an invalid session URL: "sv << rtsp_url << std::endl;
+        return false;
+      }
+      rtsp_port = util::from_view(std::string_view {rtsp_url}.substr(port_pos + 1));
+
+      if (rtsp_url.starts_with("rtspenc://"sv)) {
+        rtsp_cipher.emplace(crypto::aes_t {std::begin(rikey), std::end(rikey)}, false);
+      }
+
+      return true;
+    }
+
+    /**
+     * @brief Send a single RTSP request, the host answers each on its own connection.
+     * @param command The RTSP command.
+     * @param target The target of the command.
+     * @param payload The SDP payload, if any.
+     * @return The response, or `std::nullopt` if the request failed.
+     */
+    std::optional<rtsp_response_t> rtsp(std::string_view command, std::string_view target, const std::string &payload = {}) {
+      std::ostringstream ss;
+      ss << command << ' ' << target << " RTSP/1.0\r\n"sv
+         << "CSeq: "sv << ++rtsp_seq << "\r\n"sv
+         << "X-GS-ClientVersion: 14\r\n"sv
+         << "Host: "sv << options.host << "\r\n"sv;
+      if (!payload.empty()) {
+        ss << "Session: DEADBEEFCAFE\r\n"sv
+           << "Content-type: application/sdp\r\n"sv
+           << "Content-length: "sv << payload.size() << "\r\n"sv;
+      }
+      ss << "\r\n"sv << payload;
+      auto message = ss.str();
+
+      if (rtsp_cipher) {
+        // We use the deterministic IV construction algorithm specified in NIST SP 800-38D
+        // Section 8.2.1, the same way the host does for its own messages.
+        crypto::aes_t iv(12);
+        std::copy_n((uint8_t *) &rtsp_seq, sizeof(rtsp_seq), std::begin(iv));
+        iv[10] = 'C';  // Client originated
+        iv[11] = 'R';  // RTSP
+
+        std::string encrypted(sizeof(encrypted_rtsp_header_t) + message.size(), '\0');
+        auto header = (encrypted_rtsp_header_t *) encrypted.data();
+        header->typeAndLength = util::endian::big<std::uint32_t>(message.size() | encrypted_rtsp_header_t::ENCRYPTED_MESSAGE_TYPE_BIT);
+        header->sequenceNumber = util::endian::big<std::uint32_t>(rtsp_seq);
+        rtsp_cipher->encrypt(message, header->tag, (std::uint8_t *) (header + 1), &iv);
+
+        message = std::move(encrypted);
+      }
+
+      asio::io_context io;
+      asio::ip::tcp::socket sock {io};
+      boost::system::error_code ec;
+
+      sock.connect(asio::ip::tcp::endpoint {host_address, (std::uint16_t) rtsp_port}, ec);
+      if (!ec) {
+        asio::write(sock, asio::buffer(message), ec);
+      }
+
+      // The host closes the connection after responding
+      std::string reply;
+      if (!ec) {
+        asio::read(sock, asio::dynamic_buffer(reply), ec);
+      }
+      if (ec && ec != asio::error::eof) {
+        std::cout << "RTSP "sv << command << " failed: "sv << ec.message() << std::endl;
+        return std::nullopt;
+      }
+
+      if (rtsp_cipher) {
+        if (reply.size() < sizeof(encrypted_rtsp_header_t)) {
+          std::cout << "RTSP "sv << command << " failed: truncated response"sv << std::endl;
+          return std::nullopt;
+        }
+
+        auto header = (encrypted_rtsp_header_t *) reply.data();
+        auto length = util::endian::big<std::uint32_t>(header->typeAndLength) & ~encrypted_rtsp_header_t::ENCRYPTED_MESSAGE_TYPE_BIT;
+        if (reply.size() - sizeof(encrypted_rtsp_header_t) < length) {
+          std::cout << "RTSP "sv << command << " failed: truncated response"sv << std::endl;
+          return std::nullopt;
+        }
+
+        auto seq = util::endian::big<std::uint32_t>(header->sequenceNumber);
+        crypto::aes_t iv(12);
+        std::copy_n((uint8_t *) &seq, sizeof(seq), std::begin(iv));
+        iv[10] = 'H';  // Host originated
+        iv[11] = 'R';  // RTSP
+
+        std::vector<std::uint8_t> plaintext;
+        if (rtsp_cipher->decrypt(std::string_view {(char *) header->tag, sizeof(header->tag) + length}, plaintext, &iv)) {
+          std::cout << "RTSP "sv << command << " failed: couldn't verify the response"sv << std::endl;
+          return std::nullopt;
+        }
+
+        reply.assign(std::begin(plaintext), std::end(plaintext));
+      }
+
+      RTSP_MESSAGE msg {};
+      if (parseRtspMessage(&msg, reply.data(), (int) reply.size())) {
+        std::cout << "RTSP "sv << command << " failed: malformed response"sv << std::endl;
+        return std::nullopt;
+      }
+      auto fg = util::fail_guard([&]() {
+        freeMessage(&msg);
+      });
+
+      rtsp_response_t response {};
+      response.status = msg.message.response.statusCode;
+      for (auto option = msg.options; option != nullptr; option = option->next) {
+        response.headers.emplace(option->option, option->content);
+      }
+      if (msg.payload) {
+        response.payload.assign(msg.payload, msg.payloadLength);
+      }
+
+      if (response.status != 200) {
+        std::cout << "RTSP "sv << command << " failed: ["sv << response.status << ']' << std::endl;
+        return std::nullopt;
+      }
+
+      return response;
+    }
+
+    /**
+     * @brief Set up the stream through RTSP, as Moonlight does.
+     * @return `true` on success.
+     */
+    bool setup_rtsp() {
+      if (!rtsp("OPTIONS"sv, rtsp_url)) {
+        return false;
+      }
+
+      auto describe = rtsp("DESCRIBE"sv, rtsp_url);
+      if (!describe) {
+        return false;
+      }
+
+      // Use whatever encryption the host asks for, the control stream is always encrypted
+      encryption_flags = SS_ENC_CONTROL_V2;
+      constexpr auto ENCRYPTION_REQUESTED = "a=x-ss-general.encryptionRequested:"sv;
+      if (auto pos = describe->payload.find(ENCRYPTION_REQUESTED); pos != std::string::npos) {
+        encryption_flags |= util::from_view(std::string_view {describe->payload}.substr(pos + ENCRYPTION_REQUESTED.size()));
+      }
+
+      auto setup = [&](std::string_view stream, std::string_view payload_header, std::string &payload) -> std::optional<std::uint16_t> {
+        auto response = rtsp("SETUP"sv, "streamid="s + std::string {stream});
+        if (!response) {
+          return std::nullopt;
+        }
+
+        auto transport = response->headers.find("Transport"sv);
+        auto payload_it = response->headers.find(payload_header);
+        if (transport == std::end(response->headers) || payload_it == std::end(response->headers)) {
+          std::cout << "RTSP SETUP of "sv << stream << " is missing its transport"sv << std::endl;
+          return std::nullopt;
+        }
+
+        auto port_pos = transport->second.find("server_port="sv);
+        if (port_pos == std::string::npos) {
+          return std::nullopt;
+        }
+
+        payload = payload_it->second;
+        return (std::uint16_t) util::from_view(std::string_view {transport->second}.substr(port_pos + "server_port="sv.size()));
+      };
+
+      std::string connect_data;
+      auto audio = setup("audio/0/0"sv, "X-SS-Ping-Payload"sv, ping_payload);
+      auto video = setup("video/0/0"sv, "X-SS-Ping-Payload"sv, ping_payload);
+      auto control = setup("control/13/0"sv, "X-SS-Connect-Data"sv, connect_data);
+      if (!audio || !video || !control) {
+        return false;
+      }
+      audio_port = *audio;
+      video_port = *video;
+      control_port = *control;
+      control_connect_data = util::from_view(connect_data);
+
+      std::ostringstream sdp;
+      auto attribute = [&](std::string_view name, auto value) {
+        sdp << "a="sv << name << ':' << value << " \r\n"sv;
+      };
+      sdp << "v=0\r\n"sv
+          << "o=android 0 14 IN "sv << (host_address.is_v6() ? "IPv6 "sv : "IPv4 "sv) << options.host << "\r\n"sv
+          << "s=NVIDIA Streaming Client\r\n"sv;
+      attribute("x-nv-video[0].clientViewportWd"sv, options.width);
+      attribute("x-nv-video[0].clientViewportHt"sv, options.height);
+      attribute("x-nv-video[0].maxFPS"sv, options.fps);
+      attribute("x-nv-video[0].clientRefreshRateX100"sv, options.fps * 100);
+      attribute("x-nv-video[0].packetSize"sv, options.packet_size);
+      attribute("x-nv-video[0].videoEncoderSlicesPerFrame"sv, 1);
+      attribute("x-nv-video[0].maxNumReferenceFrames"sv, 1);
+      attribute("x-nv-video[0].encoderCscMode"sv, 0);
+      attribute("x-nv-video[0].dynamicRangeMode"sv, 0);
+      attribute("x-nv-vqos[0].bw.maximumBitrateKbps"sv, options.bitrate);
+      attribute("x-nv-vqos[0].bitStreamFormat"sv, options.video_format);
+      attribute("x-nv-vqos[0].fec.minRequiredFecPackets"sv, 2);
+      attribute("x-ss-video[0].chromaSamplingType"sv, 0);
+      attribute("x-ss-video[0].intraRefresh"sv, 0);
+      attribute("x-nv-audio.surround.numChannels"sv, 2);
+      attribute("x-nv-audio.surround.channelMask"sv, 3);
+      attribute("x-nv-audio.surround.enable"sv, 0);
+      attribute("x-nv-audio.surround.AudioQuality"sv, 0);
+      attribute("x-nv-aqos.packetDuration"sv, 5);
+      attribute("x-nv-general.useReliableUdp"sv, 13);
+      attribute("x-ml-general.featureFlags"sv, ML_FF_SESSION_ID_V1);
+      attribute("x-ss-general.encryptionEnabled"sv, encryption_flags);
+      sdp << "t=0 0\r\n"sv
+          << "m=video "sv << video_port << "  \r\n"sv;
+
+      if (!rtsp("ANNOUNCE"sv, "streamid=control/13/0"sv, sdp.str()) || !rtsp("PLAY"sv, "/"sv)) {
+        return false;
+      }
+
+      if (encryption_flags & SS_ENC_VIDEO) {
+        video_cipher.emplace(crypto::aes_t {std::begin(rikey), std::end(rikey)}, false);
+      }
+      control_cipher.emplace(crypto::aes_t {std::begin(rikey), std::end(rikey)}, false);
+
+      return true;
+    }
+
+    /**
+     * @brief Connect to the control stream, which hands the launch over to this client's session.
+     * @return `true` on success.
+     */
+    bool connect_control() {
+      ENetAddress address;
+      enet_address_set_host(&address, options.host.c_str());
+      enet_address_set_port(&address, control_port);
+
+      enet_host.reset(enet_host_create(host_address.is_v6() ? AF_INET6 : AF_INET, nullptr, 1, CONTROL_CHANNEL_COUNT, 0, 0));
+      if (!enet_host) {
+        std::cout << "Couldn't create the control stream"sv << std::endl;
+        return false;
+      }
+
+      peer = enet_host_connect(enet_host.get(), &address, CONTROL_CHANNEL_COUNT, control_connect_data);
+      if (!peer) {
+        return false;
+      }
+
+      auto deadline = clock::now() + CONNECT_TIMEOUT;
+      ENetEvent event;
+      while (clock::now() < deadline) {
+        if (enet_host_service(enet_host.get(), &event, 100) > 0 && event.type == ENET_EVENT_TYPE_CONNECT) {
+          return send_control(CONTROL_START_A, std::string(2, '\0')) && send_control(CONTROL_START_B, std::string(16, '\0'));
+        }
+      }
+
+      std::cout << "The host didn't accept the control stream"sv << std::endl;
+      return false;
+    }
+
+    /**
+     * @brief Send an encrypted message on the control stream.
+     * @param type The type of the message.
+     * @param payload The payload of the message.
+     * @return `true` on success.
+     */
+    bool send_control(std::uint16_t type, std::string_view payload) {
+      std::string plaintext(4, '\0');
+      *(std::uint16_t *) plaintext.data() = util::endian::little(type);
+      *(std::uint16_t *) (plaintext.data() + 2) = util::endian::little<std::uint16_t>(payload.size());
+      plaintext += payload;
+
+      auto seq = control_seq++;
+      crypto::aes_t iv(12);
+      std::copy_n((uint8_t *) &seq, sizeof(seq), std::begin(iv));
+      iv[10] = 'C';  // Client originated
+      iv[11] = 'C';  // Control stream
+
+      std::vector<std::uint8_t> message(sizeof(control_encrypted_t) + crypto::cipher::tag_size + plaintext.size());
+      auto header = (control_encrypted_t *) message.data();
+      header->encryptedHeaderType = util::endian::little(CONTROL_ENCRYPTED);
+      header->length = util::endian::little<std::uint16_t>(sizeof(header->seq) + crypto::cipher::tag_size + plaintext.size());
+      header->seq = util::endian::little(seq);
+      if (control_cipher->encrypt(plaintext, header->payload(), &iv) < 0) {
+        return false;
+      }
+
+      auto packet = enet_packet_create(message.data(), message.size(), ENET_PACKET_FLAG_RELIABLE);
+      if (enet_peer_send(peer, 0, packet)) {
+        enet_packet_destroy(packet);
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+     * @brief Handle a message the host sent on the control stream.
+     * @param data The message.
+     */
+    void handle_control(std::string_view data) {
+      if (data.size() < sizeof(control_encrypted_t) + crypto::cipher::tag_size + 4) {
+        return;
+      }
+
+      auto header = (control_encrypted_t *) data.data();
+      auto length = util::endian::little(header->length);
+      if (util::endian::little(header->encryptedHeaderType) != CONTROL_ENCRYPTED || length + 4u > data.size()) {
+        return;
+      }
+
+      auto seq = util::endian::little(header->seq);
+      crypto::aes_t iv(12);
+      std::copy_n((uint8_t *) &seq, sizeof(seq), std::begin(iv));
+      iv[10] = 'H';  // Host originated
+      iv[11] = 'C';  // Control stream
+
+      std::vector<std::uint8_t> plaintext;
+      if (control_cipher->decrypt(std::string_view {(char *) header->payload(), (std::size_t) length - sizeof(header->seq)}, plaintext, &iv) || plaintext.size() < 4) {
+        std::cout << "Client "sv << id << " couldn't verify a control message"sv << std::endl;
+        return;
+      }
+
+      auto type = util::endian::little(*(std::uint16_t *) plaintext.data());
+      if (type == CONTROL_TERMINATION) {
+        std::uint32_t reason = 0;
+        if (plaintext.size() >= 8) {
+          reason = util::endian::big(*(std::uint32_t *) (plaintext.data() + 4));
+        }
+
+        std::cout << "Client "sv << id << ": the host ended the session [0x"sv << util::hex(reason).to_string_view() << ']' << std::endl;
+        stopping = true;
+      }
+    }
+
+    void control_thread() {
+      auto next_ping = clock::now();
+      auto next_loss_stats = clock::now();
+      std::uint64_t reported_frames_lost = 0;
+
+      while (!stopping) {
+        ENetEvent event;
+        if (enet_host_service(enet_host.get(), &event, 10) > 0) {
+          if (event.type == ENET_EVENT_TYPE_RECEIVE) {
+            handle_control(std::string_view {(char *) event.packet->data, event.packet->dataLength});
+            enet_packet_destroy(event.packet);
+          } else if (event.type == ENET_EVENT_TYPE_DISCONNECT) {
+            std::cout << "Client "sv << id << ": the host closed the control stream"sv << std::endl;
+            stopping = true;
+            break;
+          }
+        }
+
+        auto now = clock::now();
+        if (now >= next_ping) {
+          send_control(CONTROL_PERIODIC_PING, std::string(8, '\0'));
+          next_ping = now + CONTROL_PING_INTERVAL;
+        }
+
+        if (now >= next_loss_stats) {
+          auto frames_lost = stats.frames_lost.load(std::memory_order_relaxed);
+
+          std::array<std::int32_t, 8> loss_stats {};
+          loss_stats[0] = util::endian::little<std::int32_t>(frames_lost - reported_frames_lost);
+          loss_stats[1] = util::endian::little<std::int32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(LOSS_STATS_INTERVAL).count());
+          loss_stats[2] = util::endian::little<std::int32_t>(1000);
+          loss_stats[3] = util::endian::little<std::int32_t>(last_good_frame.load(std::memory_order_relaxed));
+          loss_stats[6] = util::endian::little<std::int32_t>(0x14);
+          send_control(CONTROL_LOSS_STATS, std::string_view {(char *) loss_stats.data(), sizeof(loss_stats)});
+
+          reported_frames_lost = frames_lost;
+          next_loss_stats = now + LOSS_STATS_INTERVAL;
+        }
+
+        // Without reference frame invalidation, a lost frame can only be recovered from with an IDR frame
+        if (idr_requested.exchange(false)) {
+          send_control(CONTROL_REQUEST_IDR_FRAME, std::string(2, '\0'));
+        }
+      }
+
+      enet_peer_disconnect(peer, 0);
+      enet_host_flush(enet_host.get());
+    }
+
+    void media_thread() {
+      asio::io_context io;
+      asio::ip::udp::socket video_sock {io};
+      asio::ip::udp::socket audio_sock {io};
+      boost::system::error_code ec;
+
+      for (auto [sock, port] : {std::pair {&video_sock, video_port}, std::pair {&audio_sock, audio_port}}) {
+        sock->open(host_address.is_v6() ? asio::ip::udp::v6() : asio::ip::udp::v4(), ec);
+        sock->set_option(asio::socket_base::receive_buffer_size {8 * 1024 * 1024}, ec);
+        sock->connect(asio::ip::udp::endpoint {host_address, port}, ec);
+        if (ec) {
+          std::cout << "Client "sv << id << " couldn't open its media sockets: "sv << ec.message() << std::endl;
+          stopping = true;
+          return;
+        }
+      }
+
+      epoch = clock::now();
+
+      std::vector<std::uint8_t> video_buf(64 * 1024);
+      std::vector<std::uint8_t> audio_buf(4 * 1024);
+
+      std::function<void()> receive_video = [&]() {
+        video_sock.async_receive(asio::buffer(video_buf), [&](const boost::system::error_code &ec, std::size_t bytes) {
+          if (!ec) {
+            handle_video(video_buf.data(), bytes);
+          }
+          receive_video();
+        });
+      };
+      std::function<void()> receive_audio = [&]() {
+        audio_sock.async_receive(asio::buffer(audio_buf), [&](const boost::system::error_code &ec, std::size_t bytes) {
+          if (!ec) {
+            handle_audio(audio_buf.data(), bytes);
+          }
+          receive_audio();
+        });
+      };
+
+      // The host learns where to send the stream from the pings
+      SS_PING ping {};
+      std::copy_n(std::begin(ping_payload), std::min(ping_payload.size(), sizeof(ping.payload)), ping.payload);
+      std::uint32_t ping_seq = 0;
+
+      asio::steady_timer ping_timer {io};
+      auto next_ping = clock::now();
+      std::function<void()> tick = [&]() {
+        if (stopping) {
+          io.stop();
+          return;
+        }
+
+        if (clock::now() >= next_ping) {
+          ping.sequenceNumber = util::endian::big(++ping_seq);
+          boost::system::error_code ec;
+          video_sock.send(asio::buffer(&ping, sizeof(ping)), 0, ec);
+          audio_sock.send(asio::buffer(&ping, sizeof(ping)), 0, ec);
+          next_ping += PING_INTERVAL;
+        }
+
+        ping_timer.expires_after(50ms);
+        ping_timer.async_wait([&](const boost::system::error_code &) {
+          tick();
+        });
+      };
+
+      tick();
+      receive_video();
+      receive_audio();
+      io.run();
+    }
+
+    void handle_video(std::uint8_t *data, std::size_t bytes) {
+      stats.wire_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+      if (video_cipher) {
+        if (bytes < sizeof(video_packet_enc_prefix_t) + sizeof(video_packet_raw_t)) {
+          return;
+        }
+
+        auto prefix = (video_packet_enc_prefix_t *) data;
+        crypto::aes_t iv {std::begin(prefix->iv), std::end(prefix->iv)};
+        if (video_cipher->decrypt(std::string_view {(char *) prefix->tag, bytes - offsetof(video_packet_enc_prefix_t, tag)}, video_plaintext, &iv)) {
+          return;
+        }
+
+        data = video_plaintext.data();
+        bytes = video_plaintext.size();
+      }
+
+      if (bytes <= sizeof(video_packet_raw_t)) {
+        return;
+      }
+
+      auto header = (video_packet_raw_t *) data;
+      stats.video_packets.fetch_add(1, std::memory_order_relaxed);
+      stats.video_lost.fetch_add(video_seq.received(util::endian::big(header->rtp.sequenceNumber)), std::memory_order_relaxed);
+
+      auto frame_index = header->packet.frameIndex;
+      auto now = clock::now();
+
+      auto it = frames.find(frame_index);
+      if (it == std::end(frames)) {
+        if (have_frames && (std::int32_t) (frame_index - newest_frame) <= 0) {
+          // A late packet of a frame that was completed or given up on already
+          return;
+        }
+
+        // Frames that never showed up at all are lost too
+        if (have_frames && frame_index - newest_frame > 1) {
+          stats.frames_lost.fetch_add(frame_index - newest_frame - 1, std::memory_order_relaxed);
+          idr_requested = true;
+        }
+        have_frames = true;
+        newest_frame = frame_index;
+
+        it = frames.emplace(frame_index, frame_t {}).first;
+        it->second.blocks = ((header->packet.multiFecBlocks >> 6) & 0x3) + 1;
+        it->second.first_packet = now;
+
+        update_jitter(util::endian::big(header->rtp.timestamp), now);
+        give_up_stale_frames();
+      }
+
+      auto &frame = it->second;
+      auto &block = frame.block[(header->packet.multiFecBlocks >> 4) & 0x3];
+      if (block.done) {
+        return;
+      }
+
+      auto fec_info = header->packet.fecInfo;
+      auto shard_index = (fec_info >> 12) & 0x3FF;
+      auto shard_size = bytes - sizeof(video_packet_raw_t);
+      if (block.shards.empty()) {
+        int data_shards = (fec_info >> 22) & 0x3FF;
+        int percentage = (fec_info >> 4) & 0xFF;
+
+        block.data_shards = data_shards;
+        block.shards.resize(data_shards + (data_shards * percentage + 99) / 100);
+      }
+
+      if (shard_index >= block.shards.size() || !block.shards[shard_index].empty() ||
+          (block.received && block.shards[0].size() && block.shards[0].size() != shard_size)) {
+        return;
+      }
+
+      // The parity covers the packet headers too, but only the payloads are needed
+      block.shards[shard_index].assign(data + sizeof(video_packet_raw_t), data + bytes);
+      if (++block.received < block.data_shards) {
+        return;
+      }
+
+      if (!recover_block(block, shard_size)) {
+        return;
+      }
+      block.done = true;
+
+      if (++frame.blocks_done == frame.blocks) {
+        complete_frame(frame_index, frame, now);
+        frames.erase(it);
+      }
+    }
+
+    /**
+     * @brief Recover the missing data shards of a block from its parity shards.
+     * @param block The block, with at least as many shards as it has data shards.
+     * @param shard_size The size of each shard.
+     * @return `true` on success.
+     */
+    bool recover_block(video_block_t &block, std::size_t shard_size) {
+      auto total_shards = (int) block.shards.size();
+
+      int missing = 0;
+      std::vector<std::uint8_t *> shards_p(total_shards);
+      std::vector<std::uint8_t> marks(total_shards);
+      for (int x = 0; x < total_shards; ++x) {
+        auto &shard = block.shards[x];
+        if (shard.empty()) {
+          shard.resize(shard_size);
+          marks[x] = 1;
+          missing += x < block.data_shards;
+        }
+        shards_p[x] = shard.data();
+      }
+
+      if (missing == 0) {
+        return true;
+      }
+
+      auto &rs = rs_cache[{block.data_shards, total_shards - block.data_shards}];
+      if (!rs) {
+        rs.reset(reed_solomon_new(block.data_shards, total_shards - block.data_shards));
+      }
+
+      if (!rs || reed_solomon_decode(rs.get(), shards_p.data(), marks.data(), total_shards, (int) shard_size)) {
+        return false;
+      }
+
+      stats.video_recovered.fetch_add(missing, std::memory_order_relaxed);
+      return true;
+    }
+
+    void complete_frame(std::uint32_t frame_index, frame_t &frame, clock::time_point now) {
+      auto &first_shard = frame.block[0].shards[0];
+      if (first_shard.size() < sizeof(video_short_frame_header_t)) {
+        return;
+      }
+
+      auto frame_header = (video_short_frame_header_t *) first_shard.data();
+
+      // Every data shard is full, except for the last one
+      std::size_t data_shards = 0;
+      for (int x = 0; x < frame.blocks; ++x) {
+        data_shards += frame.block[x].data_shards;
+      }
+      auto last_payload = std::min<std::size_t>(util::endian::little(frame_header->lastPayloadLen), first_shard.size());
+      auto frame_size = (data_shards - 1) * first_shard.size() + last_payload;
+
+      stats.frames.fetch_add(1, std::memory_order_relaxed);
+      stats.goodput_bytes.fetch_add(frame_size - std::min(frame_size, sizeof(video_short_frame_header_t)), std::memory_order_relaxed);
+      stats.host_latency_us.fetch_add(util::endian::little(frame_header->frame_processing_latency) * 100, std::memory_order_relaxed);
+      stats.delivery_us.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(now - frame.first_packet).count(), std::memory_order_relaxed);
+
+      last_good_frame.store(frame_index, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Count the frames that can no longer be completed as lost.
+     */
+    void give_up_stale_frames() {
+      for (auto it = std::begin(frames); it != std::end(frames);) {
+        if (newest_frame - it->first < FRAME_REORDER_WINDOW) {
+          ++it;
+          continue;
+        }
+
+        stats.frames_lost.fetch_add(1, std::memory_order_relaxed);
+        idr_requested = true;
+        it = frames.erase(it);
+      }
+    }
+
+    /**
+     * @brief Update the interarrival jitter of the frames, as described in RFC 3550.
+     * @param timestamp The RTP timestamp of a new frame, in 90 kHz units.
+     * @param now The arrival time of its first packet.
+     */
+    void update_jitter(std::uint32_t timestamp, clock::time_point now) {
+      auto arrival = std::chrono::duration<double, std::ratio<1, 90000>>(now - epoch).count();
+      auto transit = arrival - timestamp;
+
+      if (have_transit) {
+        jitter += (std::abs(transit - last_transit) - jitter) / 16;
+        stats.jitter_ms.store(jitter / 90, std::memory_order_relaxed);
+      }
+
+      have_transit = true;
+      last_transit = transit;
+    }
+
+    void handle_audio(std::uint8_t *data, std::size_t bytes) {
+      stats.wire_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+      if (bytes <= sizeof(RTP_PACKET)) {
+        return;
+      }
+
+      auto rtp = (RTP_PACKET *) data;
+      std::uint16_t base;
+      int shard_index;
+      std::size_t header_size;
+      if (rtp->packetType == AUDIO_PAYLOAD_TYPE) {
+        auto seq = util::endian::big(rtp->sequenceNumber);
+
+        stats.audio_packets.fetch_add(1, std::memory_order_relaxed);
+        stats.audio_lost.fetch_add(audio_seq.received(seq), std::memory_order_relaxed);
+        stats.goodput_bytes.fetch_add(bytes - sizeof(RTP_PACKET), std::memory_order_relaxed);
+
+        base = seq - seq % RTPA_DATA_SHARDS;
+        shard_index = seq % RTPA_DATA_SHARDS;
+        header_size = sizeof(RTP_PACKET);
+      } else if (rtp->packetType == AUDIO_FEC_PAYLOAD_TYPE && bytes > sizeof(audio_fec_packet_t)) {
+        auto fec_packet = (audio_fec_packet_t *) data;
+        if (fec_packet->fecHeader.fecShardIndex >= RTPA_FEC_SHARDS) {
+          return;
+        }
+
+        base = util::endian::big(fec_packet->fecHeader.baseSequenceNumber);
+        shard_index = RTPA_DATA_SHARDS + fec_packet->fecHeader.fecShardIndex;
+        header_size = sizeof(audio_fec_packet_t);
+      } else {
+        return;
+      }
+
+      if (have_audio_blocks && (std::int16_t) (base - newest_audio_block) > 0) {
+        newest_audio_block = base;
+
+        std::erase_if(audio_blocks, [&](auto &entry) {
+          return (std::uint16_t) (newest_audio_block - entry.first) > AUDIO_BLOCK_WINDOW;
+        });
+      } else if (!have_audio_blocks) {
+        have_audio_blocks = true;
+        newest_audio_block = base;
+      }
+
+      auto &block = audio_blocks[base];
+      auto &shard = block.shards[shard_index];
+      if (block.done || !shard.empty()) {
+        return;
+      }
+
+      shard.assign(data + header_size, data + bytes);
+      if (++block.received < RTPA_DATA_SHARDS) {
+        return;
+      }
+
+      // The host sends every packet of a block at the same size
+      std::size_t shard_size = shard.size();
+      int missing = 0;
+      std::array<std::uint8_t *, RTPA_TOTAL_SHARDS> shards_p;
+      std::array<std::uint8_t, RTPA_TOTAL_SHARDS> marks {};
+      for (int x = 0; x < RTPA_TOTAL_SHARDS; ++x) {
+        auto &shard = block.shards[x];
+        if (shard.empty()) {
+          shard.resize(shard_size);
+          marks[x] = 1;
+          missing += x < RTPA_DATA_SHARDS;
+        } else if (shard.size() != shard_size) {
+          block.done = true;
+          return;
+        }
+        shards_p[x] = shard.data();
+      }
+
+      block.done = true;
+      if (missing && !reed_solomon_decode(audio_rs.get(), shards_p.data(), marks.data(), RTPA_TOTAL_SHARDS, (int) shard_size)) {
+        stats.audio_recovered.fetch_add(missing, std::memory_order_relaxed);
+        stats.goodput_bytes.fetch_add(missing * shard_size, std::memory_order_relaxed);
+      }
+    }
+
+    static rs_t make_audio_rs() {
+      rs_t rs {reed_solomon_new(RTPA_DATA_SHARDS, RTPA_FEC_SHARDS)};
+
+      // The host replaces the parity matrix with the one Nvidia uses for audio data
+      const unsigned char parity[] = {0x77, 0x40, 0x38, 0x0e, 0xc7, 0xa7, 0x0d, 0x6c};
+      std::memcpy(rs.get()->p, parity, sizeof(parity));
+
+      return rs;
+    }
+
+    const int appid;
+
+    asio::ip::address host_address;
+    std::string rikey;
+    std::uint32_t encryption_flags {0};
+
+    std::string rtsp_url;
+    int rtsp_port {0};
+    std::uint32_t rtsp_seq {0};
+    std::optional<crypto::cipher::gcm_t> rtsp_cipher;
+
+    std::string ping_payload;
+    std::uint16_t video_port {0};
+    std::uint16_t audio_port {0};
+    std::uint16_t control_port {0};
+    std::uint32_t control_connect_data {0};
+
+    util::safe_ptr<ENetHost, enet_host_destroy> enet_host;
+    ENetPeer *peer {nullptr};
+    std::uint32_t control_seq {0};
+    std::optional<crypto::cipher::gcm_t> control_cipher;
+
+    std::atomic<bool> stopping {false};
+    std::atomic<bool> idr_requested {false};
+    std::atomic<std::uint32_t> last_good_frame {0};
+
+    // Only used on the media thread
+    clock::time_point epoch;
+    std::optional<crypto::cipher::gcm_t> video_cipher;
+    std::vector<std::uint8_t> video_plaintext;
+    sequence_tracker_t video_seq;
+    std::map<std::uint32_t, frame_t> frames;
+    bool have_frames {false};
+    std::uint32_t newest_frame {0};
+    std::map<std::pair<int, int>, rs_t> rs_cache;
+    bool have_transit {false};
+    double last_transit {0};
+    double jitter {0};
+
+    sequence_tracker_t audio_seq;
+    rs_t audio_rs {make_audio_rs()};
+    std::map<std::uint16_t, audio_block_t> audio_blocks;
+    bool have_audio_blocks {false};
+    std::uint16_t newest_audio_block {0};
+  };
+
+  /**
+   * @brief Print the statistics of one or more clients over a period of time.
+   * @param label What the statistics are of.
+   * @param stats The statistics.
+   * @param clients The number of clients the statistics are summed over.
+   * @param seconds The length of the period.
+   */
+  void print_stats(const std::string &label, const totals_t &stats, int clients, double seconds) {
+    auto percentage = [](std::uint64_t part, std::uint64_t whole) {
+      return whole ? 100.0 * part / whole : 0.0;
+    };
+    auto average_ms = [&](std::uint64_t total_us) {
+      return stats.frames ? total_us / 1000.0 / stats.frames : 0.0;
+    };
+
+    std::cout << std::fixed << std::setprecision(2)
+              << label
+              << " | goodput "sv << stats.goodput_bytes * 8 / 1e6 / seconds << " Mbps, wire "sv << stats.wire_bytes * 8 / 1e6 / seconds << " Mbps"sv
+              << " | video loss "sv << percentage(stats.video_lost, stats.video_packets + stats.video_lost) << "%, "sv << stats.video_recovered << " recovered"sv
+              << " | frames "sv << stats.frames << ", "sv << stats.frames_lost << " lost"sv
+              << " | latency "sv << average_ms(stats.host_latency_us) << " ms host, "sv << average_ms(stats.delivery_us) << " ms delivery, "sv
+              << (clients ? stats.jitter_ms / clients : 0.0) << " ms jitter"sv
+              << " | audio loss "sv << percentage(stats.audio_lost, stats.audio_packets + stats.audio_lost) << "%, "sv << stats.audio_recovered << " recovered"sv
+              << std::endl;
+  }
+}  // namespace loadgen
+
+void print_help() {
+  std::cout
+    << "==== Help ===="sv << std::endl
+    << "Usage:"sv << std::endl
+    << "    loadgen [options]"sv << std::endl
+    << std::endl
+    << "Options:"sv << std::endl
+    << "    --host <address>       IP address of the host [127.0.0.1]"sv << std::endl
+    << "    --port <port>          Base port of the host [47989]"sv << std::endl
+    << "    --clients <count>      Number of virtual clients [1]"sv << std::endl
+    << "    --duration <seconds>   How long to stream for [30]"sv << std::endl
+    << "    --interval <seconds>   How often to report statistics [5]"sv << std::endl
+    << "    --mode <WxHxFPS>       Resolution and frame rate of the stream [1920x1080x60]"sv << std::endl
+    << "    --bitrate <kbps>       Bitrate of the stream [20000]"sv << std::endl
+    << "    --packet-size <bytes>  Size of the video packets [1392]"sv << std::endl
+    << "    --codec <codec>        h264, hevc or av1 [h264]"sv << std::endl
+    << "    --app <name>           Application to stream [Desktop]"sv << std::endl
+    << "    --state <path>         Where to keep the client certificate [loadgen]"sv << std::endl
+    << "    --pin <pin>            PIN to pair with, random by default"sv << std::endl
+    << "    --username <name>      Web UI user to enter the PIN with, instead of entering it yourself"sv << std::endl
+    << "    --password <password>  Web UI password to enter the PIN with"sv << std::endl
+    << std::endl
+    << "The host must allow as many concurrent sessions as there are clients, see the channels option."sv << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  using namespace loadgen;
+
+  for (auto x = 1; x < argc; ++x) {
+    std::string_view arg {argv[x]};
+    if (x + 1 >= argc) {
+      print_help();
+      return 2;
+    }
+    std::string value {argv[++x]};
+
+    if (arg == "--host"sv) {
+      options.host = value;
+    } else if (arg == "--port"sv) {
+      options.port = util::from_view(value);
+    } else if (arg == "--clients"sv) {
+      options.clients = std::max(1, (int) util::from_view(value));
+    } else if (arg == "--duration"sv) {
+      options.duration = std::chrono::seconds {util::from_view(value)};
+    } else if (arg == "--interval"sv) {
+      options.report_interval = std::chrono::seconds {std::max<std::int64_t>(1, util::from_view(value))};
+    } else if (arg == "--mode"sv) {
+      char sep1, sep2;
+      std::istringstream mode {value};
+      if (!(mode >> options.width >> sep1 >> options.height >> sep2 >> options.fps) || sep1 != 'x' || sep2 != 'x') {
+        print_help();
+        return 2;
+      }
+    } else if (arg == "--bitrate"sv) {
+      options.bitrate = util::from_view(value);
+    } else if (arg == "--packet-size"sv) {
+      options.packet_size = util::from_view(value);
+    } else if (arg == "--codec"sv) {
+      if (value == "h264"sv) {
+        options.video_format = 0;
+      } else if (value == "hevc"sv) {
+        options.video_format = 1;
+      } else if (value == "av1"sv) {
+        options.video_format = 2;
+      } else {
+        print_help();
+        return 2;
+      }
+    } else if (arg == "--app"sv) {
+      options.app = value;
+    } else if (arg == "--state"sv) {
+      options.state_dir = value;
+    } else if (arg == "--pin"sv) {
+      options.pin = value;
+    } else if (arg == "--username"sv) {
+      options.username = value;
+    } else if (arg == "--password"sv) {
+      options.password = value;
+    } else {
+      print_help();
+      return 2;
+    }
+  }
+
+  reed_solomon_init();
+  if (enet_initialize()) {
+    std::cout << "Couldn't initialize ENet"sv << std::endl;
+    return -1;
+  }
+  auto fg = util::fail_guard([]() {
+    enet_deinitialize();
+  });
+
+  auto creds = load_identity();
+  if (!creds || !pair(*creds)) {
+    return -1;
+  }
+
+  auto appid = find_app();
+  if (!appid) {
+    return -1;
+  }
+
+  std::vector<std::unique_ptr<client_t>> clients;
+  std::vector<std::thread> threads;
+  std::atomic<int> streaming {0};
+  auto start = clock::now();
+  auto until = start + options.duration;
+
+  for (auto x = 0; x < options.clients; ++x) {
+    auto &client = clients.emplace_back(std::make_unique<client_t>(x, *appid));
+    threads.emplace_back([&client = *client, &streaming, until]() {
+      if (client.start()) {
+        ++streaming;
+        client.run(until);
+      }
+    });
+  }
+
+  auto totals = [&]() {
+    totals_t sum {};
+    for (auto &client : clients) {
+      sum += client->stats.totals();
+    }
+    return sum;
+  };
+
+  auto last = totals();
+  auto last_time = start;
+  while (clock::now() < until) {
+    std::this_thread::sleep_for(std::min<clock::duration>(options.report_interval, until - clock::now()));
+
+    auto now = clock::now();
+    auto current = totals();
+    std::chrono::duration<double> elapsed = now - start;
+
+    std::ostringstream label;
+    label << '[' << std::setw(5) << (int) elapsed.count() << "s] "sv << streaming << '/' << options.clients << " clients"sv;
+    print_stats(label.str(), current - last, streaming, std::chrono::duration<double>(now - last_time).count());
+
+    last = current;
+    last_time = now;
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto seconds = std::chrono::duration<double>(options.duration).count();
+  std::cout << "====== Summary over "sv << (int) seconds << " seconds ======"sv << std::endl;
+  for (auto &client : clients) {
+    print_stats("Client "s + std::to_string(client->id), client->stats.totals(), 1, seconds);
+  }
+  print_stats("Total"s, totals(), streaming, seconds);
+
+  return 0;
+}